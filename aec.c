@@ -0,0 +1,613 @@
+/*
+ * aec.c - acoustic echo cancellation, the device's outputs against its mic
+ *
+ * With the stereo mic enabled (EN_BTL in REG2) a CM6206 board makes a
+ * speakerphone, and the mic hears the speakers. Every output channel is a
+ * source of echo, so each mic channel gets an adaptive filter per output
+ * channel, long enough for the round trip through the device and the
+ * room's reverberation, and the sum of their outputs is subtracted.
+ *
+ * The filters are partitioned-block frequency-domain adaptive filters (the
+ * multidelay filter): the echo path is cut into partitions of one block,
+ * every reference block is transformed once and kept in a frequency-domain
+ * delay line, and filtering and adaptation become complex multiply-adds per
+ * bin, which run 8 (AVX2) or 4 (NEON) bins at a time. Adaptation is
+ * normalised per bin by the power of the whole delay line, all channels. The
+ * gradient constraint, which keeps the partitions from wrapping around, is
+ * applied to one partition per block in turn rather than to all of them.
+ *
+ * Two filters run side by side, as in Speex's MDF: the background filter
+ * adapts, the foreground filter produces the output. The background is
+ * copied to the foreground when it cancels clearly better, and restored from
+ * it when it diverges, which is what near-end speech does to an adaptive
+ * filter that does not notice it in time.
+ *
+ * Double talk is detected from the ratio of the expected residual echo to
+ * the actual error: the residual echo is the foreground's echo estimate
+ * times a leakage factor, learnt from how the error's power follows the
+ * estimate's (Valin, "On Adjusting the Learning Rate in Frequency Domain
+ * Echo Cancellation With Double-Talk", 2007). When far more is left than
+ * echo would explain, someone is talking: the background slows down and the
+ * suppressor backs off. A changed echo path looks the same at first, but
+ * there the background soon does better than the foreground, which near-end
+ * speech, being in both errors alike, never lets it do; that ends it.
+ *
+ * The suppressor works on the foreground's output in overlapping windows
+ * (square-root Hann, half overlap), with a gain per bin from the residual
+ * echo estimate, which costs a block of latency.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define kHaveSIMD	1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define kHaveSIMD	1
+#else
+#define kHaveSIMD	0
+#endif
+
+#include "fft.h"
+#include "aec.h"
+
+#define kAecDelta			1e-4f	// regularisation of the normalisation, per bin
+#define kAecStep			1.0f	// normalised step size
+#define kAecLeakAdapted		0.03f	// leakage estimate that shows the filter has converged once
+#define kAecStepDoubleTalk	0.25f	// fraction of the step left during double talk
+#define kAecFarFloor		1e-7f	// mean square of the reference below which nothing is learnt
+#define kAecSpecAverage		0.05f	// smoothing of the power spectra the leakage is measured against
+#define kAecLeakRate		0.02f	// of the leakage estimate, when the echo dominates
+#define kAecLeakRateMax		0.01f
+#define kAecDoubleTalkRER	0.05f	// residual echo to error ratio below which someone talks
+#define kAecDoubleTalkHang	8		// blocks a detection is held
+#define kAecNoiseRise		1.002f	// per block, of the tracked error floor
+#define kAecForegroundGain	0.7f	// the background must leave this much less error to be copied
+#define kAecDivergence		4.0f	// or this much more to be restored
+#define kAecBackgroundAhead	0.9f	// ahead by this much, it rules out double talk
+#define kAecSuppress		4.0f	// over-subtraction of the residual echo
+#define kAecSuppressTalk	1.0f	// the same during double talk
+#define kAecGainFloor		0.01f	// -40 dB
+
+
+typedef struct AecMic {
+	float		*echo;				// foreground echo estimate, last two blocks
+	float		*cancelled;			// foreground output, last two blocks
+	float		*overlap;			// second half of the last synthesis window
+	float		*gain;				// suppression gain per bin
+	float		*errAvg;			// smoothed power spectra of the output and the
+	float		*echoAvg;			// echo estimate, for the leakage estimate
+	float		pey, pyy, leak;
+	double		errBack, errFore;	// smoothed error energies of the two filters
+	float		noise;				// tracked floor of the error energy
+	int			hang;				// blocks of double talk still to report
+	int			adapted;			// past the first convergence
+} AecMic;
+
+struct CMAec {
+	int			refs, mics;
+	int			blockSize;			// N
+	int			bins;				// N + 1
+	int			parts;				// partitions of N
+	int			pos;				// delay line slot of the newest reference block
+	int			suppress;
+	int			farBlocks;			// far-end blocks seen, up to parts
+	int			doubleTalk;
+	unsigned long	block;
+	CMFFT		*fft;				// of 2N
+	float		*window;			// square-root Hann, 2N
+
+	float		*history;			// last 2N reference samples [ref][2N]
+	float		*xRe, *xIm;			// reference spectra [ref][part][bin]
+	float		*partPower;			// reference power per bin, all refs [part][bin]
+	float		*power;				// the same over the whole delay line
+	float		*backRe, *backIm;	// background filter [mic][ref][part][bin]
+	float		*foreRe, *foreIm;	// foreground filter, the same
+	AecMic		mic[kAecMaxMics];
+
+	// Scratch
+	float		*time;				// 2N
+	float		*accRe, *accIm;		// bins each, and so on
+	float		*errRe, *errIm;
+	float		*outRe, *outIm;
+	float		*estRe, *estIm;
+	float		*back, *fore;		// N each: background and foreground echo estimates
+
+	CMAecStats	stats;
+};
+
+static int gUseSIMD = kHaveSIMD;
+
+
+int aecUseSIMD( int enable )
+{
+	gUseSIMD = enable && kHaveSIMD;
+	return gUseSIMD;
+}
+
+
+//================================================================================================
+// Complex arithmetic on split spectra. The vector versions do the same
+// operations in the same order as the scalar ones.
+//
+// acc += x * w
+static void spectrumMac( float *accRe, float *accIm, const float *xRe, const float *xIm,
+						 const float *wRe, const float *wIm, int n )
+{
+	int k = 0;
+
+#if defined(__AVX2__)
+	if( gUseSIMD )
+		for( ; k + 8 <= n; k += 8 ) {
+			__m256 xr = _mm256_loadu_ps(xRe + k), xi = _mm256_loadu_ps(xIm + k);
+			__m256 wr = _mm256_loadu_ps(wRe + k), wi = _mm256_loadu_ps(wIm + k);
+			__m256 re = _mm256_sub_ps(_mm256_mul_ps(xr, wr), _mm256_mul_ps(xi, wi));
+			__m256 im = _mm256_add_ps(_mm256_mul_ps(xr, wi), _mm256_mul_ps(xi, wr));
+			_mm256_storeu_ps(accRe + k, _mm256_add_ps(_mm256_loadu_ps(accRe + k), re));
+			_mm256_storeu_ps(accIm + k, _mm256_add_ps(_mm256_loadu_ps(accIm + k), im));
+		}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	if( gUseSIMD )
+		for( ; k + 4 <= n; k += 4 ) {
+			float32x4_t xr = vld1q_f32(xRe + k), xi = vld1q_f32(xIm + k);
+			float32x4_t wr = vld1q_f32(wRe + k), wi = vld1q_f32(wIm + k);
+			float32x4_t re = vsubq_f32(vmulq_f32(xr, wr), vmulq_f32(xi, wi));
+			float32x4_t im = vaddq_f32(vmulq_f32(xr, wi), vmulq_f32(xi, wr));
+			vst1q_f32(accRe + k, vaddq_f32(vld1q_f32(accRe + k), re));
+			vst1q_f32(accIm + k, vaddq_f32(vld1q_f32(accIm + k), im));
+		}
+#endif
+	for( ; k < n; k++ ) {
+		float re = xRe[k] * wRe[k] - xIm[k] * wIm[k];
+		float im = xRe[k] * wIm[k] + xIm[k] * wRe[k];
+		accRe[k] += re;
+		accIm[k] += im;
+	}
+}
+
+
+// w += conj(x) * g
+static void spectrumMacConj( float *wRe, float *wIm, const float *xRe, const float *xIm,
+							 const float *gRe, const float *gIm, int n )
+{
+	int k = 0;
+
+#if defined(__AVX2__)
+	if( gUseSIMD )
+		for( ; k + 8 <= n; k += 8 ) {
+			__m256 xr = _mm256_loadu_ps(xRe + k), xi = _mm256_loadu_ps(xIm + k);
+			__m256 gr = _mm256_loadu_ps(gRe + k), gi = _mm256_loadu_ps(gIm + k);
+			__m256 re = _mm256_add_ps(_mm256_mul_ps(xr, gr), _mm256_mul_ps(xi, gi));
+			__m256 im = _mm256_sub_ps(_mm256_mul_ps(xr, gi), _mm256_mul_ps(xi, gr));
+			_mm256_storeu_ps(wRe + k, _mm256_add_ps(_mm256_loadu_ps(wRe + k), re));
+			_mm256_storeu_ps(wIm + k, _mm256_add_ps(_mm256_loadu_ps(wIm + k), im));
+		}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	if( gUseSIMD )
+		for( ; k + 4 <= n; k += 4 ) {
+			float32x4_t xr = vld1q_f32(xRe + k), xi = vld1q_f32(xIm + k);
+			float32x4_t gr = vld1q_f32(gRe + k), gi = vld1q_f32(gIm + k);
+			float32x4_t re = vaddq_f32(vmulq_f32(xr, gr), vmulq_f32(xi, gi));
+			float32x4_t im = vsubq_f32(vmulq_f32(xr, gi), vmulq_f32(xi, gr));
+			vst1q_f32(wRe + k, vaddq_f32(vld1q_f32(wRe + k), re));
+			vst1q_f32(wIm + k, vaddq_f32(vld1q_f32(wIm + k), im));
+		}
+#endif
+	for( ; k < n; k++ ) {
+		float re = xRe[k] * gRe[k] + xIm[k] * gIm[k];
+		float im = xRe[k] * gIm[k] - xIm[k] * gRe[k];
+		wRe[k] += re;
+		wIm[k] += im;
+	}
+}
+
+
+//================================================================================================
+// The filters
+//
+static inline long filterAt( const CMAec *aec, int m, int r, int p )
+{
+	return (((long)m * aec->refs + r) * aec->parts + p) * aec->bins;
+}
+
+
+static inline long lineAt( const CMAec *aec, int r, int p )
+{
+	// Partition p sees the reference p blocks back
+	int slot = aec->pos - p < 0 ? aec->pos - p + aec->parts : aec->pos - p;
+	return ((long)r * aec->parts + slot) * aec->bins;
+}
+
+
+// The echo of mic m through one of the filters, for the current block
+static void estimate( CMAec *aec, int m, const float *wRe, const float *wIm, float *echo )
+{
+	int N = aec->blockSize, K = aec->bins, r, p, i;
+	float scale = 1.0f / (2 * N);
+
+	memset(aec->accRe, 0, sizeof(float) * K);
+	memset(aec->accIm, 0, sizeof(float) * K);
+	for( r = 0; r < aec->refs; r++ )
+		for( p = 0; p < aec->parts; p++ )
+			spectrumMac(aec->accRe, aec->accIm, aec->xRe + lineAt(aec, r, p), aec->xIm + lineAt(aec, r, p),
+						wRe + filterAt(aec, m, r, p), wIm + filterAt(aec, m, r, p), K);
+	fftInverse(aec->fft, aec->accRe, aec->accIm, aec->time);
+	for( i = 0; i < N; i++ )
+		echo[i] = aec->time[N + i] * scale;
+}
+
+
+// One step of size mu of the background filter of mic m, against the error
+// in errRe/Im
+static void adapt( CMAec *aec, int m, float mu )
+{
+	int N = aec->blockSize, K = aec->bins, r, p, k;
+	int constrain = (int)(aec->block % aec->parts);
+	float scale = 1.0f / (2 * N);
+
+	for( k = 0; k < K; k++ ) {
+		float g = mu / (aec->power[k] + kAecDelta);
+		aec->errRe[k] *= g;
+		aec->errIm[k] *= g;
+	}
+	for( r = 0; r < aec->refs; r++ ) {
+		float *wRe, *wIm;
+
+		for( p = 0; p < aec->parts; p++ )
+			spectrumMacConj(aec->backRe + filterAt(aec, m, r, p), aec->backIm + filterAt(aec, m, r, p),
+							aec->xRe + lineAt(aec, r, p), aec->xIm + lineAt(aec, r, p), aec->errRe, aec->errIm, K);
+
+		// The gradient constraint, for one partition per block: what would
+		// wrap around into the second half of the impulse response goes
+		wRe = aec->backRe + filterAt(aec, m, r, constrain);
+		wIm = aec->backIm + filterAt(aec, m, r, constrain);
+		fftInverse(aec->fft, wRe, wIm, aec->time);
+		for( k = 0; k < N; k++ )
+			aec->time[k] *= scale;
+		memset(aec->time + N, 0, sizeof(float) * N);
+		fftForward(aec->fft, aec->time, wRe, wIm);
+	}
+}
+
+
+//================================================================================================
+// Per mic: the two filters, double-talk detection, adaptation and suppression
+//
+static void processMic( CMAec *aec, int m, const float *mic, float *out, int far )
+{
+	AecMic *st = &aec->mic[m];
+	int N = aec->blockSize, K = aec->bins, i, k, copied = 0, reset = 0, talk = 0;
+	long filterLen = (long)aec->refs * aec->parts * K;
+	double errBack = 0, errFore = 0, sumErr = 0, sumEcho = 0, pey = 0, pyy = 0;
+	float *cancelled = st->cancelled + N, *echo = st->echo + N;
+	float rer, beta, over, scale = 1.0f / (2 * N);
+
+	estimate(aec, m, aec->backRe, aec->backIm, aec->back);
+	estimate(aec, m, aec->foreRe, aec->foreIm, aec->fore);
+	for( i = 0; i < N; i++ ) {
+		float eb = mic[i] - aec->back[i], ef = mic[i] - aec->fore[i];
+		errBack += eb * eb;
+		errFore += ef * ef;
+	}
+	st->errBack = 0.5 * st->errBack + 0.5 * errBack;
+	st->errFore = 0.5 * st->errFore + 0.5 * errFore;
+
+	// The error of the background, for adaptation, before it may be replaced
+	memset(aec->time, 0, sizeof(float) * N);
+	for( i = 0; i < N; i++ )
+		aec->time[N + i] = mic[i] - aec->back[i];
+	fftForward(aec->fft, aec->time, aec->errRe, aec->errIm);
+
+	// Foreground or background
+	memmove(st->echo, st->echo + N, sizeof(float) * N);
+	memmove(st->cancelled, st->cancelled + N, sizeof(float) * N);
+	if( st->errBack < kAecForegroundGain * st->errFore && errBack < errFore ) {
+		memcpy(aec->foreRe + filterAt(aec, m, 0, 0), aec->backRe + filterAt(aec, m, 0, 0), sizeof(float) * filterLen);
+		memcpy(aec->foreIm + filterAt(aec, m, 0, 0), aec->backIm + filterAt(aec, m, 0, 0), sizeof(float) * filterLen);
+		st->errFore = st->errBack;
+		aec->stats.foregroundUpdates++;
+		copied = 1;
+	} else if( st->errBack > kAecDivergence * st->errFore && far ) {
+		memcpy(aec->backRe + filterAt(aec, m, 0, 0), aec->foreRe + filterAt(aec, m, 0, 0), sizeof(float) * filterLen);
+		memcpy(aec->backIm + filterAt(aec, m, 0, 0), aec->foreIm + filterAt(aec, m, 0, 0), sizeof(float) * filterLen);
+		st->errBack = st->errFore;
+		aec->stats.backgroundResets++;
+		reset = 1;
+	}
+	for( i = 0; i < N; i++ ) {
+		// Crossfade over the block when the foreground changes
+		float w = copied ? (float)(i + 1) / N : 0.0f;
+		echo[i] = aec->fore[i] + w * (aec->back[i] - aec->fore[i]);
+		cancelled[i] = mic[i] - echo[i];
+	}
+
+	// The output and the echo estimate, through the suppressor's window
+	for( i = 0; i < 2 * N; i++ )
+		aec->time[i] = st->cancelled[i] * aec->window[i];
+	fftForward(aec->fft, aec->time, aec->outRe, aec->outIm);
+	for( i = 0; i < 2 * N; i++ )
+		aec->time[i] = st->echo[i] * aec->window[i];
+	fftForward(aec->fft, aec->time, aec->estRe, aec->estIm);
+
+	// Leakage: how much of the estimated echo's power shows up in the error
+	for( k = 0; k < K; k++ ) {
+		float e = aec->outRe[k] * aec->outRe[k] + aec->outIm[k] * aec->outIm[k];
+		float y = aec->estRe[k] * aec->estRe[k] + aec->estIm[k] * aec->estIm[k];
+
+		st->errAvg[k] += kAecSpecAverage * (e - st->errAvg[k]);
+		st->echoAvg[k] += kAecSpecAverage * (y - st->echoAvg[k]);
+		pey += (e - st->errAvg[k]) * (y - st->echoAvg[k]);
+		pyy += (y - st->echoAvg[k]) * (y - st->echoAvg[k]);
+		sumErr += e;
+		sumEcho += y;
+	}
+	beta = sumErr > 0 ? kAecLeakRate * (float)(sumEcho / sumErr) : kAecLeakRateMax;
+	if( beta > kAecLeakRateMax )
+		beta = kAecLeakRateMax;
+	if( far ) {
+		st->pey = (1 - beta) * st->pey + beta * (float)pey;
+		st->pyy = (1 - beta) * st->pyy + beta * (float)pyy;
+	}
+	if( st->pyy < 1e-12f )
+		st->pyy = 1e-12f;
+	if( st->pey < 0.005f * st->pyy )
+		st->pey = 0.005f * st->pyy;
+	if( st->pey > st->pyy )
+		st->pey = st->pyy;
+	st->leak = st->pey / st->pyy;
+	if( !st->adapted && aec->farBlocks >= aec->parts && st->leak > kAecLeakAdapted )
+		st->adapted = 1;
+	rer = sumErr > 0 ? (float)(st->leak * sumEcho / sumErr) : 1.0f;
+	if( rer > 0.5f )
+		rer = 0.5f;
+
+	// Double talk: far end on, the filter past its first convergence, and much
+	// more error than the residual echo would make
+	if( st->noise <= 0 || sumErr < st->noise )
+		st->noise = (float)sumErr;
+	else
+		st->noise *= kAecNoiseRise;
+	if( copied || st->errBack < kAecBackgroundAhead * st->errFore )
+		st->hang = 0;		// near-end speech would be in both filters' error alike
+	else if( far && st->adapted && rer < kAecDoubleTalkRER && sumErr > 4 * st->noise )
+		st->hang = kAecDoubleTalkHang;
+	else if( st->hang > 0 )
+		st->hang--;
+	talk = st->hang > 0;
+	aec->doubleTalk |= talk;
+
+	// Adaptation, slowed down by double talk
+	if( far && !reset )
+		adapt(aec, m, talk ? kAecStep * kAecStepDoubleTalk : kAecStep);
+
+	// Suppression of what is left of the echo
+	over = talk ? kAecSuppressTalk : kAecSuppress;
+	for( k = 0; k < K; k++ ) {
+		float e = aec->outRe[k] * aec->outRe[k] + aec->outIm[k] * aec->outIm[k] + 1e-12f;
+		float y = aec->estRe[k] * aec->estRe[k] + aec->estIm[k] * aec->estIm[k];
+		float g = 1.0f - over * st->leak * y / e;
+
+		if( g < kAecGainFloor )
+			g = kAecGainFloor;
+		if( !aec->suppress )
+			g = 1.0f;
+		// Down at once, up over a few blocks
+		st->gain[k] = g < st->gain[k] ? g : st->gain[k] + 0.5f * (g - st->gain[k]);
+		aec->outRe[k] *= st->gain[k];
+		aec->outIm[k] *= st->gain[k];
+	}
+	fftInverse(aec->fft, aec->outRe, aec->outIm, aec->time);
+	for( i = 0; i < N; i++ ) {
+		out[i] = st->overlap[i] + aec->time[i] * aec->window[i] * scale;
+		st->overlap[i] = aec->time[N + i] * aec->window[N + i] * scale;
+	}
+}
+
+
+void aecProcess( CMAec *aec, const float * const *ref, const float * const *mic, float * const *out )
+{
+	int N = aec->blockSize, K = aec->bins, r, m, i, k, far;
+	double energy = 0;
+	float *newest;
+
+	// The new reference block, into the delay line
+	aec->pos = aec->pos + 1 == aec->parts ? 0 : aec->pos + 1;
+	for( r = 0; r < aec->refs; r++ ) {
+		float *h = aec->history + (long)r * 2 * N;
+
+		memmove(h, h + N, sizeof(float) * N);
+		memcpy(h + N, ref[r], sizeof(float) * N);
+		for( i = 0; i < N; i++ )
+			energy += ref[r][i] * ref[r][i];
+		fftForward(aec->fft, h, aec->xRe + lineAt(aec, r, 0), aec->xIm + lineAt(aec, r, 0));
+	}
+	// Normalisation: the power of everything the filters see, per bin
+	newest = aec->partPower + (long)aec->pos * K;
+	for( k = 0; k < K; k++ ) {
+		float sum = 0;
+
+		for( r = 0; r < aec->refs; r++ ) {
+			long at = lineAt(aec, r, 0) + k;
+			sum += aec->xRe[at] * aec->xRe[at] + aec->xIm[at] * aec->xIm[at];
+		}
+		newest[k] = sum;
+	}
+	memcpy(aec->power, aec->partPower, sizeof(float) * K);
+	for( i = 1; i < aec->parts; i++ )
+		for( k = 0; k < K; k++ )
+			aec->power[k] += aec->partPower[(long)i * K + k];
+	far = energy > kAecFarFloor * N * aec->refs;
+	if( far ) {
+		aec->stats.farBlocks++;
+		if( aec->farBlocks < aec->parts )
+			aec->farBlocks++;
+	}
+
+	aec->doubleTalk = 0;
+	for( m = 0; m < aec->mics; m++ )
+		processMic(aec, m, mic[m], out[m], far);
+	aec->stats.doubleTalk += aec->doubleTalk;
+	aec->stats.blocks++;
+	aec->block++;
+}
+
+
+//================================================================================================
+//
+CMAec *aecCreate( int refs, int mics, int blockSize, int tailFrames )
+{
+	CMAec *aec;
+	size_t line, filter;
+	int N = blockSize, K = blockSize + 1, i, m;
+
+	if( refs < 1 || refs > kAecMaxRefs || mics < 1 || mics > kAecMaxMics || blockSize < 32 ||
+		blockSize > 4096 || (blockSize & (blockSize - 1)) || tailFrames < 1 )
+		return NULL;
+	aec = calloc(1, sizeof(CMAec));
+	if( aec == NULL )
+		return NULL;
+	aec->refs = refs;
+	aec->mics = mics;
+	aec->blockSize = N;
+	aec->bins = K;
+	aec->parts = (tailFrames + N - 1) / N;
+	aec->suppress = 1;
+	line = (size_t)refs * aec->parts * K;
+	filter = (size_t)mics * line;
+
+	aec->fft = fftCreate(2 * N);
+	aec->window = malloc(sizeof(float) * 2 * N);
+	aec->history = malloc(sizeof(float) * refs * 2 * N);
+	aec->xRe = malloc(sizeof(float) * line);
+	aec->xIm = malloc(sizeof(float) * line);
+	aec->partPower = malloc(sizeof(float) * (aec->parts + 1) * K);
+	aec->backRe = malloc(sizeof(float) * filter);
+	aec->backIm = malloc(sizeof(float) * filter);
+	aec->foreRe = malloc(sizeof(float) * filter);
+	aec->foreIm = malloc(sizeof(float) * filter);
+	aec->time = malloc(sizeof(float) * 2 * N);
+	aec->accRe = malloc(sizeof(float) * K * 8);
+	aec->back = malloc(sizeof(float) * N * 2);
+	if( aec->fft == NULL || aec->window == NULL || aec->history == NULL || aec->xRe == NULL ||
+		aec->xIm == NULL || aec->partPower == NULL || aec->backRe == NULL || aec->backIm == NULL ||
+		aec->foreRe == NULL || aec->foreIm == NULL || aec->time == NULL || aec->accRe == NULL ||
+		aec->back == NULL ) {
+		aecDestroy(aec);
+		return NULL;
+	}
+	aec->accIm = aec->accRe + K;
+	aec->errRe = aec->accRe + 2 * K;
+	aec->errIm = aec->accRe + 3 * K;
+	aec->outRe = aec->accRe + 4 * K;
+	aec->outIm = aec->accRe + 5 * K;
+	aec->estRe = aec->accRe + 6 * K;
+	aec->estIm = aec->accRe + 7 * K;
+	aec->power = aec->partPower + (long)aec->parts * K;
+	aec->fore = aec->back + N;
+
+	for( m = 0; m < mics; m++ ) {
+		AecMic *st = &aec->mic[m];
+
+		st->echo = malloc(sizeof(float) * (2 * N * 3 + K * 3));
+		if( st->echo == NULL ) {
+			aecDestroy(aec);
+			return NULL;
+		}
+		st->cancelled = st->echo + 2 * N;
+		st->overlap = st->echo + 4 * N;		// N, and N spare
+		st->gain = st->echo + 6 * N;
+		st->errAvg = st->gain + K;
+		st->echoAvg = st->gain + 2 * K;
+	}
+	for( i = 0; i < 2 * N; i++ )
+		aec->window[i] = sinf((float)M_PI * (i + 0.5f) / (2 * N));
+	aecReset(aec);
+	return aec;
+}
+
+
+void aecDestroy( CMAec *aec )
+{
+	int m;
+
+	if( aec == NULL )
+		return;
+	for( m = 0; m < kAecMaxMics; m++ )
+		free(aec->mic[m].echo);
+	fftDestroy(aec->fft);
+	free(aec->window);
+	free(aec->history);
+	free(aec->xRe);
+	free(aec->xIm);
+	free(aec->partPower);
+	free(aec->backRe);
+	free(aec->backIm);
+	free(aec->foreRe);
+	free(aec->foreIm);
+	free(aec->time);
+	free(aec->accRe);
+	free(aec->back);
+	free(aec);
+}
+
+
+void aecReset( CMAec *aec )
+{
+	size_t line = (size_t)aec->refs * aec->parts * aec->bins, filter = (size_t)aec->mics * line;
+	int N = aec->blockSize, K = aec->bins, m, k;
+
+	memset(aec->history, 0, sizeof(float) * aec->refs * 2 * N);
+	memset(aec->xRe, 0, sizeof(float) * line);
+	memset(aec->xIm, 0, sizeof(float) * line);
+	memset(aec->partPower, 0, sizeof(float) * (aec->parts + 1) * K);
+	memset(aec->backRe, 0, sizeof(float) * filter);
+	memset(aec->backIm, 0, sizeof(float) * filter);
+	memset(aec->foreRe, 0, sizeof(float) * filter);
+	memset(aec->foreIm, 0, sizeof(float) * filter);
+	for( m = 0; m < aec->mics; m++ ) {
+		AecMic *st = &aec->mic[m];
+
+		memset(st->echo, 0, sizeof(float) * (2 * N * 3 + K * 3));
+		for( k = 0; k < K; k++ )
+			st->gain[k] = 1.0f;
+		st->pey = st->pyy = 0;
+		st->leak = 1.0f;
+		st->errBack = st->errFore = 0;
+		st->noise = 0;
+		st->hang = 0;
+		st->adapted = 0;
+	}
+	aec->pos = 0;
+	aec->farBlocks = 0;
+	aec->doubleTalk = 0;
+	aec->block = 0;
+	memset(&aec->stats, 0, sizeof(CMAecStats));
+}
+
+
+void aecSetSuppression( CMAec *aec, int enable )
+{
+	aec->suppress = enable != 0;
+}
+
+
+int aecDoubleTalk( const CMAec *aec )
+{
+	return aec->doubleTalk;
+}
+
+
+void aecStats( const CMAec *aec, CMAecStats *stats )
+{
+	int m;
+
+	*stats = aec->stats;
+	for( m = 0; m < aec->mics; m++ )
+		stats->leak[m] = aec->mic[m].leak;
+}
@@ -0,0 +1,57 @@
+/*
+ * aec.h - acoustic echo cancellation, the device's outputs against its mic
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_AEC_H
+#define CM_AEC_H
+
+#define kAecMaxRefs		8		// output channels used as the reference
+#define kAecMaxMics		2
+
+typedef struct CMAecStats {
+	unsigned long	blocks;
+	unsigned long	farBlocks;				// with the reference above the noise floor
+	unsigned long	doubleTalk;				// blocks in which near-end speech was detected
+	unsigned long	foregroundUpdates;		// the adapting filter did better and was copied over
+	unsigned long	backgroundResets;		// it did much worse (diverged) and was restored
+	float			leak[kAecMaxMics];		// residual echo as a fraction of the estimated echo
+} CMAecStats;
+
+typedef struct CMAec CMAec;
+
+// A canceller for `refs' reference channels (what is sent to the device) and
+// `mics' capture channels, in blocks of blockSize frames (a power of two, 32
+// to 4096), with an echo path of up to tailFrames frames: the device's round
+// trip plus the room's reverberation. Everything is allocated here; NULL on
+// bad arguments or no memory.
+CMAec *aecCreate( int refs, int mics, int blockSize, int tailFrames );
+void aecDestroy( CMAec *aec );
+
+// Forgets the echo path and all signal history.
+void aecReset( CMAec *aec );
+
+// Residual echo suppression after the linear filter, on by default. Off, the
+// output is just the capture minus the estimated echo.
+void aecSetSuppression( CMAec *aec, int enable );
+
+// Selects the AVX2/NEON complex arithmetic (the default when compiled in) or
+// the scalar reference, for all cancellers. Returns 1 if vector code is now
+// in use.
+int aecUseSIMD( int enable );
+
+// Cancels one block: ref holds the block that was sent to the outputs, mic
+// the block captured at the same time. out, which may not alias either, gets
+// the mic channels with the echo removed, blockSize frames late (the
+// suppressor's overlap). Does not allocate or lock.
+void aecProcess( CMAec *aec, const float * const *ref, const float * const *mic, float * const *out );
+
+// Whether near-end speech was detected in the last block; adaptation slows
+// down and suppression backs off while it lasts.
+int aecDoubleTalk( const CMAec *aec );
+
+void aecStats( const CMAec *aec, CMAecStats *stats );
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * bench_chain.c - fused against stage-by-stage processing of the output chain
+ *
+ * Runs an 8-channel chain (remix, gain, delay, limiter, conversion to S24)
+ * on 40 ms blocks at 48 and 96 kHz, fused and unfused, and reports frames
+ * per microsecond and, where perf events are available, cache misses per
+ * 1000 frames. A second chain leaves out the limiter, to show the linear
+ * stages on their own. Fails if the two modes' outputs differ by more than
+ * 1 LSB anywhere.
+ *
+ *   cc -O3 -std=gnu11 -I. -o bench_chain bench/bench_chain.c chain.c limiter.c truepeak.c pcmconv.c -lm
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "chain.h"
+
+#define kChannels	8
+#define kBlockMs	40
+#define kSeconds	4			// of audio processed per measurement
+#define kCheckBlocks	25		// compared between the modes
+
+static float *gIn[kChannels];
+
+
+static double nowSeconds( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// A counter of last-level cache misses for this thread, or -1
+static int openMissCounter( void )
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+
+static long long readMisses( int fd )
+{
+	long long count;
+
+	if( fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count) )
+		return -1;
+	return count;
+}
+
+
+typedef struct Setup {
+	CMChain		*chain;
+	CMLimiter	*lim;
+	PCMDither	dither;
+} Setup;
+
+// 5.1 in the first six channels, upmixed to 7.1 with the surrounds copied to
+// the back pair, then trimmed and time-aligned per speaker
+static int setupChain( Setup *s, float rate, int frames, int fused, int withLimiter )
+{
+	float remix[kChannels * kChannels];
+	static const float trim[kChannels] = { 0.9f, 0.9f, 1.0f, 0.7f, 0.8f, 0.8f, 0.8f, 0.8f };
+	int delay[kChannels], c;
+	CMLimiterParams params;
+
+	memset(remix, 0, sizeof(remix));
+	for( c = 0; c < 6; c++ )
+		remix[c * kChannels + c] = 1.0f;
+	remix[6 * kChannels + 4] = 0.7f;
+	remix[7 * kChannels + 5] = 0.7f;
+	remix[4 * kChannels + 4] = 0.7f;
+	remix[5 * kChannels + 5] = 0.7f;
+	remix[0 * kChannels + 2] = 0.1f;	// a little of the centre into the fronts
+	remix[1 * kChannels + 2] = 0.1f;
+	for( c = 0; c < kChannels; c++ )
+		delay[c] = (int)(rate * 0.001f * (c < 3 ? 0.5f : (c < 6 ? 2.0f : 3.5f)));
+
+	pcmDitherInit(&s->dither, kChannels, 0, 777);
+	s->chain = chainCreate(kChannels, frames, kChainS24, &s->dither);
+	s->lim = NULL;
+	if( s->chain == NULL )
+		return -1;
+	chainAddRemix(s->chain, remix);
+	chainAddGain(s->chain, trim);
+	chainAddDelay(s->chain, delay);
+	if( withLimiter ) {
+		limiterDefaultParams(&params);
+		s->lim = limiterCreate(kChannels, rate, frames, &params);
+		if( s->lim == NULL || chainAddLimiter(s->chain, s->lim) != 0 )
+			return -1;
+	}
+	chainSetFusion(s->chain, fused);
+	return 0;
+}
+
+
+static void teardown( Setup *s )
+{
+	chainDestroy(s->chain);
+	limiterDestroy(s->lim);
+}
+
+
+static int32_t s24At( const uint8_t *p, size_t i )
+{
+	int32_t v = p[3 * i] | (p[3 * i + 1] << 8) | (p[3 * i + 2] << 16);
+	return v & 0x800000 ? v - 0x1000000 : v;
+}
+
+
+// Largest difference in LSB between the two modes over kCheckBlocks blocks
+static int32_t compare( float rate, int frames, int withLimiter )
+{
+	Setup s[2];
+	uint8_t *out[2];
+	size_t bytes = (size_t)frames * kChannels * 3, i;
+	int32_t worst = 0;
+	int b, m;
+
+	for( m = 0; m < 2; m++ ) {
+		if( setupChain(&s[m], rate, frames, m, withLimiter) != 0 )
+			return INT32_MAX;
+		out[m] = malloc(bytes);
+	}
+	for( b = 0; b < kCheckBlocks; b++ ) {
+		for( m = 0; m < 2; m++ )
+			chainProcess(s[m].chain, (const float * const *)gIn, out[m], frames);
+		for( i = 0; i < bytes / 3; i++ ) {
+			int32_t d = abs(s24At(out[0], i) - s24At(out[1], i));
+			if( d > worst )
+				worst = d;
+		}
+	}
+	for( m = 0; m < 2; m++ ) {
+		teardown(&s[m]);
+		free(out[m]);
+	}
+	return worst;
+}
+
+
+typedef struct Result {
+	double	framesPerUs;
+	double	missesPer1000;		// < 0 when not available
+	int		passes;
+} Result;
+
+static Result measure( float rate, int frames, int fused, int withLimiter, int missFd )
+{
+	Setup s;
+	Result r = { 0, -1, 0 };
+	uint8_t *out = malloc((size_t)frames * kChannels * 3);
+	int blocks = (int)(kSeconds * rate) / frames, b;
+	long long misses;
+	double start;
+
+	if( setupChain(&s, rate, frames, fused, withLimiter) != 0 )
+		return r;
+	r.passes = chainPasses(s.chain);
+	for( b = 0; b < 5; b++ )
+		chainProcess(s.chain, (const float * const *)gIn, out, frames);
+#ifdef __linux__
+	if( missFd >= 0 ) {
+		ioctl(missFd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(missFd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	start = nowSeconds();
+	for( b = 0; b < blocks; b++ )
+		chainProcess(s.chain, (const float * const *)gIn, out, frames);
+	r.framesPerUs = (double)blocks * frames / ((nowSeconds() - start) * 1e6);
+#ifdef __linux__
+	if( missFd >= 0 )
+		ioctl(missFd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+	misses = readMisses(missFd);
+	if( misses >= 0 )
+		r.missesPer1000 = misses * 1000.0 / ((double)blocks * frames);
+	teardown(&s);
+	free(out);
+	return r;
+}
+
+
+int main( void )
+{
+	static const float rates[] = { 48000.0f, 96000.0f };
+	int missFd = openMissCounter(), failed = 0, i, c, k, withLimiter;
+	unsigned seed = 1;
+
+	if( missFd < 0 )
+		printf("(perf events not available; no cache miss counts)\n\n");
+	printf("%-8s %-9s %6s %8s %12s %14s %10s\n", "rate", "limiter", "mode", "passes", "frames/us",
+		   "misses/1000f", "max diff");
+	for( i = 0; i < 2; i++ ) {
+		float rate = rates[i];
+		int frames = (int)(rate * kBlockMs / 1000);
+
+		for( c = 0; c < kChannels; c++ ) {
+			gIn[c] = malloc(sizeof(float) * frames);
+			for( k = 0; k < frames; k++ ) {
+				seed = seed * 1664525u + 1013904223u;
+				gIn[c][k] = 0.6f * sinf(2 * (float)M_PI * (110.0f * (c + 1)) * k / rate)
+							+ 0.5f * ((seed >> 8) * (1.0f / 16777216.0f) - 0.5f);
+			}
+		}
+		for( withLimiter = 0; withLimiter <= 1; withLimiter++ ) {
+			int32_t diff = compare(rate, frames, withLimiter);
+			int fused;
+
+			for( fused = 0; fused <= 1; fused++ ) {
+				Result r = measure(rate, frames, fused, withLimiter, missFd);
+				char misses[16];
+
+				if( r.missesPer1000 < 0 )
+					snprintf(misses, sizeof(misses), "-");
+				else
+					snprintf(misses, sizeof(misses), "%.1f", r.missesPer1000);
+				printf("%-8.0f %-9s %6s %8d %12.2f %14s", rate, withLimiter ? "yes" : "no",
+					   fused ? "fused" : "stages", r.passes, r.framesPerUs, misses);
+				if( fused )
+					printf(" %7d LSB%s\n", diff, diff > 1 ? "  FAIL" : "");
+				else
+					printf("\n");
+			}
+			failed += diff > 1;
+		}
+		for( c = 0; c < kChannels; c++ )
+			free(gIn[c]);
+	}
+	if( missFd >= 0 )
+		close(missFd);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,455 @@
+/*
+ * bench_core.c - microbenchmarks of the activation core, as JSON
+ *
+ * Times the parts of the program that run on every device event, against
+ * the fake device: encoding register requests, sending and diffing register
+ * plans, the sleep and wake transitions with a given latency per control
+ * transfer, and the Linux hot-plug path from receiving a uevent to the end
+ * of activation. Every case runs a fixed number of iterations after a
+ * warm-up, with no randomness, so runs on the same machine are comparable.
+ *
+ * Prints one JSON object: for each case the median and 99th percentile time
+ * per operation in nanoseconds, and the heap allocations per operation
+ * (counted with glibc; null elsewhere). Very short operations are timed in
+ * batches, and the percentiles are over batches. Linux only, for hotplug.c.
+ *
+ *   cc -O2 -std=gnu99 -I. -o bench_core bench/bench_core.c cm6206.c config.c power.c explore.c \
+ *      hotplug.c fakedev.c usbtrace.c
+ *
+ * Usage: bench_core [-o file] [-q]
+ *   -o: write the JSON to a file instead of standard output
+ *   -q: a tenth of the iterations, for a quick check
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "cm6206.h"
+#include "config.h"
+#include "power.h"
+#include "hotplug.h"
+#include "fakedev.h"
+
+#define kMaxSamples		20000
+
+
+//================================================================================================
+// Allocation counting. glibc exports its allocator under other names, so the
+// standard ones can be replaced here and still forward to it.
+//
+#ifdef __GLIBC__
+#define kCountsAllocations	1
+
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t n, size_t size );
+extern void *__libc_realloc( void *p, size_t size );
+extern void __libc_free( void *p );
+
+static unsigned long gAllocations;
+
+void *malloc( size_t size )
+{
+	gAllocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc( size_t n, size_t size )
+{
+	gAllocations++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc( void *p, size_t size )
+{
+	gAllocations++;
+	return __libc_realloc(p, size);
+}
+
+void free( void *p )
+{
+	__libc_free(p);
+}
+#else
+#define kCountsAllocations	0
+static unsigned long gAllocations;
+#endif
+
+
+//================================================================================================
+// Timing and the report
+//
+static uint64_t nowNs( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static int compareU64( const void *a, const void *b )
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+typedef void (*BenchOp)( void *arg );
+
+static FILE		*gOut;
+static int		gCases;
+static int		gScale = 1;		// divides the iteration counts
+
+
+// Runs op samples * batch times after a warm-up of a tenth of that, and
+// reports one case
+static void bench( const char *name, BenchOp op, void *arg, int samples, int batch )
+{
+	static uint64_t ns[kMaxSamples];
+	unsigned long allocations;
+	uint64_t total = 0;
+	int i, k;
+
+	samples /= gScale;
+	if( samples < 10 )
+		samples = 10;
+	if( samples > kMaxSamples )
+		samples = kMaxSamples;
+	for( i = 0; i < samples * batch / 10; i++ )
+		op(arg);
+
+	allocations = gAllocations;
+	for( i = 0; i < samples; i++ ) {
+		uint64_t start = nowNs();
+
+		for( k = 0; k < batch; k++ )
+			op(arg);
+		ns[i] = nowNs() - start;
+		total += ns[i];
+	}
+	allocations = gAllocations - allocations;
+	qsort(ns, samples, sizeof(ns[0]), compareU64);
+
+	fprintf(gOut, "%s    {\"name\": \"%s\", \"iterations\": %d, \"batch\": %d, "
+			"\"p50_ns\": %.1f, \"p99_ns\": %.1f, \"mean_ns\": %.1f, ",
+			gCases++ ? ",\n" : "", name, samples * batch, batch,
+			(double)ns[samples / 2] / batch, (double)ns[samples * 99 / 100] / batch,
+			(double)total / ((double)samples * batch));
+	if( kCountsAllocations )
+		fprintf(gOut, "\"allocs_per_op\": %.3f}", (double)allocations / ((double)samples * batch));
+	else
+		fprintf(gOut, "\"allocs_per_op\": null}");
+}
+
+
+//================================================================================================
+// A transport that takes a fixed time per control transfer, to stand in for
+// the bus; the fake device itself answers instantly
+//
+typedef struct SlowBus {
+	CMTransport		*inner;
+	uint64_t		latencyNs;
+} SlowBus;
+
+static int32_t slowRequest( void *ctx, CMControlRequest *req )
+{
+	SlowBus *bus = ctx;
+	uint64_t until = nowNs() + bus->latencyNs;
+	int32_t result = cmControlRequest(bus->inner, req);
+
+	while( nowNs() < until )
+		;
+	return result;
+}
+
+
+static int32_t discardRequest( void *ctx, CMControlRequest *req )
+{
+	// Keeps the compiler from dropping the encoding
+	const uint8_t *data = req->pData;
+
+	*(volatile uint8_t *)ctx = data[1] ^ data[3];
+	return 0;
+}
+
+
+//================================================================================================
+// Register encoding and plans
+//
+typedef struct PlanArgs {
+	CMTransport			*t;
+	const CMDeviceModel	*from, *to;
+	unsigned			step;
+	volatile unsigned	sink;		// results go here, so nothing is optimised away
+} PlanArgs;
+
+static void encodeWrite( void *arg )
+{
+	PlanArgs *a = arg;
+
+	a->step++;
+	writeCM6206Registers(a->t, a->step % kFakeNumRegisters, (uint16_t)(a->step * 0x9e37));
+}
+
+
+static void encodeRead( void *arg )
+{
+	PlanArgs *a = arg;
+	uint8_t selectBuf[4], fetchBuf[kCM6206ReadSize];
+	CMControlRequest select, fetch;
+
+	a->step++;
+	cm6206ReadRequests(a->step % kFakeNumRegisters, &select, selectBuf, &fetch, fetchBuf);
+	a->sink = cm6206ReadValue(fetchBuf) + select.wLength + fetch.wLength;
+}
+
+
+static void sendPlan( void *arg )
+{
+	PlanArgs *a = arg;
+
+	initCMDevice(a->t, a->to, 0);
+}
+
+
+static void diffPlans( void *arg )
+{
+	PlanArgs *a = arg;
+	CMRegisterWrite out[kConfigMaxWrites];
+
+	a->sink = configDiff(a->from, a->to, out, kConfigMaxWrites);
+}
+
+
+static void lookUpModel( void *arg )
+{
+	PlanArgs *a = arg;
+
+	a->step++;
+	a->sink = cmFindDeviceModel(0x10f5, (a->step & 1) ? 0x0200 : 0x0201) != NULL;
+}
+
+
+//================================================================================================
+// Activation state transitions: cold activation, then sleep (snapshot and
+// mute) and wake (restore and unmute) in turn
+//
+typedef struct PowerArgs {
+	CMTransport			*t;
+	const CMDeviceModel	*model;
+	CMPowerSnapshot		snap;
+	unsigned long		failures;
+} PowerArgs;
+
+static void activate( void *arg )
+{
+	PowerArgs *a = arg;
+
+	a->failures += initCMDevice(a->t, a->model, 0) != 0;
+}
+
+
+static void sleepWake( void *arg )
+{
+	PowerArgs *a = arg;
+
+	a->failures += powerQuiesce(a->t, &a->snap) != 0;
+	a->failures += powerRestore(a->t, a->model, &a->snap, 0) != 0;
+}
+
+
+//================================================================================================
+// The hot-plug path, as in main_linux.c: receive a uevent, parse and classify
+// it, and activate the device if it is one of ours. Events come from a
+// socketpair, as in tools/uevent_replay.c.
+//
+typedef struct HotplugArgs {
+	int				fds[2];
+	const char		*msg;
+	size_t			len;
+	CMTransport		*t;
+	unsigned long	activations, failures;
+} HotplugArgs;
+
+// Kernel wire format: "action@devpath", then NUL-separated KEY=VALUE pairs
+static size_t wireMessage( char *out, size_t size, const char *lines )
+{
+	size_t n = strlen(lines) + 1;
+
+	if( n > size )
+		n = size;
+	memcpy(out, lines, n);
+	for( size_t i = 0; i < n; i++ )
+		if( out[i] == '\n' )
+			out[i] = '\0';
+	return n;
+}
+
+
+static void hotplugEvent( void *arg )
+{
+	HotplugArgs *a = arg;
+	char buf[kUEventMaxSize];
+	CMUEvent ev;
+	int len;
+
+	if( send(a->fds[1], a->msg, a->len, 0) < 0 )
+		return;
+	while( (len = hotplugReceive(a->fds[0], buf, sizeof(buf))) > 0 ) {
+		CMHotplugEvent what = kHotplugIgnore;
+
+		if( hotplugParse(buf, len, &ev) == 0 )
+			what = hotplugClassify(&ev);
+		if( what == kHotplugDeviceAdded || what == kHotplugAudioBound ) {
+			a->failures += initCMDevice(a->t, cmFindDeviceModel(ev.vendor, ev.product), 0) != 0;
+			a->activations++;
+		}
+	}
+}
+
+
+static void hotplugParseOnly( void *arg )
+{
+	HotplugArgs *a = arg;
+	CMUEvent ev;
+
+	if( hotplugParse(a->msg, a->len, &ev) == 0 )
+		a->activations += hotplugClassify(&ev) != kHotplugIgnore;
+}
+
+
+static const char *kAddEvent =
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-2\n"
+	"ACTION=add\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2\nSUBSYSTEM=usb\n"
+	"DEVNAME=bus/usb/001/005\nDEVTYPE=usb_device\nPRODUCT=d8c/102/100\nTYPE=0/0/0\nBUSNUM=001\nDEVNUM=005\nSEQNUM=4101";
+
+static const char *kOtherEvent =
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-3\n"
+	"ACTION=add\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-3\nSUBSYSTEM=usb\n"
+	"DEVNAME=bus/usb/001/004\nDEVTYPE=usb_device\nPRODUCT=46d/c52b/1211\nBUSNUM=001\nDEVNUM=004\nSEQNUM=4100";
+
+
+//================================================================================================
+//
+int main( int argc, const char *argv[] )
+{
+	static const int latenciesUs[] = { 0, 125, 1000 };
+	static char addMsg[kUEventMaxSize], otherMsg[kUEventMaxSize];
+	const CMDeviceModel *cm6206 = cmFindDeviceModel(kVendorID, kProductID);
+	volatile uint8_t sink;
+	CMTransport nullBus = { discardRequest, (void *)&sink, NULL, NULL }, fake, slow;
+	CMFakeDevice dev;
+	SlowBus bus;
+	PlanArgs plan;
+	PowerArgs power;
+	HotplugArgs hp;
+	CMConfig *cfg;
+	char name[64];
+	int a, i, stderrFd, devNull;
+	unsigned long failures = 0;
+
+	gOut = stdout;
+	for( a = 1; a < argc; a++ ) {
+		if( strcmp(argv[a], "-o") == 0 && a + 1 < argc ) {
+			gOut = fopen(argv[++a], "w");
+			if( gOut == NULL ) {
+				perror(argv[a]);
+				return 1;
+			}
+		}
+		else if( strcmp(argv[a], "-q") == 0 )
+			gScale = 10;
+		else {
+			fprintf(stderr, "Usage: %s [-o file] [-q]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// initCMDevice() reports every activation on stderr
+	fflush(stderr);
+	stderrFd = dup(2);
+	devNull = open("/dev/null", O_WRONLY);
+	dup2(devNull, 2);
+
+	fakeDeviceInit(&dev);
+	fakeDeviceTransport(&dev, &fake);
+	bus.inner = &fake;
+	slow.controlRequest = slowRequest;
+	slow.ctx = &bus;
+	slow.submitRequest = NULL;
+	slow.runCompletions = NULL;
+
+	fprintf(gOut, "{\n  \"benchmark\": \"cm6206-core\",\n  \"allocations_counted\": %s,\n  \"cases\": [\n",
+			kCountsAllocations ? "true" : "false");
+
+	// Encoding and plans, no bus time at all
+	memset(&plan, 0, sizeof(plan));
+	plan.t = &nullBus;
+	bench("encode/write_request", encodeWrite, &plan, 2000, 1000);
+	bench("encode/read_requests", encodeRead, &plan, 2000, 1000);
+	bench("plan/find_model", lookUpModel, &plan, 2000, 1000);
+	plan.to = cm6206;
+	bench("plan/send_cm6206", sendPlan, &plan, 2000, 100);
+
+	// A configuration that changes one register and adds one
+	cfg = malloc(sizeof(CMConfig));
+	configDefaults(cfg);
+	cfg->storage[0].writes[1].value = 0x3000;
+	cfg->storage[0].writes[3] = (CMRegisterWrite){ 0x03, 0x007e, "all channels" };
+	cfg->models[0].planLength = 4;
+	plan.from = cm6206;
+	plan.to = &cfg->models[0];
+	bench("plan/diff_reload", diffPlans, &plan, 2000, 1000);
+
+	// State transitions, with each control transfer taking this long
+	memset(&power, 0, sizeof(power));
+	power.model = cm6206;
+	for( i = 0; i < (int)(sizeof(latenciesUs) / sizeof(latenciesUs[0])); i++ ) {
+		int samples = latenciesUs[i] ? 200 : 5000;
+
+		bus.latencyNs = latenciesUs[i] * 1000u;
+		power.t = &slow;
+		snprintf(name, sizeof(name), "activation/activate@%dus", latenciesUs[i]);
+		bench(name, activate, &power, samples, 1);
+		snprintf(name, sizeof(name), "activation/sleep_wake@%dus", latenciesUs[i]);
+		bench(name, sleepWake, &power, samples, 1);
+	}
+	failures += power.failures;
+
+	// Hot-plug: parsing alone, then the whole path for one of ours and for
+	// a device that isn't
+	memset(&hp, 0, sizeof(hp));
+	if( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, hp.fds) != 0 ) {
+		perror("socketpair");
+		return 1;
+	}
+	fcntl(hp.fds[0], F_SETFL, O_NONBLOCK);
+	hp.t = &fake;
+	hp.msg = addMsg;
+	hp.len = wireMessage(addMsg, sizeof(addMsg), kAddEvent);
+	bench("hotplug/parse_classify", hotplugParseOnly, &hp, 2000, 100);
+	bench("hotplug/add_to_activated", hotplugEvent, &hp, 5000, 1);
+	hp.msg = otherMsg;
+	hp.len = wireMessage(otherMsg, sizeof(otherMsg), kOtherEvent);
+	bench("hotplug/ignore_other_device", hotplugEvent, &hp, 5000, 1);
+	failures += hp.failures;
+
+	fprintf(gOut, "\n  ],\n  \"failures\": %lu\n}\n", failures);
+
+	dup2(stderrFd, 2);
+	if( gOut != stdout )
+		fclose(gOut);
+	free(cfg);
+	if( failures )
+		fprintf(stderr, "bench_core: %lu operations failed\n", failures);
+	if( hp.activations == 0 )
+		fprintf(stderr, "bench_core: the hot-plug path never activated the device\n");
+	return failures || hp.activations == 0;
+}
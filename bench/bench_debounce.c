@@ -0,0 +1,237 @@
+/*
+ * bench_debounce.c - hot-plug storms against the debouncer and a fake backend
+ *
+ * Replays thousands of add and terminate notifications, in simulated time, the
+ * way the daemon would see them through hub resets: every kEpisodeUs a reset
+ * makes each connected device bounce 1 to 6 times, a few milliseconds to
+ * 150 ms apart, and now and then a device is plugged in or left out. The
+ * backend does what main.c does: one record per port, kept while it bounces,
+ * and a fake CM6206 activated when the settle timer fires (up to kJitterUs
+ * late, as a run loop might be).
+ *
+ * Fails unless every port that settles with a device on it is activated
+ * exactly once, within the settle delay plus the timer's lateness; records
+ * are freed as ports settle empty (their number never exceeds the number of
+ * ports, and is back to the connected devices after every episode); and the
+ * activated devices have the right register values. Also reports what the
+ * previous handling, one activation and one record per add, would have cost.
+ *
+ *   cc -O2 -std=gnu99 -I. -o bench_debounce bench/bench_debounce.c debounce.c cm6206.c fakedev.c usbtrace.c
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cm6206.h"
+#include "fakedev.h"
+#include "debounce.h"
+
+#define kPorts			6
+#define kEpisodes		1000
+#define kEpisodeUs		3000000
+#define kSettleUs		1000000		// the default settle-delay-ms
+#define kJitterUs		2000
+#define kMaxGapUs		150000
+
+typedef struct Event {
+	uint64_t	us;
+	int			port;
+	int			present;
+} Event;
+
+// The backend's record of a port, like MyPrivateData in main.c
+typedef struct Record {
+	uint32_t		location;
+	int				present;
+	CMFakeDevice	dev;
+} Record;
+
+static unsigned long	gRecordsLive, gRecordsPeak, gRecordsMade;
+static unsigned		gSeed = 12345;
+
+
+static unsigned randomBelow( unsigned n )
+{
+	gSeed = gSeed * 1664525u + 1013904223u;
+	return (gSeed >> 8) % n;
+}
+
+
+static double nowSeconds( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static int compareEvents( const void *a, const void *b )
+{
+	const Event *x = a, *y = b;
+	return x->us < y->us ? -1 : x->us > y->us;
+}
+
+
+// Storms for every episode. Returns the number of events; *expected is set to
+// the number of storms that end with a device present.
+static int makeEvents( Event *events, int max, unsigned long *expected )
+{
+	int present[kPorts], e, p, n = 0;
+
+	memset(present, 0, sizeof(present));
+	*expected = 0;
+	for( e = 0; e < kEpisodes; e++ ) {
+		uint64_t start = (uint64_t)e * kEpisodeUs + kEpisodeUs / 10;
+
+		for( p = 0; p < kPorts; p++ ) {
+			int bounces, endPresent, i;
+			uint64_t t = start + randomBelow(20000);
+
+			if( present[p] ) {
+				// Reset by the hub; 1 in 8 is unplugged for good
+				endPresent = randomBelow(8) != 0;
+			} else if( randomBelow(3) == 0 ) {
+				endPresent = 1;		// plugged in during the reset
+			} else
+				continue;
+			// Notifications alternate, so the count's parity decides the end state
+			bounces = 1 + randomBelow(6);
+			if( (bounces % 2 == 1) != (present[p] != endPresent) )
+				bounces++;
+			for( i = 0; i < bounces && n < max; i++ ) {
+				present[p] = !present[p];
+				events[n].us = t;
+				events[n].port = p;
+				events[n].present = present[p];
+				n++;
+				t += 2000 + randomBelow(kMaxGapUs - 2000);
+			}
+			*expected += endPresent;
+		}
+	}
+	qsort(events, n, sizeof(Event), compareEvents);
+	return n;
+}
+
+
+int main( void )
+{
+	const CMDeviceModel *model = cmFindDeviceModel(kVendorID, kProductID);
+	int maxEvents = kEpisodes * kPorts * 7, numEvents, next = 0, failed = 0, connected = 0, i;
+	Event *events = malloc(sizeof(Event) * maxEvents);
+	uint64_t now = 0, lastEventUs[kPorts], worstUs = 0;
+	unsigned long expected, activations = 0, adds = 0, wrongRegisters = 0, notFlat = 0, episode = 0;
+	double busy = 0;
+	CMDebouncer d;
+
+	// initCMDevice() reports every activation on stderr
+	fflush(stderr);
+	if( freopen("/dev/null", "w", stderr) == NULL )
+		return 1;
+
+	debounceInit(&d, kSettleUs);
+	numEvents = makeEvents(events, maxEvents, &expected);
+	memset(lastEventUs, 0, sizeof(lastEventUs));
+
+	for( ;; ) {
+		int64_t wait = debounceNextUs(&d, now);
+		uint64_t fire = wait < 0 ? UINT64_MAX : now + wait + randomBelow(kJitterUs);
+		double start;
+
+		// Records may only outlive an episode for ports with a device on them
+		if( next < numEvents && events[next].us / kEpisodeUs != episode && wait < 0 ) {
+			episode = events[next].us / kEpisodeUs;
+			for( connected = 0, i = 0; i < d.numPorts; i++ )
+				connected += ((Record *)d.ports[i].record)->present;
+			if( gRecordsLive != (unsigned long)connected || d.numPorts != connected )
+				notFlat++;
+		}
+		if( next == numEvents && wait < 0 )
+			break;
+
+		start = nowSeconds();
+		if( next < numEvents && events[next].us <= fire ) {
+			const Event *ev = &events[next++];
+			CMDebouncePort *port;
+			Record *rec;
+
+			now = ev->us;
+			lastEventUs[ev->port] = now;
+			adds += ev->present;
+			port = debounceNotify(&d, 0x14100000 + ev->port * 0x1000, ev->present, now);
+			if( port == NULL ) {
+				printf("notification for port %d not taken\n", ev->port);
+				failed = 1;
+				continue;
+			}
+			rec = port->record;
+			if( rec == NULL ) {
+				rec = malloc(sizeof(Record));
+				rec->location = port->location;
+				port->record = rec;
+				gRecordsMade++;
+				if( ++gRecordsLive > gRecordsPeak )
+					gRecordsPeak = gRecordsLive;
+			}
+			rec->present = ev->present;
+		} else {
+			CMDebounceAction action;
+			uint32_t location;
+			void *record;
+
+			now = fire;
+			while( (action = debounceTake(&d, now, &location, &record)) != kDebounceNothing ) {
+				Record *rec = record;
+
+				if( action == kDebounceRelease ) {
+					free(rec);
+					gRecordsLive--;
+				} else {
+					CMTransport t;
+					int p = (int)(location - 0x14100000) / 0x1000, r;
+
+					if( now - lastEventUs[p] > worstUs )
+						worstUs = now - lastEventUs[p];
+					fakeDeviceInit(&rec->dev);
+					fakeDeviceTransport(&rec->dev, &t);
+					initCMDevice(&t, model, 0);
+					for( r = 0; r < model->planLength; r++ )
+						if( rec->dev.regs[model->plan[r].regNo] != model->plan[r].value )
+							wrongRegisters++;
+					activations++;
+				}
+			}
+		}
+		busy += nowSeconds() - start;
+	}
+
+	for( connected = 0, i = 0; i < d.numPorts; i++ )
+		connected += ((Record *)d.ports[i].record)->present;
+
+	printf("%d ports, %d episodes of %d s, settle delay %d ms\n\n", kPorts, kEpisodes,
+		   kEpisodeUs / 1000000, kSettleUs / 1000);
+	printf("notifications            %8d  (%lu adds, %lu removes, %lu collapsed)\n", numEvents,
+		   d.stats.adds, d.stats.removes, d.stats.collapsed);
+	printf("activations              %8lu  (expected %lu; one per add would be %lu)\n", activations, expected, adds);
+	printf("records allocated        %8lu  (one per add would be %lu)\n", gRecordsMade, adds);
+	printf("records at most          %8lu  (%d ports)\n", gRecordsPeak, kPorts);
+	printf("records left             %8lu  (%d devices connected)\n", gRecordsLive, connected);
+	printf("episodes not ending flat %8lu\n", notFlat);
+	printf("time to activation, max  %8.1f ms  (budget %.1f ms)\n", worstUs / 1000.0, (kSettleUs + kJitterUs) / 1000.0);
+	printf("wrong register values    %8lu\n", wrongRegisters);
+	printf("CPU per notification     %8.0f ns, activations included\n", busy * 1e9 / numEvents);
+
+	failed |= activations != expected || gRecordsPeak > kPorts || notFlat || wrongRegisters ||
+			  gRecordsLive != (unsigned long)connected ||
+			  worstUs > kSettleUs + kJitterUs || d.stats.overflows;
+	for( i = 0; i < d.numPorts; i++ )
+		free(d.ports[i].record);
+	free(events);
+	printf("\n%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
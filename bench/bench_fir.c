@@ -0,0 +1,159 @@
+/*
+ * bench_fir.c - scaling benchmark for the partitioned FIR engine
+ *
+ * Checks the engine against direct convolution once, then times 8 channels
+ * of room correction for 1-8 threads and several filter lengths, reporting
+ * the mean time per block and the real-time load at 48 kHz: on average, and
+ * for the 99th percentile and the slowest block, which is what decides
+ * whether a block is late.
+ *
+ *   cc -O3 -std=gnu11 -I. -o bench_fir bench/bench_fir.c fir.c fft.c -lpthread -lm
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "fir.h"
+
+#define kChannels	8
+#define kBlockSize	256
+#define kRate		48000.0
+
+
+static double nowSeconds( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static float noise( unsigned *state )
+{
+	*state = *state * 1664525u + 1013904223u;
+	return (float)((*state >> 8) * (1.0 / 16777216.0)) - 0.5f;
+}
+
+
+//================================================================================================
+// Compare against a plain time-domain convolution, across several segments.
+//
+static int checkAgainstDirect( void )
+{
+	const int taps = 3000, B = 64, blocks = 80;
+	float *h = malloc(sizeof(float) * taps);
+	float *x = malloc(sizeof(float) * B * blocks);
+	float *y = malloc(sizeof(float) * B * blocks);
+	unsigned seed = 1;
+	double maxErr = 0.0;
+	CMFir *fir;
+	int i, n, k;
+
+	for( i = 0; i < taps; i++ )
+		h[i] = noise(&seed) * expf(-i / 800.0f);
+	for( i = 0; i < B * blocks; i++ )
+		x[i] = noise(&seed);
+
+	fir = firCreate(1, B, taps, 2);
+	if( !fir || firLoadFilter(fir, 0, h, taps) ) {
+		fprintf(stderr, "bench_fir: could not create engine\n");
+		return -1;
+	}
+	for( n = 0; n < blocks; n++ ) {
+		const float *in[1] = { x + n * B };
+		float *out[1] = { y + n * B };
+		firProcess(fir, in, out);
+	}
+	for( i = 0; i < B * blocks; i++ ) {
+		double ref = 0.0;
+		for( k = 0; k < taps && k <= i; k++ )
+			ref += (double)h[k] * x[i - k];
+		if( fabs(ref - y[i]) > maxErr )
+			maxErr = fabs(ref - y[i]);
+	}
+	printf("check: %d segments, max error vs direct convolution %.2e\n", firNumSegments(fir), maxErr);
+	firDestroy(fir);
+	free(h);
+	free(x);
+	free(y);
+	return maxErr < 1e-4 ? 0 : -1;
+}
+
+
+static const char *percent( double load )
+{
+	static char buf[4][16];
+	static int next;
+
+	next = (next + 1) % 4;
+	snprintf(buf[next], sizeof(buf[next]), "%.1f%%", 100.0 * load);
+	return buf[next];
+}
+
+
+static int compareDoubles( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+int main( void )
+{
+	static const int tapCounts[] = { 4096, 16384, 65536 };
+	static float bufs[kChannels][kBlockSize];
+	float *chans[kChannels];
+	unsigned seed = 7;
+	int t, c, i, threads;
+
+	if( checkAgainstDirect() ) {
+		fprintf(stderr, "bench_fir: engine output does not match direct convolution\n");
+		return 1;
+	}
+	for( c = 0; c < kChannels; c++ )
+		chans[c] = bufs[c];
+
+	printf("\n%-8s %-8s %-10s %-12s %-9s %-9s %s\n", "taps", "threads", "segments", "us/block", "RT load",
+		   "p99", "max");
+	for( t = 0; t < (int)(sizeof(tapCounts) / sizeof(tapCounts[0])); t++ ) {
+		int taps = tapCounts[t];
+		float *h = malloc(sizeof(float) * taps);
+
+		for( i = 0; i < taps; i++ )
+			h[i] = noise(&seed) * expf(-i / (taps / 6.0f));
+
+		for( threads = 1; threads <= 8; threads *= 2 ) {
+			CMFir *fir = firCreate(kChannels, kBlockSize, taps, threads);
+			// Run long enough to cycle through the largest partitions several times
+			int blocks = 4 * kFirMaxPartition / kBlockSize * 4;
+			double *times = malloc(sizeof(double) * blocks), elapsed = 0, blockTime = kBlockSize / kRate;
+
+			for( c = 0; c < kChannels; c++ )
+				firLoadFilter(fir, c, h, taps);
+			for( i = 0; i < blocks; i++ ) {
+				double start;
+
+				for( c = 0; c < kChannels; c++ )
+					bufs[c][i % kBlockSize] = noise(&seed);
+				start = nowSeconds();
+				firProcess(fir, (const float * const *)chans, chans);
+				times[i] = nowSeconds() - start;
+				elapsed += times[i];
+			}
+			elapsed /= blocks;
+			qsort(times, blocks, sizeof(double), compareDoubles);
+			printf("%-8d %-8d %-10d %-12.1f %-9s %-9s %.1f%%\n", taps, threads, firNumSegments(fir),
+			       elapsed * 1e6, percent(elapsed / blockTime), percent(times[blocks * 99 / 100] / blockTime),
+			       100.0 * times[blocks - 1] / blockTime);
+			firDestroy(fir);
+			free(times);
+		}
+		free(h);
+	}
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * bench_gpio.c - GPIO toggle rate and latency against the fake device
+ *
+ * Compares a read-modify-write of REG1 per pin change with the cached copy
+ * in gpio.c, one change at a time and in bursts changing all four pins. The
+ * fake device answers instantly, so each control transfer is made to take
+ * -l microseconds (default 1000, one full-speed frame) to stand in for the
+ * bus.
+ *
+ *   cc -O2 -std=gnu99 -I. -o bench_gpio bench/bench_gpio.c gpio.c cm6206.c fakedev.c usbtrace.c
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cm6206.h"
+#include "fakedev.h"
+#include "gpio.h"
+
+#define kSteps		500
+
+typedef struct SlowBus {
+	CMTransport		*inner;
+	unsigned long	latencyUs;
+} SlowBus;
+
+static int32_t slowRequest( void *ctx, CMControlRequest *req )
+{
+	SlowBus *bus = ctx;
+	uint64_t until = cmMonotonicUs() + bus->latencyUs;
+	int32_t result = cmControlRequest(bus->inner, req);
+
+	while( cmMonotonicUs() < until )
+		;
+	return result;
+}
+
+
+static int compareUs( const void *a, const void *b )
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+typedef enum { kReadModifyWrite, kCached, kCachedBurst } Mode;
+
+static const char *kModeNames[] = { "read-modify-write", "cached", "cached, 4-pin bursts" };
+
+
+static void run( Mode mode, CMFakeDevice *dev, CMTransport *t )
+{
+	uint64_t lat[kSteps], start, total;
+	unsigned long requests;
+	int changes = mode == kCachedBurst ? kGPIONumPins : 1;
+	CMGPIO g;
+	int i, p;
+
+	gpioOpen(&g, t);
+	requests = dev->requests;
+	start = cmMonotonicUs();
+	for( i = 0; i < kSteps; i++ ) {
+		uint64_t t0 = cmMonotonicUs();
+
+		if( mode == kReadModifyWrite ) {
+			uint16_t reg1 = 0;
+			readCM6206Register(t, 0x01, &reg1);
+			reg1 ^= kGPIOOutputBit(1);
+			writeCM6206Registers(t, 0x01, reg1 | kGPIOEnableBit(1));
+		}
+		else {
+			for( p = 1; p <= changes; p++ )
+				gpioSet(&g, p, i & 1);
+			gpioFlush(&g);
+		}
+		lat[i] = cmMonotonicUs() - t0;
+	}
+	total = cmMonotonicUs() - start;
+	qsort(lat, kSteps, sizeof(lat[0]), compareUs);
+
+	printf("%-22s %8.0f changes/s  p50 %6.2f ms  p99 %6.2f ms  %.2f transfers/change\n",
+		   kModeNames[mode], kSteps * changes / (total * 1e-6),
+		   lat[kSteps / 2] / 1000.0, lat[kSteps * 99 / 100] / 1000.0,
+		   (double)(dev->requests - requests) / (kSteps * changes));
+}
+
+
+int main( int argc, char *argv[] )
+{
+	CMFakeDevice dev;
+	CMTransport fake, slow;
+	SlowBus bus;
+
+	bus.latencyUs = 1000;
+	if( argc == 3 && strcmp(argv[1], "-l") == 0 )
+		bus.latencyUs = strtoul(argv[2], NULL, 0);
+	else if( argc != 1 ) {
+		fprintf(stderr, "Usage: %s [-l microseconds-per-transfer]\n", argv[0]);
+		return 2;
+	}
+
+	fakeDeviceInit(&dev);
+	fakeDeviceTransport(&dev, &fake);
+	bus.inner = &fake;
+	memset(&slow, 0, sizeof(slow));
+	slow.controlRequest = slowRequest;
+	slow.ctx = &bus;
+	initCM6206(&fake, 0);
+
+	printf("%d steps, %lu us per control transfer\n", kSteps, bus.latencyUs);
+	run(kReadModifyWrite, &dev, &slow);
+	run(kCached, &dev, &slow);
+	run(kCachedBurst, &dev, &slow);
+
+	// The cached copy must still match the device
+	{
+		CMGPIO g;
+		uint16_t reg1;
+
+		gpioOpen(&g, &fake);
+		gpioSet(&g, 3, 1);
+		gpioRelease(&g, 4);
+		gpioFlush(&g);
+		readCM6206Register(&fake, 0x01, &reg1);
+		if( reg1 != g.written || gpioGet(&g, 3) != 1 || gpioGet(&g, 4) != kGPIOInput ) {
+			fprintf(stderr, "FAIL: REG1 is 0x%04x, expected 0x%04x\n", reg1, g.written);
+			return 1;
+		}
+	}
+	return 0;
+}
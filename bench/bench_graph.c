@@ -0,0 +1,292 @@
+/*
+ * bench_graph.c - scaling of the graph executor from one thread to all cores
+ *
+ * Four 8-channel devices, each fed by four 2-channel chains (remix, gain,
+ * delay, limiter, S24) whose output one more node interleaves into the
+ * device's buffer: 20 nodes per block, 16 of them independent. For 1 to N
+ * threads it reports throughput back to back, as a multiple of real time,
+ * and block latency at the real block rate, median, 99th percentile and
+ * worst, with 64-frame blocks at 48 kHz (1.33 ms). Fails if any output
+ * differs from running the nodes one after another, by even a bit.
+ *
+ *   cc -O3 -std=gnu11 -I. -o bench_graph bench/bench_graph.c graph.c chain.c limiter.c truepeak.c pcmconv.c -lpthread -lm
+ *
+ * Usage: bench_graph [-t maxThreads]	(default: the number of CPUs)
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "graph.h"
+#include "chain.h"
+
+#define kDevices		4
+#define kChannels		8			// per device
+#define kGroupChannels	2
+#define kGroups			(kChannels / kGroupChannels)
+#define kRate			48000.0f
+#define kFrames			64
+#define kSeconds		4			// of audio processed back to back
+#define kPacedBlocks	1500		// two seconds at the real block rate
+#define kCheckBlocks	200
+#define kSpinUs			2000		// longer than a block, so paced workers stay awake
+
+typedef struct Group {
+	CMChain			*chain;
+	CMLimiter		*lim;
+	PCMDither		dither;
+	const float		*in[kGroupChannels];
+	uint8_t			out[kFrames * kGroupChannels * 3];
+} Group;
+
+typedef struct Device {
+	Group			groups[kGroups];
+	uint8_t			out[kFrames * kChannels * 3];
+} Device;
+
+typedef struct Setup {
+	Device			devices[kDevices];
+	CMGraph			*graph;
+} Setup;
+
+static float *gIn[kDevices][kChannels];
+
+
+static double nowSeconds( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void runGroup( void *ctx, int frames, int worker )
+{
+	Group *g = ctx;
+
+	(void)worker;
+	chainProcess(g->chain, g->in, g->out, frames);
+}
+
+
+static void runPack( void *ctx, int frames, int worker )
+{
+	Device *d = ctx;
+	int g, i;
+
+	(void)worker;
+	for( g = 0; g < kGroups; g++ )
+		for( i = 0; i < frames; i++ )
+			memcpy(d->out + (i * kChannels + g * kGroupChannels) * 3,
+				   d->groups[g].out + i * kGroupChannels * 3, kGroupChannels * 3);
+}
+
+
+static int setupGroup( Group *g, int device, int group )
+{
+	static const float remix[4] = { 0.9f, 0.1f, 0.1f, 0.9f };
+	float gains[kGroupChannels] = { 0.8f + 0.05f * group, 0.75f + 0.05f * device };
+	int delay[kGroupChannels] = { 24 * group, 24 * group + 12 }, c;
+	CMLimiterParams params;
+
+	for( c = 0; c < kGroupChannels; c++ )
+		g->in[c] = gIn[device][group * kGroupChannels + c];
+	pcmDitherInit(&g->dither, kGroupChannels, 0, 100 + device * kGroups + group);
+	g->chain = chainCreate(kGroupChannels, kFrames, kChainS24, &g->dither);
+	limiterDefaultParams(&params);
+	g->lim = limiterCreate(kGroupChannels, kRate, kFrames, &params);
+	if( g->chain == NULL || g->lim == NULL )
+		return -1;
+	chainAddRemix(g->chain, remix);
+	chainAddGain(g->chain, gains);
+	chainAddDelay(g->chain, delay);
+	return chainAddLimiter(g->chain, g->lim);
+}
+
+
+// The devices, and for threads > 0 a graph that runs them. Node order is the
+// order the sequential reference runs them in.
+static int setup( Setup *s, int threads )
+{
+	int d, g;
+
+	memset(s, 0, sizeof(Setup));
+	for( d = 0; d < kDevices; d++ )
+		for( g = 0; g < kGroups; g++ )
+			if( setupGroup(&s->devices[d].groups[g], d, g) != 0 )
+				return -1;
+	if( threads == 0 )
+		return 0;
+	if( (s->graph = graphCreate(threads, kSpinUs)) == NULL )
+		return -1;
+	for( d = 0; d < kDevices; d++ ) {
+		int first = -1, pack;
+
+		for( g = 0; g < kGroups; g++ ) {
+			int n = graphAddNode(s->graph, runGroup, &s->devices[d].groups[g]);
+			if( first < 0 )
+				first = n;
+		}
+		pack = graphAddNode(s->graph, runPack, &s->devices[d]);
+		for( g = 0; g < kGroups; g++ )
+			if( graphAddEdge(s->graph, first + g, pack) != 0 )
+				return -1;
+	}
+	return 0;
+}
+
+
+static void teardown( Setup *s )
+{
+	int d, g;
+
+	graphDestroy(s->graph);
+	for( d = 0; d < kDevices; d++ )
+		for( g = 0; g < kGroups; g++ ) {
+			chainDestroy(s->devices[d].groups[g].chain);
+			limiterDestroy(s->devices[d].groups[g].lim);
+		}
+}
+
+
+static void runSequential( Setup *s )
+{
+	int d, g;
+
+	for( d = 0; d < kDevices; d++ ) {
+		for( g = 0; g < kGroups; g++ )
+			runGroup(&s->devices[d].groups[g], kFrames, 0);
+		runPack(&s->devices[d], kFrames, 0);
+	}
+}
+
+
+// Blocks that came out different from the reference
+static int compare( int threads )
+{
+	Setup s[2];
+	int b, d, wrong = 0;
+
+	if( setup(&s[0], 0) != 0 || setup(&s[1], threads) != 0 )
+		return -1;
+	for( b = 0; b < kCheckBlocks; b++ ) {
+		int differs = 0;
+
+		runSequential(&s[0]);
+		graphRun(s[1].graph, kFrames);
+		for( d = 0; d < kDevices; d++ )
+			differs |= memcmp(s[0].devices[d].out, s[1].devices[d].out, sizeof(s[0].devices[d].out)) != 0;
+		wrong += differs;
+	}
+	teardown(&s[0]);
+	teardown(&s[1]);
+	return wrong;
+}
+
+
+static int compareDoubles( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+typedef struct Result {
+	double			realtime;		// audio time per wall time, back to back
+	double			median, p99, worst;	// us, paced
+	CMGraphStats	stats;
+} Result;
+
+static int measure( int threads, Result *r )
+{
+	int blocks = (int)(kSeconds * kRate) / kFrames, b;
+	double *latency = malloc(sizeof(double) * kPacedBlocks), start;
+	struct timespec next;
+	Setup s;
+
+	if( latency == NULL || setup(&s, threads) != 0 )
+		return -1;
+	for( b = 0; b < 50; b++ )
+		graphRun(s.graph, kFrames);
+	start = nowSeconds();
+	for( b = 0; b < blocks; b++ )
+		graphRun(s.graph, kFrames);
+	r->realtime = blocks * kFrames / kRate / (nowSeconds() - start);
+
+	// At the rate a render thread would run it
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for( b = 0; b < kPacedBlocks; b++ ) {
+		next.tv_nsec += (long)(kFrames * 1e9 / kRate);
+		if( next.tv_nsec >= 1000000000L ) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		start = nowSeconds();
+		graphRun(s.graph, kFrames);
+		latency[b] = (nowSeconds() - start) * 1e6;
+	}
+	qsort(latency, kPacedBlocks, sizeof(double), compareDoubles);
+	r->median = latency[kPacedBlocks / 2];
+	r->p99 = latency[kPacedBlocks * 99 / 100];
+	r->worst = latency[kPacedBlocks - 1];
+	graphStats(s.graph, &r->stats);
+	teardown(&s);
+	free(latency);
+	return 0;
+}
+
+
+int main( int argc, char **argv )
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int maxThreads = cpus < 1 ? 1 : (cpus > kGraphMaxThreads ? kGraphMaxThreads : (int)cpus);
+	int failed = 0, opt, d, c, i, t;
+	unsigned seed = 1;
+
+	while( (opt = getopt(argc, argv, "t:")) != -1 ) {
+		if( opt != 't' || (maxThreads = atoi(optarg)) < 1 || maxThreads > kGraphMaxThreads ) {
+			fprintf(stderr, "usage: %s [-t maxThreads]  (1 to %d)\n", argv[0], kGraphMaxThreads);
+			return 2;
+		}
+	}
+	for( d = 0; d < kDevices; d++ )
+		for( c = 0; c < kChannels; c++ ) {
+			gIn[d][c] = malloc(sizeof(float) * kFrames);
+			for( i = 0; i < kFrames; i++ ) {
+				seed = seed * 1664525u + 1013904223u;
+				gIn[d][c][i] = 0.7f * sinf(2 * (float)M_PI * 220.0f * (c + 1) * i / kRate)
+							   + 0.6f * ((seed >> 8) * (1.0f / 16777216.0f) - 0.5f);
+			}
+		}
+
+	printf("%d devices x %d channels, %d-frame blocks at %.0f Hz (%.0f us), %ld CPUs\n\n", kDevices, kChannels,
+		   kFrames, kRate, kFrames * 1e6 / kRate, cpus);
+	printf("%7s %10s %9s %9s %9s %8s %7s %7s\n", "threads", "x realtime", "median us", "p99 us", "worst us",
+		   "steals", "parks", "wrong");
+	for( t = 1; t <= maxThreads; t++ ) {
+		int wrong = compare(t);
+		Result r;
+
+		if( wrong != 0 || measure(t, &r) != 0 ) {
+			printf("%7d  %s\n", t, wrong < 0 ? "setup failed" : "outputs differ");
+			failed = 1;
+			continue;
+		}
+		printf("%7d %10.1f %9.1f %9.1f %9.1f %8lu %7lu %7d\n", t, r.realtime, r.median, r.p99, r.worst,
+			   r.stats.steals, r.stats.parks, wrong);
+	}
+	for( d = 0; d < kDevices; d++ )
+		for( c = 0; c < kChannels; c++ )
+			free(gIn[d][c]);
+	printf("\n%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
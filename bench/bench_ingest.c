@@ -0,0 +1,224 @@
+/*
+ * bench_ingest.c - handing audio blocks from client processes to the daemon
+ *
+ * Forks 1 to kIngestMaxClients client processes, which attach to the
+ * shared-memory rings and publish 8-channel blocks of 64 frames. The parent
+ * consumes them in place, checking every block's contents and each client's
+ * sequence numbers. It runs twice per client count:
+ *
+ *   burst   clients publish as fast as they can: the cost per handed-over
+ *           block, and how many futex calls (waits and wakes) it took
+ *   paced   each client publishes every kPeriodUs, like an audio callback:
+ *           the latency from publication to the daemon having the block
+ *
+ * Then every ring is claimed by a client that exits without detaching, one of
+ * them after scribbling a huge frame count and stride over a block it
+ * published. Fails if a block is lost, reordered or corrupted, if the daemon
+ * hands out a frame count beyond the block size, or if a new client can't
+ * take over a dead client's ring.
+ *
+ *   cc -O2 -std=gnu11 -I. -o bench_ingest bench/bench_ingest.c ingest.c
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "ingest.h"
+
+#define kChannels		8
+#define kFrames			64
+#define kRingBlocks		16
+#define kBurstBlocks	100000		// per client
+#define kPacedBlocks	2000
+#define kPeriodUs		500
+
+
+static int64_t nowNs( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void runClient( int fd, int blocks, int paced )
+{
+	CMIngestClient *client = ingestAttach(fd);
+	struct timespec next;
+	int b, c, i;
+
+	if( client == NULL )
+		_exit(2);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for( b = 0; b < blocks; b++ ) {
+		CMIngestBlock *block = ingestAcquire(client, -1);
+
+		// What the consumer checks: block number plus channel, everywhere
+		for( c = 0; c < kChannels; c++ ) {
+			float *x = ingestChannel(block, c);
+			for( i = 0; i < kFrames; i++ )
+				x[i] = (float)(b + c);
+		}
+		ingestPublish(client, kFrames);
+		if( paced ) {
+			next.tv_nsec += kPeriodUs * 1000;
+			if( next.tv_nsec >= 1000000000 ) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+	}
+	ingestDetach(client);
+	_exit(0);
+}
+
+
+static int compareNs( const void *a, const void *b )
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+// Returns the number of faults found
+static int run( int clients, int paced )
+{
+	int blocks = paced ? kPacedBlocks : kBurstBlocks, total = clients * blocks, got = 0, faults = 0, i, c;
+	int64_t *latency = malloc(sizeof(int64_t) * total), start = 0;
+	uint32_t expect[kIngestMaxClients];
+	CMIngest *ingest = ingestCreate(kChannels, kFrames, kRingBlocks);
+	CMIngestStats stats[2];
+	pid_t pids[kIngestMaxClients];
+
+	if( ingest == NULL || latency == NULL )
+		return 1;
+	memset(expect, 0, sizeof(expect));
+	for( i = 0; i < clients; i++ ) {
+		pids[i] = fork();
+		if( pids[i] == 0 )
+			runClient(ingestFd(ingest), blocks, paced);
+	}
+
+	while( got < total ) {
+		int client, frames;
+		CMIngestBlock *block = ingestNext(ingest, &client, &frames, 5000);
+		float want;
+
+		if( block == NULL ) {
+			printf("  timed out with %d of %d blocks\n", got, total);
+			faults++;
+			break;
+		}
+		latency[got] = nowNs() - (int64_t)block->timeNs;
+		if( got++ == 0 )
+			start = nowNs();
+		want = (float)block->sequence;
+		if( block->sequence != expect[client]++ || frames != kFrames )
+			faults++;
+		for( c = 0; c < kChannels; c++ )
+			if( ingestSamples(ingest, block, c)[0] != want + c || ingestSamples(ingest, block, c)[kFrames - 1] != want + c )
+				faults++;
+		ingestRelease(ingest, client);
+	}
+	{
+		double elapsedNs = (double)(nowNs() - start);
+		char cost[16] = "-";		// paced runs take the period per block
+
+		if( !paced && got > 1 )
+			snprintf(cost, sizeof(cost), "%.0f", elapsedNs / (got - 1));
+		ingestStats(ingest, stats);
+		for( i = 0; i < clients; i++ ) {
+			int status;
+			waitpid(pids[i], &status, 0);
+			if( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+				faults++;
+		}
+		qsort(latency, got, sizeof(int64_t), compareNs);
+		printf("%-6s %7d %9d %10s %9.3f %9.1f %9.1f %9.1f %9.1f %s\n", paced ? "paced" : "burst", clients, got,
+			   cost,
+			   (double)(stats[0].waits + stats[0].wakes + stats[1].waits + stats[1].wakes) / (got ? got : 1),
+			   got ? latency[got / 2] / 1000.0 : 0, got ? latency[(int)(got * 0.99)] / 1000.0 : 0,
+			   got ? latency[(int)(got * 0.999)] / 1000.0 : 0, got ? latency[got - 1] / 1000.0 : 0,
+			   faults ? "FAULTS" : "ok");
+	}
+	ingestDestroy(ingest);
+	free(latency);
+	return faults;
+}
+
+
+// Clients that die holding their rings, one of them after corrupting a block
+static int runAbandoned( void )
+{
+	CMIngest *ingest = ingestCreate(kChannels, kFrames, kRingBlocks);
+	CMIngestClient *late;
+	CMIngestBlock *block;
+	int faults = 0, client, frames, i, c;
+
+	if( ingest == NULL )
+		return 1;
+	for( i = 0; i < kIngestMaxClients; i++ ) {
+		pid_t pid = fork();
+		int status;
+
+		if( pid == 0 ) {
+			CMIngestClient *dying = ingestAttach(ingestFd(ingest));
+
+			if( dying == NULL )
+				_exit(2);
+			if( i == 0 ) {
+				block = ingestAcquire(dying, 0);
+				for( c = 0; c < kChannels; c++ )
+					for( frames = 0; frames < kFrames; frames++ )
+						ingestChannel(block, c)[frames] = (float)c;
+				ingestPublish(dying, kFrames);
+				block->frames = 0xffffffffu;
+				block->stride = 0x40000000u;
+			}
+			_exit(0);
+		}
+		waitpid(pid, &status, 0);
+		if( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+			faults++;
+	}
+	block = ingestNext(ingest, &client, &frames, 1000);
+	if( block == NULL || frames != kFrames )
+		faults++;
+	else {
+		for( c = 0; c < kChannels; c++ )
+			if( ingestSamples(ingest, block, c)[kFrames - 1] != (float)c )
+				faults++;
+		ingestRelease(ingest, client);
+	}
+	late = ingestAttach(ingestFd(ingest));
+	if( late == NULL )
+		faults++;
+	ingestDetach(late);
+	printf("\nabandoned rings: %s\n", faults ? "FAULTS" : "ok");
+	ingestDestroy(ingest);
+	return faults;
+}
+
+
+int main( void )
+{
+	int clients, paced, faults = 0;
+
+	printf("%d channels x %d frames per block, %d blocks per ring; latencies in us\n\n",
+		   kChannels, kFrames, kRingBlocks);
+	printf("%-6s %7s %9s %10s %9s %9s %9s %9s %9s\n", "mode", "clients", "blocks", "ns/block",
+		   "futex/blk", "p50", "p99", "p99.9", "max");
+	for( paced = 0; paced <= 1; paced++ )
+		for( clients = 1; clients <= kIngestMaxClients; clients *= 2 )
+			faults += run(clients, paced);
+	faults += runAbandoned();
+	return faults ? 1 : 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * bench_loudness.c - accuracy and CPU cost of the loudness meter
+ *
+ * Checks a few of the EBU Tech 3341/3342 compliance cases with synthesised
+ * signals, then measures the cost per block for 8 channels at 96 kHz, with a
+ * second thread reading the meter every millisecond the whole time. Fails if
+ * a reading is outside the tolerance or the reader ever sees a torn reading.
+ *
+ *   cc -O3 -std=gnu11 -I. -o bench_loudness bench/bench_loudness.c loudness.c truepeak.c -lm -lpthread
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "loudness.h"
+
+#define kChannels	8
+
+
+static double nowSeconds( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Feeds `seconds' of a sine at dBFS to the first `channels' channels, in
+// blocks of 480 frames
+static void feedSine( CMLoudness *m, int channels, float rate, double freq, double dbfs,
+                      double phase, double seconds, long *t )
+{
+	enum { kBlock = 480 };
+	static float buf[kChannels][kBlock];
+	const float *p[kChannels];
+	double amp = pow(10.0, dbfs / 20.0);
+	long frames = (long)(seconds * rate), done;
+	int c, i;
+
+	for( c = 0; c < kChannels; c++ )
+		p[c] = buf[c];
+	for( done = 0; done < frames; done += kBlock ) {
+		for( i = 0; i < kBlock; i++ ) {
+			float v = (float)(amp * sin(2 * M_PI * freq * (*t + i) / rate + phase));
+			for( c = 0; c < channels; c++ )
+				buf[c][i] = v;
+		}
+		*t += kBlock;
+		loudnessProcess(m, p, kBlock);
+	}
+}
+
+
+static int check( const char *what, double value, double expected, double tolerance )
+{
+	int ok = fabs(value - expected) <= tolerance;
+
+	printf("%-44s %8.2f  (expected %.1f +- %.1f)  %s\n", what, value, expected, tolerance, ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+
+static int compliance( void )
+{
+	CMLoudnessReading r;
+	CMLoudness *m;
+	int failed = 0;
+	long t = 0;
+
+	// Tech 3341 case 1: stereo 1 kHz at -23 dBFS reads -23 LUFS
+	m = loudnessCreate(2, 48000.0f);
+	feedSine(m, 2, 48000.0f, 997.0, -23.0, 0.0, 20.0, &t);
+	loudnessRead(m, &r);
+	failed += check("3341-1 momentary, stereo -23 dBFS", r.momentary, -23.0, 0.1);
+	failed += check("3341-1 short-term", r.shortTerm, -23.0, 0.1);
+	failed += check("3341-1 integrated", r.integrated, -23.0, 0.1);
+	loudnessDestroy(m);
+
+	// Case 3: -36, -23, -36 dBFS; the relative gate drops the quiet parts
+	m = loudnessCreate(2, 48000.0f);
+	feedSine(m, 2, 48000.0f, 997.0, -36.0, 0.0, 10.0, &t);
+	feedSine(m, 2, 48000.0f, 997.0, -23.0, 0.0, 60.0, &t);
+	feedSine(m, 2, 48000.0f, 997.0, -36.0, 0.0, 10.0, &t);
+	loudnessRead(m, &r);
+	failed += check("3341-3 integrated, gated", r.integrated, -23.0, 0.1);
+	loudnessDestroy(m);
+
+	// Tech 3342 case 1: 20 s at -20 dBFS then 20 s at -30 dBFS gives 10 LU
+	m = loudnessCreate(2, 48000.0f);
+	feedSine(m, 2, 48000.0f, 997.0, -20.0, 0.0, 20.0, &t);
+	feedSine(m, 2, 48000.0f, 997.0, -30.0, 0.0, 20.0, &t);
+	loudnessRead(m, &r);
+	failed += check("3342-1 loudness range", r.range, 10.0, 1.0);
+	loudnessDestroy(m);
+
+	// Inter-sample peak: fs/4 at 45 degrees has samples at -3 dB, peaks at 0 dB
+	m = loudnessCreate(2, 48000.0f);
+	feedSine(m, 2, 48000.0f, 12000.0, 0.0, M_PI / 4, 2.0, &t);
+	loudnessRead(m, &r);
+	failed += check("true peak of fs/4 sine at 45 degrees", r.maxTruePeak, 0.0, 0.5);
+	loudnessDestroy(m);
+
+	// Reset from another thread takes effect with the next block
+	m = loudnessCreate(2, 96000.0f);
+	feedSine(m, 2, 96000.0f, 997.0, -10.0, 0.0, 5.0, &t);
+	loudnessReset(m);
+	feedSine(m, 2, 96000.0f, 997.0, -30.0, 0.0, 5.0, &t);
+	loudnessRead(m, &r);
+	failed += check("integrated after reset, 96 kHz", r.integrated, -30.0, 0.1);
+	loudnessDestroy(m);
+	return failed;
+}
+
+
+typedef struct Reader {
+	CMLoudness		*meter;
+	atomic_int		stop;
+	uint64_t		subBlock;		// frames
+	unsigned long	reads, torn;
+} Reader;
+
+
+// A reading is torn if it mixes two publishes; every publish here has all
+// channel peaks equal, and its frame count a multiple of the sub-block
+static void *readerThread( void *arg )
+{
+	Reader *rd = arg;
+	CMLoudnessReading r;
+	uint64_t last = 0;
+	int c;
+
+	while( !atomic_load(&rd->stop) ) {
+		loudnessRead(rd->meter, &r);
+		rd->reads++;
+		for( c = 1; c < kChannels; c++ )
+			if( r.truePeak[c] != r.truePeak[0] )
+				rd->torn++;
+		if( r.sequence < last || r.frames % rd->subBlock != 0 )
+			rd->torn++;
+		last = r.sequence;
+		usleep(1000);
+	}
+	return NULL;
+}
+
+
+static int cpuPerBlock( float rate, int block )
+{
+	static float buf[kChannels][4096];
+	const float *p[kChannels];
+	CMLoudness *m = loudnessCreate(kChannels, rate);
+	Reader rd;
+	pthread_t thread;
+	unsigned seed = 5;
+	int blocks = (int)(rate * 20) / block, c, i, k;
+	double start, perBlock;
+
+	for( c = 0; c < kChannels; c++ )
+		p[c] = buf[c];
+	memset(&rd, 0, sizeof(rd));
+	rd.meter = m;
+	rd.subBlock = (uint64_t)(rate / 10);
+	pthread_create(&thread, NULL, readerThread, &rd);
+
+	start = nowSeconds();
+	for( i = 0; i < blocks; i++ ) {
+		for( k = 0; k < block; k++ ) {
+			seed = seed * 1664525u + 1013904223u;
+			for( c = 0; c < kChannels; c++ )
+				buf[c][k] = ((seed >> 9) * (1.0f / 8388608.0f) - 1.0f) * 0.5f;
+		}
+		loudnessProcess(m, p, block);
+	}
+	perBlock = (nowSeconds() - start) / blocks;
+	atomic_store(&rd.stop, 1);
+	pthread_join(thread, NULL);
+
+	printf("%-8.0f %-6d %10.2f %9.2f%%  %8lu reads, %lu torn\n", rate, block, perBlock * 1e6,
+	       100.0 * perBlock / (block / rate), rd.reads, rd.torn);
+	loudnessDestroy(m);
+	return rd.torn != 0;
+}
+
+
+int main( void )
+{
+	int failed = compliance();
+
+	printf("\n%d channels, noise input (block generation included)\n", kChannels);
+	printf("%-8s %-6s %10s %10s\n", "rate", "block", "us/block", "CPU");
+	failed += cpuPerBlock(96000.0f, 64);
+	failed += cpuPerBlock(96000.0f, 256);
+	failed += cpuPerBlock(96000.0f, 1024);
+	failed += cpuPerBlock(48000.0f, 256);
+	return failed ? 1 : 0;
+}
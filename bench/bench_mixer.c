@@ -0,0 +1,157 @@
+/*
+ * bench_mixer.c - feature unit discovery and fade traffic against the fake device
+ *
+ * Walks the fake device's configuration descriptor and checks that it holds
+ * together (every descriptor where the previous one says, the audio control
+ * header's length right, both feature units with their channel counts), then
+ * that mixerFindFeatureUnit() picks the 8-channel output unit. With the
+ * mixer open, reading volumes and mutes and setting unchanged values must
+ * not send anything, and a 500 ms fade of all 8 channels must stay within
+ * one transfer per channel every kMixerMinIntervalUs (plus the last one)
+ * and leave the device at the target volume.
+ *
+ *   cc -O2 -std=gnu99 -I. -o bench_mixer bench/bench_mixer.c mixer.c cm6206.c fakedev.c usbtrace.c
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fakedev.h"
+#include "mixer.h"
+
+#define kFadeUs			500000
+#define kFadeTarget		kMixerDB(-40)
+#define kGetRounds		1000
+
+
+// The descriptor as the device sends it, checked descriptor by descriptor
+static int checkDescriptor( CMTransport *t )
+{
+	uint8_t buf[kMixerMaxDescriptor];
+	CMControlRequest req;
+	int total, pos, csTotal = 0, csDeclared = -1, units = 0, outputs = -1, inputs = -1, vendor = 0;
+	int inControl = 0, failed = 0;
+
+	req.bmRequestType = kCMRequestIn;
+	req.bRequest = 0x06;
+	req.wValue = 0x0200;
+	req.wIndex = 0;
+	req.wLength = sizeof(buf);
+	req.pData = buf;
+	if( cmControlRequest(t, &req) != kCMReturnSuccess ) {
+		fprintf(stderr, "FAIL: could not read the configuration descriptor\n");
+		return 1;
+	}
+	total = buf[2] | buf[3] << 8;
+	for( pos = 0; pos < total && buf[pos] >= 2 && pos + buf[pos] <= total; pos += buf[pos] ) {
+		const uint8_t *d = buf + pos;
+
+		if( d[1] == 0x04 ) {
+			inControl = d[5] == 0x01 && d[6] == 0x01;
+			vendor |= d[2] == 3;
+		}
+		else if( inControl && d[1] == 0x24 ) {
+			csTotal += d[0];
+			if( d[2] == 0x01 )
+				csDeclared = d[5] | d[6] << 8;
+			else if( d[2] == 0x06 ) {
+				int n = d[5] > 0 ? (d[0] - 7) / d[5] - 1 : -1;
+
+				units++;
+				if( d[3] == kFakeOutputUnit )
+					outputs = n;
+				else
+					inputs = n;
+			}
+		}
+	}
+	printf("configuration descriptor: %d of %d bytes walked, %d feature units (%d and %d channels), "
+	       "audio control %d of %d bytes, vendor interface %s\n",
+	       pos, total, units, outputs, inputs, csTotal, csDeclared, vendor ? "found" : "missing");
+	if( pos != total || units != 2 || outputs != kFakeNumChannels || inputs != 2 ||
+	    csTotal != csDeclared || !vendor ) {
+		fprintf(stderr, "FAIL: the fake device's configuration descriptor is malformed\n");
+		failed = 1;
+	}
+	return failed;
+}
+
+
+int main( void )
+{
+	CMFakeDevice dev;
+	CMTransport fake;
+	CMMixer m;
+	uint8_t interface = 0xFF, unit = 0;
+	int numChannels = 0, failed = 0, c, i;
+	unsigned long requests, limit;
+	uint64_t start;
+
+	fakeDeviceInit(&dev);
+	fakeDeviceTransport(&dev, &fake);
+
+	failed |= checkDescriptor(&fake);
+	if( mixerFindFeatureUnit(&fake, &interface, &unit, &numChannels) != 0 )
+		return 1;
+	printf("feature unit %d on interface %d, %d channels\n", unit, interface, numChannels);
+	if( interface != 0 || unit != kFakeOutputUnit || numChannels != kFakeNumChannels ) {
+		fprintf(stderr, "FAIL: expected feature unit %d on interface 0 with %d channels\n",
+		        kFakeOutputUnit, kFakeNumChannels);
+		failed = 1;
+	}
+
+	requests = dev.requests;
+	if( mixerOpen(&m, &fake, interface, unit, numChannels) != 0 )
+		return 1;
+	printf("open: %lu transfers\n", dev.requests - requests);
+
+	// Everything below the open comes from the cache
+	requests = dev.requests;
+	for( i = 0; i < kGetRounds; i++ )
+		for( c = 0; c <= m.numChannels; c++ ) {
+			int16_t volume;
+			int muted;
+
+			if( m.ch[c].hasVolume ) {
+				mixerGetVolume(&m, c, &volume);
+				mixerSetVolume(&m, c, volume);
+			}
+			if( m.ch[c].hasMute ) {
+				mixerGetMute(&m, c, &muted);
+				mixerSetMute(&m, c, muted);
+			}
+		}
+	printf("%d rounds of cached gets and unchanged sets: %lu transfers\n", kGetRounds, dev.requests - requests);
+	if( dev.requests != requests ) {
+		fprintf(stderr, "FAIL: cached gets and unchanged sets went to the device\n");
+		failed = 1;
+	}
+
+	// Per channel one transfer per interval, and the one at the end
+	requests = dev.requests;
+	start = cmMonotonicUs();
+	for( c = 1; c <= m.numChannels; c++ )
+		mixerRamp(&m, c, kFadeTarget, kFadeUs);
+	if( mixerFinish(&m) != 0 )
+		failed = 1;
+	limit = (unsigned long)m.numChannels * (kFadeUs / kMixerMinIntervalUs + 1);
+	printf("%d-channel %d ms fade: %lu transfers in %.0f ms (at most %lu; one per channel and ms would be %d)\n",
+	       m.numChannels, kFadeUs / 1000, dev.requests - requests, (cmMonotonicUs() - start) / 1000.0,
+	       limit, m.numChannels * kFadeUs / 1000);
+	if( dev.requests - requests > limit ) {
+		fprintf(stderr, "FAIL: the fade sent more than %lu transfers\n", limit);
+		failed = 1;
+	}
+	for( c = 1; c <= m.numChannels; c++ )
+		if( dev.volume[c] != kFadeTarget ) {
+			fprintf(stderr, "FAIL: channel %d ended at %d/256 dB, not %d/256 dB\n", c, dev.volume[c], kFadeTarget);
+			failed = 1;
+		}
+
+	printf("\n%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
@@ -0,0 +1,157 @@
+/*
+ * bench_retry.c - recovery from failed control transfers, against the fake device
+ *
+ * Injects each error that retry.c knows about into the fake device while it
+ * is activated, once with the retry policy and once without, and checks the
+ * outcome: transient errors must be recovered (all registers end up right),
+ * fatal ones must not be retried, and an error that never goes away must be
+ * given up on within the time limit, overrun by at most one transfer. Timeouts are made to take
+ * kTimeoutUs each, as a real one would. Prints the time each activation took
+ * and the per-class counters, and fails if any outcome is wrong.
+ *
+ *   cc -O2 -std=gnu99 -I. -o bench_retry bench/bench_retry.c retry.c cm6206.c fakedev.c usbtrace.c
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cm6206.h"
+#include "fakedev.h"
+#include "retry.h"
+
+#define kTimeoutUs		20000		// how long an injected timeout takes
+#define kBudgetUs		100000		// recovery time per device, for the persistent cases
+#define kSlackUs		5000		// for scheduling and the fake device's own time
+
+typedef struct Injection {
+	const char	*name;
+	int32_t		err;
+} Injection;
+
+static const Injection kInjections[] = {
+	{ "pipe stalled",			kCMUSBPipeStalled },
+	{ "CRC error",				(int32_t)0xe0004001 },
+	{ "transaction timeout",	kCMUSBTransactionTimeout },
+	{ "I/O timeout",			kCMReturnTimeout },
+	{ "not responding",			kCMReturnNotResponding },
+	{ "aborted",				kCMReturnAborted },
+	{ "busy",					kCMReturnBusy },
+	{ "not sent",				(int32_t)0xe000400e },
+	{ "not open",				kCMReturnNotOpen },
+	{ "no device",				kCMReturnNoDevice },
+	{ "not privileged",			kCMReturnNotPrivileged },
+	{ "unsupported",			kCMReturnUnsupported },
+};
+
+
+// Makes injected timeouts take as long as real ones
+typedef struct TimedBus {
+	CMTransport		inner;
+} TimedBus;
+
+static int32_t timedRequest( void *ctx, CMControlRequest *req )
+{
+	TimedBus *bus = ctx;
+	int32_t err = cmControlRequest(&bus->inner, req);
+
+	if( retryClassify(err) == kCMErrorTimeout )
+		usleep(kTimeoutUs);
+	return err;
+}
+
+
+typedef struct Outcome {
+	int			registersRight;
+	int			attempts;			// requests that reached the device
+	uint64_t	us;
+} Outcome;
+
+static Outcome activate( const Injection *inj, int count, int withPolicy, uint64_t budgetUs,
+						 CMRetryStats *stats )
+{
+	const CMDeviceModel *model = cmFindDeviceModel(kVendorID, kProductID);
+	CMFakeDevice dev;
+	CMTransport fake, t;
+	TimedBus bus;
+	CMRetryPolicy policy;
+	Outcome o;
+	uint64_t start;
+	int i;
+
+	fakeDeviceInit(&dev);
+	fakeDeviceTransport(&dev, &fake);
+	bus.inner = fake;
+	t.controlRequest = timedRequest;
+	t.ctx = &bus;
+	t.submitRequest = NULL;
+	t.runCompletions = NULL;
+	if( withPolicy ) {
+		retryWrap(&policy, &t, stats, &t);
+		policy.clearStall = fakeDeviceClearStall;
+		policy.reopen = fakeDeviceReopen;
+		policy.hookCtx = &dev;
+		policy.budgetUs = budgetUs;
+	}
+	fakeDeviceInjectError(&dev, inj->err, count);
+	start = cmMonotonicUs();
+	initCMDevice(&t, model, 0);
+	o.us = cmMonotonicUs() - start;
+	o.attempts = (int)dev.requests;
+	o.registersRight = 1;
+	for( i = 0; i < model->planLength; i++ )
+		if( dev.regs[model->plan[i].regNo] != model->plan[i].value )
+			o.registersRight = 0;
+	return o;
+}
+
+
+int main( void )
+{
+	CMRetryStats stats;
+	int failed = 0, n = (int)(sizeof(kInjections) / sizeof(kInjections[0])), i;
+
+	// initCMDevice() reports every failed write on stderr
+	fflush(stderr);
+	if( freopen("/dev/null", "w", stderr) == NULL )
+		return 1;
+
+	memset(&stats, 0, sizeof(stats));
+	printf("One injected error during activation (plan of 3 writes):\n");
+	printf("%-22s %-12s %14s %14s   %s\n", "error", "class", "without", "with policy", "result");
+	for( i = 0; i < n; i++ ) {
+		const Injection *inj = &kInjections[i];
+		CMErrorClass c = retryClassify(inj->err);
+		Outcome plain = activate(inj, 1, 0, kRetryBudgetUs, NULL);
+		Outcome retried = activate(inj, 1, 1, kRetryBudgetUs, &stats);
+		// Transient errors are recovered; fatal ones get exactly one attempt
+		int ok = c == kCMErrorFatal ? retried.attempts == plain.attempts : retried.registersRight;
+		char a[32], b[32];
+
+		snprintf(a, sizeof(a), "%s %6.1f ms", plain.registersRight ? "ok  " : "FAIL", plain.us / 1000.0);
+		snprintf(b, sizeof(b), "%s %6.1f ms", retried.registersRight ? "ok  " : "FAIL", retried.us / 1000.0);
+		printf("%-22s %-12s %14s %14s   %s\n", inj->name, retryClassName(c), a, b, ok ? "as expected" : "WRONG");
+		failed += !ok;
+	}
+
+	printf("\nErrors that never go away, %d ms recovery time per device:\n", kBudgetUs / 1000);
+	for( i = 0; i < n; i++ ) {
+		const Injection *inj = &kInjections[i];
+		Outcome o = activate(inj, 1000, 1, kBudgetUs, &stats);
+		// Within the budget, plus the one transfer under way when it ran out
+		int ok = o.us < kBudgetUs + kTimeoutUs + kSlackUs && !o.registersRight;
+
+		printf("%-22s %-12s gave up after %3d requests, %6.1f ms   %s\n", inj->name,
+			   retryClassName(retryClassify(inj->err)), o.attempts, o.us / 1000.0, ok ? "as expected" : "WRONG");
+		failed += !ok;
+	}
+
+	printf("\nCounters over all of the above:\n");
+	retryReport(&stats, stdout);
+	printf("  %lu retries\n", stats.retries);
+	return failed ? 1 : 0;
+}
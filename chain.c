@@ -0,0 +1,498 @@
+/*
+ * chain.c - the processing chain in front of the device, fused into few passes
+ *
+ * Run one stage after another, a chain of remix, gain, delay, limiter and
+ * conversion reads and writes the whole block once per stage; at 8 channels
+ * and 40 ms that is 60 kB a pass at 48 kHz and twice that at 96 kHz, so every
+ * pass goes out to L2 or further. Fused, the chain runs a tile at a time,
+ * with tiles small enough that the scratch buffers stay in L1: the input is
+ * read once, the output written once, and everything in between is cache
+ * hits. A tile keeps three buffers live (two planar, one interleaved), and
+ * the three together take kChainTileBytes: half of the 32 kB L1d of the
+ * small hosts, leaving the other half for the stretch of each delay line in
+ * use, the limiter's state and the streams in and out.
+ *
+ * Within a tile the remix, gain and delay stages are compiled into kernels of
+ * the form delay, matrix, delay. Gains fold into the matrix (row scaling), and
+ * consecutive remixes multiply into one; a stage that doesn't fit the current
+ * kernel starts the next one. The limiter works on whole frames and keeps its
+ * own state, so it ends a kernel and runs on the tile in place. The tile
+ * length is a multiple of kPCMDitherLanes frames, so the dither sequence is
+ * the same as for one conversion of the whole block.
+ *
+ * Both modes use the same delay lines, and a delay only ever sees what it
+ * would see unfused (gains are not folded across a delay), so fusion can be
+ * switched while audio runs.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chain.h"
+
+typedef enum {
+	kStageRemix = 0,
+	kStageGain,
+	kStageDelay,
+	kStageLimiter
+} StageKind;
+
+typedef struct Stage {
+	StageKind	kind;
+	float		matrix[kChainMaxChannels * kChainMaxChannels];
+	float		gains[kChainMaxChannels];
+	int			delay[kChainMaxChannels];
+	float		*ring;			// delay lines, ringLen per channel
+	unsigned	pos;
+	CMLimiter	*lim;
+} Stage;
+
+typedef enum {
+	kMatrixNone = 0,			// identity
+	kMatrixDiagonal,
+	kMatrixFull
+} MatrixKind;
+
+// A kernel: pre-delay, matrix, post-delay; or a limiter on its own
+typedef struct Step {
+	int			pre, post;		// delay stages, -1 for none
+	MatrixKind	matrixKind;
+	float		matrix[kChainMaxChannels * kChainMaxChannels];
+	float		gains[kChainMaxChannels];
+	CMLimiter	*lim;
+} Step;
+
+struct CMChain {
+	int				channels;
+	int				maxBlock;
+	CMChainFormat	format;
+	PCMDither		*dither;
+	int				fused;
+	int				tileFrames;
+	unsigned		ringLen;		// a power of 2, >= kChainMaxDelay + maxBlock
+
+	Stage			stages[kChainMaxStages];
+	int				numStages;
+	Step			fusedSteps[kChainMaxStages];
+	int				numFusedSteps;
+	Step			plainSteps[kChainMaxStages];	// one per stage
+
+	float			*tile[2];		// planar scratch, channels x tileFrames each
+	float			*tileOut;		// interleaved, channels x tileFrames
+	float			*block[2];		// the same for unfused processing, maxBlock frames
+	float			*blockOut;
+};
+
+
+CMChain *chainCreate( int channels, int maxBlock, CMChainFormat format, PCMDither *dither )
+{
+	CMChain *chain;
+	int i;
+
+	if( channels < 1 || channels > kChainMaxChannels || maxBlock < 1 || (format != kChainS16 && format != kChainS24) )
+		return NULL;
+	chain = calloc(1, sizeof(CMChain));
+	if( chain == NULL )
+		return NULL;
+	chain->channels = channels;
+	chain->maxBlock = maxBlock;
+	chain->format = format;
+	chain->dither = dither;
+	chain->fused = 1;
+	chain->tileFrames = kChainTileBytes / 3 / (int)(sizeof(float) * channels) / kPCMDitherLanes * kPCMDitherLanes;
+	if( chain->tileFrames > maxBlock )
+		chain->tileFrames = maxBlock;
+	for( chain->ringLen = 1; chain->ringLen < (unsigned)(kChainMaxDelay + maxBlock); chain->ringLen <<= 1 )
+		;
+	for( i = 0; i < 2; i++ ) {
+		chain->tile[i] = calloc((size_t)channels * chain->tileFrames, sizeof(float));
+		chain->block[i] = calloc((size_t)channels * maxBlock, sizeof(float));
+	}
+	chain->tileOut = calloc((size_t)channels * chain->tileFrames, sizeof(float));
+	chain->blockOut = calloc((size_t)channels * maxBlock, sizeof(float));
+	if( !chain->tile[0] || !chain->tile[1] || !chain->block[0] || !chain->block[1] || !chain->tileOut || !chain->blockOut ) {
+		chainDestroy(chain);
+		return NULL;
+	}
+	return chain;
+}
+
+
+void chainDestroy( CMChain *chain )
+{
+	int i;
+
+	if( chain == NULL )
+		return;
+	for( i = 0; i < chain->numStages; i++ )
+		free(chain->stages[i].ring);
+	for( i = 0; i < 2; i++ ) {
+		free(chain->tile[i]);
+		free(chain->block[i]);
+	}
+	free(chain->tileOut);
+	free(chain->blockOut);
+	free(chain);
+}
+
+
+//================================================================================================
+// Compiling the stages into kernels
+//
+static void stepInit( Step *step )
+{
+	memset(step, 0, sizeof(Step));
+	step->pre = step->post = -1;
+}
+
+
+// Makes the step's matrix a full one, if it isn't already
+static void stepPromote( Step *step, int channels )
+{
+	int o, c;
+
+	if( step->matrixKind == kMatrixFull )
+		return;
+	for( o = 0; o < channels; o++ )
+		for( c = 0; c < channels; c++ )
+			step->matrix[o * kChainMaxChannels + c] = o != c ? 0.0f
+				: (step->matrixKind == kMatrixDiagonal ? step->gains[o] : 1.0f);
+	step->matrixKind = kMatrixFull;
+}
+
+
+// Adds stage s to the step if it fits there. Returns 0 if it did.
+static int stepAbsorb( Step *step, const Stage *stage, int s, int channels )
+{
+	float m[kChainMaxChannels * kChainMaxChannels];
+	int o, c, k;
+
+	if( step->lim != NULL )
+		return -1;
+	switch( stage->kind ) {
+		case kStageDelay:
+			if( step->post >= 0 )
+				return -1;
+			if( step->pre < 0 && step->matrixKind == kMatrixNone )
+				step->pre = s;
+			else
+				step->post = s;
+			return 0;
+		case kStageGain:
+			if( step->post >= 0 )
+				return -1;
+			if( step->matrixKind == kMatrixNone ) {
+				memcpy(step->gains, stage->gains, sizeof(step->gains));
+				step->matrixKind = kMatrixDiagonal;
+			} else if( step->matrixKind == kMatrixDiagonal ) {
+				for( c = 0; c < channels; c++ )
+					step->gains[c] *= stage->gains[c];
+			} else {
+				for( o = 0; o < channels; o++ )
+					for( c = 0; c < channels; c++ )
+						step->matrix[o * kChainMaxChannels + c] *= stage->gains[o];
+			}
+			return 0;
+		case kStageRemix:
+			if( step->post >= 0 )
+				return -1;
+			stepPromote(step, channels);
+			for( o = 0; o < channels; o++ )
+				for( c = 0; c < channels; c++ ) {
+					float sum = 0.0f;
+					for( k = 0; k < channels; k++ )
+						sum += stage->matrix[o * kChainMaxChannels + k] * step->matrix[k * kChainMaxChannels + c];
+					m[o * kChainMaxChannels + c] = sum;
+				}
+			memcpy(step->matrix, m, sizeof(m));
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+
+static void stepFromStage( Step *step, const Stage *stage, int s, int channels )
+{
+	stepInit(step);
+	if( stage->kind == kStageLimiter )
+		step->lim = stage->lim;
+	else if( stage->kind == kStageRemix ) {
+		memcpy(step->matrix, stage->matrix, sizeof(step->matrix));
+		step->matrixKind = kMatrixFull;
+	} else
+		stepAbsorb(step, stage, s, channels);
+}
+
+
+static void chainCompile( CMChain *chain )
+{
+	int s;
+
+	chain->numFusedSteps = 0;
+	for( s = 0; s < chain->numStages; s++ ) {
+		const Stage *stage = &chain->stages[s];
+
+		stepFromStage(&chain->plainSteps[s], stage, s, chain->channels);
+		if( chain->numFusedSteps > 0 && stage->kind != kStageLimiter &&
+			stepAbsorb(&chain->fusedSteps[chain->numFusedSteps - 1], stage, s, chain->channels) == 0 )
+			continue;
+		stepFromStage(&chain->fusedSteps[chain->numFusedSteps++], stage, s, chain->channels);
+	}
+}
+
+
+static Stage *chainAddStage( CMChain *chain, StageKind kind )
+{
+	Stage *stage;
+
+	if( chain->numStages == kChainMaxStages )
+		return NULL;
+	stage = &chain->stages[chain->numStages];
+	memset(stage, 0, sizeof(Stage));
+	stage->kind = kind;
+	return stage;
+}
+
+
+int chainAddRemix( CMChain *chain, const float *matrix )
+{
+	Stage *stage = chainAddStage(chain, kStageRemix);
+	int o;
+
+	if( stage == NULL )
+		return -1;
+	for( o = 0; o < chain->channels; o++ )
+		memcpy(&stage->matrix[o * kChainMaxChannels], &matrix[o * chain->channels], sizeof(float) * chain->channels);
+	chain->numStages++;
+	chainCompile(chain);
+	return 0;
+}
+
+
+int chainAddGain( CMChain *chain, const float *gains )
+{
+	Stage *stage = chainAddStage(chain, kStageGain);
+
+	if( stage == NULL )
+		return -1;
+	memcpy(stage->gains, gains, sizeof(float) * chain->channels);
+	chain->numStages++;
+	chainCompile(chain);
+	return 0;
+}
+
+
+int chainAddDelay( CMChain *chain, const int *frames )
+{
+	Stage *stage = chainAddStage(chain, kStageDelay);
+	int c;
+
+	if( stage == NULL )
+		return -1;
+	for( c = 0; c < chain->channels; c++ )
+		if( frames[c] < 0 || frames[c] > kChainMaxDelay )
+			return -1;
+	stage->ring = calloc((size_t)chain->channels * chain->ringLen, sizeof(float));
+	if( stage->ring == NULL )
+		return -1;
+	memcpy(stage->delay, frames, sizeof(int) * chain->channels);
+	chain->numStages++;
+	chainCompile(chain);
+	return 0;
+}
+
+
+int chainAddLimiter( CMChain *chain, CMLimiter *lim )
+{
+	Stage *stage = chainAddStage(chain, kStageLimiter);
+
+	if( stage == NULL || lim == NULL )
+		return -1;
+	stage->lim = lim;
+	chain->numStages++;
+	chainCompile(chain);
+	return 0;
+}
+
+
+void chainSetFusion( CMChain *chain, int enable )
+{
+	chain->fused = enable != 0;
+}
+
+
+int chainPasses( const CMChain *chain )
+{
+	// Unfused: every stage, then interleaving, then conversion
+	return chain->fused ? 1 : chain->numStages + 2;
+}
+
+
+//================================================================================================
+// Processing
+//
+// Writes from[] into the delay lines and reads the delayed signal into to[],
+// which may be from[].
+static void delayRun( Stage *stage, unsigned ringLen, int channels, float * const *from, float * const *to, int n )
+{
+	unsigned mask = ringLen - 1;
+	int c;
+
+	for( c = 0; c < channels; c++ ) {
+		float *ring = stage->ring + (size_t)c * ringLen;
+		unsigned w = stage->pos, r = (stage->pos - stage->delay[c]) & mask;
+		unsigned first = ringLen - w < (unsigned)n ? ringLen - w : (unsigned)n;
+
+		memcpy(ring + w, from[c], sizeof(float) * first);
+		memcpy(ring, from[c] + first, sizeof(float) * (n - first));
+		if( stage->delay[c] == 0 ) {
+			if( to[c] != from[c] )
+				memcpy(to[c], from[c], sizeof(float) * n);
+			continue;
+		}
+		first = ringLen - r < (unsigned)n ? ringLen - r : (unsigned)n;
+		memcpy(to[c], ring + r, sizeof(float) * first);
+		memcpy(to[c] + first, ring, sizeof(float) * (n - first));
+	}
+	stage->pos = (stage->pos + n) & mask;
+}
+
+
+// to[] must not be from[]
+static void matrixRun( const float *m, int channels, const float * const *from, float * const *to, int n )
+{
+	int o, c, i;
+
+	for( o = 0; o < channels; o++ ) {
+		float *y = to[o];
+		int first = 1;
+
+		for( c = 0; c < channels; c++ ) {
+			const float *x = from[c];
+			float k = m[o * kChainMaxChannels + c];
+
+			if( k == 0.0f )
+				continue;
+			if( first )
+				for( i = 0; i < n; i++ )
+					y[i] = k * x[i];
+			else
+				for( i = 0; i < n; i++ )
+					y[i] += k * x[i];
+			first = 0;
+		}
+		if( first )
+			memset(y, 0, sizeof(float) * n);
+	}
+}
+
+
+static void gainRun( const float *gains, int channels, const float * const *from, float * const *to, int n )
+{
+	int c, i;
+
+	for( c = 0; c < channels; c++ ) {
+		const float *x = from[c];
+		float *y = to[c], g = gains[c];
+
+		for( i = 0; i < n; i++ )
+			y[i] = g * x[i];
+	}
+}
+
+
+// A step writes in place when its data is in scratch already, and into
+// scratch buffer 0 when it is still the input, which is never written
+static inline int writable( int at )
+{
+	return at < 0 ? 0 : at;
+}
+
+
+static inline float * const *current( float * const *src, float *buf[2][kChainMaxChannels], int at )
+{
+	return at < 0 ? src : buf[at];
+}
+
+
+// Runs the steps over n frames of in[], starting at frame `offset', with
+// scratch[] as planar buffers of `stride' frames, and converts the result into
+// out.
+static void chainRun( CMChain *chain, const Step *steps, int numSteps, const float * const *in, int offset,
+					  float * const *scratch, float *interleaved, int stride, void *out, int n )
+{
+	int channels = chain->channels, s, c;
+	float *buf[2][kChainMaxChannels], *src[kChainMaxChannels];
+	int at = -1;		// scratch buffer the data is in, -1 for the input
+	size_t samples = (size_t)n * channels;
+
+	for( c = 0; c < channels; c++ ) {
+		buf[0][c] = scratch[0] + (size_t)c * stride;
+		buf[1][c] = scratch[1] + (size_t)c * stride;
+		src[c] = (float *)in[c] + offset;
+	}
+	for( s = 0; s < numSteps; s++ ) {
+		const Step *step = &steps[s];
+		int to;
+
+		if( step->lim != NULL ) {
+			to = writable(at);
+			limiterProcess(step->lim, (const float * const *)current(src, buf, at), buf[to], n);
+			at = to;
+			continue;
+		}
+		if( step->pre >= 0 ) {
+			to = writable(at);
+			delayRun(&chain->stages[step->pre], chain->ringLen, channels, current(src, buf, at), buf[to], n);
+			at = to;
+		}
+		if( step->matrixKind == kMatrixFull ) {
+			to = at == 0 ? 1 : 0;
+			matrixRun(step->matrix, channels, (const float * const *)current(src, buf, at), buf[to], n);
+			at = to;
+		} else if( step->matrixKind == kMatrixDiagonal ) {
+			to = writable(at);
+			gainRun(step->gains, channels, (const float * const *)current(src, buf, at), buf[to], n);
+			at = to;
+		}
+		if( step->post >= 0 ) {
+			to = writable(at);
+			delayRun(&chain->stages[step->post], chain->ringLen, channels, current(src, buf, at), buf[to], n);
+			at = to;
+		}
+	}
+	for( c = 0; at >= 0 && c < channels; c++ )
+		src[c] = buf[at][c];
+
+	if( channels == 1 )
+		memcpy(interleaved, src[0], sizeof(float) * n);
+	else
+		pcmInterleave((const float * const *)src, interleaved, channels, n);
+	if( chain->format == kChainS16 )
+		pcmFloatToS16(interleaved, (int16_t *)out + (size_t)offset * channels, samples, chain->dither);
+	else
+		pcmFloatToS24(interleaved, (uint8_t *)out + (size_t)offset * channels * 3, samples, chain->dither);
+}
+
+
+void chainProcess( CMChain *chain, const float * const *in, void *out, int frames )
+{
+	int offset, n;
+
+	if( frames > chain->maxBlock )
+		frames = chain->maxBlock;
+	if( !chain->fused ) {
+		chainRun(chain, chain->plainSteps, chain->numStages, in, 0, chain->block, chain->blockOut,
+				 chain->maxBlock, out, frames);
+		return;
+	}
+	for( offset = 0; offset < frames; offset += n ) {
+		n = frames - offset < chain->tileFrames ? frames - offset : chain->tileFrames;
+		chainRun(chain, chain->fusedSteps, chain->numFusedSteps, in, offset, chain->tile, chain->tileOut,
+				 chain->tileFrames, out, n);
+	}
+}
@@ -0,0 +1,54 @@
+/*
+ * chain.h - the processing chain in front of the device, fused into few passes
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_CHAIN_H
+#define CM_CHAIN_H
+
+#include "limiter.h"
+#include "pcmconv.h"
+
+#define kChainMaxChannels	8
+#define kChainMaxStages		16
+#define kChainMaxDelay		4095	// frames, per delay stage
+#define kChainTileBytes		16384	// all of one tile's scratch; half of a 32 kB L1d
+
+// What the chain delivers: interleaved, little endian
+typedef enum {
+	kChainS16 = 0,
+	kChainS24				// 3 bytes per sample
+} CMChainFormat;
+
+typedef struct CMChain CMChain;
+
+// A chain for `channels' channels and blocks of up to maxBlock frames. dither
+// may be NULL, and is used as it is (pcmDitherInit() it for `channels').
+// Returns NULL on bad arguments or no memory.
+CMChain *chainCreate( int channels, int maxBlock, CMChainFormat format, PCMDither *dither );
+void chainDestroy( CMChain *chain );
+
+// Stages run in the order they are added. Each returns 0, or -1 if the chain
+// is full or an argument is out of range.
+int chainAddRemix( CMChain *chain, const float *matrix );	// channels x channels, row per output
+int chainAddGain( CMChain *chain, const float *gains );		// linear, per channel
+int chainAddDelay( CMChain *chain, const int *frames );		// per channel, up to kChainMaxDelay
+int chainAddLimiter( CMChain *chain, CMLimiter *lim );		// not owned; needs maxBlock >= the chain's
+
+// Fusion is on by default: runs of remix, gain and delay stages are compiled
+// into one kernel (a delay, a matrix and a delay per frame) and the whole
+// chain runs tile by tile, so each block is read and written once. Off, every
+// stage makes its own pass over the block. The results agree to within
+// float rounding.
+void chainSetFusion( CMChain *chain, int enable );
+
+// Passes over the whole block that processing makes: 1 when fused
+int chainPasses( const CMChain *chain );
+
+// Processes up to maxBlock frames of planar float into `out'. Does not
+// allocate or lock.
+void chainProcess( CMChain *chain, const float * const *in, void *out, int frames );
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * cm6206.c - CM6206 register access and activation, independent of the OS
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+
+#include "cm6206.h"
+
+
+int writeCM6206Registers( CMTransport *t, uint8_t regNo, uint16_t value )
+{
+    uint8_t buf[8];
+    int32_t err;
+    CMControlRequest req;
+    
+    buf[0] = 0x20;
+    buf[1] = value & 0xFF;          // Low byte (DATAL)
+    buf[2] = (value >> 8) & 0xFF;   // High byte (DATAH)
+    buf[3] = regNo;
+    
+    req.bmRequestType = kCMRequestOut | kCMRequestClass | kCMRequestInterface;
+    req.bRequest=0x09; // these values are taken from the SPDIF enable log
+    req.wValue=0x0200;
+    req.wIndex=0x03;
+    req.wLength=4;
+    req.pData=buf;
+    err = cmControlRequest(t, &req);
+    
+    return (err != 0);
+}
+
+//================================================================================================
+// Register reads use the same HID report interface: command 0x30 latches the
+// register, and the following GET_REPORT returns { status, DATAL, DATAH }.
+void cm6206ReadRequests( uint8_t regNo, CMControlRequest *select, uint8_t *selectBuf,
+						 CMControlRequest *fetch, uint8_t *fetchBuf )
+{
+    selectBuf[0] = 0x30;
+    selectBuf[1] = 0;
+    selectBuf[2] = 0;
+    selectBuf[3] = regNo;
+    select->bmRequestType = kCMRequestOut | kCMRequestClass | kCMRequestInterface;
+    select->bRequest = 0x09;    // SET_REPORT
+    select->wValue = 0x0200;
+    select->wIndex = 0x03;
+    select->wLength = 4;
+    select->pData = selectBuf;
+    
+    fetchBuf[0] = fetchBuf[1] = fetchBuf[2] = 0;
+    fetch->bmRequestType = kCMRequestIn | kCMRequestClass | kCMRequestInterface;
+    fetch->bRequest = 0x01;     // GET_REPORT
+    fetch->wValue = 0x0100;     // input report
+    fetch->wIndex = 0x03;
+    fetch->wLength = kCM6206ReadSize;
+    fetch->pData = fetchBuf;
+}
+
+
+uint16_t cm6206ReadValue( const uint8_t *fetchBuf )
+{
+    return fetchBuf[1] | fetchBuf[2] << 8;
+}
+
+
+int readCM6206Register( CMTransport *t, uint8_t regNo, uint16_t *value )
+{
+    uint8_t selectBuf[4], fetchBuf[kCM6206ReadSize];
+    CMControlRequest select, fetch;
+    
+    cm6206ReadRequests(regNo, &select, selectBuf, &fetch, fetchBuf);
+    if( cmControlRequest(t, &select) != 0 || cmControlRequest(t, &fetch) != 0 )
+        return 1;
+    *value = cm6206ReadValue(fetchBuf);
+    return 0;
+}
+
+//================================================================================================
+// Register plans
+//
+// REG0:
+// bit15      DMA_Master       R/W 1: SPDIFOUT as Master 0: DACs as Master
+// bit14-12   Sampling_rate    R/W SPDIF out sample rate (48K: 3'b010; 96K: 3'b110)
+// bit11-4    Category_code    R/W SPDIF out category code depends on the equipment type
+// bit3       Emphasis         R/W SPDIFOUT emphasis. 1: emphasis-CD_type 0: Emphasis is not indicated
+// bit2       Copyright        R/W 1: not asserted; 0: asserted
+// bit1       Non_audio        R/W 1: non-PCM audio data (like AC3) 0: PCM-data
+// bit0       Pro_con          R/W 1: professional format 0: consumer
+//
+// REG1:
+// bit15      Rsvd             R/W Reserved
+// bit14      SEL_CLK          R/W For test. Select 44.1k source for DACs 1=from 22.58M 0=from 24.576M
+// bit13      PLLBINen         R/W PLL binary search enable
+// bit12      SOFTMUTEen       R/W Soft mute enable
+// bit11      GPIO4_o          R/W Gpio4 signal
+// bit10      GPIO4_OEN        R/W Gpio4 output enable
+// bit9       GPIO3_o          R/W Gpio3 signal
+// bit8       GPIO3_OEN        R/W Gpio3 output enable
+// bit7       GPIO2_o          R/W Gpio2 signal
+// bit6       GPIO2_OEN        R/W Gpio2 output enable
+// bit5       GPIO1_o          R/W Gpio1 signal
+// bit4       GPIO1_OEN        R/W Gpio1 output enable
+// bit3       VALID            R/W SPDIFOUT Valid Signal 1=un-valid
+// bit2       SPDIFLOOP        R/W SPDIF loop-back enable
+// bit1       DIS_SPDIFO       R/W SPDIF out disable
+// bit0       SPDIFMIX         R/W SPDIF in mix enable
+//
+// REG2:
+// bit15      DRIVERON         R/W Line-out driver mode enable (1=enable)
+// bit14-3    (various)        R/W Headphone source, channel config, etc.
+// bit2       EN_BTL           R/W BTL mode enable (2-channel mode only) / Stereo mic enable
+// bit1-0     (reserved)       R/W
+/* 🍎 */
+static const CMRegisterWrite kCM6206Plan[] = {
+    // This should reset the registers
+    { 0x00, 0xa004, "S/PDIF, sampling rate" },          // S/PDIF Master, 48kHz, Copyright=not asserted
+    // This enables SPDIF, values copied from SniffUSB log (this one was easy)
+    // I'm not sure if the SPDIF outputs surround data, as I don't have the means to test it.
+    { 0x01, 0x2000, "PLL binary search" },              // PLLBINen=1
+    // This enables sound output. Why on earth it's disabled upon power-on,
+    // nobody knows (except maybe some Taiwanese engineer).
+    // These values were taken from the ALSA USB driver: "Enable line-out driver mode,
+    // set headphone source to front channels, enable stereo mic."
+    // That's for the CM106, however. On the CM6206 they appear to enable everything.
+    { 0x02, 0x8004, "analog output, stereo mic" },      // DRIVERON=1, EN_BTL=1
+};
+
+// Extra stuff, taken from the Alsa-user mailinglist.
+// The above works for me, so I didn't bother testing the following.
+// It may be completely redundant or make your Mac explode. Try at your own risk.
+//   "Enable DACx2, PLL binary, Soft Mute, and SPDIF-out"       REG1 = 0xb000
+//   "Enable all channels and select 48-pin chipset"             REG3 = 0x007e
+
+// The CM106 only needs its outputs switched on; this is all the ALSA boot
+// quirk for it does.
+static const CMRegisterWrite kCM106Plan[] = {
+    { 0x02, 0x8004, "analog output, stereo mic" },
+};
+
+#define PLAN(p)	p, (int)(sizeof(p) / sizeof(p[0]))
+
+// The IDs are those the ALSA driver applies its CM106/CM6206 boot quirks to.
+// Each device lists its interfaces in the same order, and the register
+// commands go to the second one.
+const CMDeviceModel kCMDeviceModels[] = {
+    { kVendorID, kProductID, "CM6206", "C-Media CM6206 / CM106-like sound device", 1, PLAN(kCM6206Plan) },
+    { 0x0ccd, 0x00b1, "CM6206", "Terratec Aureon 7.1 USB", 1, PLAN(kCM6206Plan) },
+    { 0x10f5, 0x0200, "CM106", "Turtle Beach Audio Advantage Roadie", 1, PLAN(kCM106Plan) },
+};
+const int kCMNumDeviceModels = sizeof(kCMDeviceModels) / sizeof(kCMDeviceModels[0]);
+
+// The table in use, which a configuration file may replace
+static const CMDeviceModel *gModels = kCMDeviceModels;
+static int gNumModels = sizeof(kCMDeviceModels) / sizeof(kCMDeviceModels[0]);
+
+
+void cmSetDeviceModels( const CMDeviceModel *models, int count )
+{
+    gModels = models;
+    gNumModels = count;
+}
+
+
+const CMDeviceModel *cmFindDeviceModel( uint16_t vendorID, uint16_t productID )
+{
+    int i;
+    
+    for( i = 0; i < gNumModels; i++ )
+        if( gModels[i].vendorID == vendorID && gModels[i].productID == productID )
+            return &gModels[i];
+    return NULL;
+}
+
+
+//================================================================================================
+// This sends the actual activation commands
+int initCMDevice( CMTransport *t, const CMDeviceModel *model, int verbose )
+{
+    int successCount = 0;
+    const int totalCommands = model->planLength;
+    int i;
+    
+    for( i = 0; i < totalCommands; i++ ) {
+        const CMRegisterWrite *w = &model->plan[i];
+        
+        if( writeCM6206Registers(t, w->regNo, w->value) == 0 ) {
+            successCount++;
+            if(verbose)
+                fprintf(stderr, "  [%d/%d] REG%d configuration (%s): OK\n", i + 1, totalCommands,
+                        w->regNo, w->description);
+        } else {
+            fprintf(stderr, "  [%d/%d] REG%d configuration (%s): FAILED\n", i + 1, totalCommands,
+                    w->regNo, w->description);
+        }
+    }
+
+    // Print summary
+    if(successCount == totalCommands) {
+        if(verbose)
+            fprintf(stderr, "Successfully sent all %s activation commands (%d/%d)\n",
+                    model->chip, successCount, totalCommands);
+        else
+            fprintf(stderr, "Successfully sent %s activation commands!\n", model->chip);
+    } else {
+        fprintf(stderr, "Warning: Only %d/%d commands succeeded\n",
+                successCount, totalCommands);
+    }
+    return totalCommands - successCount;
+}
+
+
+int initCM6206( CMTransport *t, int verbose )
+{
+    return initCMDevice(t, &kCMDeviceModels[0], verbose);
+}
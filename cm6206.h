@@ -0,0 +1,67 @@
+/*
+ * cm6206.h - CM6206 register access and activation, independent of the OS
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_CM6206_H
+#define CM_CM6206_H
+
+#include <stdint.h>
+
+#include "cmusb.h"
+
+#define kVendorID	0x0d8c
+#define kProductID	0x0102
+
+#define kCM6206ReadSize		3	// GET_REPORT answer: status, DATAL, DATAH
+
+typedef struct CMRegisterWrite {
+	uint8_t			regNo;
+	uint16_t		value;
+	const char		*description;
+} CMRegisterWrite;
+
+// A supported product: how to recognise it and what to send to activate it
+typedef struct CMDeviceModel {
+	uint16_t				vendorID;
+	uint16_t				productID;
+	const char				*chip;				// for messages
+	const char				*product;
+	int						interfaceIndex;		// the interface IOKit lists at this position (from 0) takes the commands
+	const CMRegisterWrite	*plan;
+	int						planLength;
+} CMDeviceModel;
+
+extern const CMDeviceModel	kCMDeviceModels[];
+extern const int			kCMNumDeviceModels;
+
+// The table entry for an ID, or NULL if it isn't a device we handle
+const CMDeviceModel *cmFindDeviceModel( uint16_t vendorID, uint16_t productID );
+
+// Makes cmFindDeviceModel() search another table (see config.h) from now on.
+// The table must stay valid until it is replaced.
+void cmSetDeviceModels( const CMDeviceModel *models, int count );
+
+// Sends one register write. Returns non-zero on failure.
+int writeCM6206Registers( CMTransport *t, uint8_t regNo, uint16_t value );
+
+// Reads one register. Returns non-zero on failure.
+int readCM6206Register( CMTransport *t, uint8_t regNo, uint16_t *value );
+
+// A register read is two requests: a command selecting the register, and a
+// GET_REPORT that fetches its value. These build them, for callers that want
+// to queue many reads at once; the buffers must hold 4 and kCM6206ReadSize
+// bytes respectively.
+void cm6206ReadRequests( uint8_t regNo, CMControlRequest *select, uint8_t *selectBuf,
+						 CMControlRequest *fetch, uint8_t *fetchBuf );
+uint16_t cm6206ReadValue( const uint8_t *fetchBuf );
+
+// Sends the activation commands of a model. Returns the number that failed.
+int initCMDevice( CMTransport *t, const CMDeviceModel *model, int verbose );
+
+// initCMDevice() for the plain CM6206 (kVendorID/kProductID)
+int initCM6206( CMTransport *t, int verbose );
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * cmusb.h - platform-neutral USB control transfer interface
+ *
+ * The activation logic only ever talks to the device through a CMTransport,
+ * so the same code runs on top of IOKit, libusb, a trace recorder or the
+ * in-process fake device.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_USB_H
+#define CM_USB_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Result codes are IOReturn values on every platform, so traces recorded on a
+// Mac and replayed on Linux mean the same thing. Other backends map their own
+// errors onto these.
+#define kCMReturnSuccess			0
+#define kCMReturnError				((int32_t)0xe00002bc)
+#define kCMReturnNoDevice			((int32_t)0xe00002c0)
+#define kCMReturnNotPrivileged		((int32_t)0xe00002c1)
+#define kCMReturnBadArgument		((int32_t)0xe00002c2)
+#define kCMReturnExclusiveAccess	((int32_t)0xe00002c5)
+#define kCMReturnUnsupported		((int32_t)0xe00002c7)
+#define kCMReturnIOError			((int32_t)0xe00002ca)
+#define kCMReturnNotOpen			((int32_t)0xe00002cd)
+#define kCMReturnBusy				((int32_t)0xe00002d5)
+#define kCMReturnTimeout			((int32_t)0xe00002d6)
+#define kCMReturnNotAttached		((int32_t)0xe00002d9)
+#define kCMReturnNoPower			((int32_t)0xe00002e3)
+#define kCMReturnOverrun			((int32_t)0xe00002e8)
+#define kCMReturnAborted			((int32_t)0xe00002eb)
+#define kCMReturnNotResponding		((int32_t)0xe00002ed)
+#define kCMUSBPipeStalled			((int32_t)0xe000404f)
+#define kCMUSBTransactionTimeout	((int32_t)0xe0004051)
+
+// bmRequestType, as built by USBmakebmRequestType()
+#define kCMRequestOut			0x00
+#define kCMRequestIn			0x80
+#define kCMRequestClass			0x20
+#define kCMRequestInterface		0x01
+#define kCMRequestEndpoint		0x02
+
+typedef struct CMControlRequest {
+	uint8_t		bmRequestType;
+	uint8_t		bRequest;
+	uint16_t	wValue;
+	uint16_t	wIndex;
+	uint16_t	wLength;
+	void		*pData;
+} CMControlRequest;
+
+// Called when an asynchronous request finishes, from inside runCompletions()
+typedef void (*CMRequestCompletion)( void *refcon, CMControlRequest *req, int32_t result );
+
+typedef struct CMTransport {
+	// Sends one request on the default pipe; returns kCMReturnSuccess or an
+	// error code. For IN requests the device's answer ends up in pData.
+	int32_t		(*controlRequest)( void *ctx, CMControlRequest *req );
+	void		*ctx;
+
+	// Optional (may be NULL): queues a request without waiting for it. req and
+	// its data must stay valid until `done` has been called. Requests on the
+	// default pipe complete in the order they were submitted.
+	int32_t		(*submitRequest)( void *ctx, CMControlRequest *req, CMRequestCompletion done, void *refcon );
+	// Delivers completions, waiting up to timeoutMs for at least one. Returns
+	// the number delivered, or -1 on error.
+	int			(*runCompletions)( void *ctx, int timeoutMs );
+} CMTransport;
+
+
+static inline int32_t cmControlRequest( CMTransport *t, CMControlRequest *req )
+{
+	return t->controlRequest(t->ctx, req);
+}
+
+
+static inline int cmCanSubmit( const CMTransport *t )
+{
+	return t->submitRequest != NULL && t->runCompletions != NULL;
+}
+
+
+// Monotonic clock in microseconds, used for trace and latency timestamps
+static inline uint64_t cmMonotonicUs( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+#endif
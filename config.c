@@ -0,0 +1,408 @@
+/*
+ * config.c - the configuration file, and watching it for changes
+ *
+ * The daemon watches the file and, when it changes, loads it again and sends
+ * each device it already knows only the writes that configDiff() finds,
+ * without restarting or scanning the bus. The watch is on the directory as
+ * well as the file, because editors usually save by writing a new file and
+ * renaming it over the old one.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#ifdef __APPLE__
+#include <sys/event.h>
+#endif
+
+#include "config.h"
+
+#define kConfigMaxLine		256
+
+
+static void copyString( char *dst, size_t size, const char *src )
+{
+	snprintf(dst, size, "%s", src);
+}
+
+
+// Makes the CMDeviceModel point at its own copies of everything
+static void adoptModel( CMConfig *cfg, int i, const CMDeviceModel *from )
+{
+	CMDeviceModel *m = &cfg->models[i];
+	CMConfigModel *s = &cfg->storage[i];
+	int w;
+
+	*m = *from;
+	copyString(s->chip, sizeof(s->chip), from->chip);
+	copyString(s->product, sizeof(s->product), from->product);
+	for( w = 0; w < from->planLength && w < kConfigMaxWrites; w++ ) {
+		s->writes[w] = from->plan[w];
+		copyString(s->descriptions[w], kConfigMaxDescription, from->plan[w].description);
+		s->writes[w].description = s->descriptions[w];
+	}
+	m->chip = s->chip;
+	m->product = s->product;
+	m->plan = s->writes;
+	m->planLength = w;
+}
+
+
+void configDefaults( CMConfig *cfg )
+{
+	int i;
+
+	memset(cfg, 0, sizeof(CMConfig));
+	for( i = 0; i < kCMNumDeviceModels && i < kConfigMaxModels; i++ )
+		adoptModel(cfg, i, &kCMDeviceModels[i]);
+	cfg->numModels = i;
+	cfg->openAttempts = 20;
+	cfg->retryDelayMs = 1000;
+	cfg->settleDelayMs = 1000;
+}
+
+
+static int parseInt( const char *s, long min, long max, long *out )
+{
+	char *end;
+	long v;
+
+	errno = 0;
+	v = strtol(s, &end, 0);
+	if( end == s || errno || v < min || v > max )
+		return -1;
+	*out = v;
+	return (int)(end - s);
+}
+
+
+static const char *skipSpace( const char *s )
+{
+	while( isspace((unsigned char)*s) )
+		s++;
+	return s;
+}
+
+
+// Starts a device section. Returns the model index, or -1.
+static int deviceLine( CMConfig *cfg, const char *args, const char *path, int line )
+{
+	unsigned vendor, product;
+	char chip[16] = "CM6206", name[64] = "";
+	CMDeviceModel model;
+	int n = 0, i;
+
+	if( sscanf(args, "%x:%x%n", &vendor, &product, &n) < 2 || vendor > 0xffff || product > 0xffff ) {
+		fprintf(stderr, "%s:%d: expected `device vendor:product [chip [product name]]'\n", path, line);
+		return -1;
+	}
+	args = skipSpace(args + n);
+	n = 0;
+	if( *args ) {
+		sscanf(args, "%15s%n", chip, &n);
+		copyString(name, sizeof(name), skipSpace(args + n));
+	}
+
+	for( i = 0; i < cfg->numModels; i++ )
+		if( cfg->models[i].vendorID == vendor && cfg->models[i].productID == product )
+			break;
+	if( i == cfg->numModels ) {
+		if( i == kConfigMaxModels ) {
+			fprintf(stderr, "%s:%d: too many devices (at most %d)\n", path, line, kConfigMaxModels);
+			return -1;
+		}
+		memset(&model, 0, sizeof(model));
+		model.vendorID = vendor;
+		model.productID = product;
+		model.chip = chip;
+		model.product = name[0] ? name : "configured device";
+		model.interfaceIndex = 1;
+		adoptModel(cfg, i, &model);
+		cfg->numModels++;
+	}
+	else {
+		if( n > 0 )
+			copyString(cfg->storage[i].chip, sizeof(cfg->storage[i].chip), chip);
+		if( name[0] )
+			copyString(cfg->storage[i].product, sizeof(cfg->storage[i].product), name);
+	}
+	return i;
+}
+
+
+static int regLine( CMConfig *cfg, int model, int *firstReg, const char *args, const char *path, int line )
+{
+	CMDeviceModel *m;
+	CMConfigModel *s;
+	long reg, value;
+	int n, v;
+
+	if( model < 0 ) {
+		fprintf(stderr, "%s:%d: `reg' outside a device section\n", path, line);
+		return -1;
+	}
+	m = &cfg->models[model];
+	s = &cfg->storage[model];
+	if( (n = parseInt(args, 0, 0xff, &reg)) < 0 || (v = parseInt(args + n, 0, 0xffff, &value)) < 0 ) {
+		fprintf(stderr, "%s:%d: expected `reg number value [description]'\n", path, line);
+		return -1;
+	}
+	// The first reg line of a section replaces the built-in plan
+	if( *firstReg ) {
+		m->planLength = 0;
+		*firstReg = 0;
+	}
+	if( m->planLength == kConfigMaxWrites ) {
+		fprintf(stderr, "%s:%d: too many register writes (at most %d)\n", path, line, kConfigMaxWrites);
+		return -1;
+	}
+	args = skipSpace(args + n + v);
+	s->writes[m->planLength].regNo = (uint8_t)reg;
+	s->writes[m->planLength].value = (uint16_t)value;
+	copyString(s->descriptions[m->planLength], kConfigMaxDescription, *args ? args : "set in the configuration file");
+	s->writes[m->planLength].description = s->descriptions[m->planLength];
+	m->planLength++;
+	return 0;
+}
+
+
+int configLoad( CMConfig *cfg, const char *path, int optional )
+{
+	char buf[kConfigMaxLine];
+	FILE *fp;
+	int line = 0, model = -1, firstReg = 0, errors = 0;
+
+	configDefaults(cfg);
+	fp = fopen(path, "r");
+	if( fp == NULL ) {
+		if( optional && errno == ENOENT )
+			return 0;
+		fprintf(stderr, "Error: could not read %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while( fgets(buf, sizeof(buf), fp) ) {
+		char *p, *key, *args;
+		size_t n;
+		long value;
+
+		line++;
+		if( (p = strchr(buf, '#')) )
+			*p = '\0';
+		n = strlen(buf);
+		while( n > 0 && isspace((unsigned char)buf[n - 1]) )
+			buf[--n] = '\0';
+		key = (char *)skipSpace(buf);
+		if( *key == '\0' )
+			continue;
+		for( args = key; *args && !isspace((unsigned char)*args); args++ )
+			;
+		if( *args )
+			*args++ = '\0';
+		args = (char *)skipSpace(args);
+
+		if( strcmp(key, "device") == 0 ) {
+			model = deviceLine(cfg, args, path, line);
+			firstReg = 1;
+			errors += model < 0;
+		}
+		else if( strcmp(key, "reg") == 0 )
+			errors += regLine(cfg, model, &firstReg, args, path, line) != 0;
+		else if( strcmp(key, "open-attempts") == 0 && parseInt(args, 1, 100, &value) > 0 )
+			cfg->openAttempts = (int)value;
+		else if( strcmp(key, "retry-delay-ms") == 0 && parseInt(args, 0, 60000, &value) > 0 )
+			cfg->retryDelayMs = (int)value;
+		else if( strcmp(key, "settle-delay-ms") == 0 && parseInt(args, 0, 60000, &value) > 0 )
+			cfg->settleDelayMs = (int)value;
+		else {
+			fprintf(stderr, "%s:%d: don't know what to do with `%s %s'\n", path, line, key, args);
+			errors++;
+		}
+	}
+	fclose(fp);
+	return errors ? -1 : 0;
+}
+
+
+// The value a plan leaves a register at, or -1 if it doesn't set it
+static long finalValue( const CMDeviceModel *m, uint8_t reg )
+{
+	long value = -1;
+	int i;
+
+	for( i = 0; m && i < m->planLength; i++ )
+		if( m->plan[i].regNo == reg )
+			value = m->plan[i].value;
+	return value;
+}
+
+
+int configDiff( const CMDeviceModel *from, const CMDeviceModel *to, CMRegisterWrite *out, int max )
+{
+	int i, j, n = 0;
+
+	for( i = 0; i < to->planLength; i++ ) {
+		const CMRegisterWrite *w = &to->plan[i];
+		int later = 0;
+
+		// Only the last write of a register counts
+		for( j = i + 1; j < to->planLength; j++ )
+			if( to->plan[j].regNo == w->regNo )
+				later = 1;
+		if( later || finalValue(from, w->regNo) == w->value || n == max )
+			continue;
+		out[n++] = *w;
+	}
+	return n;
+}
+
+
+//================================================================================================
+// Watching
+//
+static char	gWatchDir[PATH_MAX];
+static char	gWatchName[NAME_MAX + 1];
+static int	gWatchFileFd = -1;		// kqueue only
+static int	gWatchDirFd = -1;
+
+
+static int splitPath( const char *path )
+{
+	const char *slash = strrchr(path, '/');
+
+	if( slash == NULL ) {
+		copyString(gWatchDir, sizeof(gWatchDir), ".");
+		copyString(gWatchName, sizeof(gWatchName), path);
+	}
+	else {
+		snprintf(gWatchDir, sizeof(gWatchDir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+		copyString(gWatchName, sizeof(gWatchName), slash + 1);
+	}
+	return gWatchName[0] ? 0 : -1;
+}
+
+
+#if defined(__linux__)
+
+int configWatchOpen( const char *path )
+{
+	int fd;
+
+	if( splitPath(path) != 0 )
+		return -1;
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if( fd < 0 ) {
+		fprintf(stderr, "Error: could not watch %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	// Files are saved in place (close after writing) or moved over the old one
+	if( inotify_add_watch(fd, gWatchDir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0 ) {
+		fprintf(stderr, "Error: could not watch %s: %s\n", gWatchDir, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+int configWatchChanged( int fd )
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	int changed = 0;
+
+	while( (len = read(fd, buf, sizeof(buf))) > 0 ) {
+		char *p = buf;
+
+		while( p < buf + len ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			if( ev->len > 0 && strcmp(ev->name, gWatchName) == 0 )
+				changed = 1;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	return changed;
+}
+
+#elif defined(__APPLE__)
+
+// Registers the file itself, if it exists right now
+static void watchFile( int kq )
+{
+	char path[PATH_MAX];
+	struct kevent change;
+
+	if( gWatchFileFd >= 0 )
+		close(gWatchFileFd);
+	snprintf(path, sizeof(path), "%s/%s", gWatchDir, gWatchName);
+	gWatchFileFd = open(path, O_EVTONLY);
+	if( gWatchFileFd < 0 )
+		return;
+	EV_SET(&change, gWatchFileFd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+	       NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+	kevent(kq, &change, 1, NULL, 0, NULL);
+}
+
+
+int configWatchOpen( const char *path )
+{
+	struct kevent change;
+	int kq;
+
+	if( splitPath(path) != 0 )
+		return -1;
+	kq = kqueue();
+	gWatchDirFd = open(gWatchDir, O_EVTONLY);
+	if( kq < 0 || gWatchDirFd < 0 ) {
+		fprintf(stderr, "Error: could not watch %s: %s\n", gWatchDir, strerror(errno));
+		if( kq >= 0 )
+			close(kq);
+		return -1;
+	}
+	// A write to the directory means an entry was added, removed or renamed
+	EV_SET(&change, gWatchDirFd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+	kevent(kq, &change, 1, NULL, 0, NULL);
+	watchFile(kq);
+	return kq;
+}
+
+
+int configWatchChanged( int fd )
+{
+	struct kevent events[8];
+	struct timespec zero = { 0, 0 };
+	int n, changed = 0;
+
+	while( (n = kevent(fd, NULL, 0, events, 8, &zero)) > 0 )
+		changed = 1;
+	// The file may be a different one now
+	if( changed )
+		watchFile(fd);
+	return changed;
+}
+
+#endif
+
+
+void configWatchClose( int fd )
+{
+	if( gWatchFileFd >= 0 )
+		close(gWatchFileFd);
+	if( gWatchDirFd >= 0 )
+		close(gWatchDirFd);
+	gWatchFileFd = gWatchDirFd = -1;
+	close(fd);
+}
@@ -0,0 +1,78 @@
+/*
+ * config.h - the configuration file, and watching it for changes
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_CONFIG_H
+#define CM_CONFIG_H
+
+#include "cm6206.h"
+
+#ifdef __APPLE__
+#define kConfigDefaultPath		"/usr/local/etc/cm6206-enabler.conf"
+#else
+#define kConfigDefaultPath		"/etc/cm6206-enabler.conf"
+#endif
+
+#define kConfigMaxModels		16
+#define kConfigMaxWrites		16		// per model
+#define kConfigMaxDescription	48
+
+// A device model with room for its own strings and plan
+typedef struct CMConfigModel {
+	char			chip[16];
+	char			product[64];
+	CMRegisterWrite	writes[kConfigMaxWrites];
+	char			descriptions[kConfigMaxWrites][kConfigMaxDescription];
+} CMConfigModel;
+
+typedef struct CMConfig {
+	// The table handed to cmSetDeviceModels(); its strings and plans point
+	// into storage[], so a CMConfig must not be copied
+	CMDeviceModel	models[kConfigMaxModels];
+	CMConfigModel	storage[kConfigMaxModels];
+	int				numModels;
+
+	int				openAttempts;		// tries at opening a device
+	int				retryDelayMs;		// between them, and before retrying a restore after wake
+	int				settleDelayMs;		// quiet time on a port after hot-plug notifications, before activating
+} CMConfig;
+
+// The built-in device table and timings
+void configDefaults( CMConfig *cfg );
+
+// The built-in settings, changed by the file at path. A missing file is not
+// an error if `optional' is set. On errors, messages with line numbers go to
+// stderr and -1 is returned. The file looks like this:
+//
+//   open-attempts 20
+//   retry-delay-ms 1000
+//   settle-delay-ms 1000
+//
+//   device 0d8c:0102 CM6206 C-Media CM6206     # chip name and product are optional
+//   reg 0x00 0xa004 S/PDIF, sampling rate      # description optional
+//   reg 0x02 0x8004
+//
+// A device section replaces the plan of a built-in model with the same IDs,
+// or adds a model. Without reg lines a built-in model keeps its plan.
+int configLoad( CMConfig *cfg, const char *path, int optional );
+
+// The writes needed to take a device from one model's plan to another's:
+// every register whose final value differs, or that `from' didn't set, in
+// the order of `to'. from may be NULL. Returns the number of writes.
+int configDiff( const CMDeviceModel *from, const CMDeviceModel *to, CMRegisterWrite *out, int max );
+
+// Watches the file at path (one at a time), including being replaced by an
+// editor or created later; its directory must exist. Uses inotify on Linux
+// and kqueue on macOS. Returns a descriptor that becomes readable on
+// changes, or -1.
+int configWatchOpen( const char *path );
+
+// Consumes pending notifications. Returns 1 if the file may have changed.
+int configWatchChanged( int fd );
+
+void configWatchClose( int fd );
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * debounce.c - collapsing bursts of hot-plug notifications per USB port
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <string.h>
+
+#include "debounce.h"
+
+
+void debounceInit( CMDebouncer *d, uint64_t settleUs )
+{
+	memset(d, 0, sizeof(CMDebouncer));
+	d->settleUs = settleUs;
+}
+
+
+static CMDebouncePort *findPort( CMDebouncer *d, uint32_t location )
+{
+	int i;
+
+	for( i = 0; i < d->numPorts; i++ )
+		if( d->ports[i].location == location )
+			return &d->ports[i];
+	return NULL;
+}
+
+
+CMDebouncePort *debounceNotify( CMDebouncer *d, uint32_t location, int present, uint64_t nowUs )
+{
+	CMDebouncePort *port = findPort(d, location);
+
+	if( present )
+		d->stats.adds++;
+	else
+		d->stats.removes++;
+	if( port == NULL ) {
+		if( !present )
+			return NULL;
+		if( d->numPorts == kDebounceMaxPorts ) {
+			d->stats.overflows++;
+			return NULL;
+		}
+		port = &d->ports[d->numPorts++];
+		memset(port, 0, sizeof(CMDebouncePort));
+		port->location = location;
+	}
+	else if( port->deadlineUs != 0 )
+		d->stats.collapsed++;
+
+	port->present = present;
+	if( !present )
+		port->activated = 0;	// whatever comes back is a fresh device
+	// Never 0, which means settled
+	port->deadlineUs = nowUs + d->settleUs > 0 ? nowUs + d->settleUs : 1;
+	return port;
+}
+
+
+int64_t debounceNextUs( const CMDebouncer *d, uint64_t nowUs )
+{
+	int64_t next = -1;
+	int i;
+
+	for( i = 0; i < d->numPorts; i++ ) {
+		uint64_t deadline = d->ports[i].deadlineUs;
+		int64_t wait;
+
+		if( deadline == 0 )
+			continue;
+		wait = deadline > nowUs ? (int64_t)(deadline - nowUs) : 0;
+		if( next < 0 || wait < next )
+			next = wait;
+	}
+	return next;
+}
+
+
+CMDebounceAction debounceTake( CMDebouncer *d, uint64_t nowUs, uint32_t *location, void **record )
+{
+	int i;
+
+	for( i = 0; i < d->numPorts; i++ ) {
+		CMDebouncePort *port = &d->ports[i];
+
+		if( port->deadlineUs == 0 || port->deadlineUs > nowUs )
+			continue;
+		port->deadlineUs = 0;
+		*location = port->location;
+		*record = port->record;
+		if( !port->present ) {
+			// Order doesn't matter; fill the gap with the last entry
+			*port = d->ports[--d->numPorts];
+			d->stats.releases++;
+			return kDebounceRelease;
+		}
+		if( !port->activated ) {
+			port->activated = 1;
+			d->stats.activations++;
+			return kDebounceActivate;
+		}
+		// A repeated add of a device that never went away
+	}
+	return kDebounceNothing;
+}
@@ -0,0 +1,69 @@
+/*
+ * debounce.h - collapsing bursts of hot-plug notifications per USB port
+ *
+ * A hub reset can make a device disappear and come back several times within
+ * a second, each time with a fresh add and terminate notification. Handled
+ * one by one, every add meant an activation (after a settle delay) and every
+ * terminate freed the device's record, only to make a new one straight away.
+ * Here notifications are collected per location ID, which stays the same
+ * across re-enumeration, and only the state a port settles in is acted on:
+ * a device that bounces five times is activated once, settleUs after the
+ * last notification. The table has a fixed size and nothing is allocated.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_DEBOUNCE_H
+#define CM_DEBOUNCE_H
+
+#include <stdint.h>
+
+#define kDebounceMaxPorts	32
+
+typedef enum {
+	kDebounceNothing = 0,
+	kDebounceActivate,		// settled present after being absent (or new): activate it
+	kDebounceRelease		// settled absent: the backend's record can go
+} CMDebounceAction;
+
+typedef struct CMDebouncePort {
+	uint32_t	location;
+	int			present;		// the last notification was an add
+	int			activated;		// and the device has been activated since it came
+	uint64_t	deadlineUs;		// when the port counts as settled; 0 once acted on
+	void		*record;		// the backend's, kept from the first add to the release
+} CMDebouncePort;
+
+typedef struct CMDebounceStats {
+	unsigned long	adds, removes;
+	unsigned long	collapsed;		// notifications that came before the port settled
+	unsigned long	activations, releases;
+	unsigned long	overflows;		// notifications for a new port with the table full
+} CMDebounceStats;
+
+typedef struct CMDebouncer {
+	CMDebouncePort	ports[kDebounceMaxPorts];
+	int				numPorts;
+	uint64_t		settleUs;
+	CMDebounceStats	stats;
+} CMDebouncer;
+
+void debounceInit( CMDebouncer *d, uint64_t settleUs );
+
+// Records an add (present) or terminate notification at nowUs, and returns
+// the port's entry, whose record the backend may read and set. Returns NULL
+// for a terminate of an unknown port, or an add with the table full; the
+// caller then has to act on the notification directly.
+CMDebouncePort *debounceNotify( CMDebouncer *d, uint32_t location, int present, uint64_t nowUs );
+
+// Microseconds from nowUs until the next port settles (0 if one has), or -1
+// if none is waiting.
+int64_t debounceNextUs( const CMDebouncer *d, uint64_t nowUs );
+
+// Takes the next port that has settled by nowUs and needs something done,
+// with its location and record. Returns kDebounceNothing when there is none.
+// After a release the port's entry is gone.
+CMDebounceAction debounceTake( CMDebouncer *d, uint64_t nowUs, uint32_t *location, void **record );
+
+#endif
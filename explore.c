@@ -0,0 +1,326 @@
+/*
+ * explore.c - mapping the undocumented CM6206 register space
+ *
+ * Only REG0-REG3 are documented, but the read command accepts any register
+ * number. A read is a select command followed by a GET_REPORT, about 2 ms on
+ * a full-speed bus when sent one at a time, so a full map or a bit sweep is
+ * dominated by round trips. When the transport can queue requests, the reads
+ * are kept in flight back to back instead: the default pipe completes
+ * requests in order, so every GET_REPORT still answers the select before it.
+ * Reads that fail while pipelined (a stall makes the host abort the rest of
+ * the queue) are repeated one at a time.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cm6206.h"
+#include "explore.h"
+
+
+typedef struct ReadPipeline ReadPipeline;
+
+typedef struct ReadOp {
+	CMControlRequest	select, fetch;
+	uint8_t				selectBuf[4];
+	uint8_t				fetchBuf[kCM6206ReadSize];
+	int32_t				result;			// first error of the pair
+	ReadPipeline		*pipe;
+} ReadOp;
+
+struct ReadPipeline {
+	int				completed;			// requests, two per read
+	int				inFlight;
+	unsigned long	maxInFlight;
+};
+
+
+static void readDone( void *refcon, CMControlRequest *req, int32_t result )
+{
+	ReadOp *op = refcon;
+
+	(void)req;
+	if( result != kCMReturnSuccess && op->result == kCMReturnSuccess )
+		op->result = result;
+	op->pipe->completed++;
+	op->pipe->inFlight--;
+}
+
+
+// Sends the requests of all n reads, keeping up to kExploreMaxInFlight queued.
+// Every submitted request is waited for before returning, since it points
+// into ops. Reads that could not be submitted are marked as failed.
+static void runPipelined( CMTransport *t, ReadOp *ops, int n, ReadPipeline *pipe )
+{
+	int total = 2 * n, submitted = 0;
+
+	while( pipe->completed < total ) {
+		while( submitted < total && pipe->inFlight < kExploreMaxInFlight ) {
+			ReadOp *op = &ops[submitted / 2];
+			CMControlRequest *req = (submitted & 1) ? &op->fetch : &op->select;
+			int32_t err = t->submitRequest(t->ctx, req, readDone, op);
+
+			if( err != kCMReturnSuccess ) {
+				if( pipe->inFlight > 0 )
+					break;		// queue full; wait for some to finish
+				// Nothing is queued and it still refuses: give up on the rest
+				for( ; submitted < total; submitted++ ) {
+					if( ops[submitted / 2].result == kCMReturnSuccess )
+						ops[submitted / 2].result = err;
+					pipe->completed++;
+				}
+				break;
+			}
+			submitted++;
+			pipe->inFlight++;
+			if( (unsigned long)pipe->inFlight > pipe->maxInFlight )
+				pipe->maxInFlight = pipe->inFlight;
+		}
+		if( pipe->inFlight > 0 && t->runCompletions(t->ctx, 1000) < 0 )
+			break;
+	}
+}
+
+
+int exploreReadRange( CMTransport *t, int first, int last, CMRegisterMap *map, CMExploreStats *stats )
+{
+	ReadPipeline pipe = { 0, 0, 0 };
+	ReadOp *ops;
+	uint64_t start = cmMonotonicUs();
+	int n, i, failed = 0;
+	unsigned long retries = 0;
+
+	memset(map, 0, sizeof(CMRegisterMap));
+	if( first < 0 || last >= kExploreNumRegisters || first > last )
+		return 0;
+	n = last - first + 1;
+	ops = calloc(n, sizeof(ReadOp));
+	if( ops == NULL )
+		return n;
+
+	for( i = 0; i < n; i++ ) {
+		cm6206ReadRequests(first + i, &ops[i].select, ops[i].selectBuf, &ops[i].fetch, ops[i].fetchBuf);
+		ops[i].pipe = &pipe;
+	}
+	if( cmCanSubmit(t) )
+		runPipelined(t, ops, n, &pipe);
+
+	for( i = 0; i < n; i++ ) {
+		int reg = first + i;
+
+		if( !cmCanSubmit(t) || ops[i].result != kCMReturnSuccess ) {
+			if( cmCanSubmit(t) )
+				retries++;
+			if( readCM6206Register(t, reg, &map->value[reg]) != 0 ) {
+				failed++;
+				continue;
+			}
+		}
+		else
+			map->value[reg] = cm6206ReadValue(ops[i].fetchBuf);
+		map->valid[reg] = 1;
+	}
+	free(ops);
+
+	if( stats ) {
+		stats->reads += n;
+		stats->failedReads += failed;
+		stats->retries += retries;
+		if( pipe.maxInFlight > stats->maxInFlight )
+			stats->maxInFlight = pipe.maxInFlight;
+		stats->elapsedUs += cmMonotonicUs() - start;
+	}
+	return failed;
+}
+
+
+//================================================================================================
+// Snapshots
+//
+int exploreSaveMap( const CMRegisterMap *map, const char *path )
+{
+	FILE *fp = fopen(path, "w");
+	int reg;
+
+	if( fp == NULL ) {
+		fprintf(stderr, "Error: could not create %s\n", path);
+		return -1;
+	}
+	fprintf(fp, "# CM6206 register snapshot: register value\n");
+	for( reg = 0; reg < kExploreNumRegisters; reg++ )
+		if( map->valid[reg] )
+			fprintf(fp, "0x%02x 0x%04x\n", reg, map->value[reg]);
+	if( fclose(fp) != 0 ) {
+		fprintf(stderr, "Error: could not write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+
+int exploreLoadMap( CMRegisterMap *map, const char *path )
+{
+	FILE *fp = fopen(path, "r");
+	char line[128];
+	int reg, value, lineNo = 0;
+
+	if( fp == NULL ) {
+		fprintf(stderr, "Error: could not open %s\n", path);
+		return -1;
+	}
+	memset(map, 0, sizeof(CMRegisterMap));
+	while( fgets(line, sizeof(line), fp) ) {
+		lineNo++;
+		if( line[0] == '#' || line[0] == '\n' )
+			continue;
+		if( sscanf(line, "%i %i", &reg, &value) != 2 || reg < 0 || reg >= kExploreNumRegisters ||
+		    value < 0 || value > 0xFFFF ) {
+			fprintf(stderr, "Error: %s:%d: expected `register value'\n", path, lineNo);
+			fclose(fp);
+			return -1;
+		}
+		map->value[reg] = value;
+		map->valid[reg] = 1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+
+void explorePrintMap( const CMRegisterMap *map, FILE *out )
+{
+	int row, col;
+
+	for( row = 0; row < kExploreNumRegisters; row += 8 ) {
+		int any = 0;
+
+		for( col = 0; col < 8; col++ )
+			any |= map->valid[row + col];
+		if( !any )
+			continue;
+		fprintf(out, "REG%02X:", row);
+		for( col = 0; col < 8; col++ ) {
+			if( map->valid[row + col] )
+				fprintf(out, " %04x", map->value[row + col]);
+			else
+				fprintf(out, " ----");
+		}
+		fprintf(out, "\n");
+	}
+}
+
+
+int explorePrintDiff( const CMRegisterMap *a, const CMRegisterMap *b, FILE *out )
+{
+	int reg, count = 0;
+
+	for( reg = 0; reg < kExploreNumRegisters; reg++ ) {
+		if( !a->valid[reg] && !b->valid[reg] )
+			continue;
+		if( a->valid[reg] != b->valid[reg] )
+			fprintf(out, "  REG%02X: %s -> %s\n", reg, a->valid[reg] ? "readable" : "unreadable",
+					b->valid[reg] ? "readable" : "unreadable");
+		else if( a->value[reg] != b->value[reg] )
+			fprintf(out, "  REG%02X: 0x%04x -> 0x%04x (bits 0x%04x)\n", reg, a->value[reg], b->value[reg],
+					a->value[reg] ^ b->value[reg]);
+		else
+			continue;
+		count++;
+	}
+	return count;
+}
+
+
+//================================================================================================
+// Bit sweeps
+//
+static int changed( const CMRegisterMap *a, const CMRegisterMap *b, int reg )
+{
+	return a->valid[reg] != b->valid[reg] || (a->valid[reg] && a->value[reg] != b->value[reg]);
+}
+
+
+int exploreSweep( CMTransport *t, uint8_t reg, int bit, int width, int first, int last, FILE *out )
+{
+	CMRegisterMap base, again, cur;
+	uint8_t isVolatile[kExploreNumRegisters];
+	CMExploreStats stats;
+	uint16_t original, mask;
+	int v, r, numVolatile = 0;
+
+	if( width < 1 || width > kExploreMaxSweepWidth || bit < 0 || bit + width > 16 ) {
+		fprintf(stderr, "Error: a sweep covers 1 to %d bits within bits 0-15\n", kExploreMaxSweepWidth);
+		return -1;
+	}
+	if( readCM6206Register(t, reg, &original) != 0 ) {
+		fprintf(stderr, "Error: could not read REG%02X\n", reg);
+		return -1;
+	}
+	mask = ((1 << width) - 1) << bit;
+	memset(&stats, 0, sizeof(stats));
+
+	// Two untouched reads tell which registers change on their own
+	exploreReadRange(t, first, last, &base, &stats);
+	exploreReadRange(t, first, last, &again, &stats);
+	memset(isVolatile, 0, sizeof(isVolatile));
+	fprintf(out, "Sweeping REG%02X bits %d-%d, original value 0x%04x\n", reg, bit, bit + width - 1, original);
+	for( r = first; r <= last; r++ ) {
+		if( changed(&base, &again, r) ) {
+			if( numVolatile++ == 0 )
+				fprintf(out, "  volatile, ignored:");
+			fprintf(out, " REG%02X", r);
+			isVolatile[r] = 1;
+		}
+	}
+	if( numVolatile )
+		fprintf(out, "\n");
+
+	for( v = 0; v < (1 << width); v++ ) {
+		uint16_t value = (original & ~mask) | (v << bit);
+		int reactions = 0;
+
+		fprintf(out, "  field = %d (REG%02X = 0x%04x):", v, reg, value);
+		if( writeCM6206Registers(t, reg, value) != 0 ) {
+			fprintf(out, " write failed\n");
+			continue;
+		}
+		exploreReadRange(t, first, last, &cur, &stats);
+		for( r = first; r <= last; r++ ) {
+			if( isVolatile[r] )
+				continue;
+			if( r == reg ) {
+				// Shows whether the field is writable at all
+				if( cur.valid[r] && cur.value[r] != value ) {
+					fprintf(out, "%s reads back 0x%04x", reactions++ ? "," : "", cur.value[r]);
+				}
+			}
+			else if( changed(&base, &cur, r) ) {
+				if( cur.valid[r] && base.valid[r] )
+					fprintf(out, "%s REG%02X 0x%04x -> 0x%04x", reactions++ ? "," : "", r,
+							base.value[r], cur.value[r]);
+				else
+					fprintf(out, "%s REG%02X %s", reactions++ ? "," : "", r,
+							cur.valid[r] ? "became readable" : "became unreadable");
+			}
+		}
+		fprintf(out, "%s\n", reactions ? "" : " no reaction");
+	}
+
+	if( writeCM6206Registers(t, reg, original) != 0 ) {
+		fprintf(stderr, "Error: could not restore REG%02X to 0x%04x\n", reg, original);
+		return -1;
+	}
+	exploreReadRange(t, first, last, &cur, &stats);
+	for( r = first; r <= last; r++ ) {
+		if( !isVolatile[r] && changed(&base, &cur, r) ) {
+			fprintf(out, "  Warning: REG%02X did not return to 0x%04x after restoring REG%02X\n",
+					r, base.value[r], reg);
+		}
+	}
+	fprintf(out, "%lu reads in %.3f s (%lu failed, up to %lu in flight)\n", stats.reads,
+			stats.elapsedUs / 1e6, stats.failedReads, stats.maxInFlight);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * explore.h - mapping the undocumented CM6206 register space
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_EXPLORE_H
+#define CM_EXPLORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cmusb.h"
+
+#define kExploreNumRegisters	256		// the register number is one byte
+#define kExploreMaxInFlight		32		// reads queued on the default pipe at once
+#define kExploreMaxSweepWidth	4		// a sweep covers at most 16 field values
+
+typedef struct CMRegisterMap {
+	uint16_t	value[kExploreNumRegisters];
+	uint8_t		valid[kExploreNumRegisters];	// 0 if the read failed or wasn't done
+} CMRegisterMap;
+
+typedef struct CMExploreStats {
+	unsigned long	reads;
+	unsigned long	failedReads;
+	unsigned long	retries;			// reads repeated one at a time after a pipelined failure
+	unsigned long	maxInFlight;		// 0 if the transport can't queue requests
+	uint64_t		elapsedUs;
+} CMExploreStats;
+
+// Reads registers first..last into map, keeping up to kExploreMaxInFlight
+// reads queued when the transport supports it, and one at a time otherwise.
+// Registers outside the range are marked invalid. stats may be NULL.
+// Returns the number of registers that could not be read.
+int exploreReadRange( CMTransport *t, int first, int last, CMRegisterMap *map, CMExploreStats *stats );
+
+// Text snapshots, one "reg value" line per readable register.
+int exploreSaveMap( const CMRegisterMap *map, const char *path );
+int exploreLoadMap( CMRegisterMap *map, const char *path );
+void explorePrintMap( const CMRegisterMap *map, FILE *out );
+
+// Prints the registers that differ between a and b. Returns how many did.
+int explorePrintDiff( const CMRegisterMap *a, const CMRegisterMap *b, FILE *out );
+
+// Writes every value of the `width`-bit field at `bit` of register `reg` in
+// turn, reading first..last after each write and reporting which registers
+// react. Registers that change by themselves between two untouched reads are
+// reported as volatile and left out. The register is restored afterwards.
+// Returns 0 on success.
+int exploreSweep( CMTransport *t, uint8_t reg, int bit, int width, int first, int last, FILE *out );
+
+#endif
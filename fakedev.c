@@ -0,0 +1,247 @@
+/*
+ * fakedev.c - in-process model of a CM6206, for testing without hardware
+ *
+ * Models the vendor register interface on interface 3: a class OUT request
+ * 0x09 (SET_REPORT) with the 4-byte command { 0x20, DATAL, DATAH, reg }
+ * writes a register, and { 0x30, 0, 0, reg } selects a register for the
+ * next GET_REPORT (class IN request 0x01) to return. The configuration
+ * descriptor and an audio class feature unit for the outputs are modelled
+ * too. Anything else stalls, like the real chip does.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "fakedev.h"
+
+
+// Just enough of a configuration descriptor to find the feature units in:
+// the audio control interface with a feature unit for the 8 outputs and one
+// for a stereo input, and the vendor interface.
+static const uint8_t kConfigDescriptor[] = {
+	9, 0x02, 69, 0, 2, 1, 0, 0x80, 50,
+	9, 0x04, 0, 0, 0, 0x01, 0x01, 0, 0,
+	9, 0x24, 0x01, 0x00, 0x01, 35, 0, 1, 1,
+	7 + 9, 0x24, 0x06, kFakeOutputUnit, 1, 1, 0x01, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0,
+	7 + 3, 0x24, 0x06, 5, 4, 1, 0x01, 0x02, 0x02, 0,
+	9, 0x04, 3, 0, 1, 0x03, 0, 0, 0,
+	7, 0x05, 0x82, 0x03, 8, 0, 1,
+};
+
+
+void fakeDeviceInit( CMFakeDevice *dev )
+{
+	memset(dev, 0, sizeof(CMFakeDevice));
+}
+
+
+static int32_t mixerRequest( CMFakeDevice *dev, CMControlRequest *req )
+{
+	uint8_t *data = req->pData;
+	int control = req->wValue >> 8, ch = req->wValue & 0xFF;
+	int16_t value;
+
+	if( (req->wIndex >> 8) != kFakeOutputUnit || ch > kFakeNumChannels )
+		return kCMUSBPipeStalled;
+	dev->mixerRequests++;
+	if( control == 0x01 && req->wLength >= 1 ) {
+		if( req->bRequest == 0x01 )
+			dev->mute[ch] = data[0];
+		else if( req->bRequest == 0x81 )
+			data[0] = dev->mute[ch];
+		else
+			return kCMUSBPipeStalled;
+		return kCMReturnSuccess;
+	}
+	if( control != 0x02 || ch == 0 || req->wLength < 2 )
+		return kCMUSBPipeStalled;
+	switch( req->bRequest ) {
+		case 0x01:	dev->volume[ch] = (int16_t)(data[0] | data[1] << 8); return kCMReturnSuccess;
+		case 0x81:	value = dev->volume[ch]; break;
+		case 0x82:	value = -64 * 256; break;
+		case 0x83:	value = 0; break;
+		case 0x84:	value = 256; break;
+		default:	return kCMUSBPipeStalled;
+	}
+	data[0] = value & 0xFF;
+	data[1] = (uint16_t)value >> 8;
+	return kCMReturnSuccess;
+}
+
+
+static int32_t modelRequest( CMFakeDevice *dev, CMControlRequest *req )
+{
+	const uint8_t *buf = req->pData;
+
+	uint8_t *answer = req->pData;
+
+	if( req->bmRequestType == kCMRequestIn && req->bRequest == 0x06 && req->wValue == 0x0200 ) {
+		memcpy(answer, kConfigDescriptor, req->wLength < sizeof(kConfigDescriptor) ? req->wLength : sizeof(kConfigDescriptor));
+		return kCMReturnSuccess;
+	}
+	if( (req->bmRequestType & ~kCMRequestIn) == (kCMRequestClass | kCMRequestInterface) &&
+	    (req->wIndex & 0xFF) == 0 )
+		return mixerRequest(dev, req);
+	if( req->bmRequestType == (kCMRequestOut | kCMRequestClass | kCMRequestInterface) &&
+	    req->bRequest == 0x09 && req->wLength >= 4 ) {
+		if( buf[0] == 0x20 ) {
+			if( buf[3] < kFakeNumRegisters )
+				dev->regs[buf[3]] = buf[1] | buf[2] << 8;
+			dev->registerWrites++;
+			return kCMReturnSuccess;
+		}
+		if( buf[0] == 0x30 ) {
+			dev->selected = buf[3];
+			return kCMReturnSuccess;
+		}
+	}
+	if( req->bmRequestType == (kCMRequestIn | kCMRequestClass | kCMRequestInterface) &&
+	    req->bRequest == 0x01 && req->wLength >= 3 ) {
+		uint16_t value = dev->selected < kFakeNumRegisters ? dev->regs[dev->selected] : 0;
+		answer[0] = 0;
+		answer[1] = value & 0xFF;
+		answer[2] = value >> 8;
+		dev->registerReads++;
+		return kCMReturnSuccess;
+	}
+	return kCMUSBPipeStalled;
+}
+
+
+static int scriptMatches( const CMTraceRecord *r, const CMControlRequest *req )
+{
+	if( r->bmRequestType != req->bmRequestType || r->bRequest != req->bRequest ||
+	    r->wValue != req->wValue || r->wIndex != req->wIndex || r->wLength != req->wLength )
+		return 0;
+	if( !(r->bmRequestType & kCMRequestIn) && memcmp(r->payload, req->pData, r->wLength) != 0 )
+		return 0;
+	return 1;
+}
+
+
+// An error to fail this request with, or kCMReturnSuccess
+static int32_t injectedError( CMFakeDevice *dev )
+{
+	if( dev->halted )
+		return kCMUSBPipeStalled;
+	if( dev->closed )
+		return kCMReturnNotOpen;
+	if( dev->injectCount <= 0 )
+		return kCMReturnSuccess;
+	dev->injectCount--;
+	dev->injected++;
+	if( dev->injectError == kCMUSBPipeStalled )
+		dev->halted = 1;
+	else if( dev->injectError == kCMReturnNotOpen )
+		dev->closed = 1;
+	return dev->injectError;
+}
+
+
+static int32_t fakeControlRequest( void *ctx, CMControlRequest *req )
+{
+	CMFakeDevice *dev = ctx;
+	int32_t err;
+
+	dev->requests++;
+	if( (err = injectedError(dev)) != kCMReturnSuccess )
+		return err;
+	if( dev->script && dev->scriptPos < dev->script->count ) {
+		const CMTraceRecord *r = &dev->script->records[dev->scriptPos++];
+		if( scriptMatches(r, req) ) {
+			if( dev->scriptTiming && r->durationUs )
+				usleep(r->durationUs);
+			if( r->result == kCMReturnSuccess ) {
+				if( r->bmRequestType & kCMRequestIn )
+					memcpy(req->pData, r->payload, r->wLength);
+				else
+					modelRequest(dev, req);
+			}
+			return r->result;
+		}
+		dev->divergences++;
+	}
+	return modelRequest(dev, req);
+}
+
+
+// Asynchronous requests are only queued here; runCompletions() plays them
+// through the same path as synchronous ones, in submission order.
+static int32_t fakeSubmitRequest( void *ctx, CMControlRequest *req, CMRequestCompletion done, void *refcon )
+{
+	CMFakeDevice *dev = ctx;
+	CMFakePending *p;
+
+	if( dev->numPending == kFakeMaxPending )
+		return kCMReturnBusy;
+	p = &dev->pending[dev->numPending++];
+	p->req = req;
+	p->done = done;
+	p->refcon = refcon;
+	return kCMReturnSuccess;
+}
+
+
+static int fakeRunCompletions( void *ctx, int timeoutMs )
+{
+	CMFakeDevice *dev = ctx;
+	CMFakePending batch[kFakeMaxPending];
+	int n = dev->numPending, i;
+
+	(void)timeoutMs;
+	// Completions may submit new requests, so work on a copy
+	memcpy(batch, dev->pending, n * sizeof(CMFakePending));
+	dev->numPending = 0;
+	for( i = 0; i < n; i++ )
+		batch[i].done(batch[i].refcon, batch[i].req, fakeControlRequest(dev, batch[i].req));
+	return n;
+}
+
+
+void fakeDeviceTransport( CMFakeDevice *dev, CMTransport *out )
+{
+	out->controlRequest = fakeControlRequest;
+	out->ctx = dev;
+	out->submitRequest = fakeSubmitRequest;
+	out->runCompletions = fakeRunCompletions;
+}
+
+
+void fakeDeviceInjectError( CMFakeDevice *dev, int32_t err, int count )
+{
+	dev->injectError = err;
+	dev->injectCount = count;
+}
+
+
+int32_t fakeDeviceClearStall( void *ctx )
+{
+	CMFakeDevice *dev = ctx;
+
+	dev->stallsCleared++;
+	dev->halted = 0;
+	return dev->closed ? kCMReturnNotOpen : kCMReturnSuccess;
+}
+
+
+int32_t fakeDeviceReopen( void *ctx )
+{
+	CMFakeDevice *dev = ctx;
+
+	dev->reopens++;
+	dev->closed = 0;
+	dev->halted = 0;
+	return kCMReturnSuccess;
+}
+
+
+void fakeDeviceSetScript( CMFakeDevice *dev, const CMTrace *script, int timing )
+{
+	dev->script = script;
+	dev->scriptPos = 0;
+	dev->scriptTiming = timing;
+	dev->divergences = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * fakedev.h - in-process model of a CM6206, for testing without hardware
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_FAKEDEV_H
+#define CM_FAKEDEV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cmusb.h"
+#include "usbtrace.h"
+
+#define kFakeNumRegisters	6	// REG0-REG5 exist; the rest of the address space reads as 0
+#define kFakeMaxPending		64	// asynchronous requests that can be queued
+#define kFakeOutputUnit		2	// feature unit for the 8 outputs, on interface 0
+#define kFakeNumChannels	8
+
+typedef struct CMFakePending {
+	CMControlRequest	*req;
+	CMRequestCompletion	done;
+	void				*refcon;
+} CMFakePending;
+
+typedef struct CMFakeDevice {
+	uint16_t		regs[kFakeNumRegisters];
+	uint8_t			selected;			// register latched by the last read command
+
+	// The output feature unit: mute on the master and each channel, volume
+	// (-64 to 0 dB in 1 dB steps) on each channel
+	int16_t			volume[kFakeNumChannels + 1];
+	uint8_t			mute[kFakeNumChannels + 1];
+
+	// Submitted but not yet completed requests, oldest first
+	CMFakePending	pending[kFakeMaxPending];
+	int				numPending;
+
+	// Injected errors: the next injectCount requests fail with injectError.
+	// A stall halts the pipe and one that isn't open closes the interface,
+	// and either then fails every request until fakeDeviceClearStall() or
+	// fakeDeviceReopen(). injectCount counts failures, not requests then.
+	int32_t			injectError;
+	int				injectCount;
+	int				halted, closed;
+	unsigned long	injected, stallsCleared, reopens;
+
+	unsigned long	requests;
+	unsigned long	registerWrites;
+	unsigned long	registerReads;
+	unsigned long	mixerRequests;
+
+	// Scripted mode: answer with what a recorded device did
+	const CMTrace	*script;
+	size_t			scriptPos;
+	int				scriptTiming;
+	unsigned long	divergences;		// requests that did not match the script
+} CMFakeDevice;
+
+void fakeDeviceInit( CMFakeDevice *dev );
+void fakeDeviceTransport( CMFakeDevice *dev, CMTransport *out );
+
+// From now on, request n is answered with record n's result (and IN data),
+// after sleeping its recorded duration if timing is set. Requests that differ
+// from the recording, and any beyond its end, go to the model instead.
+void fakeDeviceSetScript( CMFakeDevice *dev, const CMTrace *script, int timing );
+
+void fakeDeviceInjectError( CMFakeDevice *dev, int32_t err, int count );
+
+// The recoveries for injected stalls and closed interfaces. Both take the
+// device as a void pointer, to serve directly as CMRetryPolicy hooks.
+int32_t fakeDeviceClearStall( void *dev );
+int32_t fakeDeviceReopen( void *dev );
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * fft.c - small real-input FFT used by the DSP modules
+ *
+ * A real sequence of length n is packed into n/2 complex points, transformed
+ * with an iterative radix-2 FFT on split re/im arrays, and then untangled into
+ * the n/2+1 bins of the real spectrum. Nothing clever, but it does not
+ * allocate after fftCreate() and the inner loops vectorise well enough.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "fft.h"
+
+struct CMFFT {
+	int		n;			// real length
+	int		half;		// complex length n/2
+	int		*bitrev;	// bit-reversal permutation for half points
+	float	*twRe;		// exp(-2*pi*i*k/half), k < half/2
+	float	*twIm;
+	float	*rtRe;		// exp(-2*pi*i*k/n), k <= half/2, for the real split
+	float	*rtIm;
+};
+
+
+CMFFT *fftCreate( int n )
+{
+	CMFFT *fft;
+	int bits = 0, k;
+
+	if( n < 4 || (n & (n - 1)) != 0 )
+		return NULL;
+
+	fft = calloc(1, sizeof(CMFFT));
+	if( !fft )
+		return NULL;
+	fft->n = n;
+	fft->half = n / 2;
+	fft->bitrev = malloc(sizeof(int) * fft->half);
+	fft->twRe = malloc(sizeof(float) * (fft->half / 2 + 1));
+	fft->twIm = malloc(sizeof(float) * (fft->half / 2 + 1));
+	fft->rtRe = malloc(sizeof(float) * (fft->half / 2 + 1));
+	fft->rtIm = malloc(sizeof(float) * (fft->half / 2 + 1));
+	if( !fft->bitrev || !fft->twRe || !fft->twIm || !fft->rtRe || !fft->rtIm ) {
+		fftDestroy(fft);
+		return NULL;
+	}
+
+	while( (1 << bits) < fft->half )
+		bits++;
+	for( k = 0; k < fft->half; k++ ) {
+		int r = 0, b;
+		for( b = 0; b < bits; b++ )
+			if( k & (1 << b) )
+				r |= 1 << (bits - 1 - b);
+		fft->bitrev[k] = r;
+	}
+	for( k = 0; k <= fft->half / 2; k++ ) {
+		double a = -2.0 * M_PI * k / fft->half;
+		double b = -2.0 * M_PI * k / fft->n;
+		fft->twRe[k] = (float)cos(a);
+		fft->twIm[k] = (float)sin(a);
+		fft->rtRe[k] = (float)cos(b);
+		fft->rtIm[k] = (float)sin(b);
+	}
+	return fft;
+}
+
+
+void fftDestroy( CMFFT *fft )
+{
+	if( !fft )
+		return;
+	free(fft->bitrev);
+	free(fft->twRe);
+	free(fft->twIm);
+	free(fft->rtRe);
+	free(fft->rtIm);
+	free(fft);
+}
+
+
+int fftSize( const CMFFT *fft )
+{
+	return fft->n;
+}
+
+
+//================================================================================================
+// In-place complex FFT of fft->half points, input already in bit-reversed order.
+//
+static void butterflies( const CMFFT *fft, float *re, float *im )
+{
+	int half = fft->half;
+	int size, i, j;
+
+	for( size = 2; size <= half; size <<= 1 ) {
+		int hs = size >> 1;
+		int step = half / size;
+		for( i = 0; i < half; i += size ) {
+			float *ar = re + i, *ai = im + i;
+			float *br = re + i + hs, *bi = im + i + hs;
+			for( j = 0; j < hs; j++ ) {
+				float wr = fft->twRe[j * step], wi = fft->twIm[j * step];
+				float tr = br[j] * wr - bi[j] * wi;
+				float ti = br[j] * wi + bi[j] * wr;
+				br[j] = ar[j] - tr;
+				bi[j] = ai[j] - ti;
+				ar[j] += tr;
+				ai[j] += ti;
+			}
+		}
+	}
+}
+
+
+void fftForward( const CMFFT *fft, const float *in, float *re, float *im )
+{
+	int half = fft->half;
+	int k;
+
+	// Pack even/odd samples as one complex sequence, permuted on the way in
+	for( k = 0; k < half; k++ ) {
+		int r = fft->bitrev[k];
+		re[r] = in[2 * k];
+		im[r] = in[2 * k + 1];
+	}
+	butterflies(fft, re, im);
+
+	// Untangle: X[k] = Fe[k] + W^k * Fo[k], handling k and half-k together
+	{
+		float z0r = re[0], z0i = im[0];
+		re[0] = z0r + z0i;
+		im[0] = 0.0f;
+		re[half] = z0r - z0i;
+		im[half] = 0.0f;
+	}
+	for( k = 1; k <= half / 2; k++ ) {
+		int m = half - k;
+		float ar = re[k], ai = im[k], br = re[m], bi = im[m];
+		float fer = 0.5f * (ar + br), fei = 0.5f * (ai - bi);	// (a + conj(b)) / 2
+		float for_ = 0.5f * (ai + bi), foi = -0.5f * (ar - br);	// (a - conj(b)) / 2i
+		float wr = fft->rtRe[k], wi = fft->rtIm[k];
+		float tr = wr * for_ - wi * foi;
+		float ti = wr * foi + wi * for_;
+		re[k] = fer + tr;
+		im[k] = fei + ti;
+		if( m != k ) {
+			// Fe[m] = conj(Fe[k]), Fo[m] = conj(Fo[k]), W^m = -conj(W^k)
+			re[m] = fer - tr;
+			im[m] = -fei + ti;
+		}
+	}
+}
+
+
+void fftInverse( const CMFFT *fft, float *re, float *im, float *out )
+{
+	int half = fft->half;
+	int k;
+
+	// Re-tangle: Z[k] = (X[k] + conj(X[m])) + i * (X[k] - conj(X[m])) * conj(W^k)
+	{
+		float x0 = re[0], xh = re[half];
+		re[0] = x0 + xh;
+		im[0] = x0 - xh;
+	}
+	for( k = 1; k <= half / 2; k++ ) {
+		int m = half - k;
+		float xkr = re[k], xki = im[k], xmr = re[m], xmi = im[m];
+		float ar = xkr + xmr, ai = xki - xmi;
+		float pr = xkr - xmr, pi = xki + xmi;
+		float wr = fft->rtRe[k], wi = -fft->rtIm[k];
+		float dr = pr * wr - pi * wi;
+		float di = pr * wi + pi * wr;
+		re[k] = ar - di;
+		im[k] = ai + dr;
+		if( m != k ) {
+			// Z[m] = conj(A) + i * conj(D)
+			re[m] = ar + di;
+			im[m] = -ai + dr;
+		}
+	}
+
+	// Inverse complex FFT done as a forward one with re and im swapped
+	for( k = 0; k < half; k++ ) {
+		int r = fft->bitrev[k];
+		if( r > k ) {
+			float t = re[k]; re[k] = re[r]; re[r] = t;
+			t = im[k]; im[k] = im[r]; im[r] = t;
+		}
+	}
+	butterflies(fft, im, re);
+
+	for( k = 0; k < half; k++ ) {
+		out[2 * k] = re[k];
+		out[2 * k + 1] = im[k];
+	}
+}
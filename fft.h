@@ -0,0 +1,28 @@
+/*
+ * fft.h - small real-input FFT used by the DSP modules
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_FFT_H
+#define CM_FFT_H
+
+// A plan only holds read-only tables, so one plan may be shared by any number
+// of threads as long as each one passes its own buffers.
+typedef struct CMFFT CMFFT;
+
+// n must be a power of two, at least 4. Returns NULL on bad size or no memory.
+CMFFT *fftCreate( int n );
+void fftDestroy( CMFFT *fft );
+int fftSize( const CMFFT *fft );
+
+// Real-to-complex transform. Produces n/2+1 bins in split form (re[], im[]).
+// The input is not modified; in may not alias re or im.
+void fftForward( const CMFFT *fft, const float *in, float *re, float *im );
+
+// Complex-to-real inverse of fftForward. Unnormalised: the output is n times
+// the original signal. re and im are used as scratch and are clobbered.
+void fftInverse( const CMFFT *fft, float *re, float *im, float *out );
+
+#endif
@@ -0,0 +1,483 @@
+/*
+ * fir.c - multichannel partitioned-convolution FIR engine (room correction)
+ *
+ * Long filters (4k-64k taps) are split into segments of uniform partitions,
+ * each segment run as uniformly-partitioned overlap-save convolution with a
+ * frequency-domain delay line. The first segment uses partitions of the block
+ * size so there is no added latency; later segments double the partition size
+ * (up to kFirMaxPartition), which is where the savings on long filters come
+ * from. A segment with partition size L starting at tap `offset` only has to
+ * run every L samples, as long as offset >= L - blockSize; its input is simply
+ * read that much later from the channel's input ring.
+ *
+ * Left at that, every segment of every channel would run in the same block
+ * once per largest partition, and that block would cost the transforms of
+ * all of them. So each (segment, channel) pair gets its own phase within its
+ * L/B blocks: the largest first, each one into the block that is least
+ * loaded so far. Only the transforms and the newest partition's product
+ * have to wait for the run; the older partitions' input is transformed
+ * already, so their products are summed ahead, a share in each of the L/B
+ * blocks before it.
+ *
+ * Every (segment, channel) pair is one task. Per block the caller and the
+ * worker threads grab tasks from a shared counter, meet at a barrier, and the
+ * caller then sums the segment outputs. No allocation happens after
+ * firCreate().
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fft.h"
+#include "fir.h"
+
+#define kFirPartsPerSegment	4	// partitions per segment before doubling
+
+
+typedef struct FirSegment {
+	int			size;		// partition size L
+	int			parts;		// number of partitions
+	int			offset;		// first tap covered by this segment
+	int			delay;		// input delay: offset - (L - blockSize)
+	int			bins;		// L + 1
+	int			steps;		// blocks per run, L/B
+	int			phase[kFirMaxChannels];	// runs when samples % L == phase
+	CMFFT		*fft;		// plan of size 2L
+	float		*hRe;		// filter spectra [channel][part][bin]
+	float		*hIm;
+	float		*xRe;		// frequency-domain delay line [channel][part][bin]
+	float		*xIm;
+	int			fdlPos[kFirMaxChannels];
+	float		*accRe;		// partitions 1.. summed ahead of the next run [channel][bin]
+	float		*accIm;
+	float		*out;		// most recent L output samples [channel][L]
+} FirSegment;
+
+typedef struct FirWorker {
+	struct CMFir	*fir;
+	int				index;
+} FirWorker;
+
+struct CMFir {
+	int				channels;
+	int				blockSize;
+	int				maxTaps;
+	int				numThreads;
+	int				numSegments;
+	FirSegment		seg[kFirMaxSegments];
+
+	float			*ring;		// input history [channel][ringLen]
+	long			ringLen;
+	long long		samples;	// samples written so far
+
+	float			*scratch;	// per thread: time[2L]
+	long			scratchStride;
+
+	// worker pool
+	int				numTasks;
+	atomic_int		nextTask;
+	pthread_t		threads[kFirMaxThreads];
+	FirWorker		workers[kFirMaxThreads];
+	int				numStarted;
+	pthread_mutex_t	lock;
+	pthread_cond_t	startCond;
+	pthread_cond_t	doneCond;
+	unsigned		generation;
+	int				pending;
+	int				quit;
+};
+
+
+//================================================================================================
+// Partition layout
+//
+static int planSegments( CMFir *fir )
+{
+	int B = fir->blockSize;
+	int offset = 0, size = B, n = 0;
+
+	while( offset < fir->maxTaps ) {
+		int remaining = fir->maxTaps - offset;
+		int parts;
+		FirSegment *s;
+
+		if( n == kFirMaxSegments )
+			return -1;
+		// Stay at this size for a few partitions, unless this is the largest one
+		// we are allowed or the rest of the filter fits anyway.
+		if( size >= kFirMaxPartition || n == kFirMaxSegments - 1 || remaining <= kFirPartsPerSegment * size )
+			parts = (remaining + size - 1) / size;
+		else
+			parts = kFirPartsPerSegment;
+
+		s = &fir->seg[n++];
+		s->size = size;
+		s->parts = parts;
+		s->offset = offset;
+		s->delay = offset - (size - B);
+		s->bins = size + 1;
+		s->steps = size / B;
+
+		offset += parts * size;
+		if( size < kFirMaxPartition && offset >= 2 * size - B )
+			size *= 2;
+	}
+	fir->numSegments = n;
+	return 0;
+}
+
+
+// Spreads the runs over the blocks: each (segment, channel) pair, largest
+// first, takes the phase whose blocks carry the least work so far. The cost
+// of a run is taken as that of its transforms.
+static int planPhases( CMFir *fir )
+{
+	int H = fir->seg[fir->numSegments - 1].steps, i, ch, phase, m;
+	double *load = calloc(H, sizeof(double));
+
+	if( load == NULL )
+		return -1;
+	for( i = fir->numSegments - 1; i >= 0; i-- ) {
+		FirSegment *s = &fir->seg[i];
+		double cost = s->size * log2(2.0 * s->size);
+
+		for( ch = 0; ch < fir->channels; ch++ ) {
+			double best = HUGE_VAL;
+
+			for( phase = 0; phase < s->steps; phase++ ) {
+				double worst = 0;
+				for( m = phase; m < H; m += s->steps )
+					if( load[m] > worst )
+						worst = load[m];
+				if( worst < best ) {
+					best = worst;
+					s->phase[ch] = phase * fir->blockSize;
+				}
+			}
+			for( m = s->phase[ch] / fir->blockSize; m < H; m += s->steps )
+				load[m] += cost;
+		}
+	}
+	free(load);
+	return 0;
+}
+
+
+//================================================================================================
+// One segment of one channel, one block's share: the transforms on the
+// segment's run, and the products of some of its older partitions.
+//
+static void runTask( CMFir *fir, int task, float *scratch )
+{
+	int ch = task % fir->channels;
+	FirSegment *s = &fir->seg[fir->numSegments - 1 - task / fir->channels];	// big ones first
+	int L = s->size, bins = s->bins;
+	float *time = scratch;
+	float *accRe = s->accRe + (long)ch * bins;
+	float *accIm = s->accIm + (long)ch * bins;
+	const float *ring = fir->ring + ch * fir->ringLen;
+	long mask = fir->ringLen - 1;
+	long long t = fir->samples - s->phase[ch], start;
+	int step, pos, from, to, p, k;
+
+	if( t < 0 )
+		return;
+	step = (int)(t / fir->blockSize % s->steps);
+	pos = s->fdlPos[ch];
+	if( step == 0 ) {
+		const float *hr = s->hRe + (long)ch * s->parts * bins;
+		const float *hi = s->hIm + (long)ch * s->parts * bins;
+		float *xr = s->xRe + ((long)ch * s->parts + pos) * bins;
+		float *xi = s->xIm + ((long)ch * s->parts + pos) * bins;
+
+		// Last 2L input samples as seen through this segment's delay
+		start = fir->samples - s->delay - 2 * L;
+		for( k = 0; k < 2 * L; k++ )
+			time[k] = ring[(start + k) & mask];
+		fftForward(s->fft, time, xr, xi);
+		for( k = 0; k < bins; k++ ) {
+			accRe[k] += xr[k] * hr[k] - xi[k] * hi[k];
+			accIm[k] += xr[k] * hi[k] + xi[k] * hr[k];
+		}
+		fftInverse(s->fft, accRe, accIm, time);
+		memcpy(s->out + (long)ch * L, time + L, sizeof(float) * L);
+		memset(accRe, 0, sizeof(float) * bins);
+		memset(accIm, 0, sizeof(float) * bins);
+		s->fdlPos[ch] = pos = pos + 1 == s->parts ? 0 : pos + 1;
+	}
+
+	// This block's share of partitions 1.. for the next run, which will
+	// put its input at pos
+	from = 1 + (s->parts - 1) * step / s->steps;
+	to = 1 + (s->parts - 1) * (step + 1) / s->steps;
+	for( p = from; p < to; p++ ) {
+		int xp = pos - p < 0 ? pos - p + s->parts : pos - p;
+		const float *xr = s->xRe + ((long)ch * s->parts + xp) * bins;
+		const float *xi = s->xIm + ((long)ch * s->parts + xp) * bins;
+		const float *hr = s->hRe + ((long)ch * s->parts + p) * bins;
+		const float *hi = s->hIm + ((long)ch * s->parts + p) * bins;
+		for( k = 0; k < bins; k++ ) {
+			accRe[k] += xr[k] * hr[k] - xi[k] * hi[k];
+			accIm[k] += xr[k] * hi[k] + xi[k] * hr[k];
+		}
+	}
+}
+
+
+static void runTasks( CMFir *fir, int threadIndex )
+{
+	float *scratch = fir->scratch + threadIndex * fir->scratchStride;
+	int task;
+
+	while( (task = atomic_fetch_add_explicit(&fir->nextTask, 1, memory_order_relaxed)) < fir->numTasks )
+		runTask(fir, task, scratch);
+}
+
+
+static void *workerMain( void *arg )
+{
+	FirWorker *w = arg;
+	CMFir *fir = w->fir;
+	unsigned seen = 0;
+
+	for( ;; ) {
+		pthread_mutex_lock(&fir->lock);
+		while( fir->generation == seen && !fir->quit )
+			pthread_cond_wait(&fir->startCond, &fir->lock);
+		seen = fir->generation;
+		if( fir->quit ) {
+			pthread_mutex_unlock(&fir->lock);
+			break;
+		}
+		pthread_mutex_unlock(&fir->lock);
+
+		runTasks(fir, w->index);
+
+		pthread_mutex_lock(&fir->lock);
+		if( --fir->pending == 0 )
+			pthread_cond_signal(&fir->doneCond);
+		pthread_mutex_unlock(&fir->lock);
+	}
+	return NULL;
+}
+
+
+//================================================================================================
+//
+CMFir *firCreate( int channels, int blockSize, int maxTaps, int numThreads )
+{
+	CMFir *fir;
+	long ringLen = 1;
+	int i;
+
+	if( channels < 1 || channels > kFirMaxChannels || blockSize < 4 || (blockSize & (blockSize - 1)) ||
+	    blockSize > kFirMaxPartition || maxTaps < 1 || numThreads < 1 || numThreads > kFirMaxThreads )
+		return NULL;
+
+	fir = calloc(1, sizeof(CMFir));
+	if( !fir )
+		return NULL;
+	fir->channels = channels;
+	fir->blockSize = blockSize;
+	fir->maxTaps = maxTaps;
+	fir->numThreads = numThreads;
+	pthread_mutex_init(&fir->lock, NULL);
+	pthread_cond_init(&fir->startCond, NULL);
+	pthread_cond_init(&fir->doneCond, NULL);
+
+	if( planSegments(fir) || planPhases(fir) ) {
+		firDestroy(fir);
+		return NULL;
+	}
+
+	for( i = 0; i < fir->numSegments; i++ ) {
+		FirSegment *s = &fir->seg[i];
+		size_t n = (size_t)channels * s->parts * s->bins;
+		long need = s->delay + 2L * s->size;
+
+		while( ringLen < need )
+			ringLen <<= 1;
+		s->fft = fftCreate(2 * s->size);
+		s->hRe = calloc(n, sizeof(float));
+		s->hIm = calloc(n, sizeof(float));
+		s->xRe = calloc(n, sizeof(float));
+		s->xIm = calloc(n, sizeof(float));
+		s->accRe = calloc((size_t)channels * s->bins, sizeof(float));
+		s->accIm = calloc((size_t)channels * s->bins, sizeof(float));
+		s->out = calloc((size_t)channels * s->size, sizeof(float));
+		if( !s->fft || !s->hRe || !s->hIm || !s->xRe || !s->xIm || !s->accRe || !s->accIm || !s->out ) {
+			firDestroy(fir);
+			return NULL;
+		}
+	}
+	fir->ringLen = ringLen;
+	fir->ring = calloc((size_t)channels * ringLen, sizeof(float));
+	fir->scratchStride = 2L * kFirMaxPartition;
+	fir->scratch = calloc((size_t)numThreads * fir->scratchStride, sizeof(float));
+	if( !fir->ring || !fir->scratch ) {
+		firDestroy(fir);
+		return NULL;
+	}
+	fir->numTasks = fir->numSegments * channels;
+
+	for( i = 1; i < numThreads; i++ ) {
+		fir->workers[i].fir = fir;
+		fir->workers[i].index = i;
+		if( pthread_create(&fir->threads[i], NULL, workerMain, &fir->workers[i]) ) {
+			firDestroy(fir);
+			return NULL;
+		}
+		fir->numStarted = i;
+	}
+	return fir;
+}
+
+
+void firDestroy( CMFir *fir )
+{
+	int i;
+
+	if( !fir )
+		return;
+	pthread_mutex_lock(&fir->lock);
+	fir->quit = 1;
+	pthread_cond_broadcast(&fir->startCond);
+	pthread_mutex_unlock(&fir->lock);
+	for( i = 1; i <= fir->numStarted; i++ )
+		pthread_join(fir->threads[i], NULL);
+
+	for( i = 0; i < fir->numSegments; i++ ) {
+		FirSegment *s = &fir->seg[i];
+		fftDestroy(s->fft);
+		free(s->hRe);
+		free(s->hIm);
+		free(s->xRe);
+		free(s->xIm);
+		free(s->accRe);
+		free(s->accIm);
+		free(s->out);
+	}
+	free(fir->ring);
+	free(fir->scratch);
+	pthread_mutex_destroy(&fir->lock);
+	pthread_cond_destroy(&fir->startCond);
+	pthread_cond_destroy(&fir->doneCond);
+	free(fir);
+}
+
+
+int firLoadFilter( CMFir *fir, int channel, const float *taps, int numTaps )
+{
+	float *time = fir->scratch;
+	int i, p, k;
+
+	if( channel < 0 || channel >= fir->channels || numTaps < 0 || numTaps > fir->maxTaps )
+		return -1;
+
+	for( i = 0; i < fir->numSegments; i++ ) {
+		FirSegment *s = &fir->seg[i];
+		int L = s->size;
+		// fftInverse is unnormalised, so fold its 1/2L into the filter
+		float scale = 1.0f / (2 * L);
+
+		for( p = 0; p < s->parts; p++ ) {
+			int first = s->offset + p * L;
+			long at = ((long)channel * s->parts + p) * s->bins;
+
+			for( k = 0; k < 2 * L; k++ )
+				time[k] = (k < L && first + k < numTaps) ? taps[first + k] * scale : 0.0f;
+			fftForward(s->fft, time, s->hRe + at, s->hIm + at);
+		}
+	}
+	return 0;
+}
+
+
+void firReset( CMFir *fir )
+{
+	int i;
+
+	memset(fir->ring, 0, sizeof(float) * fir->channels * fir->ringLen);
+	for( i = 0; i < fir->numSegments; i++ ) {
+		FirSegment *s = &fir->seg[i];
+		size_t n = (size_t)fir->channels * s->parts * s->bins;
+		memset(s->xRe, 0, sizeof(float) * n);
+		memset(s->xIm, 0, sizeof(float) * n);
+		memset(s->accRe, 0, sizeof(float) * fir->channels * s->bins);
+		memset(s->accIm, 0, sizeof(float) * fir->channels * s->bins);
+		memset(s->out, 0, sizeof(float) * fir->channels * s->size);
+		memset(s->fdlPos, 0, sizeof(s->fdlPos));
+	}
+	fir->samples = 0;
+}
+
+
+void firProcess( CMFir *fir, const float * const *in, float * const *out )
+{
+	int B = fir->blockSize;
+	long mask = fir->ringLen - 1;
+	int ch, i, k;
+
+	for( ch = 0; ch < fir->channels; ch++ ) {
+		float *ring = fir->ring + ch * fir->ringLen;
+		for( k = 0; k < B; k++ )
+			ring[(fir->samples + k) & mask] = in[ch][k];
+	}
+	fir->samples += B;
+
+	// Fan out, work along, and wait for everybody at the barrier
+	atomic_store_explicit(&fir->nextTask, 0, memory_order_relaxed);
+	if( fir->numThreads > 1 ) {
+		pthread_mutex_lock(&fir->lock);
+		fir->pending = fir->numThreads - 1;
+		fir->generation++;
+		pthread_cond_broadcast(&fir->startCond);
+		pthread_mutex_unlock(&fir->lock);
+	}
+	runTasks(fir, 0);
+	if( fir->numThreads > 1 ) {
+		pthread_mutex_lock(&fir->lock);
+		while( fir->pending )
+			pthread_cond_wait(&fir->doneCond, &fir->lock);
+		pthread_mutex_unlock(&fir->lock);
+	}
+
+	for( ch = 0; ch < fir->channels; ch++ ) {
+		float *dst = out[ch];
+		for( i = 0; i < fir->numSegments; i++ ) {
+			FirSegment *s = &fir->seg[i];
+			const float *src = s->out + (long)ch * s->size + (fir->samples + s->size - s->phase[ch]) % s->size;
+			if( i == 0 ) {
+				memcpy(dst, src, sizeof(float) * B);
+			} else {
+				for( k = 0; k < B; k++ )
+					dst[k] += src[k];
+			}
+		}
+	}
+}
+
+
+int firNumSegments( const CMFir *fir )
+{
+	return fir->numSegments;
+}
+
+
+void firSegmentInfo( const CMFir *fir, int segment, int *partitionSize, int *numPartitions, int *firstTap )
+{
+	const FirSegment *s = &fir->seg[segment];
+
+	if( partitionSize )
+		*partitionSize = s->size;
+	if( numPartitions )
+		*numPartitions = s->parts;
+	if( firstTap )
+		*firstTap = s->offset;
+}
@@ -0,0 +1,42 @@
+/*
+ * fir.h - multichannel partitioned-convolution FIR engine (room correction)
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_FIR_H
+#define CM_FIR_H
+
+#define kFirMaxChannels		8
+#define kFirMaxThreads		16
+#define kFirMaxSegments		16
+#define kFirMaxPartition	8192	// largest FFT partition, in taps
+
+typedef struct CMFir CMFir;
+
+// Creates an engine for `channels` planar channels processed in blocks of
+// `blockSize` samples (a power of two), with room for filters of up to
+// `maxTaps` taps. `numThreads` counts the calling thread, so 1 means no
+// worker threads at all. Everything is allocated here; NULL on failure.
+CMFir *firCreate( int channels, int blockSize, int maxTaps, int numThreads );
+void firDestroy( CMFir *fir );
+
+// Loads the impulse response of one channel (numTaps <= maxTaps; shorter
+// filters are zero-padded). Not real-time safe and must not run concurrently
+// with firProcess(). Returns 0 on success.
+int firLoadFilter( CMFir *fir, int channel, const float *taps, int numTaps );
+
+// Clears all signal history, keeping the loaded filters.
+void firReset( CMFir *fir );
+
+// Filters one block of every channel. in and out may be the same buffers.
+// Does not allocate, and the added latency is zero: output sample n depends
+// on input samples up to and including n.
+void firProcess( CMFir *fir, const float * const *in, float * const *out );
+
+// Describes the partition layout chosen by firCreate(), for diagnostics.
+int firNumSegments( const CMFir *fir );
+void firSegmentInfo( const CMFir *fir, int segment, int *partitionSize, int *numPartitions, int *firstTap );
+
+#endif
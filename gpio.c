@@ -0,0 +1,130 @@
+/*
+ * gpio.c - the four CM6206 GPIO pins in REG1
+ *
+ * Every register write is a USB control transfer, and a read is two, so a
+ * read-modify-write per pin change costs three. Here REG1 is read once and
+ * kept, making a change one write, and changes made within the same USB
+ * frame are merged into one write.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "cm6206.h"
+#include "gpio.h"
+
+
+int gpioOpen( CMGPIO *g, CMTransport *t )
+{
+	uint16_t reg1;
+
+	if( readCM6206Register(t, 0x01, &reg1) != 0 ) {
+		fprintf(stderr, "Error: could not read REG1\n");
+		return -1;
+	}
+	gpioAssume(g, t, reg1);
+	return 0;
+}
+
+
+void gpioAssume( CMGPIO *g, CMTransport *t, uint16_t reg1 )
+{
+	g->t = t;
+	g->written = g->wanted = reg1;
+	g->firstChangeUs = 0;
+	g->changes = g->writes = g->failedWrites = 0;
+}
+
+
+static int validPin( int pin )
+{
+	if( pin < 1 || pin > kGPIONumPins ) {
+		fprintf(stderr, "Error: there is no GPIO%d\n", pin);
+		return 0;
+	}
+	return 1;
+}
+
+
+// Applies new GPIO bits to `wanted', flushing if the window has run out
+static int change( CMGPIO *g, uint16_t clear, uint16_t set )
+{
+	uint64_t now = cmMonotonicUs();
+
+	g->changes++;
+	if( g->wanted == g->written )
+		g->firstChangeUs = now;
+	g->wanted = (g->wanted & ~clear) | set;
+	if( now - g->firstChangeUs >= kGPIOCoalesceUs )
+		return gpioFlush(g);
+	return 0;
+}
+
+
+int gpioSet( CMGPIO *g, int pin, int level )
+{
+	if( !validPin(pin) )
+		return -1;
+	return change(g, kGPIOOutputBit(pin), kGPIOEnableBit(pin) | (level ? kGPIOOutputBit(pin) : 0));
+}
+
+
+int gpioRelease( CMGPIO *g, int pin )
+{
+	if( !validPin(pin) )
+		return -1;
+	return change(g, kGPIOEnableBit(pin), 0);
+}
+
+
+int gpioGet( const CMGPIO *g, int pin )
+{
+	if( pin < 1 || pin > kGPIONumPins || !(g->wanted & kGPIOEnableBit(pin)) )
+		return kGPIOInput;
+	return (g->wanted & kGPIOOutputBit(pin)) != 0;
+}
+
+
+int gpioFlush( CMGPIO *g )
+{
+	if( g->wanted == g->written )
+		return 0;
+	g->writes++;
+	if( writeCM6206Registers(g->t, 0x01, g->wanted) != 0 ) {
+		g->failedWrites++;
+		return -1;
+	}
+	g->written = g->wanted;
+	return 0;
+}
+
+
+long gpioPoll( CMGPIO *g )
+{
+	uint64_t age;
+
+	if( g->wanted == g->written )
+		return -1;
+	age = cmMonotonicUs() - g->firstChangeUs;
+	if( age < kGPIOCoalesceUs )
+		return (long)(kGPIOCoalesceUs - age);
+	return gpioFlush(g) == 0 ? -1 : 0;
+}
+
+
+int gpioPulse( CMGPIO *g, int pin, int level, unsigned long us )
+{
+	int before = gpioGet(g, pin);
+
+	if( gpioSet(g, pin, level) || gpioFlush(g) )
+		return -1;
+	usleep(us);
+	if( before == kGPIOInput )
+		gpioRelease(g, pin);
+	else
+		gpioSet(g, pin, before);
+	return gpioFlush(g);
+}
@@ -0,0 +1,64 @@
+/*
+ * gpio.h - the four CM6206 GPIO pins in REG1
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_GPIO_H
+#define CM_GPIO_H
+
+#include <stdint.h>
+
+#include "cmusb.h"
+
+#define kGPIONumPins		4
+#define kGPIOCoalesceUs		1000	// one full-speed USB frame
+#define kGPIOInput			(-1)	// gpioGet() of a pin that isn't driven
+
+// REG1 bit 2n+3 is GPIOn_o, bit 2n+2 GPIOn_OEN (n = 1..4)
+#define kGPIOOutputBit(pin)	((uint16_t)(1u << (2 * (pin) + 3)))
+#define kGPIOEnableBit(pin)	((uint16_t)(1u << (2 * (pin) + 2)))
+#define kGPIOMask			0x0ff0
+
+// REG1 as the device has it and as it should become. Only the GPIO bits of
+// `wanted' are ever changed, so the rest of REG1 is written back as it was.
+typedef struct CMGPIO {
+	CMTransport		*t;
+	uint16_t		written;
+	uint16_t		wanted;
+	uint64_t		firstChangeUs;		// when wanted started to differ from written
+	unsigned long	changes;			// pin changes requested
+	unsigned long	writes;				// REG1 writes sent for them
+	unsigned long	failedWrites;
+} CMGPIO;
+
+// Reads REG1 once; from then on the copy here is trusted, so nothing else may
+// write REG1 while it is in use. Returns non-zero if REG1 can't be read.
+int gpioOpen( CMGPIO *g, CMTransport *t );
+
+// Like gpioOpen() when REG1 is already known, e.g. just after activation
+void gpioAssume( CMGPIO *g, CMTransport *t, uint16_t reg1 );
+
+// Drive a pin (1-4) to level 0 or 1, or stop driving it. The change is held
+// back for up to kGPIOCoalesceUs so that a burst of changes goes out as one
+// write; changes that cancel out send nothing. Call gpioFlush() at the end
+// of a burst. Returns non-zero if a write that was due failed.
+int gpioSet( CMGPIO *g, int pin, int level );
+int gpioRelease( CMGPIO *g, int pin );
+
+// The level a pin is (or is about to be) driven to, or kGPIOInput
+int gpioGet( const CMGPIO *g, int pin );
+
+// Sends the pending changes, if any, in a single write. Returns non-zero on
+// failure; the changes stay pending then.
+int gpioFlush( CMGPIO *g );
+
+// For event loops: flushes if the coalescing window has passed. Returns the
+// microseconds until it will have, or -1 if nothing is pending.
+long gpioPoll( CMGPIO *g );
+
+// Drives a pin to level for the given time, then back to what it was
+int gpioPulse( CMGPIO *g, int pin, int level, unsigned long us );
+
+#endif
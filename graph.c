@@ -0,0 +1,371 @@
+/*
+ * graph.c - parallel execution of a processing graph, with work stealing
+ *
+ * With several devices active, each with its own chain, one render thread runs
+ * out of time at small block sizes, although most of the work is independent:
+ * per device, and often per channel group. Here the independent parts run on a
+ * fixed pool of threads.
+ *
+ * Each thread, the caller included, has a Chase-Lev deque of node indices.
+ * It runs nodes from the bottom of its own deque, and when that is empty
+ * steals from the top of another's. A node that finishes decrements the
+ * dependency counter of each successor, and whoever takes a counter to zero
+ * pushes that successor onto its own deque, where it runs next while its
+ * input is still in cache. A block is done when the counter of nodes left
+ * reaches zero. Nothing in that takes a lock or allocates: the deques hold
+ * at most every node once, so they are sized for that and never grow.
+ *
+ * Between blocks the workers spin on the block counter for a while and then
+ * sleep on a condition variable. Only then does starting a block take the
+ * mutex, to wake them; at a steady block rate it doesn't happen.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "graph.h"
+
+#define kGraphYieldAfter	256		// failed steal rounds before giving up the CPU for a moment
+
+typedef struct GraphNode {
+	CMGraphNodeFunc	func;
+	void			*ctx;
+	int				succ[kGraphMaxEdges];
+	int				numSucc;
+	int				preds;
+} GraphNode;
+
+typedef struct GraphWorker {
+	struct CMGraph	*graph;
+	int				index;
+	unsigned		seed;			// for picking victims
+	pthread_t		thread;
+
+	// The deque: the owner pushes and takes at the bottom, thieves steal at
+	// the top. Indices only grow.
+	_Alignas(64) _Atomic long long	top;
+	_Alignas(64) _Atomic long long	bottom;
+	_Atomic int						items[kGraphMaxNodes];
+
+	// Written by this thread only
+	_Atomic unsigned long			nodes, steals, parks;
+} GraphWorker;
+
+struct CMGraph {
+	int				numThreads;
+	int				numStarted;
+	long			spinNs;
+	int				numNodes;
+	GraphNode		nodes[kGraphMaxNodes];
+	unsigned long	blocks;
+
+	// The block in progress
+	_Atomic int						pending[kGraphMaxNodes];	// predecessors still running
+	int								frames;
+	_Alignas(64) _Atomic int		remaining;					// nodes not done yet
+	_Alignas(64) _Atomic unsigned	generation;					// counts blocks started
+	_Atomic int						parked;
+	_Atomic int						quit;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	GraphWorker		workers[kGraphMaxThreads];
+};
+
+
+static inline void cpuRelax( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__( "yield" );
+#endif
+}
+
+
+static inline void bump( _Atomic unsigned long *counter )
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+
+static long nowNs( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+//================================================================================================
+// The deques (Chase and Lev, with the C11 orderings of Le et al., PPoPP 2013)
+//
+static void dequePush( GraphWorker *w, int node )
+{
+	long long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+
+	atomic_store_explicit(&w->items[b & (kGraphMaxNodes - 1)], node, memory_order_relaxed);
+	atomic_store_explicit(&w->bottom, b + 1, memory_order_release);
+}
+
+
+static int dequeTake( GraphWorker *w )
+{
+	long long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1, t;
+	int node = -1;
+
+	atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&w->top, memory_order_relaxed);
+	if( t <= b ) {
+		node = atomic_load_explicit(&w->items[b & (kGraphMaxNodes - 1)], memory_order_relaxed);
+		if( t == b ) {
+			// The last one: a thief may be after it too
+			if( !atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1, memory_order_seq_cst,
+														 memory_order_relaxed) )
+				node = -1;
+			atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+		}
+	} else
+		atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+	return node;
+}
+
+
+static int dequeSteal( GraphWorker *victim )
+{
+	long long t = atomic_load_explicit(&victim->top, memory_order_acquire), b;
+	int node;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+	if( t >= b )
+		return -1;
+	node = atomic_load_explicit(&victim->items[t & (kGraphMaxNodes - 1)], memory_order_relaxed);
+	if( !atomic_compare_exchange_strong_explicit(&victim->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed) )
+		return -1;
+	return node;
+}
+
+
+//================================================================================================
+// Running a block
+//
+static void runNode( CMGraph *g, GraphWorker *w, int n )
+{
+	GraphNode *node = &g->nodes[n];
+	int i;
+
+	node->func(node->ctx, g->frames, w->index);
+	bump(&w->nodes);
+	for( i = 0; i < node->numSucc; i++ )
+		if( atomic_fetch_sub_explicit(&g->pending[node->succ[i]], 1, memory_order_acq_rel) == 1 )
+			dequePush(w, node->succ[i]);
+	atomic_fetch_sub_explicit(&g->remaining, 1, memory_order_release);
+}
+
+
+static int stealAny( CMGraph *g, GraphWorker *w )
+{
+	int i, first, node;
+
+	if( g->numThreads < 2 )
+		return -1;
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	first = (int)(w->seed % g->numThreads);
+	for( i = 0; i < g->numThreads; i++ ) {
+		GraphWorker *victim = &g->workers[(first + i) % g->numThreads];
+
+		if( victim == w )
+			continue;
+		if( (node = dequeSteal(victim)) >= 0 ) {
+			bump(&w->steals);
+			return node;
+		}
+	}
+	return -1;
+}
+
+
+// Runs and steals nodes until the block is done
+static void work( CMGraph *g, GraphWorker *w )
+{
+	int idle = 0;
+
+	while( atomic_load_explicit(&g->remaining, memory_order_acquire) > 0 ) {
+		int node = dequeTake(w);
+
+		if( node < 0 )
+			node = stealAny(g, w);
+		if( node >= 0 ) {
+			runNode(g, w, node);
+			idle = 0;
+		} else if( ++idle % kGraphYieldAfter == 0 )
+			sched_yield();		// the thread that has our input may be waiting for this CPU
+		else
+			cpuRelax();
+	}
+}
+
+
+static void *workerMain( void *arg )
+{
+	GraphWorker *w = arg;
+	CMGraph *g = w->graph;
+	unsigned seen = atomic_load(&g->generation);
+
+	for( ;; ) {
+		long spinUntil = nowNs() + g->spinNs;
+		int spins = 0;
+
+		// Wait for the next block: spin first, then sleep
+		while( atomic_load_explicit(&g->generation, memory_order_acquire) == seen ) {
+			cpuRelax();
+			if( ++spins % 64 != 0 || nowNs() < spinUntil )
+				continue;
+			pthread_mutex_lock(&g->lock);
+			atomic_fetch_add(&g->parked, 1);
+			bump(&w->parks);
+			while( atomic_load(&g->generation) == seen )
+				pthread_cond_wait(&g->wake, &g->lock);
+			atomic_fetch_sub(&g->parked, 1);
+			pthread_mutex_unlock(&g->lock);
+		}
+		seen = atomic_load_explicit(&g->generation, memory_order_acquire);
+		if( atomic_load(&g->quit) )
+			break;
+		work(g, w);
+	}
+	return NULL;
+}
+
+
+void graphRun( CMGraph *graph, int frames )
+{
+	GraphWorker *self = &graph->workers[0];
+	int i;
+
+	if( graph->numNodes == 0 )
+		return;
+	graph->frames = frames;
+	for( i = 0; i < graph->numNodes; i++ )
+		atomic_store_explicit(&graph->pending[i], graph->nodes[i].preds, memory_order_relaxed);
+	atomic_store_explicit(&graph->remaining, graph->numNodes, memory_order_relaxed);
+	for( i = 0; i < graph->numNodes; i++ )
+		if( graph->nodes[i].preds == 0 )
+			dequePush(self, i);
+
+	atomic_fetch_add(&graph->generation, 1);
+	if( atomic_load(&graph->parked) > 0 ) {
+		pthread_mutex_lock(&graph->lock);
+		pthread_cond_broadcast(&graph->wake);
+		pthread_mutex_unlock(&graph->lock);
+	}
+	work(graph, self);
+	graph->blocks++;
+}
+
+
+//================================================================================================
+//
+CMGraph *graphCreate( int numThreads, int spinUs )
+{
+	CMGraph *graph;
+	int i;
+
+	if( numThreads < 1 || numThreads > kGraphMaxThreads || spinUs < 0 )
+		return NULL;
+	graph = calloc(1, sizeof(CMGraph));
+	if( graph == NULL )
+		return NULL;
+	graph->numThreads = numThreads;
+	graph->spinNs = spinUs * 1000L;
+	pthread_mutex_init(&graph->lock, NULL);
+	pthread_cond_init(&graph->wake, NULL);
+	for( i = 0; i < numThreads; i++ ) {
+		graph->workers[i].graph = graph;
+		graph->workers[i].index = i;
+		graph->workers[i].seed = 0x9e3779b9u * (i + 1);
+	}
+	for( i = 1; i < numThreads; i++ ) {
+		if( pthread_create(&graph->workers[i].thread, NULL, workerMain, &graph->workers[i]) ) {
+			graphDestroy(graph);
+			return NULL;
+		}
+		graph->numStarted = i;
+	}
+	return graph;
+}
+
+
+void graphDestroy( CMGraph *graph )
+{
+	int i;
+
+	if( graph == NULL )
+		return;
+	pthread_mutex_lock(&graph->lock);
+	atomic_store(&graph->quit, 1);
+	atomic_fetch_add(&graph->generation, 1);
+	pthread_cond_broadcast(&graph->wake);
+	pthread_mutex_unlock(&graph->lock);
+	for( i = 1; i <= graph->numStarted; i++ )
+		pthread_join(graph->workers[i].thread, NULL);
+	pthread_mutex_destroy(&graph->lock);
+	pthread_cond_destroy(&graph->wake);
+	free(graph);
+}
+
+
+int graphAddNode( CMGraph *graph, CMGraphNodeFunc func, void *ctx )
+{
+	GraphNode *node;
+
+	if( graph->numNodes == kGraphMaxNodes || func == NULL )
+		return -1;
+	node = &graph->nodes[graph->numNodes];
+	memset(node, 0, sizeof(GraphNode));
+	node->func = func;
+	node->ctx = ctx;
+	return graph->numNodes++;
+}
+
+
+int graphAddEdge( CMGraph *graph, int from, int to )
+{
+	GraphNode *node;
+
+	if( from < 0 || to <= from || to >= graph->numNodes )
+		return -1;
+	node = &graph->nodes[from];
+	if( node->numSucc == kGraphMaxEdges )
+		return -1;
+	node->succ[node->numSucc++] = to;
+	graph->nodes[to].preds++;
+	return 0;
+}
+
+
+void graphStats( const CMGraph *graph, CMGraphStats *stats )
+{
+	int i;
+
+	memset(stats, 0, sizeof(CMGraphStats));
+	stats->blocks = graph->blocks;
+	for( i = 0; i < graph->numThreads; i++ ) {
+		GraphWorker *w = (GraphWorker *)&graph->workers[i];
+
+		stats->nodes[i] = atomic_load_explicit(&w->nodes, memory_order_relaxed);
+		stats->steals += atomic_load_explicit(&w->steals, memory_order_relaxed);
+		stats->parks += atomic_load_explicit(&w->parks, memory_order_relaxed);
+	}
+}
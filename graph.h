@@ -0,0 +1,49 @@
+/*
+ * graph.h - parallel execution of a processing graph, with work stealing
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_GRAPH_H
+#define CM_GRAPH_H
+
+#define kGraphMaxNodes		256
+#define kGraphMaxEdges		8		// successors per node
+#define kGraphMaxThreads	16
+
+// The work of a node for one block. worker is 0 to numThreads - 1, for
+// per-thread scratch.
+typedef void (*CMGraphNodeFunc)( void *ctx, int frames, int worker );
+
+typedef struct CMGraphStats {
+	unsigned long	blocks;
+	unsigned long	nodes[kGraphMaxThreads];	// nodes run, per thread
+	unsigned long	steals;
+	unsigned long	parks;						// times a worker went to sleep
+} CMGraphStats;
+
+typedef struct CMGraph CMGraph;
+
+// `numThreads' counts the calling thread, so 1 means no worker threads. A
+// worker that finds no block to do spins for spinUs before it sleeps; the
+// render thread only takes a lock to wake one that sleeps, so that should be
+// longer than a block. NULL on failure.
+CMGraph *graphCreate( int numThreads, int spinUs );
+void graphDestroy( CMGraph *graph );
+
+// Builds the graph: nodes, and edges that make `to' wait for `from'. Edges
+// must point from an earlier node to a later one, which rules out cycles.
+// Return the node index / 0, or -1 if the graph is full or the edge invalid.
+// Not while graphRun() runs.
+int graphAddNode( CMGraph *graph, CMGraphNodeFunc func, void *ctx );
+int graphAddEdge( CMGraph *graph, int from, int to );
+
+// Runs every node once, each after the nodes it waits for, on the calling
+// thread and the workers, and returns when all are done. Takes no lock and
+// allocates nothing while the workers are awake.
+void graphRun( CMGraph *graph, int frames );
+
+void graphStats( const CMGraph *graph, CMGraphStats *stats );
+
+#endif
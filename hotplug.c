@@ -0,0 +1,165 @@
+/*
+ * hotplug.c - Linux hot-plug events from the kernel's uevent netlink socket
+ *
+ * Listening on the netlink socket instead of polling the bus means a CM6206
+ * is seen within microseconds of the kernel adding it, and nothing runs
+ * while nothing is plugged in. libudev isn't needed for this: the kernel's
+ * own messages carry everything used here.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "cm6206.h"
+#include "hotplug.h"
+
+#define kKernelEventGroup	1	// group 2 carries the same events re-sent by udev
+
+
+int hotplugOpen( void )
+{
+	struct sockaddr_nl addr;
+	int fd, size = 1 << 20;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+	if( fd < 0 ) {
+		fprintf(stderr, "Error: could not create uevent socket: %s\n", strerror(errno));
+		return -1;
+	}
+	// A hub full of devices sends a burst of events; don't lose ours in it
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = kKernelEventGroup;
+	if( bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ) {
+		fprintf(stderr, "Error: could not listen for uevents: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+int hotplugReceive( int fd, char *buf, size_t size )
+{
+	struct sockaddr_nl addr;
+	struct iovec iov = { buf, size - 1 };
+	struct msghdr msg;
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	len = recvmsg(fd, &msg, 0);
+	if( len < 0 ) {
+		if( errno == ENOBUFS )
+			return kHotplugOverflow;
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	// Only the kernel (port 0) may tell us about devices. Sockets without an
+	// address (a socketpair in the replay tool) are private to this process.
+	if( msg.msg_namelen >= sizeof(addr) && addr.nl_family == AF_NETLINK && addr.nl_pid != 0 )
+		return 0;
+	buf[len] = '\0';
+	return (int)len;
+}
+
+
+static void copyValue( char *dst, size_t size, const char *value )
+{
+	size_t n = strlen(value);
+
+	if( n >= size )
+		n = size - 1;
+	memcpy(dst, value, n);
+	dst[n] = '\0';
+}
+
+
+int hotplugParse( const char *buf, size_t len, CMUEvent *ev )
+{
+	const char *p = buf, *end = buf + len;
+	const char *at;
+
+	memset(ev, 0, sizeof(CMUEvent));
+	// udev's own messages start with "libudev"; kernel ones with action@devpath
+	at = memchr(buf, '@', strnlen(buf, len));
+	if( at == NULL || at == buf )
+		return -1;
+
+	p += strnlen(p, len) + 1;
+	while( p < end ) {
+		size_t n = strnlen(p, end - p);
+		const char *eq = memchr(p, '=', n);
+
+		if( eq ) {
+			size_t keyLen = eq - p;
+			const char *value = eq + 1;
+
+#define KEY(k)	(keyLen == sizeof(k) - 1 && memcmp(p, k, keyLen) == 0)
+			if( KEY("ACTION") )
+				copyValue(ev->action, sizeof(ev->action), value);
+			else if( KEY("DEVPATH") )
+				copyValue(ev->devpath, sizeof(ev->devpath), value);
+			else if( KEY("SUBSYSTEM") )
+				copyValue(ev->subsystem, sizeof(ev->subsystem), value);
+			else if( KEY("DEVTYPE") )
+				copyValue(ev->devtype, sizeof(ev->devtype), value);
+			else if( KEY("DEVNAME") )
+				copyValue(ev->devname, sizeof(ev->devname), value);
+			else if( KEY("DRIVER") )
+				copyValue(ev->driver, sizeof(ev->driver), value);
+			else if( KEY("PRODUCT") ) {
+				unsigned vendor, product;
+				if( sscanf(value, "%x/%x/", &vendor, &product) == 2 ) {
+					ev->vendor = vendor;
+					ev->product = product;
+				}
+			}
+			else if( KEY("BUSNUM") )
+				ev->busnum = atoi(value);
+			else if( KEY("DEVNUM") )
+				ev->devnum = atoi(value);
+			else if( KEY("SEQNUM") )
+				ev->seqnum = strtoull(value, NULL, 10);
+#undef KEY
+		}
+		p += n + 1;
+	}
+	return ev->action[0] && ev->subsystem[0] ? 0 : -1;
+}
+
+
+CMHotplugEvent hotplugClassify( const CMUEvent *ev )
+{
+	if( strcmp(ev->subsystem, "usb") != 0 || cmFindDeviceModel(ev->vendor, ev->product) == NULL )
+		return kHotplugIgnore;
+
+	if( strcmp(ev->devtype, "usb_device") == 0 ) {
+		if( strcmp(ev->action, "add") == 0 && ev->busnum > 0 && ev->devnum > 0 )
+			return kHotplugDeviceAdded;
+		if( strcmp(ev->action, "remove") == 0 )
+			return kHotplugDeviceRemoved;
+	}
+	// snd-usb-audio binds the audio control interface after running its boot
+	// quirk for this chip, which writes its own register values; activating
+	// again after it means ours are the ones that stick.
+	else if( strcmp(ev->devtype, "usb_interface") == 0 && strcmp(ev->action, "bind") == 0 &&
+	         strcmp(ev->driver, "snd-usb-audio") == 0 ) {
+		size_t n = strlen(ev->devpath);
+		if( n > 4 && strcmp(ev->devpath + n - 4, ":1.0") == 0 )
+			return kHotplugAudioBound;
+	}
+	return kHotplugIgnore;
+}
@@ -0,0 +1,58 @@
+/*
+ * hotplug.h - Linux hot-plug events from the kernel's uevent netlink socket
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_HOTPLUG_H
+#define CM_HOTPLUG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define kUEventMaxSize		8192
+
+// The parts of a uevent that matter here. Strings are empty when absent.
+typedef struct CMUEvent {
+	char		action[16];			// add, remove, bind, unbind, change...
+	char		devpath[256];		// below /sys
+	char		subsystem[32];
+	char		devtype[32];		// usb_device or usb_interface
+	char		devname[64];		// below /dev, usb_device events only
+	char		driver[32];			// bind events only
+	uint16_t	vendor, product;	// from PRODUCT=
+	int			busnum, devnum;		// usb_device events only, 0 otherwise
+	uint64_t	seqnum;
+} CMUEvent;
+
+typedef enum {
+	kHotplugIgnore = 0,
+	kHotplugDeviceAdded,		// a supported device appeared; its device node exists
+	kHotplugAudioBound,			// snd-usb-audio bound one, after running its own boot quirk
+	kHotplugDeviceRemoved
+} CMHotplugEvent;
+
+// Opens a non-blocking netlink socket receiving kernel uevents. These come
+// straight from the kernel, before udev has run its rules, and the device
+// node already exists by then (devtmpfs creates it first). Returns the file
+// descriptor, or -1 with a message on stderr.
+int hotplugOpen( void );
+
+#define kHotplugOverflow	(-2)
+
+// Receives one message from fd into buf. Netlink messages not sent by the
+// kernel are dropped. Returns the length, 0 if nothing usable was pending,
+// kHotplugOverflow if the socket's buffer overran and events were lost (the
+// caller should look at the devices afresh), or -1 on error.
+int hotplugReceive( int fd, char *buf, size_t size );
+
+// Parses a kernel uevent ("action@devpath" followed by NUL-separated
+// KEY=VALUE pairs). Returns 0 on success, -1 if buf isn't a kernel uevent.
+int hotplugParse( const char *buf, size_t len, CMUEvent *ev );
+
+// Tells what, if anything, an event means for activation. Devices that are
+// not in the device table (cm6206.h) are ignored.
+CMHotplugEvent hotplugClassify( const CMUEvent *ev );
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ * ingest.c - Linux shared-memory audio ingest: clients hand blocks to the daemon
+ *
+ * Each ring has one producer (its client) and one consumer (the daemon), so
+ * the write and read indices each have a single writer and need no locks.
+ * They run freely and are masked on use; the producer's and the consumer's
+ * fields sit on separate cache lines.
+ *
+ * Sleeping follows the usual event-count pattern, which makes the wakeups
+ * cost nothing while both sides keep up. A side that finds nothing to do
+ * reads the futex word, raises its waiting flag, checks once more and only
+ * then sleeps on the word. The other side publishes its index, and only if
+ * the flag is up clears it, bumps the word and wakes. A fence between
+ * storing and checking on both sides keeps a publication from being missed.
+ *
+ * The memfd is sealed against resizing, so a client can't truncate it under
+ * the daemon. Everything else in it can be written by any client, so the
+ * daemon keeps its own copy of the layout and addresses the memory only with
+ * that: a broken client can garble its own audio, not make the daemon read
+ * outside the mapping.
+ *
+ * A client that exits without detaching leaves its ring claimed. Each ring
+ * records its owner's pid, and an attaching client that finds no free ring
+ * takes over one whose owner no longer exists. That assumes the clients
+ * share a pid namespace, as they do with the daemon that hands them the fd.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ingest.h"
+
+#define kIngestMagic		0x434d4947		// 'CMIG'
+#define kIngestVersion		2
+
+enum { kRingFree = 0, kRingClaimed, kRingClosed };
+
+typedef struct IngestRing {
+	_Alignas(64) _Atomic uint32_t	owner;
+	_Atomic int32_t					pid;		// of the client, once it has claimed the ring
+	// The producer's line
+	_Alignas(64) _Atomic uint32_t	write;
+	_Atomic uint32_t				producerWaiting;
+	_Atomic uint32_t				space;		// futex word, bumped to wake the producer
+	_Atomic uint64_t				blocks, waits, wakes;
+	// The consumer's line
+	_Alignas(64) _Atomic uint32_t	read;
+} IngestRing;
+
+typedef struct IngestHeader {
+	uint32_t						magic, version;
+	uint32_t						channels, frames, blocks, blockBytes;
+	uint64_t						size;
+	_Alignas(64) _Atomic uint32_t	consumerWaiting;
+	_Atomic uint32_t				doorbell;	// futex word, bumped to wake the consumer
+	IngestRing						rings[kIngestMaxClients];
+} IngestHeader;
+
+struct CMIngest {
+	int				fd;
+	IngestHeader	*header;
+	size_t			size;						// the layout, as created: never read back
+	uint32_t		frames, blocks, blockBytes;
+	uint32_t		read[kIngestMaxClients];	// our copies of the read indices
+	int				next;						// ring to look at first
+	CMIngestStats	stats;
+};
+
+struct CMIngestClient {
+	IngestHeader	*header;
+	IngestRing		*ring;
+	uint8_t			*data;						// this ring's blocks
+	size_t			size;						// the layout, as checked on attaching
+	uint32_t		channels, frames, blocks, blockBytes;
+	uint32_t		write;
+	uint32_t		sequence;
+};
+
+
+static uint8_t *ringData( IngestHeader *h, uint32_t blocks, uint32_t blockBytes, int r )
+{
+	return (uint8_t *)h + sizeof(IngestHeader) + (size_t)r * blocks * blockBytes;
+}
+
+
+static int64_t nowNs( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// Sleeps while *word is value, until deadlineNs (< 0: no deadline). Returns
+// -1 once the deadline has passed.
+static int futexWait( _Atomic uint32_t *word, uint32_t value, int64_t deadlineNs )
+{
+	struct timespec ts, *timeout = NULL;
+
+	if( deadlineNs >= 0 ) {
+		int64_t left = deadlineNs - nowNs();
+		if( left <= 0 )
+			return -1;
+		ts.tv_sec = left / 1000000000;
+		ts.tv_nsec = left % 1000000000;
+		timeout = &ts;
+	}
+	// Not FUTEX_PRIVATE: the word is shared between processes
+	syscall(SYS_futex, word, FUTEX_WAIT, value, timeout, NULL, 0);
+	return 0;
+}
+
+
+// Wakes the other side if it announced that it is about to sleep. Returns 1
+// if it did.
+static int futexWakeIfWaiting( _Atomic uint32_t *waiting, _Atomic uint32_t *word )
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if( !atomic_load_explicit(waiting, memory_order_relaxed) || !atomic_exchange(waiting, 0) )
+		return 0;
+	atomic_fetch_add(word, 1);
+	syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+	return 1;
+}
+
+
+// Counters with a single writer need no locked instruction
+static inline void bump( _Atomic uint64_t *counter )
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+
+static int64_t deadlineFor( int timeoutMs )
+{
+	return timeoutMs < 0 ? -1 : nowNs() + timeoutMs * 1000000LL;
+}
+
+
+//================================================================================================
+// The daemon's side
+//
+CMIngest *ingestCreate( int channels, int frames, int blocks )
+{
+	CMIngest *ingest;
+	IngestHeader *h;
+	size_t blockBytes, size;
+	int n, r;
+
+	if( channels < 1 || channels > kIngestMaxChannels || frames < 1 || blocks < 2 || blocks > kIngestMaxBlocks ) {
+		fprintf(stderr, "Error: bad ingest ring layout (%d channels, %d frames, %d blocks)\n", channels, frames, blocks);
+		return NULL;
+	}
+	for( n = 2; n < blocks; n <<= 1 )
+		;
+	blockBytes = (sizeof(CMIngestBlock) + sizeof(float) * channels * frames + 63) & ~(size_t)63;
+	size = sizeof(IngestHeader) + (size_t)kIngestMaxClients * n * blockBytes;
+
+	ingest = calloc(1, sizeof(CMIngest));
+	if( ingest == NULL )
+		return NULL;
+	ingest->fd = memfd_create("cm6206-ingest", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if( ingest->fd < 0 || ftruncate(ingest->fd, (off_t)size) != 0 ||
+		fcntl(ingest->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ) {
+		fprintf(stderr, "Error: could not create the ingest memory: %s\n", strerror(errno));
+		ingestDestroy(ingest);
+		return NULL;
+	}
+	h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ingest->fd, 0);
+	if( h == MAP_FAILED ) {
+		fprintf(stderr, "Error: could not map the ingest memory: %s\n", strerror(errno));
+		ingestDestroy(ingest);
+		return NULL;
+	}
+	// ftruncate() zeroed it: every ring is free and empty
+	h->version = kIngestVersion;
+	h->channels = channels;
+	h->frames = frames;
+	h->blocks = n;
+	h->blockBytes = (uint32_t)blockBytes;
+	h->size = size;
+	for( r = 0; r < kIngestMaxClients; r++ ) {
+		uint8_t *data = ringData(h, n, (uint32_t)blockBytes, r);
+		int i;
+		for( i = 0; i < n; i++ )
+			((CMIngestBlock *)(data + (size_t)i * blockBytes))->stride = frames;
+	}
+	atomic_thread_fence(memory_order_release);
+	h->magic = kIngestMagic;
+	ingest->header = h;
+	ingest->size = size;
+	ingest->frames = frames;
+	ingest->blocks = n;
+	ingest->blockBytes = (uint32_t)blockBytes;
+	return ingest;
+}
+
+
+void ingestDestroy( CMIngest *ingest )
+{
+	if( ingest == NULL )
+		return;
+	if( ingest->header != NULL )
+		munmap(ingest->header, ingest->size);
+	if( ingest->fd >= 0 )
+		close(ingest->fd);
+	free(ingest);
+}
+
+
+int ingestFd( const CMIngest *ingest )
+{
+	return ingest->fd;
+}
+
+
+// The next block of any ring, or NULL. Rings whose client has gone are freed
+// once they are drained.
+static CMIngestBlock *ingestScan( CMIngest *ingest, int *client )
+{
+	IngestHeader *h = ingest->header;
+	int i;
+
+	for( i = 0; i < kIngestMaxClients; i++ ) {
+		int r = (ingest->next + i) % kIngestMaxClients;
+		IngestRing *ring = &h->rings[r];
+		uint32_t owner = atomic_load_explicit(&ring->owner, memory_order_acquire), w;
+
+		if( owner == kRingFree )
+			continue;
+		w = atomic_load_explicit(&ring->write, memory_order_acquire);
+		if( w != ingest->read[r] ) {
+			*client = r;
+			ingest->next = (r + 1) % kIngestMaxClients;
+			return (CMIngestBlock *)(ringData(h, ingest->blocks, ingest->blockBytes, r) +
+									 (size_t)(ingest->read[r] & (ingest->blocks - 1)) * ingest->blockBytes);
+		}
+		if( owner == kRingClosed ) {
+			ingest->read[r] = 0;
+			atomic_store_explicit(&ring->read, 0, memory_order_relaxed);
+			atomic_store_explicit(&ring->write, 0, memory_order_relaxed);
+			atomic_store_explicit(&ring->producerWaiting, 0, memory_order_relaxed);
+			atomic_store_explicit(&ring->pid, 0, memory_order_relaxed);
+			atomic_store_explicit(&ring->owner, kRingFree, memory_order_release);
+		}
+	}
+	return NULL;
+}
+
+
+CMIngestBlock *ingestNext( CMIngest *ingest, int *client, int *frames, int timeoutMs )
+{
+	IngestHeader *h = ingest->header;
+	int64_t deadline = deadlineFor(timeoutMs);
+	CMIngestBlock *block;
+	uint32_t n;
+
+	for( ;; ) {
+		uint32_t seq;
+
+		if( (block = ingestScan(ingest, client)) != NULL )
+			break;
+		if( timeoutMs == 0 )
+			return NULL;
+		seq = atomic_load(&h->doorbell);
+		atomic_store(&h->consumerWaiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if( (block = ingestScan(ingest, client)) != NULL ) {
+			atomic_store(&h->consumerWaiting, 0);
+			break;
+		}
+		ingest->stats.waits++;
+		if( futexWait(&h->doorbell, seq, deadline) != 0 ) {
+			atomic_store(&h->consumerWaiting, 0);
+			return NULL;
+		}
+	}
+	// Read once: the client may change it while we work
+	n = *(volatile uint32_t *)&block->frames;
+	*frames = (int)(n > ingest->frames ? ingest->frames : n);
+	ingest->stats.blocks++;
+	return block;
+}
+
+
+float *ingestSamples( const CMIngest *ingest, CMIngestBlock *block, int c )
+{
+	return block->data + (size_t)c * ingest->frames;
+}
+
+
+void ingestRelease( CMIngest *ingest, int client )
+{
+	IngestRing *ring = &ingest->header->rings[client];
+
+	atomic_store_explicit(&ring->read, ++ingest->read[client], memory_order_release);
+	ingest->stats.wakes += futexWakeIfWaiting(&ring->producerWaiting, &ring->space);
+}
+
+
+void ingestStats( const CMIngest *ingest, CMIngestStats stats[2] )
+{
+	int r;
+
+	memset(&stats[0], 0, sizeof(CMIngestStats));
+	for( r = 0; r < kIngestMaxClients; r++ ) {
+		IngestRing *ring = &ingest->header->rings[r];
+		stats[0].blocks += atomic_load_explicit(&ring->blocks, memory_order_relaxed);
+		stats[0].waits += atomic_load_explicit(&ring->waits, memory_order_relaxed);
+		stats[0].wakes += atomic_load_explicit(&ring->wakes, memory_order_relaxed);
+	}
+	stats[1] = ingest->stats;
+}
+
+
+//================================================================================================
+// A client's side
+//
+static int ownerGone( int32_t pid )
+{
+	return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+
+// A free ring, or failing that one whose client died holding it. A ring taken
+// over keeps its indices: the daemon still consumes what the dead client
+// published, and the new one carries on after it.
+static int claimRing( IngestHeader *h )
+{
+	int32_t self = (int32_t)getpid();
+	int r;
+
+	for( r = 0; r < kIngestMaxClients; r++ ) {
+		uint32_t expected = kRingFree;
+		if( atomic_compare_exchange_strong(&h->rings[r].owner, &expected, kRingClaimed) ) {
+			atomic_store(&h->rings[r].pid, self);
+			return r;
+		}
+	}
+	for( r = 0; r < kIngestMaxClients; r++ ) {
+		IngestRing *ring = &h->rings[r];
+		int32_t pid = atomic_load(&ring->pid);
+
+		if( atomic_load(&ring->owner) == kRingClaimed && ownerGone(pid) &&
+			atomic_compare_exchange_strong(&ring->pid, &pid, self) ) {
+			atomic_store(&ring->producerWaiting, 0);
+			return r;
+		}
+	}
+	return -1;
+}
+
+
+CMIngestClient *ingestAttach( int fd )
+{
+	CMIngestClient *client;
+	IngestHeader *h;
+	struct stat st;
+	int r;
+
+	if( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IngestHeader) )
+		return NULL;
+	h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	client = h != MAP_FAILED ? calloc(1, sizeof(CMIngestClient)) : NULL;
+	if( client == NULL ) {
+		if( h != MAP_FAILED )
+			munmap(h, st.st_size);
+		return NULL;
+	}
+	// Copied before checking, so another client can't change it in between
+	client->header = h;
+	client->size = (size_t)st.st_size;
+	client->channels = h->channels;
+	client->frames = h->frames;
+	client->blocks = h->blocks;
+	client->blockBytes = h->blockBytes;
+	if( h->magic != kIngestMagic || h->version != kIngestVersion ||
+		client->channels < 1 || client->channels > kIngestMaxChannels || client->frames < 1 ||
+		client->blocks < 2 || client->blocks > kIngestMaxBlocks || (client->blocks & (client->blocks - 1)) ||
+		client->blockBytes < sizeof(CMIngestBlock) + (uint64_t)sizeof(float) * client->channels * client->frames ||
+		client->size != sizeof(IngestHeader) + (uint64_t)kIngestMaxClients * client->blocks * client->blockBytes ||
+		(r = claimRing(h)) < 0 ) {
+		munmap(h, st.st_size);
+		free(client);
+		return NULL;
+	}
+	client->ring = &h->rings[r];
+	client->data = ringData(h, client->blocks, client->blockBytes, r);
+	client->write = atomic_load(&client->ring->write);
+	return client;
+}
+
+
+void ingestDetach( CMIngestClient *client )
+{
+	IngestHeader *h;
+
+	if( client == NULL )
+		return;
+	h = client->header;
+	// The daemon drains what was published, then frees the ring
+	atomic_store_explicit(&client->ring->owner, kRingClosed, memory_order_release);
+	futexWakeIfWaiting(&h->consumerWaiting, &h->doorbell);
+	munmap(h, client->size);
+	free(client);
+}
+
+
+int ingestChannels( const CMIngestClient *client )
+{
+	return (int)client->channels;
+}
+
+
+int ingestFrames( const CMIngestClient *client )
+{
+	return (int)client->frames;
+}
+
+
+CMIngestBlock *ingestAcquire( CMIngestClient *client, int timeoutMs )
+{
+	IngestRing *ring = client->ring;
+	int64_t deadline = deadlineFor(timeoutMs);
+
+	for( ;; ) {
+		uint32_t seq;
+
+		if( client->write - atomic_load_explicit(&ring->read, memory_order_acquire) < client->blocks )
+			break;
+		if( timeoutMs == 0 )
+			return NULL;
+		seq = atomic_load(&ring->space);
+		atomic_store(&ring->producerWaiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if( client->write - atomic_load_explicit(&ring->read, memory_order_acquire) < client->blocks ) {
+			atomic_store(&ring->producerWaiting, 0);
+			break;
+		}
+		bump(&ring->waits);
+		if( futexWait(&ring->space, seq, deadline) != 0 ) {
+			atomic_store(&ring->producerWaiting, 0);
+			return NULL;
+		}
+	}
+	return (CMIngestBlock *)(client->data + (size_t)(client->write & (client->blocks - 1)) * client->blockBytes);
+}
+
+
+void ingestPublish( CMIngestClient *client, int frames )
+{
+	IngestHeader *h = client->header;
+	IngestRing *ring = client->ring;
+	CMIngestBlock *block = (CMIngestBlock *)(client->data + (size_t)(client->write & (client->blocks - 1)) * client->blockBytes);
+
+	block->frames = frames < 0 ? 0 : (frames > (int)client->frames ? client->frames : (uint32_t)frames);
+	block->stride = client->frames;
+	block->sequence = client->sequence++;
+	block->timeNs = (uint64_t)nowNs();
+	atomic_store_explicit(&ring->write, ++client->write, memory_order_release);
+	bump(&ring->blocks);
+	if( futexWakeIfWaiting(&h->consumerWaiting, &h->doorbell) )
+		bump(&ring->wakes);
+}
@@ -0,0 +1,89 @@
+/*
+ * ingest.h - Linux shared-memory audio ingest: clients hand blocks to the daemon
+ *
+ * The daemon creates a memfd holding one ring of fixed-size blocks per client
+ * and passes its descriptor on (over a Unix socket or by inheritance). A
+ * client maps it, claims a ring, writes planar float straight into the next
+ * free block and publishes it; the daemon processes the block where it lies
+ * and releases it. Indices are published with atomics, so in steady state
+ * neither side copies or makes a system call. Futexes in the shared memory
+ * wake the daemon when a ring goes from empty to non-empty while it sleeps,
+ * and a client when its full ring gets space.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_INGEST_H
+#define CM_INGEST_H
+
+#include <stdint.h>
+
+#define kIngestMaxClients	8
+#define kIngestMaxChannels	8
+#define kIngestMaxBlocks	256		// per ring, a power of 2
+
+// A block in shared memory. The samples follow the header, channel by
+// channel, `stride' floats apart. Clients can write all of it at any time, so
+// the daemon reads none of it for addressing: it takes the frame count from
+// ingestNext() and the channels from ingestSamples().
+typedef struct CMIngestBlock {
+	uint32_t	frames;			// valid frames, up to the ring's block size
+	uint32_t	stride;
+	uint64_t	timeNs;			// CLOCK_MONOTONIC at publication, filled in by ingestPublish()
+	uint32_t	sequence;		// per client, counting from 0
+	uint32_t	reserved[11];	// pads the header to 64 bytes
+	float		data[];
+} CMIngestBlock;
+
+// A client's view of channel c
+static inline float *ingestChannel( CMIngestBlock *block, int c )
+{
+	return block->data + (size_t)c * block->stride;
+}
+
+typedef struct CMIngestStats {
+	unsigned long	blocks;				// published (clients) or consumed (daemon)
+	unsigned long	waits;				// futex waits: on a full ring, or on all rings empty
+	unsigned long	wakes;				// futex wakes sent to the other side
+} CMIngestStats;
+
+typedef struct CMIngest CMIngest;
+typedef struct CMIngestClient CMIngestClient;
+
+// The daemon's side. blocks is rounded up to a power of 2. Returns NULL with a
+// message on stderr on bad arguments or failure.
+CMIngest *ingestCreate( int channels, int frames, int blocks );
+void ingestDestroy( CMIngest *ingest );
+int ingestFd( const CMIngest *ingest );
+
+// The next published block of any client, taking the clients in turn, or NULL
+// if there is none within timeoutMs (0: don't wait, -1: wait indefinitely).
+// *client is set to the client it came from and *frames to the valid frames,
+// read once and limited to the ring's block size. Each block must be released
+// before the next call.
+CMIngestBlock *ingestNext( CMIngest *ingest, int *client, int *frames, int timeoutMs );
+void ingestRelease( CMIngest *ingest, int client );
+
+// The daemon's view of channel c of a block from ingestNext(), laid out by
+// the daemon's own copy of the ring geometry whatever the block says.
+float *ingestSamples( const CMIngest *ingest, CMIngestBlock *block, int c );
+
+// Sums the daemon's counters and those of every client ring into stats[0]
+// (clients) and stats[1] (daemon).
+void ingestStats( const CMIngest *ingest, CMIngestStats stats[2] );
+
+// A client's side: maps the descriptor and claims a free ring, or one whose
+// client exited without detaching. Returns NULL if the memory isn't a ring
+// set or every ring is taken by a live process.
+CMIngestClient *ingestAttach( int fd );
+void ingestDetach( CMIngestClient *client );
+int ingestChannels( const CMIngestClient *client );
+int ingestFrames( const CMIngestClient *client );
+
+// The next free block, to be filled in and then published, or NULL if the
+// ring stays full for timeoutMs (0: don't wait, -1: wait indefinitely).
+CMIngestBlock *ingestAcquire( CMIngestClient *client, int timeoutMs );
+void ingestPublish( CMIngestClient *client, int frames );
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * limiter.c - linked look-ahead brickwall limiter with "night mode" compressor
+ *
+ * Signal flow, per block:
+ *   1. The compressor follows the loudest channel with an attack/release
+ *      envelope. Every kCompHop frames it turns the envelope into a gain
+ *      (plus makeup) with one powf, and the gain ramps linearly to that
+ *      target over the next hop, so the transcendental work is per hop rather
+ *      than per frame. The gain is applied straight away, before anything
+ *      goes into the delay line.
+ *   2. The limiter detects the linked peak of the compressed signal, either
+ *      per sample or 4x oversampled (true peak), and turns it into the gain
+ *      needed to stay under the ceiling.
+ *   3. A sliding minimum over the look-ahead window W (a monotonic deque, so
+ *      O(1) per sample) holds that gain for W samples, a release envelope lets
+ *      it recover, and a W-sample moving average smooths the result. Because
+ *      the average of W values that are all <= g is <= g, the smoothed gain is
+ *      never above the required gain by the time the peak leaves the W-1
+ *      sample delay line.
+ *   4. The delayed signal of every channel is multiplied by that one gain
+ *      curve, which is a plain vectorisable loop per channel.
+ *
+ * Only the per-channel loops (peak detection, applying the gains) vectorise.
+ * The envelopes in steps 1 and 3 are first-order recursions with a
+ * data-dependent min or attack/release switch in them, so frame n needs
+ * frame n-1's result and there is nothing to spread across lanes. The moving
+ * average could be written as a prefix scan, but it consumes the release
+ * envelope as it is produced and costs one add and one subtract per frame,
+ * so it stays in the same serial loop. That loop is a handful of scalar
+ * operations per frame, shared by all channels.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "truepeak.h"
+#include "limiter.h"
+
+#define kCompHop	32		// frames per compressor gain evaluation
+
+struct CMLimiter {
+	int				channels;
+	float			sampleRate;
+	int				maxBlock;
+	int				truePeak;
+	int				window;			// look-ahead W in samples
+	int				latency;
+
+	// parameters in linear / coefficient form
+	float			ceiling;
+	float			releaseCoef;
+	int				compressor;
+	float			threshold;		// linear
+	float			slope;			// 1/ratio - 1
+	float			attackCoef;
+	float			compReleaseCoef;
+	float			makeup;
+
+	// compressor state
+	float			compEnv;
+	float			compGain;		// ramps towards the last hop's target
+	float			compStep;
+
+	// limiter state
+	long long		n;				// frames seen
+	long long		*dqIndex;		// monotonic deque of (index, required gain)
+	float			*dqValue;
+	int				dqHead, dqTail, dqSize;
+	float			env;
+	double			boxSum;
+	float			*boxRing;
+	int				boxPos;
+	float			lastReductionDb;
+	TruePeak		tp;
+
+	// delay line and per-block scratch
+	float			*ring;			// [channel][ringLen]
+	int				ringLen;
+	int				ringPos;
+	float			*pre;			// compressed input [channel][maxBlock]
+	float			*peak;
+	float			*gain;
+};
+
+
+static float msToCoef( float ms, float sampleRate )
+{
+	if( ms <= 0.0f )
+		return 1.0f;
+	return 1.0f - expf(-1000.0f / (ms * sampleRate));
+}
+
+
+void limiterDefaultParams( CMLimiterParams *params )
+{
+	memset(params, 0, sizeof(CMLimiterParams));
+	params->ceilingDb = -1.0f;
+	params->lookaheadMs = 2.0f;
+	params->releaseMs = 50.0f;
+	params->truePeak = 1;
+	params->compressor = 0;
+	params->thresholdDb = -24.0f;
+	params->ratio = 3.0f;
+	params->attackMs = 10.0f;
+	params->compReleaseMs = 200.0f;
+	params->makeupDb = 6.0f;
+}
+
+
+void limiterSetParams( CMLimiter *lim, const CMLimiterParams *params )
+{
+	lim->ceiling = powf(10.0f, params->ceilingDb / 20.0f);
+	lim->releaseCoef = msToCoef(params->releaseMs, lim->sampleRate);
+	lim->compressor = params->compressor;
+	lim->threshold = powf(10.0f, params->thresholdDb / 20.0f);
+	lim->slope = params->ratio > 1.0f ? 1.0f / params->ratio - 1.0f : 0.0f;
+	lim->attackCoef = msToCoef(params->attackMs, lim->sampleRate);
+	lim->compReleaseCoef = msToCoef(params->compReleaseMs, lim->sampleRate);
+	lim->makeup = params->compressor ? powf(10.0f, params->makeupDb / 20.0f) : 1.0f;
+}
+
+
+CMLimiter *limiterCreate( int channels, float sampleRate, int maxBlock, const CMLimiterParams *params )
+{
+	CMLimiter *lim;
+	float ms;
+	int i;
+
+	if( channels < 1 || channels > kLimiterMaxChannels || sampleRate <= 0.0f || maxBlock < 1 )
+		return NULL;
+	lim = calloc(1, sizeof(CMLimiter));
+	if( !lim )
+		return NULL;
+
+	ms = params->lookaheadMs;
+	if( ms < kLimiterMinLookaheadMs ) ms = kLimiterMinLookaheadMs;
+	if( ms > kLimiterMaxLookaheadMs ) ms = kLimiterMaxLookaheadMs;
+	lim->channels = channels;
+	lim->sampleRate = sampleRate;
+	lim->maxBlock = maxBlock;
+	lim->truePeak = params->truePeak;
+	lim->window = (int)(ms * sampleRate / 1000.0f + 0.5f);
+	if( lim->window < 1 )
+		lim->window = 1;
+	lim->latency = lim->window - 1 + (lim->truePeak ? kTruePeakDelay : 0);
+	limiterSetParams(lim, params);
+
+	lim->ringLen = 1;
+	while( lim->ringLen < lim->latency + maxBlock )
+		lim->ringLen <<= 1;
+	lim->dqSize = lim->window + 2;	// W live entries plus one expiring
+	lim->dqIndex = calloc(lim->dqSize, sizeof(long long));
+	lim->dqValue = calloc(lim->dqSize, sizeof(float));
+	lim->boxRing = calloc(lim->window, sizeof(float));
+	lim->ring = calloc((size_t)channels * lim->ringLen, sizeof(float));
+	lim->pre = calloc((size_t)channels * maxBlock, sizeof(float));
+	lim->peak = calloc(maxBlock, sizeof(float));
+	lim->gain = calloc(maxBlock, sizeof(float));
+	if( !lim->dqIndex || !lim->dqValue || !lim->boxRing || !lim->ring || !lim->pre || !lim->peak || !lim->gain ) {
+		limiterDestroy(lim);
+		return NULL;
+	}
+
+	lim->compGain = lim->makeup;
+	lim->env = 1.0f;
+	for( i = 0; i < lim->window; i++ )
+		lim->boxRing[i] = 1.0f;
+	lim->boxSum = lim->window;
+	truePeakInit(&lim->tp, channels);
+	return lim;
+}
+
+
+void limiterDestroy( CMLimiter *lim )
+{
+	if( !lim )
+		return;
+	free(lim->dqIndex);
+	free(lim->dqValue);
+	free(lim->boxRing);
+	free(lim->ring);
+	free(lim->pre);
+	free(lim->peak);
+	free(lim->gain);
+	free(lim);
+}
+
+
+int limiterLatency( const CMLimiter *lim )
+{
+	return lim->latency;
+}
+
+
+float limiterGainReductionDb( const CMLimiter *lim )
+{
+	return lim->lastReductionDb;
+}
+
+
+//================================================================================================
+// Step 1: compressor gain per frame, applied to the block in `pre`
+//
+// 10^((20 log10(env) - threshold) * slope / 20) is (env / threshold)^slope, so
+// one powf per hop covers it. Hops are counted in absolute frames, so the
+// result does not depend on how the stream is cut into blocks.
+//
+static void compress( CMLimiter *lim, const float * const *in, int frames )
+{
+	long long n = lim->n;
+	int c, i;
+
+	for( c = 0; c < lim->channels; c++ )
+		memcpy(lim->pre + c * lim->maxBlock, in[c], sizeof(float) * frames);
+	if( !lim->compressor )
+		return;
+
+	for( i = 0; i < frames; i++, n++ ) {
+		float level = 0.0f;
+		for( c = 0; c < lim->channels; c++ ) {
+			float a = fabsf(in[c][i]);
+			level = a > level ? a : level;
+		}
+		lim->compEnv += (level > lim->compEnv ? lim->attackCoef : lim->compReleaseCoef) * (level - lim->compEnv);
+		if( n % kCompHop == 0 ) {
+			float target = lim->makeup;
+			if( lim->compEnv > lim->threshold )
+				target *= powf(lim->compEnv / lim->threshold, lim->slope);
+			lim->compStep = (target - lim->compGain) * (1.0f / kCompHop);
+		}
+		lim->compGain += lim->compStep;
+		lim->gain[i] = lim->compGain;
+	}
+	for( c = 0; c < lim->channels; c++ ) {
+		float *p = lim->pre + c * lim->maxBlock;
+		for( i = 0; i < frames; i++ )
+			p[i] *= lim->gain[i];
+	}
+}
+
+
+void limiterProcess( CMLimiter *lim, const float * const *in, float * const *out, int frames )
+{
+	const float *pre[kLimiterMaxChannels];
+	int W = lim->window, mask = lim->ringLen - 1;
+	float minGain = 1.0f;
+	int c, i;
+
+	compress(lim, in, frames);
+	for( c = 0; c < lim->channels; c++ )
+		pre[c] = lim->pre + c * lim->maxBlock;
+
+	// Step 2: linked peak per frame
+	if( lim->truePeak ) {
+		truePeakProcess(&lim->tp, pre, frames, lim->peak, NULL);
+	} else {
+		memset(lim->peak, 0, sizeof(float) * frames);
+		for( c = 0; c < lim->channels; c++ )
+			for( i = 0; i < frames; i++ ) {
+				float a = fabsf(pre[c][i]);
+				lim->peak[i] = a > lim->peak[i] ? a : lim->peak[i];
+			}
+	}
+
+	// Step 3: required gain -> sliding minimum -> release -> moving average
+	for( i = 0; i < frames; i++, lim->n++ ) {
+		float need = lim->peak[i] > lim->ceiling ? lim->ceiling / lim->peak[i] : 1.0f;
+		float hold;
+
+		while( lim->dqTail != lim->dqHead && lim->dqValue[(lim->dqTail + lim->dqSize - 1) % lim->dqSize] >= need )
+			lim->dqTail = (lim->dqTail + lim->dqSize - 1) % lim->dqSize;
+		lim->dqIndex[lim->dqTail] = lim->n;
+		lim->dqValue[lim->dqTail] = need;
+		lim->dqTail = (lim->dqTail + 1) % lim->dqSize;
+		if( lim->dqIndex[lim->dqHead] <= lim->n - W )
+			lim->dqHead = (lim->dqHead + 1) % lim->dqSize;
+		hold = lim->dqValue[lim->dqHead];
+
+		lim->env += lim->releaseCoef * (1.0f - lim->env);
+		if( hold < lim->env )
+			lim->env = hold;
+
+		lim->boxSum += lim->env - lim->boxRing[lim->boxPos];
+		lim->boxRing[lim->boxPos] = lim->env;
+		if( ++lim->boxPos == W )
+			lim->boxPos = 0;
+		lim->gain[i] = (float)(lim->boxSum / W);
+		if( lim->gain[i] < minGain )
+			minGain = lim->gain[i];
+	}
+	lim->lastReductionDb = minGain < 1.0f ? -20.0f * log10f(minGain) : 0.0f;
+
+	// Step 4: through the delay line, and one gain for all channels
+	for( c = 0; c < lim->channels; c++ ) {
+		float *ring = lim->ring + c * lim->ringLen;
+		float *dst = out[c];
+		int w = lim->ringPos, r = (lim->ringPos - lim->latency) & mask;
+
+		for( i = 0; i < frames; i++ )
+			ring[(w + i) & mask] = pre[c][i];
+		if( r + frames <= lim->ringLen ) {
+			const float *src = ring + r;
+			for( i = 0; i < frames; i++ )
+				dst[i] = src[i] * lim->gain[i];
+		} else {
+			for( i = 0; i < frames; i++ )
+				dst[i] = ring[(r + i) & mask] * lim->gain[i];
+		}
+	}
+	lim->ringPos = (lim->ringPos + frames) & mask;
+}
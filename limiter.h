@@ -0,0 +1,53 @@
+/*
+ * limiter.h - linked look-ahead brickwall limiter with "night mode" compressor
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_LIMITER_H
+#define CM_LIMITER_H
+
+#define kLimiterMaxChannels		8
+#define kLimiterMinLookaheadMs	1.0f
+#define kLimiterMaxLookaheadMs	5.0f
+
+typedef struct CMLimiterParams {
+	// Limiter
+	float	ceilingDb;		// output ceiling, dBFS (dBTP with truePeak)
+	float	lookaheadMs;	// 1-5 ms; only read by limiterCreate()
+	float	releaseMs;
+	int		truePeak;		// detect inter-sample peaks; only read by limiterCreate()
+	// Downward compressor in front of the limiter ("night mode")
+	int		compressor;
+	float	thresholdDb;
+	float	ratio;
+	float	attackMs;
+	float	compReleaseMs;
+	float	makeupDb;
+} CMLimiterParams;
+
+typedef struct CMLimiter CMLimiter;
+
+// Fills in sensible defaults: -1 dB ceiling, 2 ms look-ahead, 50 ms release,
+// compressor off (-24 dB threshold, 3:1, 10/200 ms, +6 dB makeup when on).
+void limiterDefaultParams( CMLimiterParams *params );
+
+// All channels share one gain, so the stereo/surround image does not shift.
+// Returns NULL on bad arguments or no memory.
+CMLimiter *limiterCreate( int channels, float sampleRate, int maxBlock, const CMLimiterParams *params );
+void limiterDestroy( CMLimiter *lim );
+
+// Updates ceiling, release and compressor settings; safe between blocks.
+void limiterSetParams( CMLimiter *lim, const CMLimiterParams *params );
+
+// Processes up to maxBlock frames. in and out may be the same buffers. Does
+// not allocate. The output is delayed by limiterLatency() frames.
+void limiterProcess( CMLimiter *lim, const float * const *in, float * const *out, int frames );
+
+int limiterLatency( const CMLimiter *lim );
+
+// Largest gain reduction applied during the last block, in dB (>= 0).
+float limiterGainReductionDb( const CMLimiter *lim );
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * loudness.c - EBU R128 loudness and true-peak meter
+ *
+ * Measurement per ITU-R BS.1770-4 and EBU Tech 3341/3342:
+ *   1. Every channel goes through the K-weighting filter (a high shelf and a
+ *      high-pass, two biquads). The filter state is stored frame-major with
+ *      the channel dimension padded to kLoudnessMaxChannels, like the true
+ *      peak history, so each filter step is one vector operation over all
+ *      channels instead of a recursive loop per channel.
+ *   2. Weighted mean squares are summed over 100 ms sub-blocks. Momentary
+ *      loudness averages the last 4 of them, short-term the last 30, and
+ *      every 400 ms block (75% overlap) goes into the gating histogram.
+ *   3. Integrated loudness and loudness range come from histograms of 0.1 LU
+ *      bins holding counts and summed energy, so memory stays fixed however
+ *      long the meter runs and gating is exact except within one bin.
+ *   4. True peak reuses the 4x oversampling detector from truepeak.c.
+ *
+ * Readings are published every 100 ms through a sequence lock: the audio
+ * thread never waits, and a reader that raced with a publish simply copies
+ * again.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "truepeak.h"
+#include "loudness.h"
+
+#define kMomentaryBlocks	4		// sub-blocks of 100 ms
+#define kShortTermBlocks	30
+#define kAbsoluteGate		(-70.0)
+#define kIntegratedGate		(-10.0)	// LU below the ungated loudness
+#define kRangeGate			(-20.0)
+#define kHistogramBins		750		// -70 to +5 LUFS
+#define kHistogramStep		0.1
+
+typedef struct Histogram {
+	uint32_t	count[kHistogramBins];
+	double		energy[kHistogramBins];
+} Histogram;
+
+struct CMLoudness {
+	int					channels;
+	float				sampleRate;
+	float				weight[kLoudnessMaxChannels];
+
+	// K-weighting: two biquads shared by all channels, transposed direct form II
+	float				b[2][3], a[2][2];
+	float				z[2][2][kLoudnessMaxChannels];
+
+	// Sub-blocks
+	int					subBlockLen, subBlockPos;
+	double				sum[kLoudnessMaxChannels];
+	double				power[kShortTermBlocks];	// weighted mean square, ring
+	int					powerPos;
+	uint64_t			subBlocks;
+
+	Histogram			gating, shortTerm;
+	TruePeak			tp;
+	float				peak[kLoudnessMaxChannels];
+	uint64_t			frames;
+	double				momentary, shortTermPower;
+
+	atomic_int			resetRequested;
+	atomic_uint_least64_t	sequence;				// odd while a reading is being written
+	CMLoudnessReading	reading;
+};
+
+
+static double toLUFS( double power )
+{
+	return power > 0.0 ? -0.691 + 10.0 * log10(power) : kLoudnessSilence;
+}
+
+
+static float toDB( float peak )
+{
+	return peak > 0.0f ? 20.0f * log10f(peak) : kLoudnessSilence;
+}
+
+
+// The BS.1770 filters are specified at 48 kHz; these are their analogue
+// prototypes put through the bilinear transform for any rate.
+static void makeFilters( CMLoudness *m )
+{
+	double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+	double k = tan(M_PI * f0 / m->sampleRate);
+	double vh = pow(10.0, gain / 20.0), vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+
+	m->b[0][0] = (float)((vh + vb * k / q + k * k) / a0);
+	m->b[0][1] = (float)(2.0 * (k * k - vh) / a0);
+	m->b[0][2] = (float)((vh - vb * k / q + k * k) / a0);
+	m->a[0][0] = (float)(2.0 * (k * k - 1.0) / a0);
+	m->a[0][1] = (float)((1.0 - k / q + k * k) / a0);
+
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / m->sampleRate);
+	a0 = 1.0 + k / q + k * k;
+	m->b[1][0] = 1.0f;
+	m->b[1][1] = -2.0f;
+	m->b[1][2] = 1.0f;
+	m->a[1][0] = (float)(2.0 * (k * k - 1.0) / a0);
+	m->a[1][1] = (float)((1.0 - k / q + k * k) / a0);
+}
+
+
+// Starts over, except for the filter states: blocks from before a reset
+// mustn't leak into the gating after it
+static void clearMeasurement( CMLoudness *m )
+{
+	memset(m->sum, 0, sizeof(m->sum));
+	memset(m->power, 0, sizeof(m->power));
+	m->subBlockPos = m->powerPos = 0;
+	m->subBlocks = 0;
+	m->momentary = m->shortTermPower = 0.0;
+	memset(&m->gating, 0, sizeof(Histogram));
+	memset(&m->shortTerm, 0, sizeof(Histogram));
+	memset(m->peak, 0, sizeof(m->peak));
+	m->frames = 0;
+}
+
+
+CMLoudness *loudnessCreate( int channels, float sampleRate )
+{
+	CMLoudness *m;
+	int c;
+
+	if( channels < 1 || channels > kLoudnessMaxChannels || sampleRate < 8000.0f )
+		return NULL;
+	m = calloc(1, sizeof(CMLoudness));
+	if( !m )
+		return NULL;
+	m->channels = channels;
+	m->sampleRate = sampleRate;
+	m->subBlockLen = (int)(sampleRate / 10.0f + 0.5f);
+	for( c = 0; c < channels; c++ )
+		m->weight[c] = c < 3 ? 1.0f : 1.41f;
+	if( channels >= 6 )
+		m->weight[3] = 0.0f;
+	makeFilters(m);
+	truePeakInit(&m->tp, channels);
+	atomic_init(&m->resetRequested, 0);
+	atomic_init(&m->sequence, 0);
+	clearMeasurement(m);
+	m->reading.momentary = m->reading.shortTerm = m->reading.integrated = kLoudnessSilence;
+	m->reading.maxTruePeak = kLoudnessSilence;
+	for( c = 0; c < kLoudnessMaxChannels; c++ )
+		m->reading.truePeak[c] = kLoudnessSilence;
+	m->reading.channels = channels;
+	return m;
+}
+
+
+void loudnessDestroy( CMLoudness *meter )
+{
+	free(meter);
+}
+
+
+void loudnessSetWeight( CMLoudness *meter, int channel, float weight )
+{
+	if( channel >= 0 && channel < meter->channels )
+		meter->weight[channel] = weight;
+}
+
+
+static void histogramAdd( Histogram *h, double power )
+{
+	double lufs = toLUFS(power);
+	int bin;
+
+	if( lufs < kAbsoluteGate )
+		return;
+	bin = (int)((lufs - kAbsoluteGate) / kHistogramStep);
+	if( bin >= kHistogramBins )
+		bin = kHistogramBins - 1;
+	h->count[bin]++;
+	h->energy[bin] += power;
+}
+
+
+// First bin at or above a loudness gated `gate' LU below the histogram's mean
+static int relativeGateBin( const Histogram *h, double gate )
+{
+	double energy = 0.0, threshold;
+	uint64_t count = 0;
+	int b;
+
+	for( b = 0; b < kHistogramBins; b++ ) {
+		count += h->count[b];
+		energy += h->energy[b];
+	}
+	if( count == 0 )
+		return -1;
+	threshold = toLUFS(energy / count) + gate;
+	b = (int)ceil((threshold - kAbsoluteGate) / kHistogramStep);
+	return b < 0 ? 0 : b;
+}
+
+
+static float integratedLoudness( const Histogram *h )
+{
+	int b = relativeGateBin(h, kIntegratedGate);
+	double energy = 0.0;
+	uint64_t count = 0;
+
+	if( b < 0 )
+		return kLoudnessSilence;
+	for( ; b < kHistogramBins; b++ ) {
+		count += h->count[b];
+		energy += h->energy[b];
+	}
+	return count ? (float)toLUFS(energy / count) : kLoudnessSilence;
+}
+
+
+// Difference between the 95th and 10th percentiles of the gated short-term values
+static float loudnessRange( const Histogram *h )
+{
+	int first = relativeGateBin(h, kRangeGate), b, low = -1, high = -1;
+	uint64_t count = 0, seen = 0;
+
+	if( first < 0 )
+		return 0.0f;
+	for( b = first; b < kHistogramBins; b++ )
+		count += h->count[b];
+	if( count == 0 )
+		return 0.0f;
+	for( b = first; b < kHistogramBins; b++ ) {
+		seen += h->count[b];
+		if( low < 0 && seen > count / 10 )
+			low = b;
+		if( high < 0 && seen >= (count * 95 + 99) / 100 )
+			high = b;
+	}
+	return (float)((high - low) * kHistogramStep);
+}
+
+
+static void publish( CMLoudness *m )
+{
+	uint_least64_t seq = atomic_load_explicit(&m->sequence, memory_order_relaxed);
+	CMLoudnessReading *r = &m->reading;
+	int c;
+
+	atomic_store_explicit(&m->sequence, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	r->momentary = m->subBlocks >= kMomentaryBlocks ? (float)toLUFS(m->momentary) : kLoudnessSilence;
+	r->shortTerm = (float)toLUFS(m->shortTermPower);
+	r->integrated = integratedLoudness(&m->gating);
+	r->range = loudnessRange(&m->shortTerm);
+	r->maxTruePeak = kLoudnessSilence;
+	for( c = 0; c < m->channels; c++ ) {
+		r->truePeak[c] = toDB(m->peak[c]);
+		if( r->truePeak[c] > r->maxTruePeak )
+			r->maxTruePeak = r->truePeak[c];
+	}
+	r->frames = m->frames;
+	r->sequence = seq / 2 + 1;
+
+	atomic_store_explicit(&m->sequence, seq + 2, memory_order_release);
+}
+
+
+static void endSubBlock( CMLoudness *m )
+{
+	double power = 0.0, sum = 0.0;
+	int c, i, n, s;
+
+	for( c = 0; c < m->channels; c++ ) {
+		power += m->weight[c] * m->sum[c];
+		m->sum[c] = 0.0;
+	}
+	m->power[m->powerPos] = power / m->subBlockLen;
+	m->powerPos = (m->powerPos + 1) % kShortTermBlocks;
+	m->subBlocks++;
+
+	// Momentary and short-term: means over the newest entries of the ring
+	n = m->subBlocks < kShortTermBlocks ? (int)m->subBlocks : kShortTermBlocks;
+	for( i = 1; i <= n; i++ ) {
+		sum += m->power[(m->powerPos - i + kShortTermBlocks) % kShortTermBlocks];
+		if( i == kMomentaryBlocks )
+			m->momentary = sum / kMomentaryBlocks;
+	}
+	m->shortTermPower = sum / n;
+
+	if( m->subBlocks >= kMomentaryBlocks )
+		histogramAdd(&m->gating, m->momentary);
+	if( m->subBlocks >= kShortTermBlocks )
+		histogramAdd(&m->shortTerm, m->shortTermPower);
+
+	// Let silence decay to zero rather than into denormals
+	for( s = 0; s < 2; s++ )
+		for( c = 0; c < kLoudnessMaxChannels; c++ ) {
+			if( fabsf(m->z[s][0][c]) < 1e-20f ) m->z[s][0][c] = 0.0f;
+			if( fabsf(m->z[s][1][c]) < 1e-20f ) m->z[s][1][c] = 0.0f;
+		}
+	publish(m);
+}
+
+
+static void kWeight( CMLoudness *m, const float * const *in, int offset, int frames )
+{
+	double sum[kLoudnessMaxChannels];
+	float z[2][2][kLoudnessMaxChannels];
+	int i, c, s;
+
+	memcpy(sum, m->sum, sizeof(sum));
+	memcpy(z, m->z, sizeof(z));
+	for( i = 0; i < frames; i++ ) {
+		float x[kLoudnessMaxChannels] = { 0 };
+
+		for( c = 0; c < m->channels; c++ )
+			x[c] = in[c][offset + i];
+		for( s = 0; s < 2; s++ ) {
+			float b0 = m->b[s][0], b1 = m->b[s][1], b2 = m->b[s][2], a1 = m->a[s][0], a2 = m->a[s][1];
+			for( c = 0; c < kLoudnessMaxChannels; c++ ) {
+				float y = b0 * x[c] + z[s][0][c];
+				z[s][0][c] = b1 * x[c] - a1 * y + z[s][1][c];
+				z[s][1][c] = b2 * x[c] - a2 * y;
+				x[c] = y;
+			}
+		}
+		for( c = 0; c < kLoudnessMaxChannels; c++ )
+			sum[c] += (double)(x[c] * x[c]);
+	}
+	memcpy(m->sum, sum, sizeof(sum));
+	memcpy(m->z, z, sizeof(z));
+}
+
+
+void loudnessProcess( CMLoudness *meter, const float * const *in, int frames )
+{
+	const float *part[kLoudnessMaxChannels];
+	int done = 0, c;
+
+	if( atomic_exchange_explicit(&meter->resetRequested, 0, memory_order_acquire) )
+		clearMeasurement(meter);
+
+	while( done < frames ) {
+		int n = meter->subBlockLen - meter->subBlockPos;
+
+		if( n > frames - done )
+			n = frames - done;
+		kWeight(meter, in, done, n);
+		for( c = 0; c < meter->channels; c++ )
+			part[c] = in[c] + done;
+		truePeakProcess(&meter->tp, part, n, NULL, meter->peak);
+		meter->frames += n;
+		meter->subBlockPos += n;
+		done += n;
+		if( meter->subBlockPos == meter->subBlockLen ) {
+			meter->subBlockPos = 0;
+			endSubBlock(meter);
+		}
+	}
+}
+
+
+void loudnessRead( const CMLoudness *meter, CMLoudnessReading *out )
+{
+	CMLoudness *m = (CMLoudness *)meter;
+	uint_least64_t before, after;
+
+	do {
+		before = atomic_load_explicit(&m->sequence, memory_order_acquire);
+		memcpy(out, &m->reading, sizeof(CMLoudnessReading));
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&m->sequence, memory_order_relaxed);
+	} while( before != after || (before & 1) );
+}
+
+
+void loudnessReset( CMLoudness *meter )
+{
+	atomic_store_explicit(&meter->resetRequested, 1, memory_order_release);
+}
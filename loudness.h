@@ -0,0 +1,53 @@
+/*
+ * loudness.h - EBU R128 loudness and true-peak meter
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_LOUDNESS_H
+#define CM_LOUDNESS_H
+
+#include <stdint.h>
+
+#define kLoudnessMaxChannels	8
+#define kLoudnessSilence		(-200.0f)	// reading for no signal, or not enough of it yet
+
+// One set of readings, taken every 100 ms. Loudness in LUFS, range in LU,
+// peaks in dBTP.
+typedef struct CMLoudnessReading {
+	float		momentary;							// last 400 ms
+	float		shortTerm;							// last 3 s
+	float		integrated;							// gated, since the last reset
+	float		range;								// loudness range (EBU Tech 3342)
+	float		truePeak[kLoudnessMaxChannels];		// maximum since the last reset
+	float		maxTruePeak;						// over all channels
+	int			channels;
+	uint64_t	frames;								// processed since the last reset
+	uint64_t	sequence;							// counts readings, to spot new ones
+} CMLoudnessReading;
+
+typedef struct CMLoudness CMLoudness;
+
+// Channel weights follow BS.1770 for the CM6206 layout: front left, right and
+// centre 1.0, LFE (the 4th channel, with 6 or more) 0, surrounds 1.41.
+// Returns NULL on bad arguments or no memory.
+CMLoudness *loudnessCreate( int channels, float sampleRate );
+void loudnessDestroy( CMLoudness *meter );
+
+void loudnessSetWeight( CMLoudness *meter, int channel, float weight );
+
+// Meters a block of planar audio, of any length. Does not allocate or lock;
+// meant to be called from the audio thread.
+void loudnessProcess( CMLoudness *meter, const float * const *in, int frames );
+
+// Copies the latest readings. Any thread may call this at any time: it never
+// blocks the audio thread, and only retries if that published new readings
+// while it was copying.
+void loudnessRead( const CMLoudness *meter, CMLoudnessReading *out );
+
+// Asks the audio thread to start integrated loudness, range and peaks afresh
+// with its next block. Safe from any thread.
+void loudnessReset( CMLoudness *meter );
+
+#endif
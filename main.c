@@ -72,42 +72,143 @@
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/pwr_mgt/IOPMLib.h>
 
+#include "cm6206.h"
+#include "usbtrace.h"
+#include "explore.h"
+#include "power.h"
+#include "gpio.h"
+#include "mixer.h"
+#include "config.h"
+#include "retry.h"
+#include "debounce.h"
+
 #define CMVERSION "3.0.0"
 
 // for debugging
 //#define VERBOSE
 
-#define kVendorID	0x0d8c
-#define kProductID	0x0102
-
 typedef struct MyPrivateData {
     io_object_t				notification;
     IOUSBDeviceInterface	**deviceInterface;
     CFStringRef				deviceName;
+    // Devices known in daemon mode, so sleep and wake needn't enumerate the bus.
+    // A record lives from the first add on a port until the port settles
+    // empty; service is 0 while the device is away during that time.
+    io_service_t			service;
+    UInt32					locationID;
+    UInt16					vendorID, productID;	// the model is looked up again by these on reload
+    const CMDeviceModel		*model;				// NULL while the configuration has none for it
+    int						needsFullPlan;		// some writes for model didn't go through
+    CMPowerSnapshot			snapshot;
+    int						lastResult;		// of the last quiesce or restore
+    uint64_t				activateAtUs;	// a port the debouncer had no room for: when to activate it
+    struct MyPrivateData	*next;
 } MyPrivateData;
 
+// What to do with the vendor interface of a device, and how hard to try
+typedef struct InterfaceJob {
+    int		(*action)( CMTransport *t, const CMDeviceModel *model, void *refCon );
+    void	*refCon;
+    int		openAttempts;	// retryDelayMs apart
+    uint64_t	retryBudgetUs;	// for recovering failed transfers; 0 for the default
+} InterfaceJob;
+
 
 static IONotificationPortRef	gNotifyPort;
 static io_iterator_t			gAddedIter;
 static CFRunLoopRef				gRunLoop;
 static int						gVerbose;
+static CMTraceRecorder			gRecorder;
+
+const CMDeviceModel *modelForService( io_service_t service );
+static SInt32 registryNumber( io_service_t service, CFStringRef key );
+
+static MyPrivateData			*gDevices;
+static CMPowerStats				gPowerStats;
+static CMRetryStats				gRetryStats;	// since the start, over all devices
+static CMDebouncer				gDebouncer;		// add and terminate notifications, per port
+static CFRunLoopTimerRef		gSettleTimer;
+static void armSettleTimer( void );
+
+// The device table and timings in use, from the configuration file
+static CMConfig					*gConfig;
+static const char				*gConfigPath = kConfigDefaultPath;
+
+// What to do with the vendor interface of each device found
+static int activateInterface( CMTransport *t, const CMDeviceModel *model, void *refCon );
+static int (*gInterfaceAction)( CMTransport *t, const CMDeviceModel *model, void *refCon ) = activateInterface;
+
+// Arguments of the explore command, after the word "explore"
+static int						gExploreArgc;
+static const char				**gExploreArgv;
+static int						gExploreDevices;
+static int						gExploreResult;
+
+// The gpio command, parsed: pin changes for set, one for pulse
+typedef struct GpioOp {
+    int		pin;
+    int		level;			// 0, 1 or kGPIOInput
+} GpioOp;
+
+#define kMaxGpioOps		16
+
+static const char				*gGpioCmd;
+static GpioOp					gGpioOps[kMaxGpioOps];
+static int						gGpioNumOps;
+static unsigned long			gGpioPulseUs;
+static int						gGpioDevices;
+static int						gGpioResult;
+
+// The mixer command, parsed
+static const char				*gMixerCmd;
+static int						gMixerChannel;		// -1 for all outputs
+static double					gMixerDB;
+static int						gMixerFadeMs;
+static int						gMixerMute;
+static int						gMixerDevices;
+static int						gMixerResult;
 
 
 void printUsage( const char *progName )
 {
-	printf("Usage: %s [-s] [-d] [-v] [-V] [command]\n", progName );
+	printf("Usage: %s [-s] [-d] [-v] [-V] [-c file] [-r file] [command]\n", progName );
 	printf("  Activates sound outputs on CM6206 USB devices.\n\n");
 	printf("Options:\n");
 	printf("  -s: Silent mode (default in daemon mode)\n");
 	printf("  -v: Verbose mode (default in non-daemon mode)\n");
 	printf("  -d: Daemon mode: the program keeps running and automatically activates any\n");
 	printf("      devices that are connected, or all devices upon wake-from-sleep.\n");
+	printf("  -c: Read the device table and timings from this file instead of\n");
+	printf("      " kConfigDefaultPath " (used if it exists). In daemon mode, edits\n");
+	printf("      to the file are applied to connected devices as soon as it is saved.\n");
+	printf("  -r: Record all USB control requests to a binary trace file, which can be\n");
+	printf("      replayed against a simulated device with cm6206-replay.\n");
 	printf("  -V: Print version number and exit.\n\n");
 	printf("Commands:\n");
 	printf("  install-agent      Install as LaunchAgent (auto-start on login, no sudo required)\n");
 	printf("  uninstall-agent    Uninstall LaunchAgent\n");
 	printf("  install-daemon     Install as LaunchDaemon (auto-start on boot, requires sudo)\n");
 	printf("  uninstall-daemon   Uninstall LaunchDaemon\n");
+	printf("  explore ...        Examine the CM6206 registers (see below)\n");
+	printf("  gpio ...           Drive the CM6206 GPIO pins (see below)\n");
+	printf("  mixer ...          Hardware volume and mute per channel (see below)\n\n");
+	printf("Register exploration (first device only; registers default to 0x00-0xff):\n");
+	printf("  explore read [first last]         Print all readable registers\n");
+	printf("  explore snapshot file [first last] Save the registers to a snapshot file\n");
+	printf("  explore diff before [after]       Compare a snapshot with another one or with\n");
+	printf("                                    the device as it is now\n");
+	printf("  explore sweep reg bit [width]     Write every value of a bit field in turn and\n");
+	printf("                                    report which registers react, then restore it\n\n");
+	printf("GPIO pins 1-4 (first device only):\n");
+	printf("  gpio get                          Print how each pin is configured\n");
+	printf("  gpio set pin level [pin level...] Drive pins to 0 or 1, or `in' to stop driving\n");
+	printf("                                    them; all changes go out in one USB transfer\n");
+	printf("  gpio pulse pin ms [level]         Drive a pin to level (default 1) for ms\n");
+	printf("                                    milliseconds, then put it back as it was\n\n");
+	printf("Hardware mixer (first device only; channel 0 is the master, `all' is every output):\n");
+	printf("  mixer get                         Print the volume and mute of every channel\n");
+	printf("  mixer volume channel dB [ms]      Set a volume, fading over ms milliseconds\n");
+	printf("  mixer mute channel on|off         Mute or unmute a channel\n");
 }
 
 
@@ -485,129 +586,203 @@ void CheckError(IOReturn err, char* where) {
 //
 //================================================================================================
 
-int writeCM6206Registers( IOUSBInterfaceInterface183 **intf, UInt8 regNo, UInt16 value )
+// The IOKit side of the CMTransport that the code in cm6206.c and explore.c
+// uses. Asynchronous requests complete on a private run loop mode, so only
+// runCompletions() delivers them, never the daemon's main run loop.
+#define kAsyncRunLoopMode	CFSTR("CM6206AsyncMode")
+#define kAsyncTimeoutMs		1000
+#define kSyncTimeoutMs		1000	// the longest a synchronous request may take, retry time permitting
+
+typedef struct IOKitTransport IOKitTransport;
+
+typedef struct IOKitAsyncRequest {
+    IOUSBDevRequestTO		req;
+    CMControlRequest		*cmReq;
+    CMRequestCompletion		done;
+    void					*refcon;
+    IOKitTransport			*owner;
+    int						busy;
+} IOKitAsyncRequest;
+
+struct IOKitTransport {
+    IOUSBInterfaceInterface183	**intf;
+    int							opened;			// we hold the interface open (not always possible)
+    CFRunLoopSourceRef			asyncSource;	// created on the first asynchronous request
+    int							completions;	// delivered by the current runCompletions()
+    IOKitAsyncRequest			slots[kExploreMaxInFlight];
+    const CMRetryPolicy			*policy;		// its time left bounds each synchronous request
+};
+
+
+// Sends one control request on the default pipe of the interface. A request
+// that hangs would hold up everything behind it, so it gets no longer than
+// the device has left for recovering.
+int32_t iokitControlRequest( void *ctx, CMControlRequest *cmReq )
 {
-    UInt8 buf[8];
+    IOKitTransport *it = ctx;
+    IOUSBInterfaceInterface183 **intf = it->intf;
     IOReturn err;
-    IOUSBDevRequest req;
+    IOUSBDevRequestTO req;
     UInt8 pipeNo = 0; // 0 is the default pipe (and the only one that works here)
+    UInt32 timeoutMs = kSyncTimeoutMs;
     
-    buf[0] = 0x20;
-    buf[1] = value & 0xFF;          // Low byte (DATAL)
-    buf[2] = (value >> 8) & 0xFF;   // High byte (DATAH)
-    buf[3] = regNo;
-    
-    req.bmRequestType=USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface );
-    req.bRequest=0x09; // these values are taken from the SPDIF enable log
-    req.wValue=0x0200;
-    req.wIndex=0x03;
-    req.wLength=4;
-    req.pData=buf;
-    err=(*intf)->ControlRequest(intf,pipeNo,&req);
+    if (it->policy && retryTimeLeftUs(it->policy) / 1000 < timeoutMs)
+        timeoutMs = (UInt32)(retryTimeLeftUs(it->policy) / 1000) + 1;
+    req.bmRequestType=cmReq->bmRequestType;
+    req.bRequest=cmReq->bRequest;
+    req.wValue=cmReq->wValue;
+    req.wIndex=cmReq->wIndex;
+    req.wLength=cmReq->wLength;
+    req.pData=cmReq->pData;
+    req.wLenDone=0;
+    req.noDataTimeout=timeoutMs;
+    req.completionTimeout=timeoutMs;
+    err=(*intf)->ControlRequestTO(intf,pipeNo,&req);
     CheckError(err,"usbWriteCmdWithBRequest");
-    if (err==kIOUSBPipeStalled) (*intf)->ClearPipeStall(intf,pipeNo);
     
-    return (err != 0);
+    return err;
 }
 
-//================================================================================================
-// This sends the actual activation commands
-void initCM6206(IOUSBInterfaceInterface183 **intf)
+
+// Recovery hooks for the retry policy (retry.h)
+static int32_t iokitClearStall( void *ctx )
 {
-    int err = 0;
-    int successCount = 0;
-    const int totalCommands = 3;
-
-    // This should reset the registers
-    // REG0:
-    // bit15      DMA_Master       R/W 1: SPDIFOUT as Master 0: DACs as Master
-    // bit14-12   Sampling_rate    R/W SPDIF out sample rate (48K: 3'b010; 96K: 3'b110)
-    // bit11-4    Category_code    R/W SPDIF out category code depends on the equipment type
-    // bit3       Emphasis         R/W SPDIFOUT emphasis. 1: emphasis-CD_type 0: Emphasis is not indicated
-    // bit2       Copyright        R/W 1: not asserted; 0: asserted
-    // bit1       Non_audio        R/W 1: non-PCM audio data (like AC3) 0: PCM-data
-    // bit0       Pro_con          R/W 1: professional format 0: consumer
-    if( writeCM6206Registers(intf, 0x00, 0xa004) == 0 ) {  // REG0 = 0xa004 (S/PDIF Master, 48kHz, Copyright=not asserted)
-        successCount++;
-        if(gVerbose)
-            fprintf(stderr, "  [1/3] REG0 configuration (S/PDIF, sampling rate): OK\n");
-    } else {
-    	fprintf(stderr, "  [1/3] REG0 configuration (S/PDIF, sampling rate): FAILED\n");
-		err = 1;
-    }
+    IOUSBInterfaceInterface183 **intf = ((IOKitTransport *)ctx)->intf;
+    
+    return (*intf)->ClearPipeStall(intf, 0);
+}
 
-    // This enables SPDIF, values copied from SniffUSB log (this one was easy)
-    // I'm not sure if the SPDIF outputs surround data, as I don't have the means to test it.
-    // REG1:
-    // bit15      Rsvd             R/W Reserved
-    // bit14      SEL_CLK          R/W For test. Select 44.1k source for DACs 1=from 22.58M 0=from 24.576M
-    // bit13      PLLBINen         R/W PLL binary search enable
-    // bit12      SOFTMUTEen       R/W Soft mute enable
-    // bit11      GPIO4_o          R/W Gpio4 signal
-    // bit10      GPIO4_OEN        R/W Gpio4 output enable
-    // bit9       GPIO3_o          R/W Gpio3 signal
-    // bit8       GPIO3_OEN        R/W Gpio3 output enable
-    // bit7       GPIO2_o          R/W Gpio2 signal
-    // bit6       GPIO2_OEN        R/W Gpio2 output enable
-    // bit5       GPIO1_o          R/W Gpio1 signal
-    // bit4       GPIO1_OEN        R/W Gpio1 output enable
-    // bit3       VALID            R/W SPDIFOUT Valid Signal 1=un-valid
-    // bit2       SPDIFLOOP        R/W SPDIF loop-back enable
-    // bit1       DIS_SPDIFO       R/W SPDIF out disable
-    // bit0       SPDIFMIX         R/W SPDIF in mix enable
-    /* 🍎 */
-    if( writeCM6206Registers(intf, 0x01, 0x2000) == 0 ) {  // REG1 = 0x2000 (PLLBINen=1)
-        successCount++;
-        if(gVerbose)
-            fprintf(stderr, "  [2/3] REG1 configuration (PLL binary search): OK\n");
-    } else {
-    	fprintf(stderr, "  [2/3] REG1 configuration (PLL binary search): FAILED\n");
-		err = 1;
-    }
 
-    // This enables sound output. Why on earth it's disabled upon power-on,
-    // nobody knows (except maybe some Taiwanese engineer).
-    // These values were taken from the ALSA USB driver: "Enable line-out driver mode,
-    // set headphone source to front channels, enable stereo mic."
-    // That's for the CM106, however. On the CM6206 they appear to enable everything.
-    // REG2:
-    // bit15      DRIVERON         R/W Line-out driver mode enable (1=enable)
-    // bit14-3    (various)        R/W Headphone source, channel config, etc.
-    // bit2       EN_BTL           R/W BTL mode enable (2-channel mode only) / Stereo mic enable
-    // bit1-0     (reserved)       R/W
-    if( writeCM6206Registers(intf, 0x02, 0x8004) == 0 ) {  // REG2 = 0x8004 (DRIVERON=1, EN_BTL=1)
-        successCount++;
-        if(gVerbose)
-            fprintf(stderr, "  [3/3] REG2 configuration (analog output, stereo mic): OK\n");
-    } else {
-    	fprintf(stderr, "  [3/3] REG2 configuration (analog output, stereo mic): FAILED\n");
-    	err = 1;
+static int32_t iokitReopen( void *ctx )
+{
+    IOKitTransport *it = ctx;
+    IOReturn err;
+    
+    if (it->opened)
+        (*it->intf)->USBInterfaceClose(it->intf);
+    err = (*it->intf)->USBInterfaceOpen(it->intf);
+    it->opened = (err == kIOReturnSuccess);
+    // As when opening it the first time, requests work without exclusive access
+    return err == kIOReturnExclusiveAccess ? kIOReturnSuccess : err;
+}
+
+
+static void iokitRequestDone( void *refcon, IOReturn result, void *arg0 )
+{
+    IOKitAsyncRequest *slot = refcon;
+    IOKitTransport *it = slot->owner;
+    
+    if (result==kIOUSBPipeStalled) (*it->intf)->ClearPipeStall(it->intf,0);
+    slot->busy = 0;
+    it->completions++;
+    slot->done(slot->refcon, slot->cmReq, result);
+}
+
+
+int32_t iokitSubmitRequest( void *ctx, CMControlRequest *cmReq, CMRequestCompletion done, void *refcon )
+{
+    IOKitTransport *it = ctx;
+    IOKitAsyncRequest *slot = NULL;
+    IOReturn err;
+    int i;
+    
+    for( i = 0; i < kExploreMaxInFlight && slot == NULL; i++ )
+        if( !it->slots[i].busy )
+            slot = &it->slots[i];
+    if( slot == NULL )
+        return kIOReturnBusy;
+    if( it->asyncSource == NULL ) {
+        err = (*it->intf)->CreateInterfaceAsyncEventSource(it->intf, &it->asyncSource);
+        if (err) {
+            it->asyncSource = NULL;
+            return err;
+        }
+        CFRunLoopAddSource(CFRunLoopGetCurrent(), it->asyncSource, kAsyncRunLoopMode);
     }
+    
+    slot->req.bmRequestType = cmReq->bmRequestType;
+    slot->req.bRequest = cmReq->bRequest;
+    slot->req.wValue = cmReq->wValue;
+    slot->req.wIndex = cmReq->wIndex;
+    slot->req.wLength = cmReq->wLength;
+    slot->req.pData = cmReq->pData;
+    slot->req.wLenDone = 0;
+    // The timeouts guarantee that every queued request eventually completes
+    slot->req.noDataTimeout = kAsyncTimeoutMs;
+    slot->req.completionTimeout = kAsyncTimeoutMs;
+    slot->cmReq = cmReq;
+    slot->done = done;
+    slot->refcon = refcon;
+    slot->owner = it;
+    err = (*it->intf)->ControlRequestAsyncTO(it->intf, 0, &slot->req, iokitRequestDone, slot);
+    if (err == kIOReturnSuccess)
+        slot->busy = 1;
+    return err;
+}
 
-    // Extra stuff, taken from the Alsa-user mailinglist.
-    // The above works for me, so I didn't bother testing the following.
-    // It may be completely redundant or make your Mac explode. Try at your own risk.
 
-    // "Enable DACx2, PLL binary, Soft Mute, and SPDIF-out"
-    //writeCM6206Registers(intf, 0x01, 0xb000);
-    // "Enable all channels and select 48-pin chipset"
-    //writeCM6206Registers(intf, 0x03, 0x007e);
+int iokitRunCompletions( void *ctx, int timeoutMs )
+{
+    IOKitTransport *it = ctx;
+    
+    if( it->asyncSource == NULL )
+        return -1;
+    it->completions = 0;
+    CFRunLoopRunInMode(kAsyncRunLoopMode, timeoutMs / 1000.0, true);
+    return it->completions;
+}
+
 
-    // Print summary
-    if(successCount == totalCommands) {
+static int activateInterface( CMTransport *t, const CMDeviceModel *model, void *refCon )
+{
+    return initCMDevice(t, model, gVerbose);
+}
+
+
+static int quiesceInterface( CMTransport *t, const CMDeviceModel *model, void *refCon )
+{
+    MyPrivateData *dev = refCon;
+    
+    return dev->lastResult = powerQuiesce(t, &dev->snapshot);
+}
+
+
+static int restoreInterface( CMTransport *t, const CMDeviceModel *model, void *refCon )
+{
+    MyPrivateData *dev = refCon;
+    
+    return dev->lastResult = powerRestore(t, model, &dev->snapshot, gVerbose);
+}
+
+
+// Register writes left to send after the configuration file changed
+typedef struct ConfigUpdate {
+    CMRegisterWrite	writes[kConfigMaxWrites];
+    int				numWrites;
+    int				sent;
+} ConfigUpdate;
+
+static int applyInterface( CMTransport *t, const CMDeviceModel *model, void *refCon )
+{
+    ConfigUpdate *update = refCon;
+    int i;
+    
+    for( i = 0; i < update->numWrites; i++ ) {
+        const CMRegisterWrite *w = &update->writes[i];
+        
+        if( writeCM6206Registers(t, w->regNo, w->value) != 0 ) {
+            fprintf(stderr, "  REG%d configuration (%s): FAILED\n", w->regNo, w->description);
+            return -1;
+        }
+        update->sent++;
         if(gVerbose)
-            fprintf(stderr, "Successfully sent all CM6206 activation commands (%d/%d)\n",
-                    successCount, totalCommands);
-        else
-            fprintf(stderr, "Successfully sent CM6206 activation commands!\n");
-    } else {
-        fprintf(stderr, "Warning: Only %d/%d commands succeeded\n",
-                successCount, totalCommands);
+            fprintf(stderr, "  REG%d = 0x%04x (%s)\n", w->regNo, w->value, w->description);
     }
+    return 0;
 }
 
 
-void dealWithInterface(io_service_t usbInterfaceRef)
+void dealWithInterface(io_service_t usbInterfaceRef, const CMDeviceModel *model, const InterfaceJob *job)
 {
     IOReturn					err;
     IOCFPlugInInterface 		**iodev;	// requires <IOKit/IOCFPlugIn.h>
@@ -669,7 +844,33 @@ void dealWithInterface(io_service_t usbInterfaceRef)
     }
 #endif
 
-	initCM6206(intf);
+	{
+		IOKitTransport	it = { intf, interfaceOpened };
+		CMTransport		transport = { iokitControlRequest, &it, iokitSubmitRequest, iokitRunCompletions };
+		CMTraceTap		tap;
+		CMRetryPolicy	policy;
+		CMRetryStats	before = gRetryStats;
+		
+		if( gRecorder.fp )
+			traceTap(&tap, &gRecorder, &transport, &transport);
+		// Failed transfers are recovered here, within a time limit per device
+		retryWrap(&policy, &transport, &gRetryStats, &transport);
+		policy.clearStall = iokitClearStall;
+		policy.reopen = iokitReopen;
+		policy.hookCtx = &it;
+		if( job->retryBudgetUs )
+			policy.budgetUs = job->retryBudgetUs;
+		it.policy = &policy;
+		job->action(&transport, model, job->refCon);
+		if( it.asyncSource )
+			CFRunLoopRemoveSource(CFRunLoopGetCurrent(), it.asyncSource, kAsyncRunLoopMode);
+		if( gVerbose && memcmp(&before, &gRetryStats, sizeof(before)) != 0 ) {
+			fprintf(stderr, "Transfer errors so far (%.0f ms spent recovering on this device):\n",
+					policy.spentUs / 1000.0);
+			retryReport(&gRetryStats, stderr);
+		}
+		interfaceOpened = it.opened;
+	}
 
     // Only try to close the interface if we successfully opened it
     if (interfaceOpened) {
@@ -687,7 +888,7 @@ void dealWithInterface(io_service_t usbInterfaceRef)
 }
 
 
-void dealWithDevice(io_service_t usbDeviceRef)
+void dealWithDevice(io_service_t usbDeviceRef, const CMDeviceModel *model, const InterfaceJob *job)
 {
     IOReturn					err;
     IOCFPlugInInterface			**iodev;	// requires <IOKit/IOCFPlugIn.h>
@@ -699,7 +900,7 @@ void dealWithDevice(io_service_t usbDeviceRef)
     io_iterator_t				iterator;
     io_service_t				usbInterfaceRef;
     int nCount;
-    int nAttempts = 20;
+    int nAttempts = job->openAttempts;
     
     err = IOCreatePlugInInterfaceForService(usbDeviceRef, kIOUSBDeviceUserClientTypeID,
 											kIOCFPlugInInterfaceID, &iodev, &score);
@@ -719,9 +920,9 @@ void dealWithDevice(io_service_t usbDeviceRef)
     do {
 		err = (*dev)->USBDeviceOpen(dev);
 		if(err) {
-			fprintf(stderr, "Trying to open device, %d seconds left...\n",nAttempts);
+			fprintf(stderr, "Trying to open device, %d attempts left...\n",nAttempts);
 			if( nAttempts > 1 )
-				sleep(1); // wait a second
+				usleep(gConfig->retryDelayMs * 1000);
 		}
 		else
 			nAttempts = 1;
@@ -778,8 +979,8 @@ void dealWithDevice(io_service_t usbDeviceRef)
 #ifdef VERBOSE
 		fprintf(stderr, "found interface: %p\n", (void*)(size_t)usbInterfaceRef);
 #endif
-		if( nCount == 1 ) // The second interface is the one we need
-			dealWithInterface(usbInterfaceRef); // Here the actual interesting stuff happens!!!
+		if( nCount == model->interfaceIndex ) // The device table says which interface takes the commands
+			dealWithInterface(usbInterfaceRef, model, job); // Here the actual interesting stuff happens!!!
 		IOObjectRelease(usbInterfaceRef);
 		nCount++;
     }
@@ -816,22 +1017,39 @@ void DeviceNotification(void *refCon, io_service_t service, natural_t messageTyp
     MyPrivateData	*privateDataRef = (MyPrivateData *) refCon;
     
     if (messageType == kIOMessageServiceIsTerminated) {
+        MyPrivateData	**link;
+        
 		if(gVerbose) {
-			fprintf(stderr, "CM6206 device removed.\n");
+			fprintf(stderr, "%s device removed.\n",
+					privateDataRef->model ? privateDataRef->model->chip : "USB");
 			// Dump our private data just to see what it looks like.
 			fprintf(stderr, "privateDataRef->deviceName: ");
 			CFShow(privateDataRef->deviceName);
 		}
 		
-        // Free the data we're no longer using now that the device is going away
-        CFRelease(privateDataRef->deviceName);
-        
+        // This service is gone for good; a device that comes back gets a new one
         if (privateDataRef->deviceInterface) {
             kr = (*privateDataRef->deviceInterface)->Release(privateDataRef->deviceInterface);
+            privateDataRef->deviceInterface = NULL;
         }
-        
         kr = IOObjectRelease(privateDataRef->notification);
+        privateDataRef->notification = 0;
+        IOObjectRelease(privateDataRef->service);
+        privateDataRef->service = 0;
         
+        // The record itself goes once the port has settled empty, unless the
+        // port isn't being debounced
+        if (debounceNotify(&gDebouncer, privateDataRef->locationID, 0, cmMonotonicUs()) != NULL) {
+            armSettleTimer();
+            return;
+        }
+        CFRelease(privateDataRef->deviceName);
+        for (link = &gDevices; *link; link = &(*link)->next) {
+            if (*link == privateDataRef) {
+                *link = privateDataRef->next;
+                break;
+            }
+        }
         free(privateDataRef);
     }
 }
@@ -848,7 +1066,8 @@ void DeviceNotification(void *refCon, io_service_t service, natural_t messageTyp
 //	2.  Submit an IOServiceAddInterestNotification of type kIOGeneralInterest for this device,
 //	    using the refCon field to store a pointer to our private data.  When we get called with
 //	    this interest notification, we can grab the refCon and access our private data.
-//  3.  Run the CM6206 activation routine.
+//  3.  Leave it to settleTimerFired to run the CM6206 activation routine, once the device's
+//	    port has had no notifications for the settle delay.
 //
 //================================================================================================
 void DeviceAdded(void *refCon, io_iterator_t iterator)
@@ -860,31 +1079,63 @@ void DeviceAdded(void *refCon, io_iterator_t iterator)
         io_name_t		deviceName;
         CFStringRef		deviceNameAsCFString;	
         MyPrivateData	*privateDataRef = NULL;
+        const CMDeviceModel	*model = modelForService(usbDevice);
+        CMDebouncePort	*port;
+        UInt32			locationID;
         
-        fprintf(stderr, "CM6206 device added.\n");
-        
-        // Add some app-specific information about this device.
-        // Create a buffer to hold the data.
-        privateDataRef = malloc(sizeof(MyPrivateData));
-        bzero(privateDataRef, sizeof(MyPrivateData));
-		
-        // Get the USB device's name.
-        kr = IORegistryEntryGetName(usbDevice, deviceName);
-		if (KERN_SUCCESS != kr) {
-            deviceName[0] = '\0';
+        // The notification fires for every USB device; only ours get further
+        if (model == NULL) {
+            IOObjectRelease(usbDevice);
+            continue;
         }
+        locationID = (UInt32)registryNumber(usbDevice, CFSTR(kUSBDevicePropertyLocationID));
+        port = debounceNotify(&gDebouncer, locationID, 1, cmMonotonicUs());
+        if (port == NULL)
+            fprintf(stderr, "%s device added at 0x%08x, not debounced.\n", model->chip, (unsigned)locationID);
+        else if(gVerbose)
+            fprintf(stderr, "%s device added at 0x%08x.\n", model->chip, (unsigned)locationID);
         
-        deviceNameAsCFString = CFStringCreateWithCString(kCFAllocatorDefault, deviceName, 
-                                                         kCFStringEncodingASCII);
-        
-        // Dump our data to stderr just to see what it looks like.
-		if(gVerbose) {
-			fprintf(stderr, "deviceName: ");
-			CFShow(deviceNameAsCFString);
-		}
-        
-        // Save the device's name to our private data.        
-        privateDataRef->deviceName = deviceNameAsCFString;
+        // A device that bounced keeps the record it got the first time. One
+        // on a port the table has no room for gets a record all the same.
+        privateDataRef = port ? port->record : NULL;
+        if (privateDataRef == NULL) {
+            privateDataRef = malloc(sizeof(MyPrivateData));
+            bzero(privateDataRef, sizeof(MyPrivateData));
+            
+            // Get the USB device's name.
+            kr = IORegistryEntryGetName(usbDevice, deviceName);
+            if (KERN_SUCCESS != kr) {
+                deviceName[0] = '\0';
+            }
+            deviceNameAsCFString = CFStringCreateWithCString(kCFAllocatorDefault, deviceName, 
+                                                             kCFStringEncodingASCII);
+            if(gVerbose) {
+                fprintf(stderr, "deviceName: ");
+                CFShow(deviceNameAsCFString);
+            }
+            privateDataRef->deviceName = deviceNameAsCFString;
+            privateDataRef->locationID = locationID;
+            
+            // Keep it in the list of known devices, for sleep and wake
+            privateDataRef->next = gDevices;
+            gDevices = privateDataRef;
+            if (port)
+                port->record = privateDataRef;
+        }
+        else if (privateDataRef->service) {
+            // Added again without a terminate in between
+            IOObjectRelease(privateDataRef->notification);
+            IOObjectRelease(privateDataRef->service);
+        }
+        IOObjectRetain(usbDevice);
+        privateDataRef->service = usbDevice;
+        privateDataRef->vendorID = model->vendorID;
+        privateDataRef->productID = model->productID;
+        privateDataRef->model = model;
+        privateDataRef->needsFullPlan = 0;		// it is about to be activated from scratch
+        // Without the debouncer it still waits the settle delay, on the timer
+        if (port == NULL)
+            privateDataRef->activateAtUs = cmMonotonicUs() + gDebouncer.settleUs + 1;
 		
         // Register for an interest notification of this device being removed. Use a reference to our
         // private data as the refCon which will be passed to the notification callback.
@@ -900,15 +1151,92 @@ void DeviceAdded(void *refCon, io_iterator_t iterator)
             fprintf(stderr, "IOServiceAddInterestNotification returned 0x%08x.\n", kr);
         }
 		
-		// This is not strictly necessary but it seems to avoid kernel panics when some
-		// third-party audio enhancers are active.
-		sleep(1);
-		
-		dealWithDevice(usbDevice);  // here the important stuff happens
-		
         // Done with this USB device; release the reference added by IOIteratorNext
         kr = IOObjectRelease(usbDevice);
     }
+    
+    // Activation waits until the port has been quiet for the settle delay. This
+    // is not strictly necessary but it seems to avoid kernel panics when some
+    // third-party audio enhancers are active, and it collapses hub resets.
+    armSettleTimer();
+}
+
+
+//================================================================================================
+// Runs when a port has been quiet for the settle delay: activates the device
+// that stayed, or drops the record of one that stayed away. Devices on ports
+// the debouncer had no room for wait out the settle delay on the same timer;
+// their removal frees the record directly.
+//
+static void activateUndebounced( void )
+{
+	uint64_t nowUs = cmMonotonicUs();
+	MyPrivateData *dev;
+	
+	for( dev = gDevices; dev; dev = dev->next ) {
+		InterfaceJob job = { activateInterface, NULL, gConfig->openAttempts };
+		
+		if( dev->activateAtUs == 0 || dev->activateAtUs > nowUs )
+			continue;
+		dev->activateAtUs = 0;
+		if( dev->service == 0 || dev->model == NULL )
+			continue;
+		fprintf(stderr, "%s device added.\n", dev->model->chip);
+		dealWithDevice(dev->service, dev->model, &job);
+	}
+}
+
+
+static void settleTimerFired( CFRunLoopTimerRef timer, void *info )
+{
+	CMDebounceAction action;
+	UInt32 locationID;
+	void *record;
+	
+	while( (action = debounceTake(&gDebouncer, cmMonotonicUs(), &locationID, &record)) != kDebounceNothing ) {
+		MyPrivateData *dev = record, **link;
+		
+		if( action == kDebounceActivate ) {
+			InterfaceJob job = { activateInterface, NULL, gConfig->openAttempts };
+			
+			if( dev->service == 0 || dev->model == NULL )
+				continue;
+			fprintf(stderr, "%s device added.\n", dev->model->chip);
+			dealWithDevice(dev->service, dev->model, &job);  // here the important stuff happens
+			continue;
+		}
+		CFRelease(dev->deviceName);
+		for( link = &gDevices; *link; link = &(*link)->next ) {
+			if( *link == dev ) {
+				*link = dev->next;
+				break;
+			}
+		}
+		free(dev);
+	}
+	activateUndebounced();
+	if(gVerbose && gDebouncer.stats.collapsed)
+		fprintf(stderr, "Hot-plug: %lu adds, %lu removes, %lu collapsed, %lu activations\n",
+				gDebouncer.stats.adds, gDebouncer.stats.removes, gDebouncer.stats.collapsed,
+				gDebouncer.stats.activations);
+	armSettleTimer();
+}
+
+
+static void armSettleTimer( void )
+{
+	uint64_t nowUs = cmMonotonicUs();
+	int64_t waitUs = debounceNextUs(&gDebouncer, nowUs);
+	MyPrivateData *dev;
+	
+	for( dev = gDevices; dev; dev = dev->next ) {
+		int64_t untilUs = dev->activateAtUs > nowUs ? (int64_t)(dev->activateAtUs - nowUs) : 0;
+		
+		if( dev->activateAtUs != 0 && (waitUs < 0 || untilUs < waitUs) )
+			waitUs = untilUs;
+	}
+	if( waitUs >= 0 )
+		CFRunLoopTimerSetNextFireDate(gSettleTimer, CFAbsoluteTimeGetCurrent() + waitUs / 1e6);
 }
 
 //================================================================================================
@@ -929,38 +1257,50 @@ void SignalHandler( int sigraised )
 
 
 //================================================================================================
-// Make a matching dictionary to find all devices with the given vendor & product ID
+// Make a matching dictionary for all USB devices. A dictionary can only match
+// one vendor, so instead of one notification per supported ID, everything is
+// matched and modelForService() picks out ours in the same pass.
 //
-int makeDictionary( CFMutableDictionaryRef *matchingDictionary, SInt32 idVendor, SInt32 idProduct )
+int makeDictionary( CFMutableDictionaryRef *matchingDictionary )
 {
-    CFNumberRef			numberRef = 0;
-	
     *matchingDictionary = IOServiceMatching(kIOUSBDeviceClassName);	// requires <IOKit/usb/IOUSBLib.h>
     if (!*matchingDictionary) {
         fprintf(stderr, "Error: Could not create matching dictionary\n");
         return -1;
     }
-    numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &idVendor);
-    if (!numberRef) {
-        fprintf(stderr, "Error: Could not create CFNumberRef for vendor\n");
-        return -1;
-    }
-    CFDictionaryAddValue(*matchingDictionary, CFSTR(kUSBVendorID), numberRef);
-    CFRelease(numberRef);
-    numberRef = 0;
-    numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &idProduct);
-    if (!numberRef) {
-        fprintf(stderr, "Error: Could not create CFNumberRef for product\n");
-        return -1;
-    }
-    CFDictionaryAddValue(*matchingDictionary, CFSTR(kUSBProductID), numberRef);
-    CFRelease(numberRef);
-    numberRef = 0;
-	
 	return 0;
 }
 
 
+//================================================================================================
+// Looks up a USB device in the device table, from its registry properties
+// (much cheaper than opening it). NULL if it isn't one of ours.
+//
+static SInt32 registryNumber( io_service_t service, CFStringRef key )
+{
+    CFTypeRef	ref = IORegistryEntryCreateCFProperty(service, key, kCFAllocatorDefault, 0);
+    SInt32		value = -1;
+    
+    if (ref) {
+        if (CFGetTypeID(ref) == CFNumberGetTypeID())
+            CFNumberGetValue((CFNumberRef)ref, kCFNumberSInt32Type, &value);
+        CFRelease(ref);
+    }
+    return value;
+}
+
+
+const CMDeviceModel *modelForService( io_service_t service )
+{
+    SInt32 vendor = registryNumber(service, CFSTR(kUSBVendorID));
+    SInt32 product = registryNumber(service, CFSTR(kUSBProductID));
+    
+    if (vendor < 0 || product < 0)
+        return NULL;
+    return cmFindDeviceModel((uint16_t)vendor, (uint16_t)product);
+}
+
+
 //================================================================================================
 // Look for all matching devices and deal with them once.
 //
@@ -979,7 +1319,7 @@ int ActivateDevices()
 		return kr;
 	}
 	
-	nRet = makeDictionary( &matchingDictionary, kVendorID, kProductID );
+	nRet = makeDictionary( &matchingDictionary );
 	if (nRet)
 		return nRet;
 	
@@ -987,10 +1327,16 @@ int ActivateDevices()
 	matchingDictionary = 0;		// this was consumed by the above call
 	
 	while ( (usbDeviceRef = IOIteratorNext(iterator)) ) {
-		foundDevice = 1;
-		if(gVerbose)
-			fprintf(stderr, "CM6206 found (device %p)\n", (void*)(size_t)usbDeviceRef);
-		dealWithDevice(usbDeviceRef);  // here the important stuff happens
+		const CMDeviceModel *model = modelForService(usbDeviceRef);
+		InterfaceJob job = { gInterfaceAction, NULL, gConfig->openAttempts };
+		
+		if( model ) {
+			foundDevice = 1;
+			if(gVerbose)
+				fprintf(stderr, "%s found: %s (device %p)\n", model->chip, model->product,
+						(void*)(size_t)usbDeviceRef);
+			dealWithDevice(usbDeviceRef, model, &job);  // here the important stuff happens
+		}
 		IOObjectRelease(usbDeviceRef);	// no longer need this reference
 	}
 	if(! foundDevice && gVerbose)
@@ -1005,19 +1351,406 @@ int ActivateDevices()
 }	
 
 
+//================================================================================================
+// The explore command: register maps, snapshots and bit sweeps.
+//
+static int parseNumber( const char *arg, int min, int max, int *out )
+{
+	char *end;
+	long value = strtol(arg, &end, 0);
+	
+	if( *arg == '\0' || *end != '\0' || value < min || value > max ) {
+		fprintf(stderr, "Error: `%s' is not a number in the range %d-%d\n", arg, min, max);
+		return -1;
+	}
+	*out = (int)value;
+	return 0;
+}
+
+
+// Parses an optional "first last" register range at argv[at]
+static int parseRange( int at, int *first, int *last )
+{
+	*first = 0;
+	*last = kExploreNumRegisters - 1;
+	if( gExploreArgc == at )
+		return 0;
+	if( gExploreArgc != at + 2 ) {
+		fprintf(stderr, "Error: a register range needs both a first and a last register\n");
+		return -1;
+	}
+	if( parseNumber(gExploreArgv[at], 0, kExploreNumRegisters - 1, first) ||
+	    parseNumber(gExploreArgv[at + 1], *first, kExploreNumRegisters - 1, last) )
+		return -1;
+	return 0;
+}
+
+
+static int exploreInterface( CMTransport *t, const CMDeviceModel *model, void *refCon )
+{
+	const char *cmd = gExploreArgv[0];
+	CMRegisterMap map, before;
+	CMExploreStats stats;
+	int first, last;
+	
+	if( gExploreDevices++ > 0 ) {
+		fprintf(stderr, "Skipping another CM6206; only the first one is explored\n");
+		return 0;
+	}
+	memset(&stats, 0, sizeof(stats));
+	
+	if( strcmp(cmd, "sweep") == 0 ) {
+		int reg, bit, width = 1;
+		
+		if( parseNumber(gExploreArgv[1], 0, kExploreNumRegisters - 1, &reg) ||
+		    parseNumber(gExploreArgv[2], 0, 15, &bit) ||
+		    (gExploreArgc > 3 && parseNumber(gExploreArgv[3], 1, kExploreMaxSweepWidth, &width)) )
+			return gExploreResult = -1;
+		return gExploreResult = exploreSweep(t, reg, bit, width, 0, kExploreNumRegisters - 1, stdout);
+	}
+	
+	if( strcmp(cmd, "diff") == 0 ) {
+		if( exploreLoadMap(&before, gExploreArgv[1]) )
+			return gExploreResult = -1;
+		first = 0;
+		last = kExploreNumRegisters - 1;
+	}
+	else if( parseRange(strcmp(cmd, "read") == 0 ? 1 : 2, &first, &last) )
+		return gExploreResult = -1;
+	
+	if( exploreReadRange(t, first, last, &map, &stats) && gVerbose )
+		fprintf(stderr, "%lu registers could not be read\n", stats.failedReads);
+	if( gVerbose )
+		fprintf(stderr, "Read %lu registers in %.1f ms (up to %lu requests in flight, %lu retried)\n",
+				stats.reads, stats.elapsedUs / 1000.0, stats.maxInFlight, stats.retries);
+	
+	if( strcmp(cmd, "read") == 0 )
+		explorePrintMap(&map, stdout);
+	else if( strcmp(cmd, "snapshot") == 0 )
+		gExploreResult = exploreSaveMap(&map, gExploreArgv[1]);
+	else if( explorePrintDiff(&before, &map, stdout) == 0 )
+		printf("No differences\n");
+	return gExploreResult;
+}
+
+
+int exploreCommand( int argc, const char *argv[] )
+{
+	const char *cmd = argc > 0 ? argv[0] : "";
+	
+	if( !((strcmp(cmd, "read") == 0 && (argc == 1 || argc == 3)) ||
+	      (strcmp(cmd, "snapshot") == 0 && (argc == 2 || argc == 4)) ||
+	      (strcmp(cmd, "diff") == 0 && (argc == 2 || argc == 3)) ||
+	      (strcmp(cmd, "sweep") == 0 && (argc == 3 || argc == 4))) ) {
+		fprintf(stderr, "Usage: cm6206-enabler explore read|snapshot|diff|sweep ...; see -h\n");
+		return -1;
+	}
+	
+	// Comparing two snapshots doesn't need a device
+	if( strcmp(cmd, "diff") == 0 && argc == 3 ) {
+		CMRegisterMap before, after;
+		
+		if( exploreLoadMap(&before, argv[1]) || exploreLoadMap(&after, argv[2]) )
+			return -1;
+		if( explorePrintDiff(&before, &after, stdout) == 0 )
+			printf("No differences\n");
+		return 0;
+	}
+	
+	gExploreArgc = argc;
+	gExploreArgv = argv;
+	gInterfaceAction = exploreInterface;
+	ActivateDevices();
+	if( gExploreDevices == 0 ) {
+		fprintf(stderr, "No CM6206 device found on the USB bus.\n");
+		return -1;
+	}
+	return gExploreResult;
+}
+
+
+//================================================================================================
+// The gpio command. The activation commands leave all four pins as inputs.
+//
+static int parseLevel( const char *arg, int *level )
+{
+	if( strcmp(arg, "in") == 0 ) {
+		*level = kGPIOInput;
+		return 0;
+	}
+	return parseNumber(arg, 0, 1, level);
+}
+
+
+static int gpioInterface( CMTransport *t, const CMDeviceModel *model, void *refCon )
+{
+	CMGPIO g;
+	int i;
+	
+	if( gGpioDevices++ > 0 ) {
+		fprintf(stderr, "Skipping another %s; only the first one is used\n", model->chip);
+		return 0;
+	}
+	if( gpioOpen(&g, t) )
+		return gGpioResult = -1;
+	
+	if( strcmp(gGpioCmd, "get") == 0 ) {
+		for( i = 1; i <= kGPIONumPins; i++ ) {
+			int level = gpioGet(&g, i);
+			
+			if( level == kGPIOInput )
+				printf("GPIO%d: input\n", i);
+			else
+				printf("GPIO%d: output %d\n", i, level);
+		}
+		return gGpioResult = 0;
+	}
+	
+	if( strcmp(gGpioCmd, "pulse") == 0 )
+		gGpioResult = gpioPulse(&g, gGpioOps[0].pin, gGpioOps[0].level, gGpioPulseUs);
+	else {
+		for( i = 0; i < gGpioNumOps; i++ ) {
+			if( gGpioOps[i].level == kGPIOInput )
+				gpioRelease(&g, gGpioOps[i].pin);
+			else
+				gpioSet(&g, gGpioOps[i].pin, gGpioOps[i].level);
+		}
+		gGpioResult = gpioFlush(&g);
+	}
+	if( gGpioResult )
+		fprintf(stderr, "Error: could not write the GPIO pins\n");
+	else if( gVerbose )
+		fprintf(stderr, "%lu pin change(s) sent in %lu write(s)\n", g.changes, g.writes);
+	return gGpioResult;
+}
+
+
+int gpioCommand( int argc, const char *argv[] )
+{
+	const char *cmd = argc > 0 ? argv[0] : "";
+	int i, ms;
+	
+	if( !((strcmp(cmd, "get") == 0 && argc == 1) ||
+	      (strcmp(cmd, "set") == 0 && argc >= 3 && argc % 2 == 1 && argc <= 1 + 2 * kMaxGpioOps) ||
+	      (strcmp(cmd, "pulse") == 0 && (argc == 3 || argc == 4))) ) {
+		fprintf(stderr, "Usage: cm6206-enabler gpio get|set|pulse ...; see -h\n");
+		return -1;
+	}
+	
+	// Check all of it before touching the device
+	if( strcmp(cmd, "set") == 0 ) {
+		for( i = 1; i < argc; i += 2, gGpioNumOps++ )
+			if( parseNumber(argv[i], 1, kGPIONumPins, &gGpioOps[gGpioNumOps].pin) ||
+			    parseLevel(argv[i + 1], &gGpioOps[gGpioNumOps].level) )
+				return -1;
+	}
+	else if( strcmp(cmd, "pulse") == 0 ) {
+		gGpioOps[0].level = 1;
+		if( parseNumber(argv[1], 1, kGPIONumPins, &gGpioOps[0].pin) ||
+		    parseNumber(argv[2], 1, 60000, &ms) ||
+		    (argc == 4 && parseNumber(argv[3], 0, 1, &gGpioOps[0].level)) )
+			return -1;
+		gGpioPulseUs = ms * 1000ul;
+	}
+	
+	gGpioCmd = cmd;
+	gInterfaceAction = gpioInterface;
+	ActivateDevices();
+	if( gGpioDevices == 0 ) {
+		fprintf(stderr, "No CM6206 device found on the USB bus.\n");
+		return -1;
+	}
+	return gGpioResult;
+}
+
+
+//================================================================================================
+// The mixer command: USB Audio Class volume and mute, bypassing the OS mixer.
+//
+static int mixerInterface( CMTransport *t, const CMDeviceModel *model, void *refCon )
+{
+	CMMixer m;
+	uint8_t interface, unit;
+	int numChannels, first, last, c;
+	
+	if( gMixerDevices++ > 0 ) {
+		fprintf(stderr, "Skipping another %s; only the first one is used\n", model->chip);
+		return 0;
+	}
+	if( mixerFindFeatureUnit(t, &interface, &unit, &numChannels) ||
+	    mixerOpen(&m, t, interface, unit, numChannels) )
+		return gMixerResult = -1;
+	if( gVerbose )
+		fprintf(stderr, "Feature unit %d on interface %d, %d channels\n", unit, interface, numChannels);
+	
+	if( strcmp(gMixerCmd, "get") == 0 ) {
+		for( c = 0; c <= m.numChannels; c++ ) {
+			if( !m.ch[c].hasVolume && !m.ch[c].hasMute )
+				continue;
+			if( c == 0 )
+				printf("Master ");
+			else
+				printf("Ch %d   ", c);
+			if( m.ch[c].hasVolume )
+				printf("%7.2f dB (%.2f to %.2f)", m.ch[c].volume / 256.0, m.ch[c].min / 256.0, m.ch[c].max / 256.0);
+			if( m.ch[c].hasMute )
+				printf("%s", m.ch[c].muted ? "  muted" : "");
+			printf("\n");
+		}
+		return gMixerResult = 0;
+	}
+	
+	first = gMixerChannel < 0 ? 1 : gMixerChannel;
+	last = gMixerChannel < 0 ? m.numChannels : gMixerChannel;
+	if( last > m.numChannels ) {
+		fprintf(stderr, "Error: the %s has only %d channels\n", model->chip, m.numChannels);
+		return gMixerResult = -1;
+	}
+	for( c = first; c <= last; c++ ) {
+		if( strcmp(gMixerCmd, "mute") == 0 )
+			gMixerResult |= mixerSetMute(&m, c, gMixerMute);
+		else if( gMixerFadeMs > 0 )
+			gMixerResult |= mixerRamp(&m, c, kMixerDB(gMixerDB), gMixerFadeMs * 1000ull);
+		else
+			gMixerResult |= mixerSetVolume(&m, c, kMixerDB(gMixerDB));
+	}
+	if( mixerFinish(&m) )
+		gMixerResult = -1;
+	if( gVerbose )
+		fprintf(stderr, "%lu control transfers, %lu unchanged values not sent\n", m.transfers, m.skipped);
+	return gMixerResult;
+}
+
+
+int mixerCommand( int argc, const char *argv[] )
+{
+	const char *cmd = argc > 0 ? argv[0] : "";
+	char *end;
+	
+	if( !((strcmp(cmd, "get") == 0 && argc == 1) ||
+	      (strcmp(cmd, "volume") == 0 && (argc == 3 || argc == 4)) ||
+	      (strcmp(cmd, "mute") == 0 && argc == 3)) ) {
+		fprintf(stderr, "Usage: cm6206-enabler mixer get|volume|mute ...; see -h\n");
+		return -1;
+	}
+	
+	if( argc > 1 ) {
+		if( strcmp(argv[1], "all") == 0 )
+			gMixerChannel = -1;
+		else if( parseNumber(argv[1], 0, kMixerMaxChannels, &gMixerChannel) )
+			return -1;
+	}
+	if( strcmp(cmd, "volume") == 0 ) {
+		gMixerDB = strtod(argv[2], &end);
+		if( *end != '\0' || gMixerDB < -127 || gMixerDB > 127 ) {
+			fprintf(stderr, "Error: `%s' is not a volume in dB\n", argv[2]);
+			return -1;
+		}
+		if( argc == 4 && parseNumber(argv[3], 0, 60000, &gMixerFadeMs) )
+			return -1;
+	}
+	else if( strcmp(cmd, "mute") == 0 ) {
+		if( strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0 ) {
+			fprintf(stderr, "Error: mute must be `on' or `off'\n");
+			return -1;
+		}
+		gMixerMute = strcmp(argv[2], "on") == 0;
+	}
+	
+	gMixerCmd = cmd;
+	gInterfaceAction = mixerInterface;
+	ActivateDevices();
+	if( gMixerDevices == 0 ) {
+		fprintf(stderr, "No CM6206 device found on the USB bus.\n");
+		return -1;
+	}
+	return gMixerResult;
+}
+
+
+//================================================================================================
+// Sleep and wake. Before sleep every known device is snapshotted and soft-muted,
+// with no retries, so that sleep is acknowledged straight away. On wake the
+// same list is restored in one pass, without enumerating the bus; devices
+// plugged in during sleep arrive through DeviceAdded as usual.
+//
+static int quiesceDevices( void )
+{
+	// Sleep waits for this, so failed transfers get little time to recover
+	InterfaceJob job = { quiesceInterface, NULL, 1, kPowerAckBudgetUs / 2 };
+	MyPrivateData *dev;
+	int failed = 0;
+	
+	for( dev = gDevices; dev; dev = dev->next ) {
+		if( dev->model == NULL || dev->service == 0 )
+			continue;
+		job.refCon = dev;
+		dev->lastResult = -1;
+		dealWithDevice(dev->service, dev->model, &job);
+		failed += dev->lastResult != 0;
+	}
+	return failed;
+}
+
+
+static int restoreDevices( int openAttempts, int onlyFailed )
+{
+	InterfaceJob job = { restoreInterface, NULL, openAttempts };
+	MyPrivateData *dev;
+	int failed = 0;
+	
+	for( dev = gDevices; dev; dev = dev->next ) {
+		if( dev->model == NULL || dev->service == 0 || (onlyFailed && dev->lastResult == 0) )
+			continue;
+		job.refCon = dev;
+		dev->lastResult = -1;
+		dealWithDevice(dev->service, dev->model, &job);
+		failed += dev->lastResult != 0;
+	}
+	return failed;
+}
+
+
+static int countDevices( void )
+{
+	MyPrivateData *dev;
+	int n = 0;
+	
+	for( dev = gDevices; dev; dev = dev->next )
+		n += dev->service != 0;
+	return n;
+}
+
+
 //================================================================================================
 // Callback for power events (sleep, wake).
 //
 void powerCallback(void *rootPort, io_service_t y, natural_t msgType, void *msgArgument)
 {	
 	if( msgType == kIOMessageSystemHasPoweredOn ) {
+		uint64_t start = cmMonotonicUs();
+		int failed;
+		
 		if(gVerbose)
-			fprintf(stderr, "Waking from sleep, re-activating any CM6206 devices...\n");
-		sleep(1);
-		ActivateDevices();
+			fprintf(stderr, "Waking from sleep, restoring any CM6206 devices...\n");
+		failed = restoreDevices(gConfig->openAttempts, 0);
+		if( failed ) {
+			// Some hubs take a moment after wake; this used to be a fixed delay
+			// before every restore
+			usleep(gConfig->retryDelayMs * 1000);
+			failed = restoreDevices(1, 1);
+		}
+		powerRecordWake(&gPowerStats, cmMonotonicUs() - start, countDevices(), failed, stderr);
 	}
-	else if( msgType == kIOMessageCanSystemSleep ||
-	         msgType == kIOMessageSystemWillSleep ) {
+	else if( msgType == kIOMessageSystemWillSleep ) {
+		uint64_t start = cmMonotonicUs();
+		int failed = quiesceDevices();
+		
+		// Sleep waits for this (or a 30 s timeout), so nothing slow may come before it
+		IOAllowPowerChange(* (io_connect_t *) rootPort, (long) msgArgument);
+		powerRecordSleep(&gPowerStats, cmMonotonicUs() - start, countDevices(), failed, stderr);
+	}
+	else if( msgType == kIOMessageCanSystemSleep ) {
 		// This case must be treated, otherwise the system will wait in vain for the program
 		// to allow sleep, and only sleep after a timeout.
 		IOAllowPowerChange(* (io_connect_t *) rootPort, (long) msgArgument);
@@ -1025,11 +1758,130 @@ void powerCallback(void *rootPort, io_service_t y, natural_t msgType, void *msgA
 }
 
 
+//================================================================================================
+// The configuration file. It is read once at start; in daemon mode it is also
+// watched, and an edit is applied to the devices already known by sending only
+// the registers whose planned values changed. Nothing is restarted or
+// re-enumerated. A file with errors is ignored and the settings in use stay.
+//
+static CMConfig *loadConfig( const char *path, int optional )
+{
+	CMConfig *cfg = malloc(sizeof(CMConfig));
+	
+	if( cfg == NULL || configLoad(cfg, path, optional) != 0 ) {
+		free(cfg);
+		return NULL;
+	}
+	return cfg;
+}
+
+
+static const CMDeviceModel *findModel( const CMConfig *cfg, UInt16 vendorID, UInt16 productID )
+{
+	int i;
+	
+	for( i = 0; i < cfg->numModels; i++ )
+		if( cfg->models[i].vendorID == vendorID && cfg->models[i].productID == productID )
+			return &cfg->models[i];
+	return NULL;
+}
+
+
+// Loads the one configuration file in use: the one given with -c, which must
+// exist, or else the default one if it does
+static int loadStartupConfig( int optional )
+{
+	gConfig = loadConfig(gConfigPath, optional);
+	if( gConfig == NULL )
+		return -1;
+	cmSetDeviceModels(gConfig->models, gConfig->numModels);
+	return 0;
+}
+
+
+static void reloadConfig( void )
+{
+	CMConfig *cfg = loadConfig(gConfigPath, 1), *old = gConfig;
+	MyPrivateData *dev;
+	int devices = 0, sent = 0;
+	
+	if( cfg == NULL ) {
+		fprintf(stderr, "%s not applied, keeping the current settings\n", gConfigPath);
+		return;
+	}
+	for( dev = gDevices; dev; dev = dev->next ) {
+		const CMDeviceModel *model;
+		ConfigUpdate update;
+		
+		// A device whose model was removed stays known, so adding it back
+		// applies the whole plan
+		model = findModel(cfg, dev->vendorID, dev->productID);
+		if( dev->service == 0 ) {
+			// Away for now; it is activated with the new settings if it returns
+			dev->model = model;
+			continue;
+		}
+		if( model ) {
+			InterfaceJob job = { applyInterface, &update, 1 };
+			
+			// After a shortfall the device is somewhere between two models,
+			// so it gets the whole plan rather than a diff
+			update.numWrites = configDiff(dev->needsFullPlan ? NULL : dev->model, model, update.writes, kConfigMaxWrites);
+			update.sent = 0;
+			dev->needsFullPlan = 0;
+			if( update.numWrites > 0 ) {
+				dealWithDevice(dev->service, model, &job);
+				if( update.sent < update.numWrites ) {
+					fprintf(stderr, "%s (%s): %d of %d register writes sent, the next reload sends them all again\n",
+							model->chip, model->product, update.sent, update.numWrites);
+					dev->needsFullPlan = 1;
+				}
+				sent += update.sent;
+				devices++;
+			}
+		}
+		else if(gVerbose && dev->model)
+			fprintf(stderr, "%s (%s) is no longer configured, leaving it as it is\n",
+					dev->model->chip, dev->model->product);
+		dev->model = model;
+	}
+	cmSetDeviceModels(cfg->models, cfg->numModels);
+	gDebouncer.settleUs = (uint64_t)cfg->settleDelayMs * 1000;
+	gConfig = cfg;
+	free(old);
+	fprintf(stderr, "%s reloaded: %d register writes to %d devices\n", gConfigPath, sent, devices);
+}
+
+
+static void configChanged( CFFileDescriptorRef fdRef, CFOptionFlags callBackTypes, void *info )
+{
+	if( configWatchChanged(CFFileDescriptorGetNativeDescriptor(fdRef)) )
+		reloadConfig();
+	CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+}
+
+
+static void watchConfig( void )
+{
+	int fd = configWatchOpen(gConfigPath);
+	CFFileDescriptorRef fdRef;
+	CFRunLoopSourceRef source;
+	
+	if( fd < 0 )
+		return;		// still works, just without reloading
+	fdRef = CFFileDescriptorCreate(kCFAllocatorDefault, fd, true, configChanged, NULL);
+	CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+	source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, fdRef, 0);
+	CFRunLoopAddSource(gRunLoop, source, kCFRunLoopDefaultMode);
+	CFRelease(source);
+}
+
+
 //================================================================================================
 //
 int main(int argc, const char * argv[])
 {
-	int					bDaemon = 0;
+	int					bDaemon = 0, configGiven = 0;
     sig_t				oldHandler;
 	gVerbose = 0;  // Default to silent mode (use -v for verbose output)
 
@@ -1042,6 +1894,14 @@ int main(int argc, const char * argv[])
 			gVerbose = 1;
 		else if( strcmp( argv[a], "-s" ) == 0 )
 			gVerbose = 0;
+		else if( strcmp( argv[a], "-r" ) == 0 && a + 1 < argc ) {
+			if( traceRecorderOpen( &gRecorder, argv[++a] ) != 0 )
+				return -1;
+		}
+		else if( strcmp( argv[a], "-c" ) == 0 && a + 1 < argc ) {
+			gConfigPath = argv[++a];
+			configGiven = 1;
+		}
 		else if( strcmp( argv[a], "-V" ) == 0 ) {
 			printf( "cm6206-enabler version %s\n", CMVERSION );
 			return 0;
@@ -1062,12 +1922,31 @@ int main(int argc, const char * argv[])
 		else if( strcmp( argv[a], "uninstall-daemon" ) == 0 ) {
 			return uninstallLaunchDaemon();
 		}
+		else if( strcmp( argv[a], "explore" ) == 0 ) {
+			if( loadStartupConfig(!configGiven) != 0 )
+				return -1;
+			return exploreCommand( argc - a - 1, argv + a + 1 );
+		}
+		else if( strcmp( argv[a], "gpio" ) == 0 ) {
+			if( loadStartupConfig(!configGiven) != 0 )
+				return -1;
+			return gpioCommand( argc - a - 1, argv + a + 1 );
+		}
+		else if( strcmp( argv[a], "mixer" ) == 0 ) {
+			if( loadStartupConfig(!configGiven) != 0 )
+				return -1;
+			return mixerCommand( argc - a - 1, argv + a + 1 );
+		}
 		else {
 			fprintf(stderr, "Ignoring unknown argument `%s'\n", (argv[a]));
 		}
 	}
 	
 	
+	// Only now, so that a broken file doesn't get in the way of -c, -V or -h
+	if( loadStartupConfig(!configGiven) != 0 )
+		return -1;
+	
 	// Set up a signal handler so we can clean up when we're interrupted from the command line
     // Otherwise we stay in our run loop forever.
     oldHandler = signal(SIGINT, SignalHandler);
@@ -1090,7 +1969,7 @@ int main(int argc, const char * argv[])
 		// if a device is found, send activation commands
 		// if a wake-from-sleep is detected, resend activation commands to all devices
 		// if a device disconnects, remove its reference
-		nRet = makeDictionary( &matchingDictionary, kVendorID, kProductID );
+		nRet = makeDictionary( &matchingDictionary );
 		if (nRet)
 			return nRet;
 
@@ -1117,6 +1996,16 @@ int main(int argc, const char * argv[])
 		}
 		CFRunLoopAddSource(gRunLoop, IONotificationPortGetRunLoopSource(notificationPort), kCFRunLoopDefaultMode);		
 		
+		// Apply edits to the configuration file as they are saved
+		watchConfig();
+		
+		// Fires when a port has settled after add and terminate notifications;
+		// armSettleTimer() sets the date each time
+		debounceInit(&gDebouncer, (uint64_t)gConfig->settleDelayMs * 1000);
+		gSettleTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + 1e9, 1e9, 0, 0,
+											settleTimerFired, NULL);
+		CFRunLoopAddTimer(gRunLoop, gSettleTimer, kCFRunLoopDefaultMode);
+		
 		// Iterate once to get already-present devices and arm the notification    
 		DeviceAdded(NULL, gAddedIter);	
 		
@@ -0,0 +1,608 @@
+/*
+ * main_linux.c - CM6206 Enabler for Linux
+ *
+ * The Linux counterpart of main.c. Devices are found through sysfs at
+ * startup and through kernel uevents afterwards, and the activation commands
+ * in cm6206.c are sent with libusb. Only the HID interface that carries the
+ * register commands is claimed (usbhid is detached from it for the few
+ * milliseconds that takes and re-attached afterwards); snd-usb-audio keeps
+ * the audio interfaces throughout, so playback is never interrupted.
+ *
+ * The kernel's own CM6206 boot quirk in snd-usb-audio writes different
+ * register values when it binds, which can happen before or after our
+ * activation on hot-plug. So in daemon mode a device is activated as soon
+ * as it appears, and again when snd-usb-audio has bound it.
+ *
+ * The configuration file (config.h) is watched with inotify in daemon mode;
+ * an edit is applied to the devices seen so far by sending only the
+ * registers whose planned values changed.
+ *
+ *   cc -O2 -std=gnu99 -o cm6206-enabler main_linux.c cm6206.c config.c retry.c hotplug.c usbtrace.c -lusb-1.0
+ *
+ * Needs libusb 1.0.23 or later, and root (or a udev rule giving access to
+ * the device node).
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "cm6206.h"
+#include "config.h"
+#include "retry.h"
+#include "hotplug.h"
+#include "usbtrace.h"
+
+#define CMVERSION "3.0.0"
+
+#define kCM6206Interface	3		// the HID interface; wIndex of the register commands
+#define kClaimAttempts		5		// usbhid may still be probing right after hot-plug
+#define kTransferTimeoutMs	1000
+
+// A device activated in daemon mode, kept until it is removed so that edits
+// to the configuration file can be applied to it
+typedef struct KnownDevice {
+	char				devNode[64];
+	uint16_t			vendorID, productID;	// the model is looked up again by these on reload
+	const CMDeviceModel	*model;					// NULL while the configuration has none for it
+	int					needsFullPlan;			// some writes for model didn't go through
+	struct KnownDevice	*next;
+} KnownDevice;
+
+// An opened device node, with the transport the code in cm6206.c uses
+typedef struct DevNode {
+	int						fd;
+	libusb_device_handle	*handle;
+	CMTransport				transport;
+	CMTraceTap				tap;
+	CMRetryPolicy			policy;
+} DevNode;
+
+static libusb_context			*gContext;
+static int						gVerbose;
+static CMTraceRecorder			gRecorder;
+static volatile sig_atomic_t	gRescan, gQuit;
+static KnownDevice				*gDevices;
+static CMRetryStats				gRetryStats;
+static CMConfig					*gConfig;
+static const char				*gConfigPath = kConfigDefaultPath;
+
+
+void printUsage( const char *progName )
+{
+	printf("Usage: %s [-s] [-d] [-v] [-V] [-c file] [-r file]\n", progName );
+	printf("  Activates sound outputs on CM6206 USB devices.\n\n");
+	printf("Options:\n");
+	printf("  -s: Silent mode (default in daemon mode)\n");
+	printf("  -v: Verbose mode\n");
+	printf("  -d: Daemon mode: the program keeps running and automatically activates any\n");
+	printf("      devices that are connected. SIGHUP re-activates all devices.\n");
+	printf("  -c: Read the device table and timings from this file instead of\n");
+	printf("      " kConfigDefaultPath " (used if it exists). In daemon mode, edits\n");
+	printf("      to the file are applied to connected devices as soon as it is saved.\n");
+	printf("  -r: Record all USB control requests to a binary trace file, which can be\n");
+	printf("      replayed against a simulated device with cm6206-replay.\n");
+	printf("  -V: Print version number and exit.\n");
+}
+
+
+//================================================================================================
+// libusb side of the CMTransport that the activation code in cm6206.c uses
+//
+static int32_t libusbResult( int err )
+{
+	switch( err ) {
+		case LIBUSB_SUCCESS:			return kCMReturnSuccess;
+		case LIBUSB_ERROR_PIPE:			return kCMUSBPipeStalled;
+		case LIBUSB_ERROR_TIMEOUT:		return kCMUSBTransactionTimeout;
+		case LIBUSB_ERROR_NO_DEVICE:	return kCMReturnNoDevice;
+		case LIBUSB_ERROR_BUSY:			return kCMReturnBusy;
+		case LIBUSB_ERROR_ACCESS:		return kCMReturnNotPrivileged;
+		case LIBUSB_ERROR_INVALID_PARAM:	return kCMReturnBadArgument;
+		case LIBUSB_ERROR_OVERFLOW:		return kCMReturnOverrun;
+		case LIBUSB_ERROR_NOT_SUPPORTED:	return kCMReturnUnsupported;
+		default:						return kCMReturnIOError;
+	}
+}
+
+
+static int32_t libusbControlRequest( void *ctx, CMControlRequest *req )
+{
+	int n = libusb_control_transfer(ctx, req->bmRequestType, req->bRequest, req->wValue, req->wIndex,
+									req->pData, req->wLength, kTransferTimeoutMs);
+
+	if( n < 0 ) {
+		fprintf(stderr, "Control request 0x%02x failed: %s\n", req->bRequest, libusb_error_name(n));
+		return libusbResult(n);
+	}
+	return kCMReturnSuccess;
+}
+
+
+// Recovery hooks for the retry policy (retry.h)
+static int32_t libusbClearStall( void *ctx )
+{
+	return libusbResult(libusb_clear_halt(ctx, 0));
+}
+
+
+static int32_t libusbReopen( void *ctx )
+{
+	libusb_release_interface(ctx, kCM6206Interface);
+	return libusbResult(libusb_claim_interface(ctx, kCM6206Interface));
+}
+
+
+//================================================================================================
+// Opens the device behind a /dev/bus/usb node and claims its HID interface
+//
+static int openDevNode( const char *devNode, DevNode *node )
+{
+	int err, attempt;
+
+	node->fd = open(devNode, O_RDWR | O_CLOEXEC);
+	if( node->fd < 0 ) {
+		fprintf(stderr, "Error: could not open %s: %s\n", devNode, strerror(errno));
+		return -1;
+	}
+	// Wrapping the node we already know avoids a scan of the whole bus
+	err = libusb_wrap_sys_device(gContext, (intptr_t)node->fd, &node->handle);
+	if( err ) {
+		fprintf(stderr, "Error: libusb could not use %s: %s\n", devNode, libusb_error_name(err));
+		close(node->fd);
+		return -1;
+	}
+	libusb_set_auto_detach_kernel_driver(node->handle, 1);
+	for( attempt = 1; ; attempt++ ) {
+		err = libusb_claim_interface(node->handle, kCM6206Interface);
+		if( err != LIBUSB_ERROR_BUSY || attempt == kClaimAttempts )
+			break;
+		usleep(2000);
+	}
+	if( err ) {
+		fprintf(stderr, "Error: could not claim interface %d of %s: %s\n", kCM6206Interface, devNode,
+				libusb_error_name(err));
+		libusb_close(node->handle);
+		close(node->fd);
+		return -1;
+	}
+
+	node->transport.controlRequest = libusbControlRequest;
+	node->transport.ctx = node->handle;
+	node->transport.submitRequest = NULL;
+	node->transport.runCompletions = NULL;
+	if( gRecorder.fp )
+		traceTap(&node->tap, &gRecorder, &node->transport, &node->transport);
+	// Failed transfers are recovered here, within a time limit per device
+	retryWrap(&node->policy, &node->transport, &gRetryStats, &node->transport);
+	node->policy.clearStall = libusbClearStall;
+	node->policy.reopen = libusbReopen;
+	node->policy.hookCtx = node->handle;
+	return 0;
+}
+
+
+static void closeDevNode( DevNode *node )
+{
+	if( gVerbose && node->policy.spentUs ) {
+		fprintf(stderr, "Transfer errors so far (%.0f ms spent recovering on this device):\n",
+				node->policy.spentUs / 1000.0);
+		retryReport(&gRetryStats, stderr);
+	}
+	// Gives interface 3 back to usbhid, if it had it
+	libusb_release_interface(node->handle, kCM6206Interface);
+	libusb_close(node->handle);
+	close(node->fd);
+}
+
+
+//================================================================================================
+// Activates the device behind a /dev/bus/usb node. eventUs is when the
+// hot-plug event arrived (0 if there wasn't one), for reporting latency.
+//
+static int activateDevNode( const char *devNode, const CMDeviceModel *model, uint64_t eventUs )
+{
+	DevNode node;
+	int failed;
+
+	if( openDevNode(devNode, &node) != 0 )
+		return -1;
+	if( gVerbose )
+		fprintf(stderr, "%s found: %s (%s)\n", model->chip, model->product, devNode);
+	failed = initCMDevice(&node.transport, model, gVerbose);
+	if( gVerbose && eventUs )
+		fprintf(stderr, "Activated %.1f ms after the hot-plug event\n", (cmMonotonicUs() - eventUs) / 1000.0);
+	closeDevNode(&node);
+	return failed ? -1 : 0;
+}
+
+
+// Sends a few register writes. Returns how many went through.
+static int applyDevNode( const char *devNode, const CMRegisterWrite *writes, int numWrites )
+{
+	DevNode node;
+	int i;
+
+	if( openDevNode(devNode, &node) != 0 )
+		return 0;
+	for( i = 0; i < numWrites; i++ ) {
+		if( writeCM6206Registers(&node.transport, writes[i].regNo, writes[i].value) != 0 ) {
+			fprintf(stderr, "  REG%d configuration (%s): FAILED\n", writes[i].regNo, writes[i].description);
+			break;
+		}
+		if( gVerbose )
+			fprintf(stderr, "  REG%d = 0x%04x (%s)\n", writes[i].regNo, writes[i].value, writes[i].description);
+	}
+	closeDevNode(&node);
+	return i;
+}
+
+
+//================================================================================================
+// Devices seen in daemon mode
+//
+static void rememberDevice( const char *devNode, const CMDeviceModel *model, int applied )
+{
+	KnownDevice *dev;
+
+	for( dev = gDevices; dev; dev = dev->next )
+		if( strcmp(dev->devNode, devNode) == 0 )
+			break;
+	if( dev == NULL ) {
+		dev = calloc(1, sizeof(KnownDevice));
+		if( dev == NULL )
+			return;
+		snprintf(dev->devNode, sizeof(dev->devNode), "%s", devNode);
+		dev->next = gDevices;
+		gDevices = dev;
+	}
+	dev->vendorID = model->vendorID;
+	dev->productID = model->productID;
+	dev->model = model;
+	dev->needsFullPlan = !applied;
+}
+
+
+static void forgetDevice( const char *devNode )
+{
+	KnownDevice **link, *dev;
+
+	for( link = &gDevices; (dev = *link); link = &dev->next ) {
+		if( strcmp(dev->devNode, devNode) == 0 ) {
+			*link = dev->next;
+			free(dev);
+			return;
+		}
+	}
+}
+
+
+//================================================================================================
+// sysfs helpers
+//
+static int readSysfsNumber( const char *dir, const char *attr, int base, int *value )
+{
+	char path[PATH_MAX], buf[32];
+	FILE *fp;
+	int ok;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fp = fopen(path, "r");
+	if( fp == NULL )
+		return -1;
+	ok = fgets(buf, sizeof(buf), fp) != NULL;
+	fclose(fp);
+	if( !ok )
+		return -1;
+	*value = (int)strtol(buf, NULL, base);
+	return 0;
+}
+
+
+// Finds the device node of the USB device whose sysfs directory is dir
+static int devNodeForSysfs( const char *dir, char *devNode, size_t size )
+{
+	int bus, dev;
+
+	if( readSysfsNumber(dir, "busnum", 10, &bus) || readSysfsNumber(dir, "devnum", 10, &dev) )
+		return -1;
+	snprintf(devNode, size, "/dev/bus/usb/%03d/%03d", bus, dev);
+	return 0;
+}
+
+
+//================================================================================================
+// Look for all matching devices and deal with them once.
+//
+int ActivateDevices( void )
+{
+	DIR *dir = opendir("/sys/bus/usb/devices");
+	struct dirent *entry;
+	char path[PATH_MAX], devNode[64];
+	int vendor, product, foundDevice = 0;
+
+	if( dir == NULL ) {
+		fprintf(stderr, "Error: could not read /sys/bus/usb/devices: %s\n", strerror(errno));
+		return -1;
+	}
+	// One pass over the bus, looking every device up in the device table
+	while( (entry = readdir(dir)) ) {
+		const CMDeviceModel *model;
+
+		// Interfaces ("1-2:1.0") don't have idVendor, so they drop out here
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s", entry->d_name);
+		if( readSysfsNumber(path, "idVendor", 16, &vendor) || readSysfsNumber(path, "idProduct", 16, &product) )
+			continue;
+		model = cmFindDeviceModel(vendor, product);
+		if( model == NULL )
+			continue;
+		foundDevice = 1;
+		if( devNodeForSysfs(path, devNode, sizeof(devNode)) == 0 ) {
+			rememberDevice(devNode, model, activateDevNode(devNode, model, 0) == 0);
+		}
+	}
+	closedir(dir);
+	if( !foundDevice && gVerbose )
+		fprintf(stderr, "No CM6206 device found on the USB bus.\n");
+	return 0;
+}
+
+
+static void handleEvent( const CMUEvent *ev, uint64_t eventUs )
+{
+	const CMDeviceModel *model = cmFindDeviceModel(ev->vendor, ev->product);
+	char devNode[64], path[PATH_MAX];
+	const char *slash;
+
+	switch( hotplugClassify(ev) ) {
+		case kHotplugDeviceAdded:
+			snprintf(devNode, sizeof(devNode), "/dev/bus/usb/%03d/%03d", ev->busnum, ev->devnum);
+			rememberDevice(devNode, model, activateDevNode(devNode, model, eventUs) == 0);
+			break;
+		case kHotplugAudioBound:
+			// Interface events don't carry the bus address; the parent device has it
+			slash = strrchr(ev->devpath, '/');
+			if( slash == NULL )
+				break;
+			snprintf(path, sizeof(path), "/sys%.*s", (int)(slash - ev->devpath), ev->devpath);
+			if( devNodeForSysfs(path, devNode, sizeof(devNode)) == 0 ) {
+				if( gVerbose )
+					fprintf(stderr, "snd-usb-audio bound %s, re-activating\n", devNode);
+				activateDevNode(devNode, model, eventUs);
+			}
+			break;
+		case kHotplugDeviceRemoved:
+			if( gVerbose )
+				fprintf(stderr, "%s removed (%s)\n", model->chip, ev->devpath);
+			snprintf(devNode, sizeof(devNode), "/dev/bus/usb/%03d/%03d", ev->busnum, ev->devnum);
+			forgetDevice(devNode);
+			break;
+		default:
+			// hotplugClassify() ignores devices that aren't configured, but one
+			// whose model was removed from the file is still known until it goes
+			if( strcmp(ev->action, "remove") == 0 && strcmp(ev->devtype, "usb_device") == 0 && ev->busnum > 0 ) {
+				snprintf(devNode, sizeof(devNode), "/dev/bus/usb/%03d/%03d", ev->busnum, ev->devnum);
+				forgetDevice(devNode);
+			}
+			break;
+	}
+}
+
+
+//================================================================================================
+// The configuration file, as in main.c: an edit is applied to the devices seen
+// so far by sending only the registers whose planned values changed, and a
+// file with errors is ignored.
+//
+static CMConfig *loadConfig( const char *path, int optional )
+{
+	CMConfig *cfg = malloc(sizeof(CMConfig));
+
+	if( cfg == NULL || configLoad(cfg, path, optional) != 0 ) {
+		free(cfg);
+		return NULL;
+	}
+	return cfg;
+}
+
+
+// Loads the one configuration file in use: the one given with -c, which must
+// exist, or else the default one if it does
+static int loadStartupConfig( int optional )
+{
+	gConfig = loadConfig(gConfigPath, optional);
+	if( gConfig == NULL )
+		return -1;
+	cmSetDeviceModels(gConfig->models, gConfig->numModels);
+	return 0;
+}
+
+
+static void reloadConfig( void )
+{
+	CMConfig *cfg = loadConfig(gConfigPath, 1), *old = gConfig;
+	KnownDevice *dev;
+	int devices = 0, sent = 0;
+
+	if( cfg == NULL ) {
+		fprintf(stderr, "%s not applied, keeping the current settings\n", gConfigPath);
+		return;
+	}
+	cmSetDeviceModels(cfg->models, cfg->numModels);
+	for( dev = gDevices; dev; dev = dev->next ) {
+		// A device whose model was removed stays known, so adding it back
+		// applies the whole plan
+		const CMDeviceModel *model = cmFindDeviceModel(dev->vendorID, dev->productID);
+		CMRegisterWrite writes[kConfigMaxWrites];
+		int n;
+
+		if( model == NULL ) {
+			if( gVerbose && dev->model )
+				fprintf(stderr, "%s (%s) is no longer configured, leaving it as it is\n",
+						dev->model->chip, dev->model->product);
+			dev->model = NULL;
+			continue;
+		}
+		// After a shortfall the device is somewhere between two models, so
+		// it gets the whole plan rather than a diff
+		n = configDiff(dev->needsFullPlan ? NULL : dev->model, model, writes, kConfigMaxWrites);
+		dev->model = model;
+		dev->needsFullPlan = 0;
+		if( n > 0 ) {
+			int done = applyDevNode(dev->devNode, writes, n);
+
+			if( done < n ) {
+				fprintf(stderr, "%s: %d of %d register writes sent, the next reload sends them all again\n",
+						dev->devNode, done, n);
+				dev->needsFullPlan = 1;
+			}
+			sent += done;
+			devices++;
+		}
+	}
+	gConfig = cfg;
+	free(old);
+	fprintf(stderr, "%s reloaded: %d register writes to %d devices\n", gConfigPath, sent, devices);
+}
+
+
+static void SignalHandler( int sig )
+{
+	if( sig == SIGHUP )
+		gRescan = 1;
+	else
+		gQuit = 1;
+}
+
+
+static int runDaemon( void )
+{
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	char buf[kUEventMaxSize];
+	CMUEvent ev;
+	int fd, watch;
+
+	// Listen before the first scan, so a device plugged in meanwhile isn't missed
+	fd = hotplugOpen();
+	if( fd < 0 )
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SignalHandler;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// Without a watch it still works, just without reloading
+	watch = configWatchOpen(gConfigPath);
+
+	ActivateDevices();
+	if( gVerbose )
+		printf("Waiting for devices.\n\n");
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = watch;		// ignored by poll() if -1
+	pfd[1].events = POLLIN;
+	while( !gQuit ) {
+		int len;
+
+		if( gRescan ) {
+			gRescan = 0;
+			ActivateDevices();
+		}
+		if( poll(pfd, 2, -1) < 0 ) {
+			if( errno == EINTR )
+				continue;
+			fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+			break;
+		}
+		while( (len = hotplugReceive(fd, buf, sizeof(buf))) > 0 ) {
+			uint64_t eventUs = cmMonotonicUs();
+
+			if( hotplugParse(buf, len, &ev) == 0 )
+				handleEvent(&ev, eventUs);
+		}
+		if( len == kHotplugOverflow ) {
+			// Some uevents were dropped; the devices in sysfs are the truth
+			if( gVerbose )
+				printf("Missed some uevents, rescanning devices.\n");
+			gRescan = 1;
+		} else if( len < 0 ) {
+			fprintf(stderr, "Error: could not receive uevents: %s\n", strerror(errno));
+			break;
+		}
+		if( (pfd[1].revents & POLLIN) && configWatchChanged(watch) )
+			reloadConfig();
+	}
+	if( watch >= 0 )
+		configWatchClose(watch);
+	close(fd);
+	return gQuit ? 0 : -1;
+}
+
+
+//================================================================================================
+//
+int main( int argc, const char *argv[] )
+{
+	int bDaemon = 0, configGiven = 0, ret;
+
+	for( int a = 1; a < argc; a++ ) {
+		if( strcmp( argv[a], "-d" ) == 0 ) {
+			bDaemon = 1;
+			gVerbose = 0;
+		}
+		else if( strcmp( argv[a], "-v" ) == 0 )
+			gVerbose = 1;
+		else if( strcmp( argv[a], "-s" ) == 0 )
+			gVerbose = 0;
+		else if( strcmp( argv[a], "-r" ) == 0 && a + 1 < argc ) {
+			if( traceRecorderOpen( &gRecorder, argv[++a] ) != 0 )
+				return -1;
+		}
+		else if( strcmp( argv[a], "-c" ) == 0 && a + 1 < argc ) {
+			gConfigPath = argv[++a];
+			configGiven = 1;
+		}
+		else if( strcmp( argv[a], "-V" ) == 0 ) {
+			printf( "cm6206-enabler version %s\n", CMVERSION );
+			return 0;
+		}
+		else if( strcmp( argv[a], "-h" ) == 0 || strcmp( argv[a], "--help" ) == 0 ) {
+			printUsage(argv[0]);
+			return 0;
+		}
+		else {
+			fprintf(stderr, "Ignoring unknown argument `%s'\n", (argv[a]));
+		}
+	}
+
+	// Only now, so that a broken file doesn't get in the way of -c, -V or -h
+	if( loadStartupConfig(!configGiven) != 0 )
+		return -1;
+
+	// Devices are always opened from their node, so libusb needn't scan the bus
+	libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
+	if( libusb_init(&gContext) != 0 ) {
+		fprintf(stderr, "Error: could not initialise libusb\n");
+		return -1;
+	}
+	ret = bDaemon ? runDaemon() : ActivateDevices();
+	libusb_exit(gContext);
+	traceRecorderClose(&gRecorder);
+	return ret;
+}
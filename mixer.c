@@ -0,0 +1,344 @@
+/*
+ * mixer.c - hardware volume and mute through USB Audio Class feature units
+ *
+ * The CM6206 describes its output volume and mute as a USB Audio Class
+ * feature unit, which the standard SET_CUR/GET_CUR requests reach directly,
+ * per channel and without going through the OS mixer. Each
+ * request is a control transfer of a millisecond or more, so values are
+ * cached, and fades are thinned out: a ramping channel is updated at most
+ * every kMixerMinIntervalUs and only when the value, rounded to the volume
+ * resolution the device reports, actually changes. A 500 ms fade is then
+ * at most 25 transfers per channel instead of one per millisecond.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mixer.h"
+
+#define kDescriptorTypeConfig		0x02
+#define kDescriptorTypeInterface	0x04
+#define kDescriptorTypeCSInterface	0x24
+#define kAudioClass					0x01
+#define kAudioControlSubclass		0x01
+#define kFeatureUnitSubtype			0x06
+
+
+static int32_t getDescriptor( CMTransport *t, uint8_t *buf, uint16_t length )
+{
+	CMControlRequest req;
+
+	req.bmRequestType = kCMRequestIn;	// standard, to the device
+	req.bRequest = 0x06;				// GET_DESCRIPTOR
+	req.wValue = kDescriptorTypeConfig << 8;
+	req.wIndex = 0;
+	req.wLength = length;
+	req.pData = buf;
+	return cmControlRequest(t, &req);
+}
+
+
+int mixerFindFeatureUnit( CMTransport *t, uint8_t *interface, uint8_t *unit, int *numChannels )
+{
+	uint8_t buf[kMixerMaxDescriptor];
+	int total, pos, inControl = 0, best = 0;
+	uint8_t currentInterface = 0;
+
+	if( getDescriptor(t, buf, 9) != kCMReturnSuccess ) {
+		fprintf(stderr, "Error: could not read the configuration descriptor\n");
+		return -1;
+	}
+	total = buf[2] | buf[3] << 8;
+	if( total > kMixerMaxDescriptor )
+		total = kMixerMaxDescriptor;
+	if( getDescriptor(t, buf, total) != kCMReturnSuccess ) {
+		fprintf(stderr, "Error: could not read the configuration descriptor\n");
+		return -1;
+	}
+
+	for( pos = 0; pos + 2 <= total && buf[pos] >= 2 && pos + buf[pos] <= total; pos += buf[pos] ) {
+		const uint8_t *d = buf + pos;
+
+		if( d[1] == kDescriptorTypeInterface && d[0] >= 9 ) {
+			currentInterface = d[2];
+			inControl = d[5] == kAudioClass && d[6] == kAudioControlSubclass;
+		}
+		// bUnitID, bSourceID, bControlSize, then bmaControls for the master
+		// and each channel, and iFeature
+		else if( inControl && d[1] == kDescriptorTypeCSInterface && d[2] == kFeatureUnitSubtype &&
+		         d[0] >= 7 && d[5] > 0 ) {
+			int size = d[5], n = (d[0] - 7) / size - 1, volumes = 0, c;
+
+			for( c = 0; c <= n; c++ )
+				if( d[6 + c * size] & 0x02 )
+					volumes++;
+			if( n > kMixerMaxChannels )
+				n = kMixerMaxChannels;
+			if( volumes > best ) {
+				best = volumes;
+				*interface = currentInterface;
+				*unit = d[3];
+				*numChannels = n;
+			}
+		}
+	}
+	if( best == 0 ) {
+		fprintf(stderr, "Error: the device has no feature unit with volume controls\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+static int32_t unitRequest( CMMixer *m, uint8_t request, uint8_t control, int ch, void *data, uint16_t length )
+{
+	CMControlRequest req;
+
+	req.bmRequestType = ((request & 0x80) ? kCMRequestIn : kCMRequestOut) | kCMRequestClass | kCMRequestInterface;
+	req.bRequest = request;
+	req.wValue = control << 8 | ch;
+	req.wIndex = m->unit << 8 | m->interface;
+	req.wLength = length;
+	req.pData = data;
+	m->transfers++;
+	return cmControlRequest(m->t, &req);
+}
+
+
+static int32_t getVolume( CMMixer *m, uint8_t request, int ch, int16_t *value )
+{
+	uint8_t buf[2];
+	int32_t result = unitRequest(m, request, kUACVolumeControl, ch, buf, 2);
+
+	if( result == kCMReturnSuccess )
+		*value = (int16_t)(buf[0] | buf[1] << 8);
+	return result;
+}
+
+
+static int32_t sendVolume( CMMixer *m, int ch, int16_t value )
+{
+	uint8_t buf[2] = { value & 0xFF, (uint16_t)value >> 8 };
+	int32_t result = unitRequest(m, kUACSetCur, kUACVolumeControl, ch, buf, 2);
+
+	if( result == kCMReturnSuccess )
+		m->ch[ch].volume = value;
+	else
+		m->failed++;
+	return result;
+}
+
+
+int mixerOpen( CMMixer *m, CMTransport *t, uint8_t interface, uint8_t unit, int numChannels )
+{
+	int c;
+
+	memset(m, 0, sizeof(CMMixer));
+	m->t = t;
+	m->interface = interface;
+	m->unit = unit;
+	m->numChannels = numChannels > kMixerMaxChannels ? kMixerMaxChannels : numChannels;
+
+	// Controls a channel doesn't have stall, which is how they're found
+	for( c = 0; c <= m->numChannels; c++ ) {
+		CMMixerChannel *ch = &m->ch[c];
+
+		ch->hasVolume = getVolume(m, kUACGetMin, c, &ch->min) == kCMReturnSuccess &&
+		                getVolume(m, kUACGetMax, c, &ch->max) == kCMReturnSuccess &&
+		                getVolume(m, kUACGetRes, c, &ch->res) == kCMReturnSuccess;
+		if( ch->res <= 0 )
+			ch->res = 1;
+	}
+	return mixerRefresh(m);
+}
+
+
+int mixerRefresh( CMMixer *m )
+{
+	int c, found = 0;
+
+	for( c = 0; c <= m->numChannels; c++ ) {
+		CMMixerChannel *ch = &m->ch[c];
+		uint8_t mute;
+
+		if( ch->hasVolume && getVolume(m, kUACGetCur, c, &ch->volume) != kCMReturnSuccess )
+			ch->hasVolume = 0;
+		ch->hasMute = unitRequest(m, kUACGetCur, kUACMuteControl, c, &mute, 1) == kCMReturnSuccess;
+		if( ch->hasMute )
+			ch->muted = mute != 0;
+		ch->ramping = 0;
+		found += ch->hasVolume + ch->hasMute;
+	}
+	if( found == 0 ) {
+		fprintf(stderr, "Error: feature unit %d has no volume or mute controls\n", m->unit);
+		return -1;
+	}
+	return 0;
+}
+
+
+static CMMixerChannel *volumeChannel( const CMMixer *m, int ch )
+{
+	if( ch < 0 || ch > m->numChannels || !m->ch[ch].hasVolume ) {
+		fprintf(stderr, "Error: channel %d has no volume control\n", ch);
+		return NULL;
+	}
+	return (CMMixerChannel *)&m->ch[ch];
+}
+
+
+// Clamps to the channel's range and rounds to its resolution
+static int16_t quantize( const CMMixerChannel *ch, long value )
+{
+	long steps;
+
+	if( value <= ch->min )
+		return ch->min;
+	if( value >= ch->max )
+		return ch->max;
+	steps = (value - ch->min + ch->res / 2) / ch->res;
+	value = ch->min + steps * ch->res;
+	return (int16_t)(value > ch->max ? ch->max : value);
+}
+
+
+int mixerGetVolume( const CMMixer *m, int ch, int16_t *volume )
+{
+	const CMMixerChannel *c = volumeChannel(m, ch);
+
+	if( c == NULL )
+		return -1;
+	*volume = c->volume;
+	return 0;
+}
+
+
+static int setVolume( CMMixer *m, int ch, int16_t volume )
+{
+	if( m->ch[ch].volume == volume ) {
+		m->skipped++;
+		return 0;
+	}
+	return sendVolume(m, ch, volume) == kCMReturnSuccess ? 0 : -1;
+}
+
+
+int mixerSetVolume( CMMixer *m, int ch, int16_t volume )
+{
+	CMMixerChannel *c = volumeChannel(m, ch);
+
+	if( c == NULL )
+		return -1;
+	c->ramping = 0;
+	return setVolume(m, ch, quantize(c, volume));
+}
+
+
+int mixerGetMute( const CMMixer *m, int ch, int *muted )
+{
+	if( ch < 0 || ch > m->numChannels || !m->ch[ch].hasMute ) {
+		fprintf(stderr, "Error: channel %d has no mute control\n", ch);
+		return -1;
+	}
+	*muted = m->ch[ch].muted;
+	return 0;
+}
+
+
+int mixerSetMute( CMMixer *m, int ch, int muted )
+{
+	uint8_t value = muted != 0;
+
+	if( ch < 0 || ch > m->numChannels || !m->ch[ch].hasMute ) {
+		fprintf(stderr, "Error: channel %d has no mute control\n", ch);
+		return -1;
+	}
+	if( m->ch[ch].muted == value ) {
+		m->skipped++;
+		return 0;
+	}
+	if( unitRequest(m, kUACSetCur, kUACMuteControl, ch, &value, 1) != kCMReturnSuccess ) {
+		m->failed++;
+		return -1;
+	}
+	m->ch[ch].muted = value;
+	return 0;
+}
+
+
+// Where a fade is at a given time, before rounding
+static long rampValue( const CMMixerChannel *c, uint64_t now )
+{
+	if( now >= c->rampEndUs )
+		return c->rampTo;
+	return c->rampFrom + (long)(c->rampTo - c->rampFrom) * (long)(now - c->rampStartUs) /
+	                     (long)(c->rampEndUs - c->rampStartUs);
+}
+
+
+int mixerRamp( CMMixer *m, int ch, int16_t volume, uint64_t durationUs )
+{
+	CMMixerChannel *c = volumeChannel(m, ch);
+	uint64_t now = cmMonotonicUs();
+
+	if( c == NULL )
+		return -1;
+	// Retargeting a fade carries on from where it is, not where the device is
+	c->rampFrom = c->ramping ? (int16_t)rampValue(c, now) : c->volume;
+	c->rampTo = quantize(c, volume);
+	c->rampStartUs = now;
+	c->rampEndUs = now + durationUs;
+	if( !c->ramping )
+		c->lastSentUs = 0;
+	c->ramping = 1;
+	return 0;
+}
+
+
+long mixerService( CMMixer *m )
+{
+	uint64_t now = cmMonotonicUs();
+	long wait = -1;
+	int i;
+
+	for( i = 0; i <= m->numChannels; i++ ) {
+		CMMixerChannel *c = &m->ch[i];
+		uint64_t next;
+		long due;
+
+		if( !c->ramping )
+			continue;
+		if( now >= c->rampEndUs || now - c->lastSentUs >= kMixerMinIntervalUs ) {
+			if( now >= c->rampEndUs )
+				c->ramping = 0;
+			// Counts as an update even when rounding leaves nothing to send
+			c->lastSentUs = now;
+			setVolume(m, i, quantize(c, rampValue(c, now)));
+			if( !c->ramping )
+				continue;
+		}
+		next = c->lastSentUs + kMixerMinIntervalUs;
+		if( next > c->rampEndUs )
+			next = c->rampEndUs;
+		due = next > now ? (long)(next - now) : 0;
+		if( wait < 0 || due < wait )
+			wait = due;
+	}
+	return wait;
+}
+
+
+int mixerFinish( CMMixer *m )
+{
+	unsigned long failed = m->failed;
+	long wait;
+
+	while( (wait = mixerService(m)) >= 0 )
+		if( wait > 0 )
+			usleep(wait);
+	return (int)(m->failed - failed);
+}
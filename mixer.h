@@ -0,0 +1,90 @@
+/*
+ * mixer.h - hardware volume and mute through USB Audio Class feature units
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_MIXER_H
+#define CM_MIXER_H
+
+#include <stdint.h>
+
+#include "cmusb.h"
+
+// USB Audio Class 1.0 requests and feature unit control selectors
+#define kUACSetCur				0x01
+#define kUACGetCur				0x81
+#define kUACGetMin				0x82
+#define kUACGetMax				0x83
+#define kUACGetRes				0x84
+#define kUACMuteControl			0x01
+#define kUACVolumeControl		0x02
+
+#define kMixerMaxChannels		8			// channel 0, the master, comes on top
+#define kMixerMinIntervalUs		20000		// a ramping channel is updated at most this often
+#define kMixerMaxDescriptor		1024
+
+// Volumes are in 1/256 dB, as UAC sends them
+#define kMixerDB(db)			((int16_t)((db) * 256))
+
+typedef struct CMMixerChannel {
+	int			hasVolume, hasMute;
+	int16_t		min, max, res;
+	int16_t		volume;				// as the device has it
+	int			muted;
+
+	// A fade in progress, linear in dB
+	int			ramping;
+	int16_t		rampFrom, rampTo;
+	uint64_t	rampStartUs, rampEndUs;
+	uint64_t	lastSentUs;
+} CMMixerChannel;
+
+typedef struct CMMixer {
+	CMTransport		*t;
+	uint8_t			interface;			// the audio control interface
+	uint8_t			unit;				// the feature unit's ID
+	int				numChannels;		// not counting the master
+	CMMixerChannel	ch[kMixerMaxChannels + 1];
+
+	unsigned long	transfers;			// control transfers sent
+	unsigned long	skipped;			// changes not sent because the device already had them
+	unsigned long	failed;
+} CMMixer;
+
+// Reads the configuration descriptor and finds the feature unit with volume
+// controls on the most channels, i.e. the one for the outputs. Returns 0 and
+// fills in interface, unit and numChannels, or -1 if there is none.
+int mixerFindFeatureUnit( CMTransport *t, uint8_t *interface, uint8_t *unit, int *numChannels );
+
+// Reads the range, resolution and current value of every control of the unit.
+// After that the values are cached: gets don't touch the bus, and sets of an
+// unchanged value send nothing. Returns non-zero if the unit can't be read.
+int mixerOpen( CMMixer *m, CMTransport *t, uint8_t interface, uint8_t unit, int numChannels );
+
+// Re-reads the current values, e.g. after the OS mixer may have changed them
+int mixerRefresh( CMMixer *m );
+
+// Channel 0 is the master, 1..numChannels the outputs. Setting a volume
+// stops a fade on that channel. Volumes are clamped to the channel's range.
+int mixerGetVolume( const CMMixer *m, int ch, int16_t *volume );
+int mixerSetVolume( CMMixer *m, int ch, int16_t volume );
+int mixerGetMute( const CMMixer *m, int ch, int *muted );
+int mixerSetMute( CMMixer *m, int ch, int muted );
+
+// Starts a fade from where the channel is now, which may be the middle of
+// another fade. Nothing is sent until mixerService().
+int mixerRamp( CMMixer *m, int ch, int16_t volume, uint64_t durationUs );
+
+// Moves the fades along: a channel gets a new volume at most every
+// kMixerMinIntervalUs, rounded to its resolution, and only if that differs
+// from what it has. Returns the microseconds until it should be called
+// again, or -1 when no fades are left.
+long mixerService( CMMixer *m );
+
+// Calls mixerService() until all fades are done. Returns the number of
+// transfers that failed.
+int mixerFinish( CMMixer *m );
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ * pcmconv.c - float <-> integer PCM conversion, (de)interleaving and dither
+ *
+ * All float-to-integer conversions go through one quantiser: scale, add
+ * dither, clip, round to nearest even. That kernel has AVX2 and NEON
+ * versions; the scalar version is the reference and does the same operations
+ * in the same order, so the output is bit-identical (build with
+ * -ffp-contract=off so the compiler does not fuse the scalar multiply-add).
+ * Packing into 16/24/32-bit words and the integer-to-float direction are
+ * plain loops that compilers vectorise on their own.
+ *
+ * Noise shaping feeds each channel's quantisation error back into its next
+ * sample, which is inherently serial, so the shaped path is scalar in every
+ * build.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define kHaveSIMD	1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define kHaveSIMD	1
+#else
+#define kHaveSIMD	0
+#endif
+
+#include "pcmconv.h"
+
+// Samples quantised per pass through the stack buffer. A multiple of every
+// channel count up to 8 and of kPCMDitherLanes, so chunks start on a frame.
+#define kChunk		840
+
+#define kScale16	32768.0f
+#define kScale24	8388608.0f
+#define kScale32	2147483648.0f
+#define kMax32		2147483520.0f	// largest float below 2^31
+
+static int gUseSIMD = kHaveSIMD;
+
+
+int pcmUseSIMD( int enable )
+{
+	gUseSIMD = enable && kHaveSIMD;
+	return gUseSIMD;
+}
+
+
+void pcmDitherInit( PCMDither *dither, int channels, int shaping, uint32_t seed )
+{
+	int i;
+
+	memset(dither, 0, sizeof(PCMDither));
+	dither->channels = channels < 1 ? 1 : (channels > kPCMMaxChannels ? kPCMMaxChannels : channels);
+	dither->shaping = shaping;
+	for( i = 0; i < kPCMDitherLanes; i++ ) {
+		// xorshift32 must never be seeded with zero
+		uint32_t s = seed + 0x9e3779b9u * (i + 1);
+		dither->rng[i] = s ? s : 0x6d2b79f5u;
+	}
+}
+
+
+//================================================================================================
+// Scalar reference
+//
+static inline float tpdf( uint32_t *state )
+{
+	uint32_t r = *state;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	*state = r;
+	// Difference of two 16-bit uniforms: triangular, +-1 LSB, exact in float
+	return (float)((int32_t)(r >> 16) - (int32_t)(r & 0xffff)) * (1.0f / 65536.0f);
+}
+
+
+static inline int32_t quantise( float x, float scale, float lo, float hi, float d )
+{
+	float v = x * scale;
+	v = v + d;
+	if( v > hi ) v = hi;
+	if( v < lo ) v = lo;
+	return (int32_t)lrintf(v);
+}
+
+
+static void quantiseScalar( const float *in, int32_t *out, size_t n, float scale, float lo, float hi, PCMDither *dither )
+{
+	size_t i;
+
+	if( !dither ) {
+		for( i = 0; i < n; i++ )
+			out[i] = quantise(in[i], scale, lo, hi, 0.0f);
+		return;
+	}
+	for( i = 0; i < n; i++ )
+		out[i] = quantise(in[i], scale, lo, hi, tpdf(&dither->rng[i % kPCMDitherLanes]));
+}
+
+
+//================================================================================================
+// Vector versions: kPCMDitherLanes samples at a time, one per generator lane
+//
+#if defined(__AVX2__)
+static size_t quantiseSIMD( const float *in, int32_t *out, size_t n, float scale, float lo, float hi, PCMDither *dither )
+{
+	__m256 vScale = _mm256_set1_ps(scale), vLo = _mm256_set1_ps(lo), vHi = _mm256_set1_ps(hi);
+	__m256 vLsb = _mm256_set1_ps(1.0f / 65536.0f);
+	__m256i vMask = _mm256_set1_epi32(0xffff);
+	__m256i s = dither ? _mm256_loadu_si256((const __m256i *)dither->rng) : _mm256_setzero_si256();
+	size_t i;
+
+	for( i = 0; i + 8 <= n; i += 8 ) {
+		__m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i), vScale);
+		if( dither ) {
+			__m256i d;
+			s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 13));
+			s = _mm256_xor_si256(s, _mm256_srli_epi32(s, 17));
+			s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 5));
+			d = _mm256_sub_epi32(_mm256_srli_epi32(s, 16), _mm256_and_si256(s, vMask));
+			v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_cvtepi32_ps(d), vLsb));
+		}
+		v = _mm256_max_ps(_mm256_min_ps(v, vHi), vLo);
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtps_epi32(v));
+	}
+	if( dither )
+		_mm256_storeu_si256((__m256i *)dither->rng, s);
+	return i;
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static inline uint32x4_t xorshift4( uint32x4_t s )
+{
+	s = veorq_u32(s, vshlq_n_u32(s, 13));
+	s = veorq_u32(s, vshrq_n_u32(s, 17));
+	return veorq_u32(s, vshlq_n_u32(s, 5));
+}
+
+static inline float32x4_t tpdf4( uint32x4_t s )
+{
+	int32x4_t d = vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(s, 16)),
+	                        vreinterpretq_s32_u32(vandq_u32(s, vdupq_n_u32(0xffff))));
+	return vmulq_f32(vcvtq_f32_s32(d), vdupq_n_f32(1.0f / 65536.0f));
+}
+
+static size_t quantiseSIMD( const float *in, int32_t *out, size_t n, float scale, float lo, float hi, PCMDither *dither )
+{
+	float32x4_t vScale = vdupq_n_f32(scale), vLo = vdupq_n_f32(lo), vHi = vdupq_n_f32(hi);
+	uint32x4_t s0 = vdupq_n_u32(0), s1 = vdupq_n_u32(0);
+	size_t i;
+
+	if( dither ) {
+		s0 = vld1q_u32(dither->rng);
+		s1 = vld1q_u32(dither->rng + 4);
+	}
+	for( i = 0; i + 8 <= n; i += 8 ) {
+		float32x4_t a = vmulq_f32(vld1q_f32(in + i), vScale);
+		float32x4_t b = vmulq_f32(vld1q_f32(in + i + 4), vScale);
+		if( dither ) {
+			s0 = xorshift4(s0);
+			s1 = xorshift4(s1);
+			a = vaddq_f32(a, tpdf4(s0));
+			b = vaddq_f32(b, tpdf4(s1));
+		}
+		a = vmaxq_f32(vminq_f32(a, vHi), vLo);
+		b = vmaxq_f32(vminq_f32(b, vHi), vLo);
+		vst1q_s32(out + i, vcvtnq_s32_f32(a));
+		vst1q_s32(out + i + 4, vcvtnq_s32_f32(b));
+	}
+	if( dither ) {
+		vst1q_u32(dither->rng, s0);
+		vst1q_u32(dither->rng + 4, s1);
+	}
+	return i;
+}
+#endif
+
+
+//================================================================================================
+// Quantise n samples to int32. Picks the shaped, vector or scalar path.
+//
+static void quantiseBlock( const float *in, int32_t *out, size_t n, float scale, float lo, float hi, PCMDither *dither )
+{
+	size_t done = 0;
+
+	if( dither && dither->shaping ) {
+		// First-order error feedback: the quantisation noise gets a (1 - z^-1)
+		// high-pass shape, moving it away from where the ear is most sensitive.
+		int ch = 0;
+		size_t i;
+		for( i = 0; i < n; i++ ) {
+			float v = in[i] * scale;
+			float w;
+			int32_t q;
+			int clipped;
+			v = v - dither->err[ch];
+			w = v + tpdf(&dither->rng[i % kPCMDitherLanes]);
+			clipped = w > hi || w < lo;
+			if( w > hi ) w = hi;
+			if( w < lo ) w = lo;
+			q = (int32_t)lrintf(w);
+			// Unclipped, the error is within +-1.5 LSB (dither plus rounding)
+			// and goes back unchanged. Clipping would feed back huge errors;
+			// those are held to the same bound to keep the loop stable.
+			w = (float)q - v;
+			if( clipped )
+				w = w > 1.5f ? 1.5f : (w < -1.5f ? -1.5f : w);
+			dither->err[ch] = w;
+			out[i] = q;
+			if( ++ch == dither->channels )
+				ch = 0;
+		}
+		return;
+	}
+#if kHaveSIMD
+	if( gUseSIMD )
+		done = quantiseSIMD(in, out, n, scale, lo, hi, dither);
+#endif
+	if( done < n ) {
+		// The tail starts on a multiple of kPCMDitherLanes, so i % lanes still matches
+		quantiseScalar(in + done, out + done, n - done, scale, lo, hi, dither);
+	}
+}
+
+
+//================================================================================================
+// Float to integer
+//
+void pcmFloatToS16( const float *in, int16_t *out, size_t n, PCMDither *dither )
+{
+	int32_t tmp[kChunk];
+	size_t i, k;
+
+	for( i = 0; i < n; i += kChunk ) {
+		size_t len = n - i < kChunk ? n - i : kChunk;
+		quantiseBlock(in + i, tmp, len, kScale16, -32768.0f, 32767.0f, dither);
+		for( k = 0; k < len; k++ )
+			out[i + k] = (int16_t)tmp[k];
+	}
+}
+
+
+void pcmFloatToS24( const float *in, uint8_t *out, size_t n, PCMDither *dither )
+{
+	int32_t tmp[kChunk];
+	size_t i, k;
+
+	for( i = 0; i < n; i += kChunk ) {
+		size_t len = n - i < kChunk ? n - i : kChunk;
+		uint8_t *p = out + 3 * i;
+		quantiseBlock(in + i, tmp, len, kScale24, -8388608.0f, 8388607.0f, dither);
+		for( k = 0; k < len; k++ ) {
+			p[3 * k] = (uint8_t)tmp[k];
+			p[3 * k + 1] = (uint8_t)(tmp[k] >> 8);
+			p[3 * k + 2] = (uint8_t)(tmp[k] >> 16);
+		}
+	}
+}
+
+
+void pcmFloatToS24in32( const float *in, int32_t *out, size_t n, PCMDither *dither )
+{
+	quantiseBlock(in, out, n, kScale24, -8388608.0f, 8388607.0f, dither);
+}
+
+
+void pcmFloatToS32( const float *in, int32_t *out, size_t n )
+{
+	// A float only carries 24 bits of mantissa, so there is nothing to dither
+	quantiseBlock(in, out, n, kScale32, -kScale32, kMax32, NULL);
+}
+
+
+//================================================================================================
+// Integer to float
+//
+void pcmS16ToFloat( const int16_t *in, float *out, size_t n )
+{
+	size_t i;
+	for( i = 0; i < n; i++ )
+		out[i] = (float)in[i] * (1.0f / kScale16);
+}
+
+
+void pcmS24ToFloat( const uint8_t *in, float *out, size_t n )
+{
+	size_t i;
+	for( i = 0; i < n; i++ ) {
+		uint32_t u = (uint32_t)in[3 * i] << 8 | (uint32_t)in[3 * i + 1] << 16 | (uint32_t)in[3 * i + 2] << 24;
+		out[i] = (float)((int32_t)u >> 8) * (1.0f / kScale24);
+	}
+}
+
+
+void pcmS24in32ToFloat( const int32_t *in, float *out, size_t n )
+{
+	size_t i;
+	for( i = 0; i < n; i++ )
+		out[i] = (float)((int32_t)((uint32_t)in[i] << 8) >> 8) * (1.0f / kScale24);
+}
+
+
+void pcmS32ToFloat( const int32_t *in, float *out, size_t n )
+{
+	size_t i;
+	for( i = 0; i < n; i++ )
+		out[i] = (float)in[i] * (1.0f / kScale32);
+}
+
+
+//================================================================================================
+// Interleaving. The fixed channel counts get their own copy of the loop so the
+// compiler can unroll the inner one completely.
+//
+static inline void interleaveN( const float * const *in, float *out, int channels, size_t frames )
+{
+	size_t f;
+	int c;
+	for( f = 0; f < frames; f++ )
+		for( c = 0; c < channels; c++ )
+			out[f * channels + c] = in[c][f];
+}
+
+
+static inline void deinterleaveN( const float *in, float * const *out, int channels, size_t frames )
+{
+	size_t f;
+	int c;
+	for( f = 0; f < frames; f++ )
+		for( c = 0; c < channels; c++ )
+			out[c][f] = in[f * channels + c];
+}
+
+
+void pcmInterleave( const float * const *in, float *out, int channels, size_t frames )
+{
+	switch( channels ) {
+		case 2: interleaveN(in, out, 2, frames); break;
+		case 4: interleaveN(in, out, 4, frames); break;
+		case 6: interleaveN(in, out, 6, frames); break;
+		case 8: interleaveN(in, out, 8, frames); break;
+		default: interleaveN(in, out, channels, frames); break;
+	}
+}
+
+
+void pcmDeinterleave( const float *in, float * const *out, int channels, size_t frames )
+{
+	switch( channels ) {
+		case 2: deinterleaveN(in, out, 2, frames); break;
+		case 4: deinterleaveN(in, out, 4, frames); break;
+		case 6: deinterleaveN(in, out, 6, frames); break;
+		case 8: deinterleaveN(in, out, 8, frames); break;
+		default: deinterleaveN(in, out, channels, frames); break;
+	}
+}
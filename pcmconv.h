@@ -0,0 +1,50 @@
+/*
+ * pcmconv.h - float <-> integer PCM conversion, (de)interleaving and dither
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_PCMCONV_H
+#define CM_PCMCONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define kPCMMaxChannels		8
+#define kPCMDitherLanes		8
+
+// TPDF dither state. The generator is kPCMDitherLanes independent xorshift32
+// streams; sample i of every call draws from lane i % kPCMDitherLanes, which
+// is what lets the vector and scalar code produce bit-identical output.
+typedef struct PCMDither {
+	uint32_t	rng[kPCMDitherLanes];
+	float		err[kPCMMaxChannels];	// noise-shaping error, per channel
+	int			channels;				// interleave stride of the data
+	int			shaping;				// 0: plain TPDF, 1: first-order noise shaping
+} PCMDither;
+
+void pcmDitherInit( PCMDither *dither, int channels, int shaping, uint32_t seed );
+
+// Selects the AVX2/NEON code (the default when compiled in) or the scalar
+// reference. Returns 1 if vector code is now in use, 0 otherwise.
+int pcmUseSIMD( int enable );
+
+// Float to integer. Input is clipped to [-1, 1). dither may be NULL for
+// plain round-to-nearest. n counts samples, not frames.
+void pcmFloatToS16( const float *in, int16_t *out, size_t n, PCMDither *dither );
+void pcmFloatToS24( const float *in, uint8_t *out, size_t n, PCMDither *dither );		// 3 bytes, little endian
+void pcmFloatToS24in32( const float *in, int32_t *out, size_t n, PCMDither *dither );	// low 24 bits, sign extended
+void pcmFloatToS32( const float *in, int32_t *out, size_t n );
+
+// Integer to float, scaled to [-1, 1).
+void pcmS16ToFloat( const int16_t *in, float *out, size_t n );
+void pcmS24ToFloat( const uint8_t *in, float *out, size_t n );
+void pcmS24in32ToFloat( const int32_t *in, float *out, size_t n );
+void pcmS32ToFloat( const int32_t *in, float *out, size_t n );
+
+// Planar <-> interleaved float, 2 to kPCMMaxChannels channels.
+void pcmInterleave( const float * const *in, float *out, int channels, size_t frames );
+void pcmDeinterleave( const float *in, float * const *out, int channels, size_t frames );
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * power.c - muting devices for system sleep and restoring them on wake
+ *
+ * The register snapshot is read with the pipelined reader from explore.c,
+ * which keeps the time between the sleep notification and its
+ * acknowledgement to a few milliseconds per device. Version 2.1 fixed a bug
+ * where that acknowledgement was late; the timings are logged for every
+ * cycle so it can't quietly come back.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include "explore.h"
+#include "power.h"
+
+
+int powerQuiesce( CMTransport *t, CMPowerSnapshot *snap )
+{
+	CMRegisterMap map;
+	int r;
+
+	snap->valid = 0;
+	if( exploreReadRange(t, 0, kPowerNumRegisters - 1, &map, NULL) != 0 )
+		return -1;
+	for( r = 0; r < kPowerNumRegisters; r++ )
+		snap->regs[r] = map.value[r];
+	if( writeCM6206Registers(t, 0x01, snap->regs[1] | kCM6206SoftMute) != 0 )
+		return -1;
+	snap->valid = 1;
+	return 0;
+}
+
+
+int powerRestore( CMTransport *t, const CMDeviceModel *model, CMPowerSnapshot *snap, int verbose )
+{
+	int r, failed = 0;
+
+	if( !snap->valid )
+		return initCMDevice(t, model, verbose);
+
+	// The chip may have lost power, so REG1 is rewritten too, still muted
+	if( writeCM6206Registers(t, 0x01, snap->regs[1] | kCM6206SoftMute) != 0 )
+		failed++;
+	for( r = 0; r < kPowerNumRegisters; r++ )
+		if( r != 1 && writeCM6206Registers(t, r, snap->regs[r]) != 0 )
+			failed++;
+	if( failed ) {
+		fprintf(stderr, "Warning: %d register writes failed on wake, leaving the %s muted\n", failed, model->chip);
+		return failed;
+	}
+	// Back to the state before sleep, which unmutes unless it was muted then
+	if( writeCM6206Registers(t, 0x01, snap->regs[1]) != 0 ) {
+		fprintf(stderr, "Warning: could not unmute the %s after wake\n", model->chip);
+		return 1;
+	}
+	snap->valid = 0;
+	if( verbose )
+		fprintf(stderr, "Restored %s registers REG0-REG%d from before sleep\n", model->chip, kPowerNumRegisters - 1);
+	return 0;
+}
+
+
+void powerRecordSleep( CMPowerStats *stats, uint64_t ackUs, int devices, int failed, FILE *log )
+{
+	stats->sleeps++;
+	stats->lastAckUs = ackUs;
+	stats->totalAckUs += ackUs;
+	if( ackUs > stats->maxAckUs )
+		stats->maxAckUs = ackUs;
+	fprintf(log, "Sleep %lu: %d device(s) muted, %d failed, acknowledged after %.1f ms (max %.1f ms)\n",
+			stats->sleeps, devices - failed, failed, ackUs / 1000.0, stats->maxAckUs / 1000.0);
+	if( ackUs > kPowerAckBudgetUs )
+		fprintf(log, "Warning: sleep acknowledgement took longer than %d ms\n", kPowerAckBudgetUs / 1000);
+}
+
+
+void powerRecordWake( CMPowerStats *stats, uint64_t restoreUs, int devices, int failed, FILE *log )
+{
+	stats->wakes++;
+	stats->restoreFailures += failed;
+	stats->lastWakeUs = restoreUs;
+	stats->totalWakeUs += restoreUs;
+	if( restoreUs > stats->maxWakeUs )
+		stats->maxWakeUs = restoreUs;
+	fprintf(log, "Wake %lu: %d device(s) restored, %d failed, %.1f ms after power-on (max %.1f ms)\n",
+			stats->wakes, devices - failed, failed, restoreUs / 1000.0, stats->maxWakeUs / 1000.0);
+	if( restoreUs > kPowerWakeBudgetUs )
+		fprintf(log, "Warning: restoring after wake took longer than %d ms\n", kPowerWakeBudgetUs / 1000);
+}
@@ -0,0 +1,49 @@
+/*
+ * power.h - muting devices for system sleep and restoring them on wake
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_POWER_H
+#define CM_POWER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cm6206.h"
+
+#define kPowerNumRegisters	6			// REG0-REG5, the registers the ALSA boot quirk sets
+#define kCM6206SoftMute		0x1000		// REG1 bit12 SOFTMUTEen
+#define kPowerAckBudgetUs	100000		// sleep acknowledgements slower than this get a warning
+#define kPowerWakeBudgetUs	2000000
+
+typedef struct CMPowerSnapshot {
+	uint16_t	regs[kPowerNumRegisters];
+	int			valid;					// the registers were read and the device muted
+} CMPowerSnapshot;
+
+typedef struct CMPowerStats {
+	unsigned long	sleeps, wakes;
+	unsigned long	restoreFailures;
+	uint64_t		lastAckUs, maxAckUs, totalAckUs;
+	uint64_t		lastWakeUs, maxWakeUs, totalWakeUs;
+} CMPowerStats;
+
+// Reads the register state into snap and soft-mutes the device, so nothing
+// pops while it loses power. Returns 0 on success; otherwise snap is marked
+// invalid and the device is left as it was.
+int powerQuiesce( CMTransport *t, CMPowerSnapshot *snap );
+
+// Writes the snapshot back with the device still muted, and unmutes it only
+// if all of that worked; the snapshot is used up then, and kept for another
+// attempt otherwise. Without a valid snapshot the model's activation plan is
+// sent instead. Returns the number of writes that failed.
+int powerRestore( CMTransport *t, const CMDeviceModel *model, CMPowerSnapshot *snap, int verbose );
+
+// Record one sleep acknowledgement / one wake, and log it with the running
+// maximum, warning when a budget above was exceeded.
+void powerRecordSleep( CMPowerStats *stats, uint64_t ackUs, int devices, int failed, FILE *log );
+void powerRecordWake( CMPowerStats *stats, uint64_t restoreUs, int devices, int failed, FILE *log );
+
+#endif
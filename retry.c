@@ -0,0 +1,204 @@
+/*
+ * retry.c - recovering from failed control transfers
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <unistd.h>
+
+#include "retry.h"
+
+// IOKit USB family codes without a cmusb.h name; the values are IOUSBLib's
+#define kUSBNotSent1Err				((int32_t)0xe000400e)
+#define kUSBNotSent2Err				((int32_t)0xe000400f)
+#define kUSBBufferUnderrunErr		((int32_t)0xe000400c)
+#define kUSBBufferOverrunErr		((int32_t)0xe000400b)
+#define kUSBTransactionReturned		((int32_t)0xe0004050)
+#define kUSBLinkErr					((int32_t)0xe0004010)
+#define kUSBWrongPIDErr				((int32_t)0xe0004007)
+#define kUSBPIDCheckErr				((int32_t)0xe0004006)
+#define kUSBDataToggleErr			((int32_t)0xe0004003)
+#define kUSBBitstufErr				((int32_t)0xe0004002)
+#define kUSBCRCErr					((int32_t)0xe0004001)
+#define kReturnNotReady				((int32_t)0xe00002d8)
+#define kReturnOffline				((int32_t)0xe00002d7)
+#define kReturnUnderrun				((int32_t)0xe00002e7)
+#define kReturnDMAError				((int32_t)0xe00002d4)
+
+
+CMErrorClass retryClassify( int32_t err )
+{
+	switch( err ) {
+		// The chip (or the bus) halted the pipe; a CLEAR_FEATURE is needed
+		case kCMUSBPipeStalled:
+		case kUSBWrongPIDErr:
+		case kUSBPIDCheckErr:
+		case kUSBDataToggleErr:
+		case kUSBBitstufErr:
+		case kUSBCRCErr:
+			return kCMErrorStall;
+		case kCMUSBTransactionTimeout:
+		case kCMReturnTimeout:
+		case kCMReturnNotResponding:
+			return kCMErrorTimeout;
+		case kCMReturnAborted:
+		case kCMReturnBusy:
+		case kCMReturnOverrun:
+		case kReturnUnderrun:
+		case kReturnDMAError:
+		case kReturnNotReady:
+		case kUSBNotSent1Err:
+		case kUSBNotSent2Err:
+		case kUSBBufferUnderrunErr:
+		case kUSBBufferOverrunErr:
+		case kUSBTransactionReturned:
+		case kUSBLinkErr:
+		case kCMReturnIOError:
+			return kCMErrorInterrupted;
+		case kCMReturnNotOpen:
+		case kReturnOffline:
+			return kCMErrorClosed;
+		default:
+			// kIOReturnNoDevice, NotAttached, NoPower, NotPrivileged,
+			// BadArgument, Unsupported, ExclusiveAccess and anything unknown
+			return kCMErrorFatal;
+	}
+}
+
+
+const char *retryClassName( CMErrorClass c )
+{
+	static const char *names[kCMNumErrorClasses] = { "stall", "timeout", "interrupted", "closed", "fatal" };
+
+	return c < kCMNumErrorClasses ? names[c] : "?";
+}
+
+
+// Runs the recovery for an error class. Returns 0 if the request may be tried
+// again, after `attempt' attempts.
+static int recover( CMRetryPolicy *p, CMErrorClass c, int attempt )
+{
+	useconds_t pause;
+
+	switch( c ) {
+		case kCMErrorStall:
+			// A request the chip doesn't support stalls every time; one
+			// retry tells that apart from a stall on the line
+			if( attempt > 1 || p->clearStall == NULL )
+				return -1;
+			return p->clearStall(p->hookCtx) == kCMReturnSuccess ? 0 : -1;
+		case kCMErrorTimeout:
+		case kCMErrorInterrupted:
+			pause = (c == kCMErrorTimeout ? kRetryTimeoutPauseUs : kRetryFirstPauseUs) << (attempt - 1);
+			if( p->spentUs + pause >= p->budgetUs )
+				return -1;
+			usleep(pause);
+			return 0;
+		case kCMErrorClosed:
+			if( attempt > 1 || p->reopen == NULL )
+				return -1;
+			return p->reopen(p->hookCtx) == kCMReturnSuccess ? 0 : -1;
+		default:
+			return -1;
+	}
+}
+
+
+static int32_t retryControlRequest( void *ctx, CMControlRequest *req )
+{
+	CMRetryPolicy *p = ctx;
+	CMErrorClass last = kCMErrorFatal;
+	int32_t err;
+	int attempt;
+
+	// Once the time is used up the device is taken to be dead: what is left
+	// of the plan fails at once instead of waiting out a timeout per request
+	if( p->spentUs >= p->budgetUs && p->lastError != kCMReturnSuccess ) {
+		if( p->stats ) {
+			p->stats->outOfTime++;
+			p->stats->gaveUp[retryClassify(p->lastError)]++;
+		}
+		return p->lastError;
+	}
+	for( attempt = 1; ; attempt++ ) {
+		uint64_t start = cmMonotonicUs();
+
+		err = cmControlRequest(&p->inner, req);
+		if( err == kCMReturnSuccess ) {
+			if( attempt > 1 && p->stats )
+				p->stats->recovered[last]++;
+			return err;
+		}
+		// Charged before deciding anything, so every failed attempt counts
+		p->spentUs += cmMonotonicUs() - start;
+		p->lastError = err;
+		last = retryClassify(err);
+		if( p->stats )
+			p->stats->errors[last]++;
+		if( last == kCMErrorFatal || attempt == kRetryMaxAttempts )
+			break;
+		if( p->spentUs >= p->budgetUs ) {
+			if( p->stats )
+				p->stats->outOfTime++;
+			break;
+		}
+		start = cmMonotonicUs();
+		if( recover(p, last, attempt) != 0 ) {
+			p->spentUs += cmMonotonicUs() - start;
+			break;
+		}
+		p->spentUs += cmMonotonicUs() - start;
+		if( p->stats )
+			p->stats->retries++;
+	}
+	if( p->stats )
+		p->stats->gaveUp[last]++;
+	return err;
+}
+
+
+static int32_t retrySubmitRequest( void *ctx, CMControlRequest *req, CMRequestCompletion done, void *refcon )
+{
+	CMRetryPolicy *p = ctx;
+
+	return p->inner.submitRequest(p->inner.ctx, req, done, refcon);
+}
+
+
+static int retryRunCompletions( void *ctx, int timeoutMs )
+{
+	CMRetryPolicy *p = ctx;
+
+	return p->inner.runCompletions(p->inner.ctx, timeoutMs);
+}
+
+
+void retryWrap( CMRetryPolicy *policy, const CMTransport *inner, CMRetryStats *stats, CMTransport *out )
+{
+	policy->inner = *inner;
+	policy->clearStall = NULL;
+	policy->reopen = NULL;
+	policy->hookCtx = NULL;
+	policy->budgetUs = kRetryBudgetUs;
+	policy->spentUs = 0;
+	policy->lastError = kCMReturnSuccess;
+	policy->stats = stats;
+	out->controlRequest = retryControlRequest;
+	out->ctx = policy;
+	out->submitRequest = cmCanSubmit(inner) ? retrySubmitRequest : NULL;
+	out->runCompletions = cmCanSubmit(inner) ? retryRunCompletions : NULL;
+}
+
+
+void retryReport( const CMRetryStats *stats, FILE *log )
+{
+	int c;
+
+	for( c = 0; c < kCMNumErrorClasses; c++ )
+		if( stats->errors[c] )
+			fprintf(log, "  %-12s %lu failed attempts, %lu requests recovered, %lu given up\n",
+					retryClassName(c), stats->errors[c], stats->recovered[c], stats->gaveUp[c]);
+	if( stats->outOfTime )
+		fprintf(log, "  %lu retries or requests skipped, out of recovery time\n", stats->outOfTime);
+}
@@ -0,0 +1,83 @@
+/*
+ * retry.h - recovering from failed control transfers
+ *
+ * A failed transfer used to count as a failed register write, and the
+ * device stayed half-configured until it was replugged or the next wake.
+ * The policy here sorts the error codes into classes: transient ones get
+ * the recovery that suits them and are retried, fatal ones are not. All
+ * recovery for one device shares a time limit, so a dead device can't hold
+ * up the daemon (or an acknowledgement of sleep) for long: every failed
+ * attempt is charged to it, a retry is only started with time left, and once
+ * it is used up the remaining requests fail without being sent. The limit
+ * can still be overrun by the one transfer in progress, so the backend
+ * should bound each transfer by the time left (retryTimeLeftUs()).
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_RETRY_H
+#define CM_RETRY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cmusb.h"
+
+#define kRetryBudgetUs			2000000		// default recovery time per device
+#define kRetryMaxAttempts		4			// per request, the first one included
+#define kRetryFirstPauseUs		1000		// before retrying an interrupted request; doubles each time
+#define kRetryTimeoutPauseUs	5000		// the same after a timeout
+
+typedef enum {
+	kCMErrorStall = 0,		// the endpoint halted: clear the stall, retry once
+	kCMErrorTimeout,		// no answer in time: pause, retry
+	kCMErrorInterrupted,	// aborted, busy, not sent or a host buffer error: pause, retry
+	kCMErrorClosed,			// the interface isn't open (any more): reopen it, retry
+	kCMErrorFatal,			// gone, not allowed, a bad request, or unknown: give up
+	kCMNumErrorClasses
+} CMErrorClass;
+
+typedef struct CMRetryStats {
+	unsigned long	errors[kCMNumErrorClasses];		// failed attempts
+	unsigned long	recovered[kCMNumErrorClasses];	// requests that worked after this error
+	unsigned long	gaveUp[kCMNumErrorClasses];		// requests that failed with it in the end
+	unsigned long	retries;
+	unsigned long	outOfTime;						// retries or requests not made because the budget was used up
+} CMRetryStats;
+
+typedef struct CMRetryPolicy {
+	CMTransport		inner;
+
+	// Recovery hooks of the backend; either may be NULL, and then the error
+	// is treated as fatal. Both get hookCtx and return a result code.
+	int32_t			(*clearStall)( void *hookCtx );
+	int32_t			(*reopen)( void *hookCtx );
+	void			*hookCtx;
+
+	uint64_t		budgetUs;		// recovery time allowed for this device
+	uint64_t		spentUs;		// in failed attempts, pauses and recovery so far
+	int32_t			lastError;		// of the last failed attempt
+	CMRetryStats	*stats;			// may be shared between devices
+} CMRetryPolicy;
+
+// Error classes are decided on the IOReturn codes of cmusb.h, plus the other
+// USB family codes IOKit can return (the ones ErrorName() in main.c lists).
+CMErrorClass retryClassify( int32_t err );
+const char *retryClassName( CMErrorClass c );
+
+// Sets up a policy around inner with the default budget and no hooks, and
+// fills in out to send requests through it. Asynchronous requests are
+// passed straight to inner, without retries.
+void retryWrap( CMRetryPolicy *policy, const CMTransport *inner, CMRetryStats *stats, CMTransport *out );
+
+// What is left of the policy's recovery time
+static inline uint64_t retryTimeLeftUs( const CMRetryPolicy *policy )
+{
+	return policy->spentUs < policy->budgetUs ? policy->budgetUs - policy->spentUs : 0;
+}
+
+// One line per error class that occurred
+void retryReport( const CMRetryStats *stats, FILE *log );
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * replay.c - replays recorded CM6206 control traffic against the fake device
+ *
+ * Usage: cm6206-replay [-t] [-n count] trace
+ *        cm6206-replay -w trace
+ *
+ * First the recorded requests are sent to a fresh fake device, which shows
+ * whether the model still agrees with the hardware the trace came from. Then
+ * the current activation code is run against a fake device that answers like
+ * the recorded one did, which is how to measure a change to the activation
+ * logic against field traces. -t keeps the recorded timing; without it
+ * everything runs as fast as possible. -w records a synthetic trace of one
+ * activation, for trying this out without a Mac.
+ *
+ *   cc -O2 -std=gnu99 -I. -o cm6206-replay tools/replay.c cm6206.c usbtrace.c fakedev.c
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cm6206.h"
+#include "usbtrace.h"
+#include "fakedev.h"
+
+
+static void printUsage( const char *progName )
+{
+	printf("Usage: %s [-t] [-n count] trace\n", progName);
+	printf("       %s -w trace\n", progName);
+	printf("  -t: keep the recorded timing instead of running as fast as possible\n");
+	printf("  -n: number of activations to emulate (default: until the trace is used up)\n");
+	printf("  -w: write a synthetic trace of one activation against the fake device\n");
+}
+
+
+static int writeSynthetic( const char *path )
+{
+	CMTraceRecorder rec;
+	CMTraceTap tap;
+	CMFakeDevice dev;
+	CMTransport fake, t;
+
+	if( traceRecorderOpen(&rec, path) )
+		return 1;
+	fakeDeviceInit(&dev);
+	fakeDeviceTransport(&dev, &fake);
+	traceTap(&tap, &rec, &fake, &t);
+	initCM6206(&t, 0);
+	printf("Wrote %lu requests to %s\n", rec.records, path);
+	traceRecorderClose(&rec);
+	return 0;
+}
+
+
+int main( int argc, const char *argv[] )
+{
+	const char *path = NULL;
+	int realtime = 0, maxRuns = 0, a;
+	CMTrace *trace;
+	CMFakeDevice dev;
+	CMTransport t;
+	CMReplayStats stats;
+
+	for( a = 1; a < argc; a++ ) {
+		if( strcmp(argv[a], "-t") == 0 )
+			realtime = 1;
+		else if( strcmp(argv[a], "-n") == 0 && a + 1 < argc )
+			maxRuns = atoi(argv[++a]);
+		else if( strcmp(argv[a], "-w") == 0 && a + 1 < argc )
+			return writeSynthetic(argv[a + 1]);
+		else if( argv[a][0] != '-' && !path )
+			path = argv[a];
+		else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+	if( !path ) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	trace = traceLoad(path);
+	if( !trace )
+		return 1;
+	printf("%s: %lu requests over %.3f s\n", path, (unsigned long)trace->count,
+	       trace->count ? trace->records[trace->count - 1].startUs / 1e6 : 0.0);
+
+	// 1. Recorded requests against the model
+	fakeDeviceInit(&dev);
+	fakeDeviceTransport(&dev, &t);
+	traceReplay(trace, &t, realtime, &stats);
+	printf("replay:   %lu requests in %.3f ms, %lu result / %lu data mismatches, "
+	       "latency avg %.2f us max %llu us\n",
+	       stats.requests, stats.elapsedUs / 1e3, stats.resultMismatches, stats.dataMismatches,
+	       stats.requests ? (double)stats.totalLatencyUs / stats.requests : 0.0,
+	       (unsigned long long)stats.maxLatencyUs);
+
+	// 2. Current activation logic against a device that behaves like the recorded one
+	{
+		uint64_t start, worst = 0, total = 0;
+		int runs = 0, failed = 0;
+
+		fakeDeviceInit(&dev);
+		fakeDeviceSetScript(&dev, trace, realtime);
+		while( dev.scriptPos < trace->count && (maxRuns == 0 || runs < maxRuns) ) {
+			uint64_t elapsed;
+			start = cmMonotonicUs();
+			failed += initCM6206(&t, 0) != 0;
+			elapsed = cmMonotonicUs() - start;
+			total += elapsed;
+			if( elapsed > worst )
+				worst = elapsed;
+			runs++;
+		}
+		printf("emulate:  %d activations (%d with failures), %lu requests diverged from the trace, "
+		       "avg %.2f us max %llu us per activation\n",
+		       runs, failed, dev.divergences, runs ? (double)total / runs : 0.0,
+		       (unsigned long long)worst);
+	}
+	traceFree(trace);
+	return 0;
+}
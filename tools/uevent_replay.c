@@ -0,0 +1,271 @@
+/*
+ * uevent_replay.c - replays recorded kernel uevents through the Linux hot-plug path
+ *
+ * Usage: cm6206-uevent-replay [-n repeat] [-i interval_ms] events
+ *        cm6206-uevent-replay -w events
+ *
+ * The events file holds one uevent per paragraph, as printed by
+ * `udevadm monitor --kernel --property`: an "action@devpath" line, then one
+ * KEY=VALUE line per property. A sender thread writes them to a socketpair
+ * in the kernel's wire format; the main thread receives and classifies them
+ * exactly like the daemon does and activates a fake CM6206 for every event
+ * that calls for it. When snd-usb-audio binds, the fake device first gets
+ * the register values of the kernel's boot quirk, so the replay also checks
+ * that our values are the ones that stick. Reports the latency from sending
+ * an event to the end of its activation, and fails if that ever reaches
+ * 50 ms. -w writes a sample plug/unplug sequence to try this with.
+ *
+ *   cc -O2 -std=gnu99 -I. -o cm6206-uevent-replay tools/uevent_replay.c hotplug.c cm6206.c fakedev.c usbtrace.c -lpthread
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "cm6206.h"
+#include "hotplug.h"
+#include "fakedev.h"
+
+#define kMaxEvents			256
+#define kLatencyBudgetUs	50000
+
+typedef struct Event {
+	char		msg[kUEventMaxSize];
+	size_t		len;
+} Event;
+
+typedef struct Replay {
+	Event		*events;
+	int			count;
+	int			repeat;
+	int			intervalMs;
+	int			fd;
+	uint64_t	*sentUs;			// per message sent, in order
+} Replay;
+
+
+static void printUsage( const char *progName )
+{
+	printf("Usage: %s [-n repeat] [-i interval_ms] events\n", progName);
+	printf("       %s -w events\n", progName);
+	printf("  -n: replay the whole sequence this many times (default 1)\n");
+	printf("  -i: pause between events, in milliseconds (default 0)\n");
+	printf("  -w: write a sample CM6206 plug/unplug sequence\n");
+}
+
+
+static const char *kSample =
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-3\n"
+	"ACTION=add\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-3\nSUBSYSTEM=usb\n"
+	"DEVNAME=bus/usb/001/004\nDEVTYPE=usb_device\nPRODUCT=46d/c52b/1211\nBUSNUM=001\nDEVNUM=004\nSEQNUM=4100\n"
+	"\n"
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-2\n"
+	"ACTION=add\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2\nSUBSYSTEM=usb\n"
+	"DEVNAME=bus/usb/001/005\nDEVTYPE=usb_device\nPRODUCT=d8c/102/100\nTYPE=0/0/0\nBUSNUM=001\nDEVNUM=005\nSEQNUM=4101\n"
+	"\n"
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0\n"
+	"ACTION=add\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0\nSUBSYSTEM=usb\n"
+	"DEVTYPE=usb_interface\nPRODUCT=d8c/102/100\nINTERFACE=1/1/0\nSEQNUM=4102\n"
+	"\n"
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.3\n"
+	"ACTION=add\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.3\nSUBSYSTEM=usb\n"
+	"DEVTYPE=usb_interface\nPRODUCT=d8c/102/100\nINTERFACE=3/0/0\nSEQNUM=4103\n"
+	"\n"
+	"bind@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.3\n"
+	"ACTION=bind\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.3\nSUBSYSTEM=usb\n"
+	"DEVTYPE=usb_interface\nDRIVER=usbhid\nPRODUCT=d8c/102/100\nINTERFACE=3/0/0\nSEQNUM=4104\n"
+	"\n"
+	"bind@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0\n"
+	"ACTION=bind\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0\nSUBSYSTEM=usb\n"
+	"DEVTYPE=usb_interface\nDRIVER=snd-usb-audio\nPRODUCT=d8c/102/100\nINTERFACE=1/1/0\nSEQNUM=4105\n"
+	"\n"
+	"remove@/devices/pci0000:00/0000:00:14.0/usb1/1-2\n"
+	"ACTION=remove\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2\nSUBSYSTEM=usb\n"
+	"DEVNAME=bus/usb/001/005\nDEVTYPE=usb_device\nPRODUCT=d8c/102/100\nBUSNUM=001\nDEVNUM=005\nSEQNUM=4106\n";
+
+
+// Turns paragraphs of lines into NUL-separated kernel messages
+static int loadEvents( const char *path, Event *events )
+{
+	FILE *fp = fopen(path, "r");
+	char line[1024];
+	int count = 0, open = 0;
+
+	if( fp == NULL ) {
+		fprintf(stderr, "Error: could not open %s\n", path);
+		return -1;
+	}
+	while( fgets(line, sizeof(line), fp) ) {
+		size_t n = strcspn(line, "\r\n");
+
+		line[n] = '\0';
+		if( n == 0 ) {
+			open = 0;
+			continue;
+		}
+		if( !open ) {
+			if( count == kMaxEvents )
+				break;
+			events[count].len = 0;
+			open = 1;
+			count++;
+		}
+		if( events[count - 1].len + n + 1 <= kUEventMaxSize ) {
+			memcpy(events[count - 1].msg + events[count - 1].len, line, n + 1);
+			events[count - 1].len += n + 1;
+		}
+	}
+	fclose(fp);
+	return count;
+}
+
+
+static void *sender( void *arg )
+{
+	Replay *r = arg;
+	int i, k = 0;
+
+	for( int rep = 0; rep < r->repeat; rep++ ) {
+		for( i = 0; i < r->count; i++, k++ ) {
+			if( r->intervalMs )
+				usleep(r->intervalMs * 1000);
+			r->sentUs[k] = cmMonotonicUs();
+			if( send(r->fd, r->events[i].msg, r->events[i].len, 0) < 0 )
+				perror("send");
+		}
+	}
+	return NULL;
+}
+
+
+static int cmpU64( const void *a, const void *b )
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+int main( int argc, const char *argv[] )
+{
+	static Event events[kMaxEvents];
+	Replay r;
+	pthread_t thread;
+	int fds[2], a, received = 0, total, numLatencies = 0, wrongRegisters = 0;
+	unsigned long activations = 0, ignored = 0;
+	uint64_t *latencies;
+	const char *path = NULL;
+	CMFakeDevice dev;
+	CMTransport fake;
+	char buf[kUEventMaxSize];
+
+	memset(&r, 0, sizeof(r));
+	r.repeat = 1;
+	for( a = 1; a < argc; a++ ) {
+		if( strcmp(argv[a], "-n") == 0 && a + 1 < argc )
+			r.repeat = atoi(argv[++a]);
+		else if( strcmp(argv[a], "-i") == 0 && a + 1 < argc )
+			r.intervalMs = atoi(argv[++a]);
+		else if( strcmp(argv[a], "-w") == 0 && a + 1 < argc ) {
+			FILE *fp = fopen(argv[++a], "w");
+			if( fp == NULL || fputs(kSample, fp) < 0 || fclose(fp) != 0 ) {
+				fprintf(stderr, "Error: could not write %s\n", argv[a]);
+				return 1;
+			}
+			return 0;
+		}
+		else if( argv[a][0] != '-' && path == NULL )
+			path = argv[a];
+		else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+	if( path == NULL || r.repeat < 1 ) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	r.count = loadEvents(path, events);
+	if( r.count <= 0 )
+		return 1;
+	r.events = events;
+	total = r.count * r.repeat;
+	r.sentUs = calloc(total, sizeof(uint64_t));
+	latencies = calloc(total, sizeof(uint64_t));
+	if( !r.sentUs || !latencies )
+		return 1;
+
+	// SEQPACKET keeps message boundaries, like netlink does. Only the
+	// receiving end is non-blocking, as in the daemon.
+	if( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0 ) {
+		perror("socketpair");
+		return 1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	r.fd = fds[1];
+	fakeDeviceInit(&dev);
+	fakeDeviceTransport(&dev, &fake);
+	pthread_create(&thread, NULL, sender, &r);
+
+	while( received < total ) {
+		struct pollfd pfd = { fds[0], POLLIN, 0 };
+		int len;
+
+		if( poll(&pfd, 1, 1000) <= 0 ) {
+			fprintf(stderr, "Error: timed out waiting for event %d\n", received);
+			break;
+		}
+		while( (len = hotplugReceive(fds[0], buf, sizeof(buf))) > 0 ) {
+			CMUEvent ev;
+			CMHotplugEvent what = kHotplugIgnore;
+			int k = received++;
+
+			if( hotplugParse(buf, len, &ev) == 0 )
+				what = hotplugClassify(&ev);
+			if( what == kHotplugDeviceAdded )
+				fakeDeviceInit(&dev);		// a freshly powered chip
+			else if( what == kHotplugAudioBound ) {
+				// What snd_usb_cm6206_boot_quirk() writes
+				static const uint16_t quirk[] = { 0x2004, 0x3000, 0xf800, 0x143f, 0x0000, 0x3000 };
+				for( int i = 0; i < 6; i++ )
+					writeCM6206Registers(&fake, i, quirk[i]);
+			}
+			if( what == kHotplugDeviceAdded || what == kHotplugAudioBound ) {
+				const CMDeviceModel *model = cmFindDeviceModel(ev.vendor, ev.product);
+				int failed = initCMDevice(&fake, model, 0);
+
+				latencies[numLatencies++] = cmMonotonicUs() - r.sentUs[k];
+				activations++;
+				for( int i = 0; i < model->planLength; i++ )
+					failed |= dev.regs[model->plan[i].regNo] != model->plan[i].value;
+				if( failed )
+					wrongRegisters++;
+			}
+			else
+				ignored++;
+		}
+	}
+	pthread_join(thread, NULL);
+
+	printf("%d events: %lu activations, %lu ignored, %d left the registers wrong\n",
+		   received, activations, ignored, wrongRegisters);
+	if( numLatencies ) {
+		qsort(latencies, numLatencies, sizeof(uint64_t), cmpU64);
+		printf("event to activation: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			   latencies[numLatencies / 2] / 1000.0, latencies[(numLatencies * 99) / 100] / 1000.0,
+			   latencies[numLatencies - 1] / 1000.0);
+	}
+	if( received < total || wrongRegisters ||
+	    (numLatencies && latencies[numLatencies - 1] >= kLatencyBudgetUs) ) {
+		printf("FAILED\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * truepeak.c - 4x oversampled (inter-sample) peak detector
+ *
+ * Each frame is followed by three interpolated points at 1/4, 1/2 and 3/4 of
+ * a sample, computed with a 12-tap Hann-windowed sinc per phase, in the spirit
+ * of ITU-R BS.1770 annex 2. Phase 0 is the plain sample.
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "truepeak.h"
+
+static float	gCoef[kTruePeakPhases][kTruePeakTaps];
+static int		gCoefReady;
+
+
+static void makeCoefficients( void )
+{
+	int p, k;
+
+	for( p = 0; p < kTruePeakPhases; p++ ) {
+		double sum = 0.0;
+		for( k = 0; k < kTruePeakTaps; k++ ) {
+			// Distance from tap k (k frames back) to the point kTruePeakDelay - p/4 back
+			double u = k - kTruePeakDelay + (double)p / kTruePeakPhases;
+			double s = u == 0.0 ? 1.0 : sin(M_PI * u) / (M_PI * u);
+			double w = 0.5 * (1.0 + cos(M_PI * u / (kTruePeakDelay + 0.5)));
+			gCoef[p][k] = (float)(s * w);
+			sum += s * w;
+		}
+		for( k = 0; k < kTruePeakTaps; k++ )
+			gCoef[p][k] = (float)(gCoef[p][k] / sum);
+	}
+	gCoefReady = 1;
+}
+
+
+void truePeakInit( TruePeak *tp, int channels )
+{
+	if( !gCoefReady )
+		makeCoefficients();
+	memset(tp, 0, sizeof(TruePeak));
+	tp->channels = channels > kTruePeakMaxChannels ? kTruePeakMaxChannels : channels;
+}
+
+
+void truePeakProcess( TruePeak *tp, const float * const *in, int frames, float *framePeak, float *chanPeak )
+{
+	int i, c, p, k;
+
+	for( i = 0; i < frames; i++ ) {
+		float peak[kTruePeakMaxChannels] = { 0 };
+		const float *h;
+
+		// Write each frame twice so the last kTruePeakTaps frames are always contiguous
+		tp->pos = tp->pos == 0 ? kTruePeakTaps - 1 : tp->pos - 1;
+		for( c = 0; c < tp->channels; c++ ) {
+			tp->hist[tp->pos][c] = in[c][i];
+			tp->hist[tp->pos + kTruePeakTaps][c] = in[c][i];
+		}
+		h = tp->hist[tp->pos];	// h[k * kTruePeakMaxChannels + c] is k frames back
+
+		for( p = 0; p < kTruePeakPhases; p++ ) {
+			float acc[kTruePeakMaxChannels] = { 0 };
+			for( k = 0; k < kTruePeakTaps; k++ ) {
+				float g = gCoef[p][k];
+				for( c = 0; c < kTruePeakMaxChannels; c++ )
+					acc[c] += g * h[k * kTruePeakMaxChannels + c];
+			}
+			for( c = 0; c < kTruePeakMaxChannels; c++ ) {
+				float a = fabsf(acc[c]);
+				peak[c] = a > peak[c] ? a : peak[c];
+			}
+		}
+
+		if( framePeak ) {
+			float m = 0.0f;
+			for( c = 0; c < kTruePeakMaxChannels; c++ )
+				m = peak[c] > m ? peak[c] : m;
+			framePeak[i] = m;
+		}
+		if( chanPeak ) {
+			for( c = 0; c < tp->channels; c++ )
+				chanPeak[c] = peak[c] > chanPeak[c] ? peak[c] : chanPeak[c];
+		}
+	}
+}
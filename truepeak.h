@@ -0,0 +1,32 @@
+/*
+ * truepeak.h - 4x oversampled (inter-sample) peak detector
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_TRUEPEAK_H
+#define CM_TRUEPEAK_H
+
+#define kTruePeakMaxChannels	8
+#define kTruePeakTaps			12	// taps per phase
+#define kTruePeakPhases			4
+#define kTruePeakDelay			6	// frames between input and the peak it describes
+
+// History is stored frame-major with the channel dimension padded to
+// kTruePeakMaxChannels, so the filter loops run across channels and vectorise.
+typedef struct TruePeak {
+	int		channels;
+	int		pos;
+	float	hist[2 * kTruePeakTaps][kTruePeakMaxChannels];
+} TruePeak;
+
+void truePeakInit( TruePeak *tp, int channels );
+
+// Consumes `frames` frames of planar input. If framePeak is given, it receives
+// for each frame the largest absolute value over all channels and all four
+// phases, describing the signal kTruePeakDelay frames earlier. If chanPeak is
+// given, each channel's maximum over the block is max'ed into it.
+void truePeakProcess( TruePeak *tp, const float * const *in, int frames, float *framePeak, float *chanPeak );
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * usbtrace.c - recording and replaying USB control traffic
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usbtrace.h"
+
+
+static void put16( uint8_t *p, uint16_t v ) { p[0] = v; p[1] = v >> 8; }
+static void put32( uint8_t *p, uint32_t v ) { put16(p, v); put16(p + 2, v >> 16); }
+static uint16_t get16( const uint8_t *p ) { return p[0] | p[1] << 8; }
+static uint32_t get32( const uint8_t *p ) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+
+//================================================================================================
+// Recording
+//
+int traceRecorderOpen( CMTraceRecorder *rec, const char *path )
+{
+	uint8_t header[kTraceHeaderSize];
+	uint64_t now = (uint64_t)time(NULL);
+
+	memset(rec, 0, sizeof(CMTraceRecorder));
+	rec->fp = fopen(path, "wb");
+	if( rec->fp == NULL ) {
+		fprintf(stderr, "Error: could not create trace file %s\n", path);
+		return -1;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(header, kTraceMagic, 4);
+	put16(header + 4, kTraceVersion);
+	put32(header + 8, (uint32_t)now);
+	put32(header + 12, (uint32_t)(now >> 32));
+	fwrite(header, 1, sizeof(header), rec->fp);
+	fflush(rec->fp);
+	return 0;
+}
+
+
+void traceRecorderClose( CMTraceRecorder *rec )
+{
+	if( rec->fp )
+		fclose(rec->fp);
+	rec->fp = NULL;
+}
+
+
+static int32_t tapControlRequest( void *ctx, CMControlRequest *req )
+{
+	CMTraceTap *tap = ctx;
+	CMTraceRecorder *rec = tap->recorder;
+	uint8_t head[kTraceRecordSize];
+	uint64_t start, delta;
+	int32_t err;
+
+	start = cmMonotonicUs();
+	err = cmControlRequest(&tap->inner, req);
+	if( !rec->fp )
+		return err;
+
+	delta = rec->records ? start - rec->lastStartUs : 0;
+	rec->lastStartUs = start;
+	put32(head, delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta);
+	put32(head + 4, (uint32_t)(cmMonotonicUs() - start));
+	head[8] = req->bmRequestType;
+	head[9] = req->bRequest;
+	put16(head + 10, req->wValue);
+	put16(head + 12, req->wIndex);
+	put16(head + 14, req->wLength);
+	put32(head + 16, (uint32_t)err);
+	fwrite(head, 1, sizeof(head), rec->fp);
+	if( req->wLength )
+		fwrite(req->pData, 1, req->wLength, rec->fp);
+	// Field traces are usually wanted after something went wrong, so don't buffer
+	fflush(rec->fp);
+	rec->records++;
+	return err;
+}
+
+
+void traceTap( CMTraceTap *tap, CMTraceRecorder *rec, const CMTransport *inner, CMTransport *out )
+{
+	tap->recorder = rec;
+	tap->inner = *inner;
+	out->controlRequest = tapControlRequest;
+	out->ctx = tap;
+	// Recording is synchronous, so that records come out in request order
+	out->submitRequest = NULL;
+	out->runCompletions = NULL;
+}
+
+
+//================================================================================================
+// Loading
+//
+CMTrace *traceLoad( const char *path )
+{
+	FILE *fp = fopen(path, "rb");
+	uint8_t header[kTraceHeaderSize], head[kTraceRecordSize];
+	CMTrace *trace;
+	long size;
+	size_t cap = 0, used = 0;
+	uint64_t t = 0;
+
+	if( fp == NULL ) {
+		fprintf(stderr, "Error: could not open trace file %s\n", path);
+		return NULL;
+	}
+	if( fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, kTraceMagic, 4) != 0 ||
+	    get16(header + 4) != kTraceVersion ) {
+		fprintf(stderr, "Error: %s is not a version %d trace file\n", path, kTraceVersion);
+		fclose(fp);
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, kTraceHeaderSize, SEEK_SET);
+
+	trace = calloc(1, sizeof(CMTrace));
+	// The payloads can't be larger than the file
+	if( trace )
+		trace->blob = malloc(size > 0 ? size : 1);
+	if( !trace || !trace->blob ) {
+		traceFree(trace);
+		fclose(fp);
+		return NULL;
+	}
+	trace->wallClock = get32(header + 8) | (uint64_t)get32(header + 12) << 32;
+
+	while( fread(head, 1, sizeof(head), fp) == sizeof(head) ) {
+		CMTraceRecord *r;
+		if( trace->count == cap ) {
+			CMTraceRecord *grown;
+			cap = cap ? cap * 2 : 64;
+			grown = realloc(trace->records, cap * sizeof(CMTraceRecord));
+			if( !grown ) {
+				traceFree(trace);
+				fclose(fp);
+				return NULL;
+			}
+			trace->records = grown;
+		}
+		r = &trace->records[trace->count];
+		t += get32(head);
+		r->startUs = t;
+		r->durationUs = get32(head + 4);
+		r->bmRequestType = head[8];
+		r->bRequest = head[9];
+		r->wValue = get16(head + 10);
+		r->wIndex = get16(head + 12);
+		r->wLength = get16(head + 14);
+		r->result = (int32_t)get32(head + 16);
+		r->payload = trace->blob + used;
+		if( r->wLength && fread(trace->blob + used, 1, r->wLength, fp) != r->wLength ) {
+			// A daemon killed mid-write leaves a torn last record; keep the rest
+			fprintf(stderr, "Warning: %s ends in a truncated record\n", path);
+			break;
+		}
+		used += r->wLength;
+		trace->count++;
+	}
+	fclose(fp);
+	return trace;
+}
+
+
+void traceFree( CMTrace *trace )
+{
+	if( !trace )
+		return;
+	free(trace->records);
+	free(trace->blob);
+	free(trace);
+}
+
+
+//================================================================================================
+// Replay
+//
+void traceReplay( const CMTrace *trace, CMTransport *target, int realtime, CMReplayStats *stats )
+{
+	uint8_t buf[65536];
+	uint64_t begin = cmMonotonicUs();
+	size_t i;
+
+	memset(stats, 0, sizeof(CMReplayStats));
+	for( i = 0; i < trace->count; i++ ) {
+		const CMTraceRecord *r = &trace->records[i];
+		CMControlRequest req;
+		uint64_t start, latency;
+		int32_t err;
+
+		if( realtime ) {
+			uint64_t now = cmMonotonicUs() - begin;
+			if( r->startUs > now )
+				usleep((useconds_t)(r->startUs - now));
+		}
+		req.bmRequestType = r->bmRequestType;
+		req.bRequest = r->bRequest;
+		req.wValue = r->wValue;
+		req.wIndex = r->wIndex;
+		req.wLength = r->wLength;
+		req.pData = buf;
+		if( r->bmRequestType & kCMRequestIn )
+			memset(buf, 0, r->wLength);
+		else
+			memcpy(buf, r->payload, r->wLength);
+
+		start = cmMonotonicUs();
+		err = cmControlRequest(target, &req);
+		latency = cmMonotonicUs() - start;
+
+		stats->requests++;
+		stats->totalLatencyUs += latency;
+		if( latency > stats->maxLatencyUs )
+			stats->maxLatencyUs = latency;
+		if( err != r->result )
+			stats->resultMismatches++;
+		else if( err == kCMReturnSuccess && (r->bmRequestType & kCMRequestIn) &&
+		         memcmp(buf, r->payload, r->wLength) != 0 )
+			stats->dataMismatches++;
+	}
+	stats->elapsedUs = cmMonotonicUs() - begin;
+}
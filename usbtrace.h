@@ -0,0 +1,84 @@
+/*
+ * usbtrace.h - recording and replaying USB control traffic
+ *
+ * Part of CM6206 Enabler. This program is free software, licensed under the
+ * GNU General Public License version 3 or later; see COPYING.
+ */
+
+#ifndef CM_USBTRACE_H
+#define CM_USBTRACE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cmusb.h"
+
+// File layout, all little endian:
+//   header  "CM6T", u16 version, u16 reserved, u64 wall clock at start (unix s)
+//   record  u32 start (us since previous record's start), u32 duration (us),
+//           u8 bmRequestType, u8 bRequest, u16 wValue, u16 wIndex,
+//           u16 wLength, i32 result, wLength bytes of payload
+// The payload is what was sent for OUT requests and what came back for IN.
+#define kTraceMagic			"CM6T"
+#define kTraceVersion		1
+#define kTraceHeaderSize	16
+#define kTraceRecordSize	20
+
+typedef struct CMTraceRecorder {
+	FILE			*fp;
+	uint64_t		lastStartUs;
+	unsigned long	records;
+} CMTraceRecorder;
+
+// A tap sits between the caller and the real transport, forwarding every
+// request and recording it. It lives as long as the wrapped transport.
+typedef struct CMTraceTap {
+	CMTraceRecorder	*recorder;
+	CMTransport		inner;
+} CMTraceTap;
+
+typedef struct CMTraceRecord {
+	uint64_t		startUs;		// since the first record
+	uint32_t		durationUs;
+	uint8_t			bmRequestType;
+	uint8_t			bRequest;
+	uint16_t		wValue;
+	uint16_t		wIndex;
+	uint16_t		wLength;
+	int32_t			result;
+	const uint8_t	*payload;
+} CMTraceRecord;
+
+typedef struct CMTrace {
+	uint64_t		wallClock;
+	size_t			count;
+	CMTraceRecord	*records;
+	uint8_t			*blob;			// all payloads
+} CMTrace;
+
+typedef struct CMReplayStats {
+	unsigned long	requests;
+	unsigned long	resultMismatches;	// device returned another result than recorded
+	unsigned long	dataMismatches;		// IN data differed from the recording
+	uint64_t		elapsedUs;
+	uint64_t		totalLatencyUs;
+	uint64_t		maxLatencyUs;
+} CMReplayStats;
+
+// Creates (truncates) a trace file. Returns 0 on success.
+int traceRecorderOpen( CMTraceRecorder *rec, const char *path );
+void traceRecorderClose( CMTraceRecorder *rec );
+
+// Makes `out` a transport that forwards to `inner` and records into `rec`.
+void traceTap( CMTraceTap *tap, CMTraceRecorder *rec, const CMTransport *inner, CMTransport *out );
+
+// Reads a whole trace into memory. NULL (with a message on stderr) on error.
+CMTrace *traceLoad( const char *path );
+void traceFree( CMTrace *trace );
+
+// Sends every recorded request to `target`, either as fast as possible or
+// (realtime != 0) with the recorded spacing, and compares the outcome.
+void traceReplay( const CMTrace *trace, CMTransport *target, int realtime, CMReplayStats *stats );
+
+#endif